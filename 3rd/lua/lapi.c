@@ -989,12 +989,32 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
   return status;
 }
 
+/*
+** constants without long strings and private short strings can be
+** shared by all the clones, they are read only.
+*/
+static int sharek (lua_State *L, const Proto *src) {
+  int i;
+  for (i=0; i<src->sp->sizek; i++) {
+    const TValue *s=&src->k[i];
+    if (ttisstring(s) && !luaS_isshared(L, tsvalue(s)))
+      return 0;
+  }
+  return 1;
+}
+
 static Proto * cloneproto (lua_State *L, const Proto *src) {
   /* copy constants and nested proto */
   int i,n;
   Proto *f = luaF_newproto(L, src->sp);
   n = src->sp->sizek;
-  f->k=luaM_newvector(L,n,TValue);
+  if (sharek(L, src)) {
+    f->k = src->k;
+    f->sharedk = 1;
+    n = 0;
+  } else {
+    f->k=luaM_newvector(L,n,TValue);
+  }
   for (i=0; i<n; i++) setnilvalue(&f->k[i]);
   for (i=0; i<n; i++) {
     const TValue *s=&src->k[i];
@@ -1042,6 +1062,32 @@ LUA_API void lua_clonefunction (lua_State *L, const void * fp) {
   lua_unlock(L);
 }
 
+static void shareproto (lua_State *L, Proto *f) {
+  int i;
+  for (i=0; i<f->sp->sizek; i++) {
+    TValue *o=&f->k[i];
+    if (ttisshrstring(o)) {
+      TString *ts = tsvalue(o);
+      setsvalue(L, o, luaS_newshrstr(getstr(ts), ts->shrlen, NULL));
+    }
+  }
+  for (i=0; i<f->sp->sizep; i++) {
+    shareproto(L, f->p[i]);
+  }
+}
+
+/*
+** move the short string constants of function fp (and its nested
+** functions) into SSM, so its clones can share the constants.
+** fp must not run any more in L, its constants are not interned in L.
+*/
+LUA_API void lua_sharefunction (lua_State *L, const void * fp) {
+  LClosure *f = cast(LClosure *, fp);
+  lua_lock(L);
+  shareproto(L, f->p);
+  lua_unlock(L);
+}
+
 LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data, int strip) {
   int status;
   TValue *o;
@@ -973,67 +973,249 @@ LUALIB_API void luaL_checkversion_ (lua_State *L, lua_Number ver, size_t sz) {
 // use clonefunction
 
 #include "spinlock.h"
+#include "atomic.h"
+#include <dirent.h>
+#include <sys/stat.h>
+
+/*
+** The cache is an open addressing hash table (filename -> prototype).
+** Readers never lock: a slot is published by writing its proto after
+** the key, and slots are never removed. Writers hold the spinlock; when
+** the table grows or is cleared, a new table replaces it and the old one
+** is retired with the next epoch. Each thread publishes the epoch it
+** started reading at in its own reader record, and a retired table is
+** freed by a later writer once no reader started before it retired.
+** The keys belong to the table retired by clear (grown tables share
+** them with their successor).
+*/
+
+struct cacheslot {
+  const void * volatile proto;
+  unsigned int hash;
+  char *key;
+};
+
+struct cachetable {
+  int size;  /* power of 2 */
+  int n;
+  unsigned int epoch;  /* the epoch it retired at */
+  int ownkeys;  /* retired by clear, free the keys with it */
+  struct cachetable *retired;
+  struct cacheslot slot[1];
+};
+
+/* one per thread, written only by its thread */
+struct cachereader {
+  volatile unsigned int active;  /* epoch when the read started, 0 for idle */
+  int hit;
+  int miss;
+  struct cachereader *next;
+};
 
 struct codecache {
-	struct spinlock lock;
-	lua_State *L;
+  struct spinlock lock;
+  struct cachetable * volatile t;
+  volatile unsigned int epoch;
+  struct cachereader *readers;
+  lua_State *preload;  /* owns the prototypes loaded by cache_preload */
+  int npreload;
 };
 
-static struct codecache CC;
+static struct codecache CC = { .epoch = 1 };
+
+static __thread struct cachereader *R;
+
+static struct cachereader *
+reader() {
+  struct cachereader *r = R;
+  if (r == NULL) {
+    r = (struct cachereader *)malloc(sizeof(*r));
+    memset(r, 0, sizeof(*r));
+    SPIN_LOCK(&CC)
+      r->next = CC.readers;
+      CC.readers = r;
+    SPIN_UNLOCK(&CC)
+    R = r;
+  }
+  return r;
+}
 
 static void
-clearcache() {
-	if (CC.L == NULL)
-		return;
-	SPIN_LOCK(&CC)
-		lua_close(CC.L);
-		CC.L = luaL_newstate();
-	SPIN_UNLOCK(&CC)
+freetable(struct cachetable *t) {
+  if (t->ownkeys) {
+    int i;
+    for (i=0; i<t->size; i++) {
+      if (t->slot[i].proto)
+        free(t->slot[i].key);
+    }
+  }
+  free(t);
 }
 
+/* retire CC.t and publish nt, call with the lock held */
 static void
-init() {
-	SPIN_INIT(&CC);
-	CC.L = luaL_newstate();
+retire(struct cachetable *nt, int ownkeys) {
+  struct cachetable *t = CC.t;
+  t->ownkeys = ownkeys;
+  nt->retired = t;
+  __sync_synchronize();
+  CC.t = nt;
+  __sync_synchronize();
+  t->epoch = CC.epoch++;
 }
 
-static const void *
-load(const char *key) {
-  if (CC.L == NULL)
-    return NULL;
+/* free the retired tables no reader can see any more, call with the lock held */
+static void
+reclaim() {
+  struct cachetable *t = CC.t;
+  struct cachereader *r;
+  unsigned int oldest = CC.epoch;
+  if (t == NULL || t->retired == NULL)
+    return;
+  __sync_synchronize();
+  for (r = CC.readers; r; r = r->next) {
+    unsigned int e = r->active;
+    if (e != 0 && e < oldest)
+      oldest = e;
+  }
+  /* the list is from the newest to the oldest */
+  while (t->retired && t->retired->epoch >= oldest)
+    t = t->retired;
+  struct cachetable *old = t->retired;
+  t->retired = NULL;
+  while (old) {
+    struct cachetable *next = old->retired;
+    freetable(old);
+    old = next;
+  }
+}
+
+static struct cachetable *
+newtable(int size) {
+  size_t sz = sizeof(struct cachetable) + (size - 1) * sizeof(struct cacheslot);
+  struct cachetable *t = (struct cachetable *)malloc(sz);
+  memset(t, 0, sz);
+  t->size = size;
+  return t;
+}
+
+/* "./lualib/skynet.lua" and "lualib/skynet.lua" are the same key */
+static const char *
+normalize(const char *key) {
+  while (key[0] == '.' && key[1] == '/') {
+    key += 2;
+    while (*key == '/')
+      ++key;
+  }
+  return key;
+}
+
+static unsigned int
+keyhash(const char *key) {
+  unsigned int h = 5381;
+  while (*key) {
+    h = h * 33 + (unsigned char)*key++;
+  }
+  return h;
+}
+
+static void
+clearcache() {
   SPIN_LOCK(&CC)
-    lua_State *L = CC.L;
-    lua_pushstring(L, key);
-    lua_rawget(L, LUA_REGISTRYINDEX);
-    const void * result = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    struct cachetable *t = CC.t;
+    if (t) {
+      retire(newtable(t->size), 1);
+      reclaim();
+    }
   SPIN_UNLOCK(&CC)
+}
 
-  return result;
+static const void *
+lookup(struct cachetable *t, const char *key) {
+  key = normalize(key);
+  unsigned int h = keyhash(key);
+  int mask = t->size - 1;
+  int i = h & mask;
+  for (;;) {
+    struct cacheslot *s = &t->slot[i];
+    const void *proto = s->proto;
+    if (proto == NULL)
+      return NULL;
+    __sync_synchronize();
+    if (s->hash == h && strcmp(s->key, key) == 0)
+      return proto;
+    i = (i + 1) & mask;
+  }
+}
+
+static const void *
+load(struct cachereader *r, const char *key) {
+  const void *proto = NULL;
+  r->active = CC.epoch;
+  __sync_synchronize();
+  struct cachetable *t = CC.t;
+  if (t)
+    proto = lookup(t, key);
+  __sync_synchronize();
+  r->active = 0;
+  return proto;
+}
+
+static void
+insert(struct cachetable *t, unsigned int h, char *key, const void *proto) {
+  int mask = t->size - 1;
+  int i = h & mask;
+  while (t->slot[i].proto) {
+    i = (i + 1) & mask;
+  }
+  struct cacheslot *s = &t->slot[i];
+  s->hash = h;
+  s->key = key;
+  __sync_synchronize();
+  s->proto = proto;
+  ++t->n;
 }
 
 static const void *
 save(const char *key, const void * proto) {
-  lua_State *L;
   const void * result = NULL;
+  key = normalize(key);
+  unsigned int h = keyhash(key);
 
   SPIN_LOCK(&CC)
-    if (CC.L == NULL) {
-      init();
-      L = CC.L;
-    } else {
-      L = CC.L;
-      lua_pushstring(L, key);
-      lua_pushvalue(L, -1);
-      lua_rawget(L, LUA_REGISTRYINDEX);
-      result = lua_touserdata(L, -1); /* stack: key oldvalue */
-      if (result == NULL) {
-        lua_pop(L,1);
-        lua_pushlightuserdata(L, (void *)proto);
-        lua_rawset(L, LUA_REGISTRYINDEX);
-      } else {
-        lua_pop(L,2);
+    struct cachetable *t = CC.t;
+    if (t == NULL) {
+      t = newtable(64);
+      CC.t = t;
+    }
+    int mask = t->size - 1;
+    int i = h & mask;
+    for (;;) {
+      struct cacheslot *s = &t->slot[i];
+      if (s->proto == NULL)
+        break;
+      if (s->hash == h && strcmp(s->key, key) == 0) {
+        result = s->proto;
+        break;
       }
+      i = (i + 1) & mask;
+    }
+    if (result == NULL) {
+      if ((t->n + 1) * 2 > t->size) {
+        struct cachetable *nt = newtable(t->size * 2);
+        for (i=0; i<t->size; i++) {
+          struct cacheslot *s = &t->slot[i];
+          if (s->proto)
+            insert(nt, s->hash, s->key, s->proto);
+        }
+        retire(nt, 0);
+        t = nt;
+      }
+      size_t sz = strlen(key) + 1;
+      char *k = (char *)malloc(sz);
+      memcpy(k, key, sz);
+      insert(t, h, k, proto);
+      reclaim();
     }
   SPIN_UNLOCK(&CC)
   return result;
@@ -1087,11 +1269,14 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
   if (level == CACHE_OFF) {
     return luaL_loadfilex_(L, filename, mode);
   }
-  const void * proto = load(filename);
+  struct cachereader *r = reader();
+  const void * proto = load(r, filename);
   if (proto) {
+    ++r->hit;
     lua_clonefunction(L, proto);
     return LUA_OK;
   }
+  ++r->miss;
   if (level == CACHE_EXIST) {
     return luaL_loadfilex_(L, filename, mode);
   }
@@ -1109,6 +1294,7 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
     return err;
   }
   proto = lua_topointer(eL, -1);
+  lua_sharefunction(eL, proto);
   const void * oldv = save(filename, proto);
   if (oldv) {
     lua_close(eL);
@@ -1124,14 +1310,127 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
 static int
 cache_clear(lua_State *L) {
 	(void)(L);
-	clearcache();
+	if (CC.t)
+		clearcache();
 	return 0;
 }
 
+static int
+cache_stat(lua_State *L) {
+	int entry = 0, hit = 0, miss = 0, retired = 0;
+	struct cachereader *r;
+	struct cachetable *t;
+	SPIN_LOCK(&CC)
+		t = CC.t;
+		if (t) {
+			entry = t->n;
+			for (t = t->retired; t; t = t->retired)
+				++retired;
+		}
+		for (r = CC.readers; r; r = r->next) {
+			hit += r->hit;
+			miss += r->miss;
+		}
+	SPIN_UNLOCK(&CC)
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, entry);
+	lua_setfield(L, -2, "entry");
+	lua_pushinteger(L, CC.npreload);
+	lua_setfield(L, -2, "preload");
+	lua_pushinteger(L, hit);
+	lua_setfield(L, -2, "hit");
+	lua_pushinteger(L, miss);
+	lua_setfield(L, -2, "miss");
+	lua_pushinteger(L, retired);
+	lua_setfield(L, -2, "retired");
+	return 1;
+}
+
+/* load every *.lua (source or precompiled) under root/path, key is path */
+static int
+preloaddir(lua_State *eL, luaL_Buffer *b, const char *root, const char *path) {
+	char fullname[4096];
+	int n = 0;
+	snprintf(fullname, sizeof(fullname), "%s/%s", root, path);
+	DIR *dir = opendir(fullname);
+	if (dir == NULL)
+		return 0;
+	struct dirent *e;
+	while ((e = readdir(dir)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		char name[4096];
+		struct stat st;
+		int sz;
+		if (path[0])
+			sz = snprintf(name, sizeof(name), "%s/%s", path, e->d_name);
+		else
+			sz = snprintf(name, sizeof(name), "%s", e->d_name);
+		if (sz >= (int)sizeof(name))
+			continue;
+		sz = snprintf(fullname, sizeof(fullname), "%s/%s", root, name);
+		if (sz >= (int)sizeof(fullname) || stat(fullname, &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			n += preloaddir(eL, b, root, name);
+			continue;
+		}
+		sz = (int)strlen(name);
+		if (!S_ISREG(st.st_mode) || sz < 4 || strcmp(name + sz - 4, ".lua") != 0)
+			continue;
+		if (luaL_loadfilex_(eL, fullname, "bt") != LUA_OK) {
+			luaL_addstring(b, lua_tostring(eL, -1));
+			luaL_addchar(b, '\n');
+			lua_pop(eL, 1);
+			continue;
+		}
+		/* keep the function alive in eL, which is never closed */
+		const void * proto = lua_topointer(eL, -1);
+		lua_rawsetp(eL, LUA_REGISTRYINDEX, proto);
+		/* SSM may be not ready at startup, so constants may be private in eL */
+		lua_sharefunction(eL, proto);
+		if (save(name, proto) == NULL) {
+			++n;
+		}
+	}
+	closedir(dir);
+	return n;
+}
+
+/*
+** preload all the code under dir, file dir/x/y.lua is used for x/y.lua
+** (or ./x/y.lua). The files can be precompiled by luac.
+** return the number of files loaded, and the error messages (or nil)
+*/
+static int
+cache_preload(lua_State *L) {
+	const char *dir = luaL_checkstring(L, 1);
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	SPIN_LOCK(&CC)
+		if (CC.preload == NULL)
+			CC.preload = luaL_newstate();
+	SPIN_UNLOCK(&CC)
+	lua_State *eL = CC.preload;
+	int n;
+	/* eL is not thread safe, only preload at startup */
+	n = preloaddir(eL, &b, dir, "");
+	ATOM_ADD(&CC.npreload, n);
+	lua_pushinteger(L, n);
+	luaL_pushresult(&b);
+	if (lua_rawlen(L, -1) == 0) {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+	return 2;
+}
+
 LUAMOD_API int luaopen_cache(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "clear", cache_clear },
 		{ "mode", cache_mode },
+		{ "stat", cache_stat },
+		{ "preload", cache_preload },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
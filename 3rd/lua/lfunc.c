@@ -100,6 +100,7 @@ Proto *luaF_newproto (lua_State *L, SharedProto *sp) {
   GCObject *o = luaC_newobj(L, LUA_TPROTO, sizeof(Proto));
   Proto *f = gco2p(o);
   f->sp = NULL;
+  f->sharedk = 0;
   f->k = NULL;
   f->p = NULL;
   f->cache = NULL;
@@ -140,7 +141,8 @@ static void freesharedproto (lua_State *L, SharedProto *f) {
 
 void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->p, f->sp->sizep);
-  luaM_freearray(L, f->k, f->sp->sizek);
+  if (!f->sharedk)
+    luaM_freearray(L, f->k, f->sp->sizek);
   freesharedproto(L, f->sp);
   luaM_free(L, f);
 }
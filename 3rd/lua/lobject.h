@@ -429,6 +429,7 @@ typedef struct SharedProto {
 */
 typedef struct Proto {
   CommonHeader;
+  lu_byte sharedk;  /* 'k' belongs to the cached prototype, don't free it */
   struct SharedProto *sp;
   TValue *k;  /* constants used by the function */
   struct Proto **p;  /* functions defined inside the function */
@@ -14,6 +14,7 @@
 
 #include "lua.h"
 
+#include "lapi.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lmem.h"
@@ -401,6 +402,64 @@ luaS_clonestring(lua_State *L, TString *ts) {
   return add_string(h, str, l);
 }
 
+/*
+** ts is a short string in SSM, and L has no private copy of it, so
+** luaS_clonestring(L, ts) would return ts itself. SSM strings are never
+** marked by any collector (marked is 0).
+*/
+int
+luaS_isshared(lua_State *L, TString *ts) {
+  const char * str;
+  unsigned int h;
+  if (ts->tt != LUA_TSHRSTR || ts->marked != 0)
+    return 0;
+  str = getaddrstr(ts);
+  h = luaS_hash(str, ts->shrlen, G(L)->seed);
+  return queryshrstr(L, str, ts->shrlen, h) == NULL;
+}
+
+/*
+** intern a short string into SSM directly (used by data shared between
+** states, e.g. sharedata). SSM strings are never freed, so a new string
+** is charged against *quota, a budget owned by the caller (NULL means no
+** limit, for the constants of shared code). Return NULL for long
+** strings, or when the quota is exhausted.
+*/
+LUA_API TString *
+luaS_newshrstr(const char *str, size_t l, int *quota) {
+  unsigned int h;
+  TString *ts;
+  if (l > LUAI_MAXSHORTLEN)
+    return NULL;
+  h = luaS_hash(str, l, 0);
+  ts = query_string(h, str, l);
+  if (ts)
+    return ts;
+  if (quota) {
+    if (*quota <= 0)
+      return NULL;
+    ATOM_DEC(quota);
+  }
+  return add_string(h, str, l);
+}
+
+/*
+** push a string in SSM. If this L has interned the same string locally,
+** push the local one instead, because short strings are compared by address.
+*/
+LUA_API void
+luaS_pushshrstr(lua_State *L, TString *ts) {
+  const char *str = getstr(ts);
+  unsigned int l = ts->shrlen;
+  TString *local = queryshrstr(L, str, l, luaS_hash(str, l, G(L)->seed));
+  if (local)
+    ts = local;
+  lua_lock(L);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  lua_unlock(L);
+}
+
 struct slotinfo {
 	int len;
 	int size;
@@ -49,6 +49,9 @@ LUA_API void luaS_initshr();
 LUA_API void luaS_exitshr();
 LUA_API void luaS_expandshr(int n);
 LUAI_FUNC TString *luaS_clonestring(lua_State *L, TString *);
+LUAI_FUNC int luaS_isshared(lua_State *L, TString *);
 LUA_API int luaS_shrinfo(lua_State *L);
+LUA_API TString *luaS_newshrstr(const char *str, size_t l, int *quota);
+LUA_API void luaS_pushshrstr(lua_State *L, TString *ts);
 
 #endif
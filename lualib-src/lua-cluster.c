@@ -442,6 +442,63 @@ lunpackresponse(lua_State *L) {
 	}
 }
 
+/*
+	string node
+	uint32_t/string addr
+	lightuserdata msg
+	uint32_t sz
+
+	return
+		lightuserdata msg
+		uint32_t sz
+
+	在 msg 之后追加目标地址和节点名, 交给 service_cluster 打包发送:
+		PADDING msg(sz)
+		DWORD addr 或者 STRING name
+		BYTE namelen	; 0 表示 addr 是数值地址
+		STRING node
+		BYTE nodelen
+ */
+static int
+lpackforward(lua_State *L) {
+	void *msg = lua_touserdata(L,3);
+	if (msg == NULL) {
+		return luaL_error(L, "Invalid request message");
+	}
+	uint32_t sz = (uint32_t)luaL_checkinteger(L,4);
+	size_t nodelen = 0;
+	const char *node = lua_tolstring(L, 1, &nodelen);
+	if (node == NULL || nodelen < 1 || nodelen > 255) {
+		skynet_free(msg);
+		return luaL_error(L, "Invalid node name %s", node);
+	}
+	size_t namelen = 0;
+	const char *name = NULL;
+	if (lua_type(L,2) != LUA_TNUMBER) {
+		name = lua_tolstring(L, 2, &namelen);
+		if (name == NULL || namelen < 1 || namelen > 255) {
+			skynet_free(msg);
+			return luaL_error(L, "name is too long %s", name);
+		}
+	}
+	size_t addrsz = name ? namelen : 4;
+	uint8_t *buf = skynet_realloc(msg, sz + addrsz + nodelen + 2);
+	uint8_t *p = buf + sz;
+	if (name) {
+		memcpy(p, name, namelen);
+	} else {
+		fill_uint32(p, (uint32_t)lua_tointeger(L,2));
+	}
+	p += addrsz;
+	*p++ = (uint8_t)namelen;
+	memcpy(p, node, nodelen);
+	p[nodelen] = (uint8_t)nodelen;
+
+	lua_pushlightuserdata(L, buf);
+	lua_pushinteger(L, sz + addrsz + nodelen + 2);
+	return 2;
+}
+
 static int
 lconcat(lua_State *L) {
 	if (!lua_istable(L,1))
@@ -483,6 +540,7 @@ luaopen_cluster_core(lua_State *L) {
 		{ "packresponse", lpackresponse },
 		{ "unpackresponse", lunpackresponse },
 		{ "concat", lconcat },
+		{ "packforward", lpackforward },
 		{ NULL, NULL },
 	};
 	luaL_checkversion(L);
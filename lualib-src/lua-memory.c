@@ -51,6 +51,7 @@ luaopen_memory(lua_State *L) {
 		{ "dumpinfo", ldumpinfo },
 		{ "dump", ldump },
 		{ "info", dump_mem_lua },
+		{ "arena", dump_arena_lua },
 		{ "ssinfo", luaS_shrinfo },
 		{ "ssexpand", lexpandshrtbl },
 		{ NULL, NULL },
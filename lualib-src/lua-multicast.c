@@ -1,4 +1,6 @@
 #include "skynet.h"
+#include "skynet_mq.h"
+#include "skynet_server.h"
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -144,6 +146,191 @@ mc_remote(lua_State *L) {
 	return 2;
 }
 
+// 频道在本节点的订阅者集合, handles 有序排列
+struct mc_group {
+	int n;
+	int cap;
+	uint32_t *handles;
+};
+
+#define MC_GROUP "MCGROUP"
+
+static struct mc_group *
+checkgroup(lua_State *L, int index) {
+	return luaL_checkudata(L, index, MC_GROUP);
+}
+
+static int
+mc_groupgc(lua_State *L) {
+	struct mc_group *g = checkgroup(L, 1);
+	skynet_free(g->handles);
+	g->handles = NULL;
+	g->n = 0;
+	g->cap = 0;
+	return 0;
+}
+
+/*
+	return group userdata
+ */
+static int
+mc_newgroup(lua_State *L) {
+	struct mc_group *g = lua_newuserdata(L, sizeof(*g));
+	g->n = 0;
+	g->cap = 0;
+	g->handles = NULL;
+	luaL_setmetatable(L, MC_GROUP);
+	return 1;
+}
+
+// 返回第一个不小于 handle 的位置
+static int
+group_find(struct mc_group *g, uint32_t handle) {
+	int lo = 0, hi = g->n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (g->handles[mid] < handle) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+	group
+	integer handle
+
+	return true if the handle is added
+ */
+static int
+mc_subscribe(lua_State *L) {
+	struct mc_group *g = checkgroup(L, 1);
+	uint32_t handle = (uint32_t)luaL_checkinteger(L, 2);
+	int pos = group_find(g, handle);
+	if (pos < g->n && g->handles[pos] == handle) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	if (g->n >= g->cap) {
+		int cap = g->cap ? g->cap * 2 : 16;
+		uint32_t * handles = skynet_malloc(cap * sizeof(uint32_t));
+		if (g->n > 0) {
+			memcpy(handles, g->handles, g->n * sizeof(uint32_t));
+		}
+		skynet_free(g->handles);
+		g->handles = handles;
+		g->cap = cap;
+	}
+	memmove(&g->handles[pos+1], &g->handles[pos], (g->n - pos) * sizeof(uint32_t));
+	g->handles[pos] = handle;
+	++g->n;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+	group
+	integer handle
+
+	return true if the handle is removed
+ */
+static int
+mc_unsubscribe(lua_State *L) {
+	struct mc_group *g = checkgroup(L, 1);
+	uint32_t handle = (uint32_t)luaL_checkinteger(L, 2);
+	int pos = group_find(g, handle);
+	if (pos >= g->n || g->handles[pos] != handle) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	--g->n;
+	memmove(&g->handles[pos], &g->handles[pos+1], (g->n - pos) * sizeof(uint32_t));
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+mc_groupsize(lua_State *L) {
+	struct mc_group *g = checkgroup(L, 1);
+	lua_pushinteger(L, g->n);
+	return 1;
+}
+
+static void
+freepackage(struct mc_package *pack) {
+	skynet_free(pack->data);
+	skynet_free(pack);
+}
+
+/*
+	group (or nil)
+	lightuserdata struct mc_package **
+	integer source
+	integer channel
+
+	把 package 的指针发送给 group 中的每个订阅者, 引用计数为订阅者的数量. 已经退出的订阅者从 group 中删除.
+	return the size of group
+ */
+static int
+mc_publish(lua_State *L) {
+	struct mc_group *g = lua_isnil(L, 1) ? NULL : checkgroup(L, 1);
+	struct mc_package ** ptr = lua_touserdata(L, 2);
+	uint32_t source = (uint32_t)luaL_checkinteger(L, 3);
+	int channel = (int)luaL_checkinteger(L, 4);
+	struct mc_package * pack = *ptr;
+	int n = g ? g->n : 0;
+	if (pack->reference != 0) {
+		return luaL_error(L, "Can't bind a multicast package more than once");
+	}
+	if (n == 0) {
+		// dead channel
+		freepackage(pack);
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	// 订阅者可能在发送的过程中就开始释放 package, 所以先设置好引用计数
+	pack->reference = n;
+
+	struct skynet_message msg[SKYNET_PUSHMULTI_MAX];
+	size_t sz = sizeof(pack) | ((size_t)PTYPE_MULTICAST << MESSAGE_TYPE_SHIFT);
+	int i, j;
+	int fail = 0;
+	int alive = 0;
+	for (i=0;i<n;i+=SKYNET_PUSHMULTI_MAX) {
+		int m = n - i < SKYNET_PUSHMULTI_MAX ? n - i : SKYNET_PUSHMULTI_MAX;
+		for (j=0;j<m;j++) {
+			struct mc_package ** data = skynet_malloc(sizeof(*data));
+			*data = pack;
+			msg[j].source = source;
+			msg[j].session = channel;
+			msg[j].data = data;
+			msg[j].sz = sz;
+		}
+		if (skynet_context_pushmulti(&g->handles[i], m, msg) == 0) {
+			if (alive != i) {
+				memmove(&g->handles[alive], &g->handles[i], m * sizeof(uint32_t));
+			}
+			alive += m;
+		} else {
+			for (j=0;j<m;j++) {
+				if (msg[j].data) {
+					g->handles[alive++] = g->handles[i+j];
+				} else {
+					++fail;
+				}
+			}
+		}
+	}
+	g->n = alive;
+	if (fail > 0 && ATOM_SUB(&pack->reference, fail) == 0) {
+		freepackage(pack);
+	}
+	lua_pushinteger(L, alive);
+	return 1;
+}
+
 static int
 mc_nextid(lua_State *L) {
 	uint32_t id = (uint32_t)luaL_checkinteger(L, 1);
@@ -164,9 +351,19 @@ luaopen_multicast_core(lua_State *L) {
 		{ "packstring", mc_packstring },
 		{ "packremote", mc_packremote },
 		{ "nextid", mc_nextid },
+		{ "newgroup", mc_newgroup },
+		{ "subscribe", mc_subscribe },
+		{ "unsubscribe", mc_unsubscribe },
+		{ "size", mc_groupsize },
+		{ "publish", mc_publish },
 		{ NULL, NULL },
 	};
 	luaL_checkversion(L);
+	if (luaL_newmetatable(L, MC_GROUP)) {
+		lua_pushcfunction(L, mc_groupgc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
 	luaL_newlib(L,l);
 	return 1;
 }
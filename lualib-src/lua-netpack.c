@@ -20,6 +20,7 @@
 #define TYPE_OPEN 4
 #define TYPE_CLOSE 5
 #define TYPE_WARNING 6
+#define TYPE_BATCH 7
 
 /*
 	Each package is uint16 + data , uint16 (serialized in big-endian) is the number of bytes comprising the data .
@@ -409,6 +410,84 @@ pushstring(lua_State *L, const char * msg, int size) {
 	}
 }
 
+/// 把批量消息中的一条控制消息(open/close/error/warning)存入栈顶的 events 表中, 每条占 3 个元素: type, fd, msg
+static void
+push_event(lua_State *L, int *n, int type, int fd) {
+	// 此时栈顶是 msg, 下面是 events 表
+	int events = lua_gettop(L) - 1;
+	lua_pushvalue(L, lua_upvalueindex(type));
+	lua_rawseti(L, events, *n * 3 + 1);
+	lua_pushinteger(L, fd);
+	lua_rawseti(L, events, *n * 3 + 2);
+	lua_rawseti(L, events, *n * 3 + 3);
+	++*n;
+}
+
+/*
+	处理批量消息 SKYNET_SOCKET_TYPE_BATCH
+	所有完整的数据包都压入 queue 中, 控制消息按顺序存入 events 表.
+	返回 queue, "batch", events, 控制消息的数量
+ */
+static int
+filter_batch(lua_State *L, struct skynet_socket_message *message) {
+	lua_createtable(L, 0, 0);	// events, 栈上索引 2
+	int n = 0;
+	const char * ptr = (const char *)(message + 1);
+	int i;
+	for (i=0;i<message->ud;i++) {
+		int size;
+		struct skynet_socket_message *m = skynet_socket_batch_next(&ptr, &size);
+		char * buffer = m->buffer;
+		if (buffer == NULL) {
+			buffer = (char *)(m + 1);
+			size -= sizeof(*m);
+		} else {
+			size = -1;
+		}
+		switch(m->type) {
+		case SKYNET_SOCKET_TYPE_DATA: {
+			int ret = filter_data(L, m->id, (uint8_t *)buffer, m->ud);
+			if (ret == 5) {
+				// 单个完整的数据包同样放入 queue 中
+				int fd = lua_tointeger(L, -3);
+				void * data = lua_touserdata(L, -2);
+				int sz = lua_tointeger(L, -1);
+				lua_pop(L, 4);
+				push_data(L, fd, data, sz, 0);
+			} else {
+				lua_pop(L, ret - 1);
+			}
+			break;
+		}
+		case SKYNET_SOCKET_TYPE_CLOSE:
+			close_uncomplete(L, m->id);
+			lua_pushnil(L);
+			push_event(L, &n, TYPE_CLOSE, m->id);
+			break;
+		case SKYNET_SOCKET_TYPE_ACCEPT:
+			pushstring(L, buffer, size);
+			push_event(L, &n, TYPE_OPEN, m->ud);
+			break;
+		case SKYNET_SOCKET_TYPE_ERROR:
+			close_uncomplete(L, m->id);
+			pushstring(L, buffer, size);
+			push_event(L, &n, TYPE_ERROR, m->id);
+			break;
+		case SKYNET_SOCKET_TYPE_WARNING:
+			lua_pushinteger(L, m->ud);
+			push_event(L, &n, TYPE_WARNING, m->id);
+			break;
+		default:
+			// ignore connect
+			break;
+		}
+	}
+	lua_pushvalue(L, lua_upvalueindex(TYPE_BATCH));
+	lua_insert(L, 2);
+	lua_pushinteger(L, n);
+	return 4;
+}
+
 /*
 	userdata queue
 	lightuserdata msg
@@ -481,6 +560,8 @@ lfilter(lua_State *L) {
 		lua_pushinteger(L, message->id);
 		lua_pushinteger(L, message->ud);
 		return 4;
+	case SKYNET_SOCKET_TYPE_BATCH:
+		return filter_batch(L, message);
 	default:
 		// never get here
 		return 1;
@@ -615,8 +696,9 @@ luaopen_netpack(lua_State *L) {
 	lua_pushliteral(L, "open");
 	lua_pushliteral(L, "close");
 	lua_pushliteral(L, "warning");
+	lua_pushliteral(L, "batch");
 
-	lua_pushcclosure(L, lfilter, 6);
+	lua_pushcclosure(L, lfilter, 7);
 	lua_setfield(L, -2, "filter");
 
 	return 1;
@@ -24,9 +24,17 @@
 #define TYPE_NUMBER_QWORD 6	// 数字类型 8 个字节
 #define TYPE_NUMBER_REAL 8	// 数字类型 8 个字节, 浮点数据
 
+// hibits 0 : lightuserdata
+// hibits 1~3 : 紧凑数组, 数组部分的元素类型相同, 不再逐个写入类型, 之后的散列部分与 TYPE_TABLE 相同
 #define TYPE_USERDATA 3
 #define TYPE_SHORT_STRING 4
 
+// 紧凑数组的元素类型
+#define TYPE_ARRAY_INTEGER 1	// 整数, 之后 1 个字节表示元素宽度 (1, 2, 4, 8), 然后是所有元素与最小值的差, 最后是最小值
+#define TYPE_ARRAY_REAL 2		// 浮点数, 每个元素 8 个字节
+#define TYPE_ARRAY_STRING 3		// 长度小于 256 的字符串, 每个元素 1 个字节长度加字符串内容, 不参与引用去重
+
+
 // hibits 0~31 : len
 #define TYPE_LONG_STRING 5
 #define TYPE_TABLE 6
@@ -39,21 +47,44 @@
 /// 组合类型和值, 低 3 位用来存储类型, 之后的高位用来存储 v
 #define COMBINE_TYPE(t,v) ((t) | (v) << 3)
 
-#define BLOCK_SIZE 128		// 数据块大小
+// hibits 0 : 引用头, 只出现在数据流的开始, 表示数据流中含有引用, 解析时需要登记字符串和 table
+// hibits 1~30 : 引用之前出现过的第 (hibits - 1) 个对象; 31 : 之后跟随一个整数, 表示引用对象的索引
+#define TYPE_REF 7
+
+#define REF_HEADER 0		// 引用头
+#define MIN_REF_STRING 4	// 长度不小于这个值的字符串才会去重
+
+#define BUFFER_SIZE 256		// 写缓冲的初始大小, 在栈上分配
+#define REF_SIZE 64			// 引用 hash 表的初始大小, 在栈上分配, 必须是 2 的幂
 #define MAX_DEPTH 32		// 允许 table 的类型的最大深度
+#define MIN_PACKED_ARRAY 8	// 数组长度不小于这个值时尝试使用紧凑数组
+#define PACKED_CHUNK 64		// 解析紧凑数组时, 每次批量转换的元素数量
 
-/// 数据块节点
-struct block {
-	struct block * next;			// 下一个关联的节点
-	char buffer[BLOCK_SIZE];		// 存储数据
+/// 引用 hash 表的节点, 记录已经写入的对象 (字符串或 table) 的地址和它的引用索引
+struct ref_node {
+	const void * ptr;	// 对象地址, NULL 表示空节点
+	int index;			// 引用索引
 };
 
-/// 写数据块队列
+/*
+写数据缓冲, 一段连续的内存, 空间不足时成倍扩展.
+初始缓冲在调用者的栈上, 数据较小时序列化过程中不会分配内存.
+
+同时记录已经写入的字符串和 table, 再次遇到相同的对象时只写入一个引用.
+写入和解析的双方按照相同的顺序给对象编号: 每个 table 和长度不小于 MIN_REF_STRING 的字符串在第一次出现时获得下一个索引.
+*/
 struct write_block {
-	struct block * head;		// 队列头
-	struct block * current;		// 当前正在写入数据的 block
-	int len;		// 写入数据的总大小
-	int ptr;		// 记录 current block 写入数据的数量
+	char * buffer;		// 数据缓冲
+	int len;			// 写入数据的总大小
+	int cap;			// 数据缓冲的容量
+	char * init;		// 栈上的初始缓冲
+	struct ref_node * ref;	// 引用 hash 表, 开放寻址
+	struct ref_node * ref_init;	// 栈上的初始 hash 表
+	int ref_cap;		// 引用 hash 表的容量
+	int ref_count;		// 引用 hash 表中的节点数量
+	int ref_n;			// 已经编号的对象数量
+	int noref;			// 大于 0 时新对象只编号不登记, 用于 __pairs 迭代产生的可能是临时的对象
+	int refstream;		// 是否已经写入了引用头
 };
 
 /// 读数据 block
@@ -61,14 +92,25 @@ struct read_block {
 	char * buffer;	// 装载读取数据的起始指针
 	int len;		// 当前剩余的可读容量
 	int ptr;		// 记录当前已读数据的数量
+	int ref;		// 登记对象的 table 在 lua 栈中的位置, 0 表示数据流中没有引用
+	int ref_n;		// 已经登记的对象数量
 };
 
-/// 分配一个 struct block 数据对象
-inline static struct block *
-blk_alloc(void) {
-	struct block *b = skynet_malloc(sizeof(struct block));
-	b->next = NULL;
-	return b;
+/// 扩展 write_block 的缓冲, 保证至少还能写入 sz 大小的数据
+static void
+wb_expand(struct write_block *b, int sz) {
+	int cap = b->cap * 2;
+	while (cap - b->len < sz) {
+		cap *= 2;
+	}
+	if (b->buffer == b->init) {
+		char * buffer = skynet_malloc(cap);
+		memcpy(buffer, b->buffer, b->len);
+		b->buffer = buffer;
+	} else {
+		b->buffer = skynet_realloc(b->buffer, cap);
+	}
+	b->cap = cap;
 }
 
 /**
@@ -79,64 +121,119 @@ blk_alloc(void) {
  */
 inline static void
 wb_push(struct write_block *b, const void *buf, int sz) {
-	const char * buffer = buf;
-
-	// 没有可用的 block, 分配新的 block
-	if (b->ptr == BLOCK_SIZE) {
-_again:
-		b->current = b->current->next = blk_alloc();
-		b->ptr = 0;
-	}
-
-	// block 数据足够使用
-	if (b->ptr <= BLOCK_SIZE - sz) {
-		memcpy(b->current->buffer + b->ptr, buffer, sz);
-		b->ptr+=sz;
-		b->len+=sz;
-
-	// block 数据空间不足
-	} else {
-		int copy = BLOCK_SIZE - b->ptr;
-		memcpy(b->current->buffer + b->ptr, buffer, copy);
-		buffer += copy;
-		b->len += copy;
-		sz -= copy;
-		goto _again;
+	if (b->cap - b->len < sz) {
+		wb_expand(b, sz);
 	}
+	memcpy(b->buffer + b->len, buf, sz);
+	b->len += sz;
 }
 
-/// 初始化 write_block
+/// 初始化 write_block, buffer 和 ref 是栈上的初始缓冲和 hash 表
 static void
-wb_init(struct write_block *wb , struct block *b) {
-	wb->head = b;
-	assert(b->next == NULL);
+wb_init(struct write_block *wb, char *buffer, struct ref_node *ref) {
+	wb->buffer = wb->init = buffer;
 	wb->len = 0;
-	wb->current = wb->head;
-	wb->ptr = 0;
+	wb->cap = BUFFER_SIZE;
+	memset(ref, 0, REF_SIZE * sizeof(*ref));
+	wb->ref = wb->ref_init = ref;
+	wb->ref_cap = REF_SIZE;
+	wb->ref_count = 0;
+	wb->ref_n = 0;
+	wb->noref = 0;
+	wb->refstream = 0;
 }
 
-/// 释放 write_block 的 block 资源
+/// 释放 write_block 在堆上分配的资源
 static void
 wb_free(struct write_block *wb) {
-	struct block *blk = wb->head;
-	blk = blk->next;	// the first block is on stack, 保留第一个 block 在栈上
-	while (blk) {
-		struct block * next = blk->next;
-		skynet_free(blk);
-		blk = next;
-	}
-	wb->head = NULL;
-	wb->current = NULL;
-	wb->ptr = 0;
+	if (wb->buffer != wb->init) {
+		skynet_free(wb->buffer);
+	}
+	if (wb->ref != wb->ref_init) {
+		skynet_free(wb->ref);
+	}
+	wb->buffer = wb->init;
+	wb->ref = wb->ref_init;
 	wb->len = 0;
 }
 
+/// 对象地址的 hash 值
+static inline unsigned
+ref_hash(const void *ptr) {
+	uintptr_t x = (uintptr_t)ptr;
+	return (unsigned)((x >> 3) ^ (x >> 17)) * 2654435761u;
+}
+
+/// 将节点插入 hash 表, 调用者保证 ptr 不在表中
+static void
+ref_insert(struct ref_node *ref, int cap, const void *ptr, int index) {
+	unsigned h = ref_hash(ptr) & (cap - 1);
+	while (ref[h].ptr) {
+		h = (h + 1) & (cap - 1);
+	}
+	ref[h].ptr = ptr;
+	ref[h].index = index;
+}
+
+/// 引用 hash 表的容量扩大一倍
+static void
+ref_expand(struct write_block *b) {
+	int cap = b->ref_cap * 2;
+	struct ref_node * ref = skynet_malloc(cap * sizeof(*ref));
+	memset(ref, 0, cap * sizeof(*ref));
+	int i;
+	for (i=0;i<b->ref_cap;i++) {
+		if (b->ref[i].ptr) {
+			ref_insert(ref, cap, b->ref[i].ptr, b->ref[i].index);
+		}
+	}
+	if (b->ref != b->ref_init) {
+		skynet_free(b->ref);
+	}
+	b->ref = ref;
+	b->ref_cap = cap;
+}
+
+/// 查询对象是否已经写入过, 是则返回它的引用索引; 否则给它编号, 返回 -1
+static int
+wb_ref(struct write_block *b, const void *ptr) {
+	unsigned h = ref_hash(ptr) & (b->ref_cap - 1);
+	while (b->ref[h].ptr) {
+		if (b->ref[h].ptr == ptr) {
+			return b->ref[h].index;
+		}
+		h = (h + 1) & (b->ref_cap - 1);
+	}
+
+	int index = b->ref_n++;
+	if (b->noref == 0) {
+		b->ref[h].ptr = ptr;
+		b->ref[h].index = index;
+		// 装载因子超过 3/4 时扩容
+		if (++b->ref_count * 4 > b->ref_cap * 3) {
+			ref_expand(b);
+		}
+	}
+	return -1;
+}
+
 /// read_block 初始化 
 static void
 rball_init(struct read_block * rb, char * buffer, int size) {
 	rb->buffer = buffer;
 	rb->len = size;
 	rb->ptr = 0;
+	rb->ref = 0;
+	rb->ref_n = 0;
+}
+
+/// 数据流中含有引用时, 登记栈顶的对象, 索引与写入时的编号一致
+static inline void
+rb_register(lua_State *L, struct read_block *rb) {
+	if (rb->ref) {
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, rb->ref, ++rb->ref_n);
+	}
 }
 
 /// 记录 read_block 读取了 sz 大小的数据, 返回剩余可读数据的指针地址
@@ -167,7 +264,7 @@ wb_boolean(struct write_block *wb, int boolean) {
 }
 
 /// write_block 压入 integer 数据
-static inline void
+static void
 wb_integer(struct write_block *wb, lua_Integer v) {
 	int type = TYPE_NUMBER;
 	if (v == 0) {
@@ -233,6 +330,29 @@ wb_pointer(struct write_block *wb, void *v) {
 	wb_push(wb, &v, sizeof(v));
 }
 
+static void wb_integer(struct write_block *wb, lua_Integer v);
+
+/// write_block 压入引用, 第一次写入引用时在数据流的开始插入引用头
+static void
+wb_reference(struct write_block *wb, int index) {
+	uint8_t n;
+	if (!wb->refstream) {
+		n = COMBINE_TYPE(TYPE_REF, REF_HEADER);
+		wb_push(wb, &n, 1);
+		memmove(wb->buffer + 1, wb->buffer, wb->len - 1);
+		wb->buffer[0] = n;
+		wb->refstream = 1;
+	}
+	if (index < MAX_COOKIE - 2) {
+		n = COMBINE_TYPE(TYPE_REF, index + 1);
+		wb_push(wb, &n, 1);
+	} else {
+		n = COMBINE_TYPE(TYPE_REF, MAX_COOKIE - 1);
+		wb_push(wb, &n, 1);
+		wb_integer(wb, index);
+	}
+}
+
 /// write_block 压入字符串数据
 static inline void
 wb_string(struct write_block *wb, const char *str, int len) {
@@ -294,6 +414,166 @@ wb_table_array(lua_State *L, struct write_block * wb, int index, int depth) {
 	return array_size;
 }
 
+/**
+ * 尝试将整数数组的元素以 8 个字节写入, 遇到非整数元素返回 0.
+ * 全部写完后改为存储每个元素与最小值的差, 按照差值的范围原地压缩成最小的宽度, 最后写入最小值.
+ */
+static int
+wb_array_integer(lua_State *L, struct write_block * wb, int index, int array_size) {
+	if (array_size > (0x7fffffff - wb->len) / 8 - 1) {
+		return 0;
+	}
+	int width_pos = wb->len;
+	if (wb->cap - wb->len < array_size * 8 + 1) {
+		wb_expand(wb, array_size * 8 + 1);
+	}
+	char * p = wb->buffer + width_pos + 1;
+	int64_t min = INT64_MAX, max = INT64_MIN;
+	int i;
+	for (i=0;i<array_size;i++) {
+		if (lua_rawgeti(L, index, i+1) != LUA_TNUMBER || !lua_isinteger(L, -1)) {
+			lua_pop(L,1);
+			return 0;
+		}
+		int64_t v = lua_tointeger(L, -1);
+		lua_pop(L,1);
+		memcpy(p + i * 8, &v, 8);
+		if (v < min) min = v;
+		if (v > max) max = v;
+	}
+
+	uint64_t range = (uint64_t)max - (uint64_t)min;
+	int width;
+	if (range <= 0xff) {
+		width = 1;
+	} else if (range <= 0xffff) {
+		width = 2;
+	} else if (range <= 0xffffffff) {
+		width = 4;
+	} else {
+		width = 8;
+	}
+
+	// 原地压缩, 第 i 个元素写入的位置不会超过第 i 个元素读取的位置
+	for (i=0;i<array_size;i++) {
+		uint64_t v;
+		memcpy(&v, p + i * 8, 8);
+		v -= (uint64_t)min;
+		switch (width) {
+		case 1: {
+			uint8_t x = (uint8_t)v;
+			memcpy(p + i, &x, 1);
+			break;
+		}
+		case 2: {
+			uint16_t x = (uint16_t)v;
+			memcpy(p + i * 2, &x, 2);
+			break;
+		}
+		case 4: {
+			uint32_t x = (uint32_t)v;
+			memcpy(p + i * 4, &x, 4);
+			break;
+		}
+		default:
+			memcpy(p + i * 8, &v, 8);
+			break;
+		}
+	}
+	wb->buffer[width_pos] = (char)width;
+	wb->len += 1 + array_size * width;
+	wb_integer(wb, min);
+	return 1;
+}
+
+/// 尝试写入浮点数数组的元素, 遇到非浮点数元素返回 0
+static int
+wb_array_real(lua_State *L, struct write_block * wb, int index, int array_size) {
+	if (array_size > (0x7fffffff - wb->len) / 8) {
+		return 0;
+	}
+	if (wb->cap - wb->len < array_size * 8) {
+		wb_expand(wb, array_size * 8);
+	}
+	char * p = wb->buffer + wb->len;
+	int i;
+	for (i=0;i<array_size;i++) {
+		if (lua_rawgeti(L, index, i+1) != LUA_TNUMBER || lua_isinteger(L, -1)) {
+			lua_pop(L,1);
+			return 0;
+		}
+		double v = lua_tonumber(L, -1);
+		lua_pop(L,1);
+		memcpy(p + i * 8, &v, 8);
+	}
+	wb->len += array_size * 8;
+	return 1;
+}
+
+/// 尝试写入短字符串数组的元素, 遇到非字符串或者长度不小于 256 的元素返回 0
+static int
+wb_array_string(lua_State *L, struct write_block * wb, int index, int array_size) {
+	int i;
+	for (i=0;i<array_size;i++) {
+		if (lua_rawgeti(L, index, i+1) != LUA_TSTRING) {
+			lua_pop(L,1);
+			return 0;
+		}
+		size_t sz;
+		const char * str = lua_tolstring(L, -1, &sz);
+		if (sz > 0xff) {
+			lua_pop(L,1);
+			return 0;
+		}
+		uint8_t len = (uint8_t)sz;
+		wb_push(wb, &len, 1);
+		wb_push(wb, str, len);
+		lua_pop(L,1);
+	}
+	return 1;
+}
+
+/**
+ * 当数组部分的元素全部是整数, 浮点数或者短字符串时, 以紧凑数组的形式写入数组部分.
+ * 元素类型由第一个元素决定, 边写入边检查, 遇到不同类型的元素时撤销已写入的数据, 返回 0, 由调用者按普通 table 写入.
+ */
+static int
+wb_table_packed(lua_State *L, struct write_block * wb, int index, int array_size) {
+	int kind;
+	int type = lua_rawgeti(L, index, 1);
+	if (type == LUA_TNUMBER) {
+		kind = lua_isinteger(L, -1) ? TYPE_ARRAY_INTEGER : TYPE_ARRAY_REAL;
+	} else if (type == LUA_TSTRING) {
+		kind = TYPE_ARRAY_STRING;
+	} else {
+		lua_pop(L,1);
+		return 0;
+	}
+	lua_pop(L,1);
+
+	int base = wb->len;
+	uint8_t n = COMBINE_TYPE(TYPE_USERDATA, kind);
+	wb_push(wb, &n, 1);
+	wb_integer(wb, array_size);
+
+	int ok;
+	switch (kind) {
+	case TYPE_ARRAY_INTEGER:
+		ok = wb_array_integer(L, wb, index, array_size);
+		break;
+	case TYPE_ARRAY_REAL:
+		ok = wb_array_real(L, wb, index, array_size);
+		break;
+	default:
+		ok = wb_array_string(L, wb, index, array_size);
+		break;
+	}
+	if (!ok) {
+		wb->len = base;
+	}
+	return ok;
+}
+
 /// write_block 压入非数组的 table
 static void
 wb_table_hash(lua_State *L, struct write_block * wb, int index, int depth, int array_size) {
@@ -344,6 +624,8 @@ wb_table_metapairs(lua_State *L, struct write_block *wb, int index, int depth) {
 	// 这时栈结构: next函数(-1), index表(-2), (-3) ...
 	// 这时栈结构: nil(-1), index表(-2), next函数(-3) ...
 
+	// __pairs 返回的键值可能是临时对象, 序列化过程中被回收后地址会被复用, 所以不能登记它们
+	wb->noref++;
 	for(;;) {
 		// index 表位于栈顶
 		lua_pushvalue(L, -2);
@@ -383,6 +665,7 @@ wb_table_metapairs(lua_State *L, struct write_block *wb, int index, int depth) {
 		// 弹出值, 下一次循环这个键需要作为 next 函数的一个参数
 		lua_pop(L, 1);
 	}
+	wb->noref--;
 
 	// 最后压入一个 nil 值, 表示这个表的加载结束了
 	wb_nil(wb);
@@ -407,8 +690,11 @@ wb_table(lua_State *L, struct write_block *wb, int index, int depth) {
 	if (luaL_getmetafield(L, index, "__pairs") != LUA_TNIL) {
 		wb_table_metapairs(L, wb, index, depth);
 	} else {
-		// 首先压入数组数据
-		int array_size = wb_table_array(L, wb, index, depth);
+		// 首先压入数组数据, 同类型的数组使用紧凑数组
+		int array_size = lua_rawlen(L, index);
+		if (array_size < MIN_PACKED_ARRAY || !wb_table_packed(L, wb, index, array_size)) {
+			array_size = wb_table_array(L, wb, index, depth);
+		}
 
 		// 接着再压入非数组数据
 		wb_table_hash(L, wb, index, depth, array_size);
@@ -447,6 +733,14 @@ pack_one(lua_State *L, struct write_block *b, int index, int depth) {
 	case LUA_TSTRING: {
 		size_t sz = 0;
 		const char *str = lua_tolstring(L,index,&sz);
+		// 短字符串在 lua 中是唯一的, 内容相同的短字符串地址也相同; 长字符串只有同一个对象才会去重
+		if (sz >= MIN_REF_STRING) {
+			int ref = wb_ref(b, str);
+			if (ref >= 0) {
+				wb_reference(b, ref);
+				break;
+			}
+		}
 		wb_string(b, str, (int)sz);
 		break;
 	}
@@ -457,6 +751,12 @@ pack_one(lua_State *L, struct write_block *b, int index, int depth) {
 		if (index < 0) {
 			index = lua_gettop(L) + index + 1;
 		}
+		// 共享的子表以及环只写入引用
+		int ref = wb_ref(b, lua_topointer(L, index));
+		if (ref >= 0) {
+			wb_reference(b, ref);
+			break;
+		}
 		wb_table(L, b, index, depth+1);
 		break;
 	}
@@ -561,32 +861,65 @@ get_buffer(lua_State *L, struct read_block *rb, int len) {
 		invalid_stream(L,rb);
 	}
 	lua_pushlstring(L,p,len);
+	if (len >= MIN_REF_STRING) {
+		rb_register(L, rb);
+	}
 }
 
 static void unpack_one(lua_State *L, struct read_block *rb);
 
+/// 从 read_block 中读取一个表示数量的整数
+static int
+get_count(lua_State *L, struct read_block *rb) {
+	// 确认数据类型, 并且获得实际的数值
+	uint8_t type;
+	uint8_t *t = rb_read(rb, sizeof(type));
+	if (t==NULL) {
+		invalid_stream(L,rb);
+	}
+	type = *t;
+	int cookie = type >> 3;
+	if ((type & 7) != TYPE_NUMBER || cookie == TYPE_NUMBER_REAL) {
+		invalid_stream(L,rb);
+	}
+	lua_Integer n = get_integer(L,rb,cookie);
+	if (n < 0 || n > 0x7fffffff) {
+		invalid_stream(L,rb);
+	}
+	return (int)n;
+}
+
+/// 从 read_block 中读取 table 的散列部分, 存入栈顶的 table 中
+static void
+unpack_table_hash(lua_State *L, struct read_block *rb) {
+	for (;;) {
+		// 键压入栈
+		unpack_one(L,rb);
+		if (lua_isnil(L,-1)) {
+			lua_pop(L,1);
+			return;
+		}
+
+		// 值压入栈
+		unpack_one(L,rb);
+
+		// 存入到 table 中
+		lua_rawset(L,-3);
+	}
+}
+
 /// 从 read_block 中读取 table 压入到当前栈的栈顶
 static void
 unpack_table(lua_State *L, struct read_block *rb, int array_size) {
 
 	// 是大数组的情况下
 	if (array_size == MAX_COOKIE-1) {
-		// 确认数据类型, 并且获得数组的实际长度
-		uint8_t type;
-		uint8_t *t = rb_read(rb, sizeof(type));
-		if (t==NULL) {
-			invalid_stream(L,rb);
-		}
-		type = *t;
-		int cookie = type >> 3;
-		if ((type & 7) != TYPE_NUMBER || cookie == TYPE_NUMBER_REAL) {
-			invalid_stream(L,rb);
-		}
-		array_size = get_integer(L,rb,cookie);
+		array_size = get_count(L, rb);
 	}
 
 	luaL_checkstack(L,LUA_MINSTACK,NULL);
 	lua_createtable(L,array_size,0);
+	rb_register(L, rb);
 
 	// 将连续的数组数据放入到 table 中
 	int i;
@@ -596,20 +929,157 @@ unpack_table(lua_State *L, struct read_block *rb, int array_size) {
 	}
 
 	// 将散列的数据存储到 table 中
-	for (;;) {
-		// 值压入栈
-		unpack_one(L,rb);
-		if (lua_isnil(L,-1)) {
-			lua_pop(L,1);
-			return;
+	unpack_table_hash(L, rb);
+}
+
+/// 读取紧凑整数数组的元素存入栈顶的 table. 每次将一批元素转换到连续的 lua_Integer 数组中, 便于编译器向量化
+static void
+unpack_array_integer(lua_State *L, struct read_block *rb, int array_size) {
+	uint8_t *w = rb_read(rb, 1);
+	if (w == NULL || (*w != 1 && *w != 2 && *w != 4 && *w != 8)) {
+		invalid_stream(L,rb);
+	}
+	int width = *w;
+	if (array_size > rb->len / width) {
+		invalid_stream(L,rb);
+	}
+	const uint8_t * p = rb_read(rb, array_size * width);
+
+	// 读取最小值
+	uint8_t *t = rb_read(rb, 1);
+	if (t == NULL || (*t & 7) != TYPE_NUMBER || (*t >> 3) == TYPE_NUMBER_REAL) {
+		invalid_stream(L,rb);
+	}
+	uint64_t base = (uint64_t)get_integer(L, rb, *t >> 3);
+
+	lua_createtable(L,array_size,0);
+	rb_register(L, rb);
+
+	lua_Integer tmp[PACKED_CHUNK];
+	int i, j;
+	for (i=0;i<array_size;i+=PACKED_CHUNK) {
+		int n = array_size - i < PACKED_CHUNK ? array_size - i : PACKED_CHUNK;
+		const uint8_t * src = p + i * width;
+		switch (width) {
+		case 1:
+			for (j=0;j<n;j++) {
+				tmp[j] = (lua_Integer)(base + src[j]);
+			}
+			break;
+		case 2:
+			for (j=0;j<n;j++) {
+				uint16_t v;
+				memcpy(&v, src + j * 2, 2);
+				tmp[j] = (lua_Integer)(base + v);
+			}
+			break;
+		case 4:
+			for (j=0;j<n;j++) {
+				uint32_t v;
+				memcpy(&v, src + j * 4, 4);
+				tmp[j] = (lua_Integer)(base + v);
+			}
+			break;
+		default:
+			for (j=0;j<n;j++) {
+				uint64_t v;
+				memcpy(&v, src + j * 8, 8);
+				tmp[j] = (lua_Integer)(base + v);
+			}
+			break;
 		}
+		for (j=0;j<n;j++) {
+			lua_pushinteger(L, tmp[j]);
+			lua_rawseti(L, -2, i + j + 1);
+		}
+	}
+}
 
-		// 键压入栈
-		unpack_one(L,rb);
+/// 读取紧凑浮点数数组的元素存入栈顶的 table
+static void
+unpack_array_real(lua_State *L, struct read_block *rb, int array_size) {
+	if (array_size > rb->len / 8) {
+		invalid_stream(L,rb);
+	}
+	const char * p = rb_read(rb, array_size * 8);
+	lua_createtable(L,array_size,0);
+	rb_register(L, rb);
+
+	double tmp[PACKED_CHUNK];
+	int i, j;
+	for (i=0;i<array_size;i+=PACKED_CHUNK) {
+		int n = array_size - i < PACKED_CHUNK ? array_size - i : PACKED_CHUNK;
+		memcpy(tmp, p + i * 8, n * 8);
+		for (j=0;j<n;j++) {
+			lua_pushnumber(L, tmp[j]);
+			lua_rawseti(L, -2, i + j + 1);
+		}
+	}
+}
 
-		// 存入到 table 中
-		lua_rawset(L,-3);
+/// 读取紧凑字符串数组的元素存入栈顶的 table
+static void
+unpack_array_string(lua_State *L, struct read_block *rb, int array_size) {
+	if (array_size > rb->len) {
+		invalid_stream(L,rb);
+	}
+	lua_createtable(L,array_size,0);
+	rb_register(L, rb);
+
+	int i;
+	for (i=1;i<=array_size;i++) {
+		uint8_t *len = rb_read(rb, 1);
+		if (len == NULL) {
+			invalid_stream(L,rb);
+		}
+		const char * str = rb_read(rb, *len);
+		if (str == NULL) {
+			invalid_stream(L,rb);
+		}
+		lua_pushlstring(L, str, *len);
+		lua_rawseti(L, -2, i);
+	}
+}
+
+/// 从 read_block 中读取紧凑数组压入到当前栈的栈顶
+static void
+unpack_packed_table(lua_State *L, struct read_block *rb, int kind) {
+	int array_size = get_count(L, rb);
+	luaL_checkstack(L,LUA_MINSTACK,NULL);
+	switch (kind) {
+	case TYPE_ARRAY_INTEGER:
+		unpack_array_integer(L, rb, array_size);
+		break;
+	case TYPE_ARRAY_REAL:
+		unpack_array_real(L, rb, array_size);
+		break;
+	case TYPE_ARRAY_STRING:
+		unpack_array_string(L, rb, array_size);
+		break;
+	default:
+		invalid_stream(L,rb);
+	}
+
+	// 将散列的数据存储到 table 中
+	unpack_table_hash(L, rb);
+}
+
+/// 从 read_block 读取引用, 将引用的对象压入栈顶
+static void
+get_reference(lua_State *L, struct read_block *rb, int cookie) {
+	lua_Integer index;
+	if (cookie == REF_HEADER || rb->ref == 0) {
+		invalid_stream(L,rb);
+	}
+	if (cookie == MAX_COOKIE-1) {
+		index = get_count(L, rb);
+	} else {
+		index = cookie - 1;
 	}
+	if (index < 0 || index >= rb->ref_n) {
+		invalid_stream(L,rb);
+	}
+	lua_rawgeti(L, rb->ref, index + 1);
 }
 
 /// 从 read_block 读取出数据压入到 lua 当前栈的栈顶
@@ -630,7 +1100,11 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 		}
 		break;
 	case TYPE_USERDATA:
-		lua_pushlightuserdata(L,get_pointer(L,rb));
+		if (cookie == 0) {
+			lua_pushlightuserdata(L,get_pointer(L,rb));
+		} else {
+			unpack_packed_table(L,rb,cookie);
+		}
 		break;
 	case TYPE_SHORT_STRING:
 		get_buffer(L,rb,cookie);
@@ -662,6 +1136,9 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 		unpack_table(L,rb,cookie);
 		break;
 	}
+	case TYPE_REF:
+		get_reference(L,rb,cookie);
+		break;
 	default: {
 		invalid_stream(L,rb);
 		break;
@@ -683,37 +1160,727 @@ unpack_one(lua_State *L, struct read_block *rb) {
 	push_value(L, rb, type & 0x7, type>>3);
 }
 
-/// 分配 len 大小的内存空间, 将连续的 block 数据读取出来, 最后将指向分配的内存空间的指针作为 lightuserdata 类型压入 lua, 然后再压入 len.
-static void
-seri(lua_State *L, struct block *b, int len) {
-	uint8_t * buffer = skynet_malloc(len);
-	uint8_t * ptr = buffer;
-	int sz = len;
-	while(len>0) {
-		if (len >= BLOCK_SIZE) {
-			memcpy(ptr, b->buffer, BLOCK_SIZE);
-			ptr += BLOCK_SIZE;
-			len -= BLOCK_SIZE;
-			b = b->next;
-		} else {
-			memcpy(ptr, b->buffer, len);
-			break;
-		}
-	}
-	
-	lua_pushlightuserdata(L, buffer);
-	lua_pushinteger(L, sz);
-}
+/// 将 buffer 中的全部值反序列化压入栈顶, 返回值的数量
+static int
+unpack_buffer(lua_State *L, char *buffer, int len) {
+	int top = lua_gettop(L);
 
-int
-_luaseri_unpack(lua_State *L) {
-	// 保证有参数
-	if (lua_isnoneornil(L,1)) {
-		return 0;
+	// 初始化 read_block
+	struct read_block rb;
+	rball_init(&rb, buffer, len);
+
+	// 数据流中含有引用, 先在栈上放一个 table 登记对象, 解析完成后移除
+	if (len > 0 && *(uint8_t *)buffer == COMBINE_TYPE(TYPE_REF, REF_HEADER)) {
+		rb_read(&rb, 1);
+		lua_newtable(L);
+		rb.ref = lua_gettop(L);
 	}
 
-	// 拿到起始地址指针和数据长度
-	void * buffer;
+	int i;
+	for (i=0;;i++) {
+
+		// 扩展栈空间
+		if (i%8==7) {
+			luaL_checkstack(L,LUA_MINSTACK,NULL);
+		}
+
+		uint8_t type = 0;
+		uint8_t *t = rb_read(&rb, sizeof(type));
+
+		// 数据读取完毕
+		if (t==NULL)
+			break;
+
+		// 将值反序列化压入到 lua 栈中
+		type = *t;
+		push_value(L, &rb, type & 0x7, type>>3);
+	}
+
+	if (rb.ref) {
+		lua_remove(L, rb.ref);
+	}
+
+	return lua_gettop(L) - top;
+}
+
+/*
+惰性解析的视图.
+_luaseri_unpackview 不解析数据, 只把序列化的数据复制到一个 userdata (view_root) 中, 返回一个视图 userdata (view).
+顶层视图对应打包时传入的一组值, 用整数索引访问第 i 个值; table 类型的值返回子视图, 访问字段时才在数据上扫描解析.
+所有视图都以 uservalue 引用 view_root, 保证数据在视图存活期间有效.
+
+每次访问字段都会从 table 的起始位置扫描, 适合只读取少量字段就转发整条消息的服务.
+数据流中含有引用时, 第一次遇到引用会扫描整个数据流, 记录每个登记对象的位置.
+*/
+
+#define VIEW_META "skynet.seri.view"
+#define VIEW_ROOT_META "skynet.seri.viewroot"
+#define VIEW_MAX_DEPTH 128		// 扫描数据时允许的最大嵌套深度
+
+/// 视图引用的数据
+struct view_root {
+	int sz;				// 数据大小
+	int refstream;		// 数据流是否以引用头开始
+	int ref_ready;		// ref 是否已经建立
+	int ref_n;			// 登记对象的数量
+	int ref_cap;		// ref 的容量
+	int * ref;			// 登记对象在数据中的偏移量, 按照登记顺序 (也就是偏移量从小到大) 排列
+	char buffer[1];		// 序列化的数据
+};
+
+/// 视图
+struct view {
+	struct view_root * root;
+	int offset;			// table: 类型字节的偏移量; 顶层视图: 第一个值的偏移量
+	int table;			// 1 表示 table 的视图, 0 表示顶层视图
+};
+
+/// 紧凑数组的解析结果
+struct view_packed {
+	int kind;			// TYPE_ARRAY_*
+	int n;				// 元素数量
+	int data;			// 第一个元素的偏移量
+	int width;			// 整数元素的宽度
+	uint64_t base;		// 整数元素的最小值
+	int hash;			// 散列部分的偏移量
+};
+
+/// 将 read_block 定位到 root 数据的 pos 处
+static inline void
+view_seek(struct read_block *rb, struct view_root *r, int pos) {
+	rball_init(rb, r->buffer, r->sz);
+	rb->ptr = pos;
+	rb->len = r->sz - pos;
+}
+
+/// 记录一个登记对象的偏移量
+static void
+view_register(struct view_root *r, int pos) {
+	if (r->ref_n >= r->ref_cap) {
+		r->ref_cap = r->ref_cap ? r->ref_cap * 2 : 64;
+		r->ref = skynet_realloc(r->ref, r->ref_cap * sizeof(int));
+	}
+	r->ref[r->ref_n++] = pos;
+}
+
+static void view_skip(lua_State *L, struct read_block *rb, struct view_root *scan, int depth);
+
+/// 读取长字符串的长度
+static int
+view_long_string(lua_State *L, struct read_block *rb, int cookie) {
+	if (cookie == 2) {
+		uint16_t n;
+		uint16_t *plen = rb_read(rb, 2);
+		if (plen == NULL) {
+			invalid_stream(L,rb);
+		}
+		memcpy(&n, plen, sizeof(n));
+		return n;
+	} else {
+		uint32_t n;
+		uint32_t *plen = rb_read(rb, 4);
+		if (cookie != 4 || plen == NULL) {
+			invalid_stream(L,rb);
+		}
+		memcpy(&n, plen, sizeof(n));
+		return (int)n;
+	}
+}
+
+/// 解析 rb 当前位置 (类型字节之后) 的紧凑数组, rb 停在散列部分的开始
+static void
+view_packed_open(lua_State *L, struct read_block *rb, int kind, struct view_packed *p) {
+	p->kind = kind;
+	p->n = get_count(L, rb);
+	p->width = 8;
+	p->base = 0;
+	switch (kind) {
+	case TYPE_ARRAY_INTEGER: {
+		uint8_t *w = rb_read(rb, 1);
+		if (w == NULL || (*w != 1 && *w != 2 && *w != 4 && *w != 8) || p->n > rb->len / *w) {
+			invalid_stream(L,rb);
+		}
+		p->width = *w;
+		p->data = rb->ptr;
+		rb_read(rb, p->n * p->width);
+		uint8_t *t = rb_read(rb, 1);
+		if (t == NULL || (*t & 7) != TYPE_NUMBER || (*t >> 3) == TYPE_NUMBER_REAL) {
+			invalid_stream(L,rb);
+		}
+		p->base = (uint64_t)get_integer(L, rb, *t >> 3);
+		break;
+	}
+	case TYPE_ARRAY_REAL:
+		if (p->n > rb->len / 8) {
+			invalid_stream(L,rb);
+		}
+		p->data = rb->ptr;
+		rb_read(rb, p->n * 8);
+		break;
+	case TYPE_ARRAY_STRING: {
+		p->data = rb->ptr;
+		int i;
+		for (i=0;i<p->n;i++) {
+			uint8_t *len = rb_read(rb, 1);
+			if (len == NULL || rb_read(rb, *len) == NULL) {
+				invalid_stream(L,rb);
+			}
+		}
+		break;
+	}
+	default:
+		invalid_stream(L,rb);
+	}
+	p->hash = rb->ptr;
+}
+
+/// 将紧凑数组的第 i 个 (从 1 开始) 元素压入栈顶
+static void
+view_packed_push(lua_State *L, struct view_root *r, struct view_packed *p, int i) {
+	const char * data = r->buffer + p->data;
+	switch (p->kind) {
+	case TYPE_ARRAY_INTEGER: {
+		uint64_t v = 0;
+		const uint8_t * src = (const uint8_t *)data + (i - 1) * p->width;
+		switch (p->width) {
+		case 1: v = src[0]; break;
+		case 2: { uint16_t x; memcpy(&x, src, 2); v = x; break; }
+		case 4: { uint32_t x; memcpy(&x, src, 4); v = x; break; }
+		default: memcpy(&v, src, 8); break;
+		}
+		lua_pushinteger(L, (lua_Integer)(p->base + v));
+		break;
+	}
+	case TYPE_ARRAY_REAL: {
+		double v;
+		memcpy(&v, data + (i - 1) * 8, 8);
+		lua_pushnumber(L, v);
+		break;
+	}
+	default: {
+		const uint8_t * s = (const uint8_t *)data;
+		while (--i > 0) {
+			s += 1 + s[0];
+		}
+		lua_pushlstring(L, (const char *)s + 1, s[0]);
+		break;
+	}
+	}
+}
+
+/// 跳过 table 的散列部分
+static void
+view_skip_hash(lua_State *L, struct read_block *rb, struct view_root *scan, int depth) {
+	for (;;) {
+		uint8_t *t = rb_read(rb, 1);
+		if (t == NULL) {
+			invalid_stream(L,rb);
+		}
+		if ((*t & 7) == TYPE_NIL) {
+			return;
+		}
+		rb->ptr--;
+		rb->len++;
+		view_skip(L, rb, scan, depth);
+		view_skip(L, rb, scan, depth);
+	}
+}
+
+/// 跳过 rb 当前位置的一个值. scan 不为 NULL 时, 按照解析时的登记顺序记录登记对象的偏移量
+static void
+view_skip(lua_State *L, struct read_block *rb, struct view_root *scan, int depth) {
+	if (depth > VIEW_MAX_DEPTH) {
+		luaL_error(L, "Serialized stream is too deep");
+	}
+	int pos = rb->ptr;
+	uint8_t *t = rb_read(rb, 1);
+	if (t == NULL) {
+		invalid_stream(L,rb);
+	}
+	int type = *t & 7;
+	int cookie = *t >> 3;
+	switch (type) {
+	case TYPE_NIL:
+	case TYPE_BOOLEAN:
+		break;
+	case TYPE_NUMBER:
+		if (cookie == TYPE_NUMBER_REAL) {
+			get_real(L, rb);
+		} else {
+			get_integer(L, rb, cookie);
+		}
+		break;
+	case TYPE_USERDATA:
+		if (cookie == 0) {
+			get_pointer(L, rb);
+		} else {
+			struct view_packed p;
+			if (scan) {
+				view_register(scan, pos);
+			}
+			view_packed_open(L, rb, cookie, &p);
+			view_skip_hash(L, rb, scan, depth + 1);
+		}
+		break;
+	case TYPE_SHORT_STRING:
+	case TYPE_LONG_STRING: {
+		int len = type == TYPE_SHORT_STRING ? cookie : view_long_string(L, rb, cookie);
+		if (rb_read(rb, len) == NULL) {
+			invalid_stream(L,rb);
+		}
+		if (scan && len >= MIN_REF_STRING) {
+			view_register(scan, pos);
+		}
+		break;
+	}
+	case TYPE_TABLE: {
+		if (scan) {
+			view_register(scan, pos);
+		}
+		int array_size = cookie == MAX_COOKIE-1 ? get_count(L, rb) : cookie;
+		int i;
+		for (i=0;i<array_size;i++) {
+			view_skip(L, rb, scan, depth + 1);
+		}
+		view_skip_hash(L, rb, scan, depth + 1);
+		break;
+	}
+	case TYPE_REF:
+		if (cookie == REF_HEADER) {
+			invalid_stream(L,rb);
+		}
+		if (cookie == MAX_COOKIE-1) {
+			get_count(L, rb);
+		}
+		break;
+	}
+}
+
+/// 扫描整个数据流, 记录每个登记对象的偏移量, 只在第一次调用时扫描
+static void
+view_refs(lua_State *L, struct view_root *r) {
+	if (!r->ref_ready) {
+		struct read_block rb;
+		r->ref_n = 0;
+		view_seek(&rb, r, 1);
+		while (rb.len > 0) {
+			view_skip(L, &rb, r, 0);
+		}
+		r->ref_ready = 1;
+	}
+}
+
+/// 返回 pos 处的引用所指向的对象的偏移量
+static int
+view_resolve(lua_State *L, struct view_root *r, int pos) {
+	struct read_block rb;
+	if (!r->refstream) {
+		view_seek(&rb, r, pos);
+		invalid_stream(L, &rb);
+	}
+	view_refs(L, r);
+
+	view_seek(&rb, r, pos + 1);
+	int cookie = (uint8_t)r->buffer[pos] >> 3;
+	int index = cookie == MAX_COOKIE-1 ? get_count(L, &rb) : cookie - 1;
+	if (index < 0 || index >= r->ref_n) {
+		invalid_stream(L, &rb);
+	}
+	return r->ref[index];
+}
+
+/// 创建视图压入栈顶, root 是 view_root 在栈中的位置
+static void
+view_new(lua_State *L, int root, int offset, int table) {
+	root = lua_absindex(L, root);
+	struct view * v = lua_newuserdata(L, sizeof(*v));
+	v->root = lua_touserdata(L, root);
+	v->offset = offset;
+	v->table = table;
+	luaL_setmetatable(L, VIEW_META);
+	lua_pushvalue(L, root);
+	lua_setuservalue(L, -2);
+}
+
+/// 将 pos 处的值压入栈顶, table 类型压入子视图, 引用压入它指向的对象
+static void
+view_push(lua_State *L, int root, struct view_root *r, int pos) {
+	uint8_t type = r->buffer[pos];
+	if ((type & 7) == TYPE_REF) {
+		pos = view_resolve(L, r, pos);
+		type = r->buffer[pos];
+	}
+	if ((type & 7) == TYPE_TABLE || ((type & 7) == TYPE_USERDATA && (type >> 3) != 0)) {
+		view_new(L, root, pos, 1);
+	} else {
+		struct read_block rb;
+		view_seek(&rb, r, pos);
+		unpack_one(L, &rb);
+	}
+}
+
+/// 返回 pos 处的字符串 (或者引用的字符串), 不是字符串时返回 NULL
+static const char *
+view_string(lua_State *L, struct view_root *r, int pos, size_t *sz) {
+	uint8_t type = r->buffer[pos];
+	if ((type & 7) == TYPE_REF) {
+		pos = view_resolve(L, r, pos);
+		type = r->buffer[pos];
+	}
+	struct read_block rb;
+	view_seek(&rb, r, pos + 1);
+	int len;
+	if ((type & 7) == TYPE_SHORT_STRING) {
+		len = type >> 3;
+	} else if ((type & 7) == TYPE_LONG_STRING) {
+		len = view_long_string(L, &rb, type >> 3);
+	} else {
+		return NULL;
+	}
+	const char * str = rb_read(&rb, len);
+	if (str == NULL) {
+		invalid_stream(L, &rb);
+	}
+	*sz = len;
+	return str;
+}
+
+/// 比较 pos 处的键与栈中 key 处的值是否相等
+static int
+view_key_equal(lua_State *L, struct view_root *r, int pos, int key) {
+	switch (lua_type(L, key)) {
+	case LUA_TSTRING: {
+		size_t sz, ksz;
+		const char * str = view_string(L, r, pos, &sz);
+		const char * k = lua_tolstring(L, key, &ksz);
+		return str && sz == ksz && memcmp(str, k, sz) == 0;
+	}
+	case LUA_TNUMBER:
+	case LUA_TBOOLEAN: {
+		int type = r->buffer[pos] & 7;
+		if (type != TYPE_NUMBER && type != TYPE_BOOLEAN) {
+			return 0;
+		}
+		struct read_block rb;
+		view_seek(&rb, r, pos);
+		unpack_one(L, &rb);
+		int eq = lua_rawequal(L, -1, key);
+		lua_pop(L, 1);
+		return eq;
+	}
+	default:
+		return 0;
+	}
+}
+
+/// 解析 table 视图的头部, 返回数组部分的长度, rb 停在数组部分的开始; 紧凑数组时 packed 返回 1, 填充 p, rb 停在散列部分的开始
+static int
+view_table_open(lua_State *L, struct view *v, struct read_block *rb, int *packed, struct view_packed *p) {
+	uint8_t type = v->root->buffer[v->offset];
+	view_seek(rb, v->root, v->offset + 1);
+	if ((type & 7) == TYPE_USERDATA) {
+		*packed = 1;
+		view_packed_open(L, rb, type >> 3, p);
+		return p->n;
+	}
+	*packed = 0;
+	return (type >> 3) == MAX_COOKIE-1 ? get_count(L, rb) : (type >> 3);
+}
+
+/// 返回顶层视图中值的数量
+static int
+view_count(lua_State *L, struct view *v) {
+	struct read_block rb;
+	view_seek(&rb, v->root, v->offset);
+	int n = 0;
+	while (rb.len > 0) {
+		view_skip(L, &rb, NULL, 0);
+		++n;
+	}
+	return n;
+}
+
+/// lua: view[key], 取值时才解析
+static int
+lview_index(lua_State *L) {
+	struct view * v = luaL_checkudata(L, 1, VIEW_META);
+	struct view_root * r = v->root;
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);		// view_root 在栈中的位置为 3
+
+	int isint = 0;
+	lua_Integer ik = 0;
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		ik = lua_tointegerx(L, 2, &isint);
+	}
+
+	struct read_block rb;
+	int i;
+	if (!v->table) {
+		if (!isint || ik < 1) {
+			return 0;
+		}
+		view_seek(&rb, r, v->offset);
+		for (i=1;i<ik;i++) {
+			if (rb.len == 0) {
+				return 0;
+			}
+			view_skip(L, &rb, NULL, 0);
+		}
+		if (rb.len == 0) {
+			return 0;
+		}
+		view_push(L, 3, r, rb.ptr);
+		return 1;
+	}
+
+	int packed;
+	struct view_packed p;
+	int array_size = view_table_open(L, v, &rb, &packed, &p);
+	if (isint && ik >= 1 && ik <= array_size) {
+		if (packed) {
+			view_packed_push(L, r, &p, (int)ik);
+		} else {
+			for (i=1;i<ik;i++) {
+				view_skip(L, &rb, NULL, 0);
+			}
+			view_push(L, 3, r, rb.ptr);
+		}
+		return 1;
+	}
+
+	// 跳过数组部分, 在散列部分中查找
+	if (packed) {
+		view_seek(&rb, r, p.hash);
+	} else {
+		for (i=0;i<array_size;i++) {
+			view_skip(L, &rb, NULL, 0);
+		}
+	}
+	for (;;) {
+		uint8_t *t = rb_read(&rb, 1);
+		if (t == NULL) {
+			invalid_stream(L, &rb);
+		}
+		if ((*t & 7) == TYPE_NIL) {
+			return 0;
+		}
+		int key = rb.ptr - 1;
+		rb.ptr--;
+		rb.len++;
+		view_skip(L, &rb, NULL, 0);
+		if (view_key_equal(L, r, key, 2)) {
+			view_push(L, 3, r, rb.ptr);
+			return 1;
+		}
+		view_skip(L, &rb, NULL, 0);
+	}
+}
+
+/// lua: #view, 顶层视图返回值的数量, table 视图返回数组部分的长度
+static int
+lview_len(lua_State *L) {
+	struct view * v = luaL_checkudata(L, 1, VIEW_META);
+	if (!v->table) {
+		lua_pushinteger(L, view_count(L, v));
+	} else {
+		struct read_block rb;
+		int packed;
+		struct view_packed p;
+		lua_pushinteger(L, view_table_open(L, v, &rb, &packed, &p));
+	}
+	return 1;
+}
+
+/**
+ * pairs 的迭代函数, 迭代状态保存在 upvalue 中:
+ * 1 视图, 2 下一个元素的偏移量, 3 下一个数组索引, 4 数组部分的长度, 5 紧凑数组的类型 (0 表示不是紧凑数组), 6 散列部分的偏移量
+ */
+static int
+lview_next(lua_State *L) {
+	struct view * v = lua_touserdata(L, lua_upvalueindex(1));
+	struct view_root * r = v->root;
+	int pos = lua_tointeger(L, lua_upvalueindex(2));
+	int idx = lua_tointeger(L, lua_upvalueindex(3));
+	int array_size = lua_tointeger(L, lua_upvalueindex(4));
+	int kind = lua_tointeger(L, lua_upvalueindex(5));
+	lua_settop(L, 0);
+	lua_getuservalue(L, lua_upvalueindex(1));	// view_root 在栈中的位置为 1
+
+	struct read_block rb;
+	if (idx <= array_size) {
+		lua_pushinteger(L, idx);
+		if (kind == TYPE_ARRAY_INTEGER || kind == TYPE_ARRAY_REAL) {
+			struct view_packed p;
+			view_seek(&rb, r, v->offset + 1);
+			view_packed_open(L, &rb, kind, &p);
+			view_packed_push(L, r, &p, idx);
+			if (idx == array_size) {
+				pos = p.hash;
+			}
+		} else if (kind == TYPE_ARRAY_STRING) {
+			uint8_t len = r->buffer[pos];
+			lua_pushlstring(L, r->buffer + pos + 1, len);
+			pos += 1 + len;
+			if (idx == array_size) {
+				pos = lua_tointeger(L, lua_upvalueindex(6));
+			}
+		} else {
+			view_push(L, 1, r, pos);
+			view_seek(&rb, r, pos);
+			view_skip(L, &rb, NULL, 0);
+			pos = rb.ptr;
+		}
+		lua_pushinteger(L, pos);
+		lua_replace(L, lua_upvalueindex(2));
+		lua_pushinteger(L, idx + 1);
+		lua_replace(L, lua_upvalueindex(3));
+		return 2;
+	}
+
+	// 顶层视图没有散列部分
+	if (!v->table) {
+		return 0;
+	}
+
+	view_seek(&rb, r, pos);
+	uint8_t *t = rb_read(&rb, 1);
+	if (t == NULL) {
+		invalid_stream(L, &rb);
+	}
+	if ((*t & 7) == TYPE_NIL) {
+		return 0;
+	}
+	view_push(L, 1, r, pos);
+	view_seek(&rb, r, pos);
+	view_skip(L, &rb, NULL, 0);
+	view_push(L, 1, r, rb.ptr);
+	view_skip(L, &rb, NULL, 0);
+	lua_pushinteger(L, rb.ptr);
+	lua_replace(L, lua_upvalueindex(2));
+	return 2;
+}
+
+/// lua: pairs(view), 顶层视图按顺序迭代每个值, table 视图先迭代数组部分, 再迭代散列部分
+static int
+lview_pairs(lua_State *L) {
+	struct view * v = luaL_checkudata(L, 1, VIEW_META);
+	struct read_block rb;
+	int array_size, kind = 0, hash = 0;
+	if (!v->table) {
+		array_size = view_count(L, v);
+		view_seek(&rb, v->root, v->offset);
+	} else {
+		int packed;
+		struct view_packed p;
+		array_size = view_table_open(L, v, &rb, &packed, &p);
+		if (packed) {
+			kind = p.kind;
+			hash = p.hash;
+			if (kind == TYPE_ARRAY_STRING && array_size > 0) {
+				view_seek(&rb, v->root, p.data);
+			}
+		}
+	}
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, rb.ptr);
+	lua_pushinteger(L, 1);
+	lua_pushinteger(L, array_size);
+	lua_pushinteger(L, kind);
+	lua_pushinteger(L, hash);
+	lua_pushcclosure(L, lview_next, 6);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+/// 释放 view_root 在堆上分配的资源
+static int
+lview_gc(lua_State *L) {
+	struct view_root * r = lua_touserdata(L, 1);
+	skynet_free(r->ref);
+	r->ref = NULL;
+	return 0;
+}
+
+/// 创建视图和 view_root 的元表
+static void
+view_metatable(lua_State *L) {
+	if (luaL_newmetatable(L, VIEW_META)) {
+		luaL_Reg l[] = {
+			{ "__index", lview_index },
+			{ "__len", lview_len },
+			{ "__pairs", lview_pairs },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+	}
+	lua_pop(L, 1);
+	if (luaL_newmetatable(L, VIEW_ROOT_META)) {
+		lua_pushcfunction(L, lview_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
+}
+
+/// 解析整个视图, 顶层视图返回全部的值, table 视图返回这个 table
+static int
+view_unpack(lua_State *L, struct view *v) {
+	struct view_root * r = v->root;
+	struct read_block rb;
+
+	// 保留视图在栈底, 保证解析过程中数据不会被回收
+	lua_settop(L, 1);
+	if (!v->table) {
+		int n = unpack_buffer(L, r->buffer, r->sz);
+		lua_remove(L, 1);
+		return n;
+	}
+	if (!r->refstream) {
+		view_seek(&rb, r, v->offset);
+		unpack_one(L, &rb);
+		return 1;
+	}
+
+	// 数据流中含有引用时, 子表可能引用到子表之外的对象, 所以解析整个数据流, 再从登记的对象中取出这个子表
+	view_refs(L, r);
+	int lo = 0, hi = r->ref_n - 1, index = -1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (r->ref[mid] == v->offset) {
+			index = mid;
+			break;
+		} else if (r->ref[mid] < v->offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (index < 0) {
+		view_seek(&rb, r, v->offset);
+		invalid_stream(L, &rb);
+	}
+	lua_settop(L, 1);
+	lua_newtable(L);
+	rball_init(&rb, r->buffer, r->sz);
+	rb_read(&rb, 1);
+	rb.ref = 2;
+	while (rb.len > 0) {
+		unpack_one(L, &rb);
+		lua_settop(L, 2);
+	}
+	lua_rawgeti(L, 2, index + 1);
+	return 1;
+}
+
+int
+_luaseri_unpackview(lua_State *L) {
+	if (lua_isnoneornil(L,1)) {
+		return 0;
+	}
+
+	// 拿到起始地址指针和数据长度
+	void * buffer;
 	int len;
 	if (lua_type(L,1) == LUA_TSTRING) {
 		size_t sz;
@@ -723,64 +1890,119 @@ _luaseri_unpack(lua_State *L) {
 		buffer = lua_touserdata(L,1);
 		len = luaL_checkinteger(L,2);
 	}
-
-	if (len == 0) {
-		return 0;
+	if (buffer == NULL && len > 0) {
+		return luaL_error(L, "deserialize null pointer");
 	}
 
-	if (buffer == NULL) {
-		return luaL_error(L, "deserialize null pointer");
+	view_metatable(L);
+
+	// 复制数据, 消息的内存在消息处理完之后就会被释放
+	struct view_root * r = lua_newuserdata(L, sizeof(*r) + len);
+	r->sz = len;
+	r->refstream = len > 0 && *(uint8_t *)buffer == COMBINE_TYPE(TYPE_REF, REF_HEADER);
+	r->ref_ready = 0;
+	r->ref_n = 0;
+	r->ref_cap = 0;
+	r->ref = NULL;
+	if (len > 0) {
+		memcpy(r->buffer, buffer, len);
 	}
+	luaL_setmetatable(L, VIEW_ROOT_META);
 
-	// 栈上所有元素移除
-	lua_settop(L,0);
+	view_new(L, -1, r->refstream ? 1 : 0, 0);
+	return 1;
+}
 
-	// 初始化 read_block
+const void *
+_luaseri_viewbuffer(lua_State *L, int index, size_t *sz) {
+	struct view * v = luaL_checkudata(L, index, VIEW_META);
+	struct view_root * r = v->root;
+	if (!v->table) {
+		*sz = r->sz;
+		return r->sz > 0 ? r->buffer : NULL;
+	}
+
+	// 没有引用时, 子表的数据本身就是一个完整的序列化数据
+	if (r->refstream) {
+		luaL_error(L, "Can't send a sub view of a serialized stream with references");
+	}
 	struct read_block rb;
-	rball_init(&rb, buffer, len);
+	view_seek(&rb, r, v->offset);
+	view_skip(L, &rb, NULL, 0);
+	*sz = rb.ptr - v->offset;
+	return r->buffer + v->offset;
+}
 
-	int i;
-	for (i=0;;i++) {
+/// 将 write_block 的数据作为 lightuserdata 类型压入 lua, 然后再压入 len. 数据在堆上时直接交出缓冲, 否则分配内存复制
+static void
+seri(lua_State *L, struct write_block *b) {
+	void * buffer;
+	if (b->buffer == b->init) {
+		buffer = skynet_malloc(b->len);
+		memcpy(buffer, b->buffer, b->len);
+	} else {
+		buffer = b->buffer;
+		b->buffer = b->init;
+	}
 
-		// 扩展栈空间
-		if (i%8==7) {
-			luaL_checkstack(L,LUA_MINSTACK,NULL);
-		}
+	lua_pushlightuserdata(L, buffer);
+	lua_pushinteger(L, b->len);
+}
 
-		uint8_t type = 0;
-		uint8_t *t = rb_read(&rb, sizeof(type));
+int
+_luaseri_unpack(lua_State *L) {
+	// 保证有参数
+	if (lua_isnoneornil(L,1)) {
+		return 0;
+	}
 
-		// 数据读取完毕
-		if (t==NULL)
-			break;
+	// 解析 _luaseri_unpackview 返回的视图
+	if (lua_type(L,1) == LUA_TUSERDATA) {
+		return view_unpack(L, luaL_checkudata(L, 1, VIEW_META));
+	}
 
-		// 将值反序列化压入到 lua 栈中
-		type = *t;
-		push_value(L, &rb, type & 0x7, type>>3);
+	// 拿到起始地址指针和数据长度
+	void * buffer;
+	int len;
+	if (lua_type(L,1) == LUA_TSTRING) {
+		size_t sz;
+		buffer = (void *)lua_tolstring(L,1,&sz);
+		len = (int)sz;
+	} else {
+		buffer = lua_touserdata(L,1);
+		len = luaL_checkinteger(L,2);
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	if (buffer == NULL) {
+		return luaL_error(L, "deserialize null pointer");
 	}
 
+	// 栈上所有元素移除
+	lua_settop(L,0);
+
 	// Need not free buffer
 	// 不必释放 buffer
 
-	return lua_gettop(L);
+	return unpack_buffer(L, buffer, len);
 }
 
 int
 _luaseri_pack(lua_State *L) {
-	struct block temp;		// 注意, 第一个 block 是在栈上的, 所以 wb_free 里面有段注释 "the first block is on stack", 第一个 block 是不能被 free
-	temp.next = NULL;
+	char temp[BUFFER_SIZE];			// 栈上的初始缓冲, 较小的数据只在最后分配一次内存
+	struct ref_node ref[REF_SIZE];	// 栈上的初始引用 hash 表
 
 	struct write_block wb;
-	wb_init(&wb, &temp);
+	wb_init(&wb, temp, ref);
 
 	// 将全部传入的参数序列化
 	pack_from(L,&wb,0);
 
-	// 校验, 不能改变 write_block 的 head 指针
-	assert(wb.head == &temp);
-
 	// 将 lightuserdata 类型和 sz 压入 lua, 作为返回值
-	seri(L, &temp, wb.len);
+	seri(L, &wb);
 
 	wb_free(&wb);
 
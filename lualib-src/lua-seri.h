@@ -2,17 +2,26 @@
  * 对 lua 数据结构初始化的数据方案.
  * 这个序列化库支持 string, boolean, number, lightuserdata, table 这些类型，
  * 但对 lua table 的 metatable 支持非常有限，所以尽量不要用其打包带有元方法的 lua 对象。
+ * 重复出现的字符串和共享的子表只打包一次, 之后写入引用, 解包后仍然是同一个 table, 也因此支持带环的 table。
+ * 元素全部是整数, 浮点数或者短字符串的数组以紧凑的形式打包, 不再为每个元素写入类型。
  */
 
 #ifndef LUA_SERIALIZE_H
 #define LUA_SERIALIZE_H
 
 #include <lua.h>
+#include <stddef.h>
 
 /// 可以将一组 lua 对象序列化为一个由 malloc 分配出来的 C 指针加一个数字长度。你需要考虑 C 指针引用的数据块何时释放的问题。
 int _luaseri_pack(lua_State *L);
 
-/// 它可以把一个 C 指针加长度的消息解码成一组 Lua 对象。
+/// 它可以把一个 C 指针加长度的消息解码成一组 Lua 对象。也可以传入 _luaseri_unpackview 返回的视图, 解码视图对应的全部数据。
 int _luaseri_unpack(lua_State *L);
 
+/// 复制一个 C 指针加长度的消息, 返回一个惰性解析的视图, 访问字段时才解码。
+int _luaseri_unpackview(lua_State *L);
+
+/// 返回栈中 index 处的视图对应的序列化数据及其长度, 可以直接作为消息发送。
+const void * _luaseri_viewbuffer(lua_State *L, int index, size_t *sz);
+
 #endif
@@ -2,9 +2,17 @@
 #include <lauxlib.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "atomic.h"
+#include "luashrtbl.h"
 
 #define KEYTYPE_INTEGER 0
 #define KEYTYPE_STRING 1
@@ -16,19 +24,30 @@
 #define VALUETYPE_TABLE 4
 #define VALUETYPE_INTEGER 5
 
-struct table;
+// 整个配置 (所有的 table, node 和字符串) 被编译进一块连续的内存, 称为 image.
+// image 内部只使用相对 image 起始位置的偏移量, 不保存指针, 所以可以直接写入文件, 之后用 mmap 只读映射回来.
+// 偏移量是 uint32_t, 一个 image 最大 4G.
+// 增量更新生成的 image 可以引用之前的 image 中没有变化的子表, 这种 image 只存在于内存中, 保存时需要先展开.
+
+#define IMAGE_MAGIC "SKYSDI05"
+#define IMAGE_LAYOUT ((uint32_t)(sizeof(struct table) << 16 | sizeof(struct node) << 8 | sizeof(union value)))
+
+struct image;
 
 union value {
 	lua_Number n;
 	lua_Integer d;
-	struct table * tbl;
-	int string;
+	struct {
+		uint32_t offset;	// offset of table
+		uint32_t image;	// 0 means the same image, or index of externs (base 1)
+	} tbl;
+	uint32_t string;	// offset of string
 	int boolean;
 };
 
 struct node {
 	union value v;
-	int key;	// integer key or index of string table
+	int key;	// integer key or offset of string
 	int next;	// next slot index
 	uint32_t keyhash;
 	uint8_t keytype;	// key type must be integer or string
@@ -36,25 +55,83 @@ struct node {
 	uint8_t nocolliding;	// 0 means colliding slot
 };
 
+// 运行时的状态, 写入文件时清零
 struct state {
 	int dirty;
 	int ref;
-	struct table * root;
+	int mapped;	// 1 表示 image 来自 mmap, 否则是 malloc 出来的
+	int nextern;
+	struct image ** externs;	// 引用的其他 image, 每个都持有一份引用计数
+	TString ** strings;	// 短字符串在全局短字符串表 (SSM) 中的 TString, 建立或载入 image 时填入, 超出配额的为 NULL
+};
+
+// 放入全局短字符串表的字符串数量配额, 所有 image 共用. 这些字符串不会释放, 相同的字符串只计算一次.
+// sharedatad 启动时按 sharedata_string 配置设置 (默认 65536), 配额用完后读取字符串时复制一份.
+static int STRING_LEFT = 0;
+
+// image 的头部, 位于偏移量 0 的位置.
+// mmap 时使用 MAP_PRIVATE, 运行时只会写头部所在的一页, 其余的页在多个进程之间共享.
+struct image {
+	char magic[8];
+	uint32_t layout;
+	uint32_t size;
+	uint32_t root;	// offset of root table
+	uint32_t nstring;
+	uint32_t strings;	// offset of uint32_t [nstring], 按序号排列的字符串偏移量
+	struct state state;
 };
 
+// 所有偏移量都相对于 image 的起始位置, base 是 table 自己的偏移量, 用来从任意一个 table 找回 image.
 struct table {
+	uint32_t base;
 	int sizearray;
 	int sizehash;
-	uint8_t *arraytype;
-	union value * array;
-	struct node * hash;
-	lua_State * L;
+	uint32_t arraytype;	// offset of uint8_t [sizearray]
+	uint32_t array;	// offset of union value [sizearray]
+	uint32_t hash;	// offset of struct node [sizehash]
+	uint32_t sorted;	// offset of the first struct sortindex, 0 means none
+};
+
+// 排序索引, 按照子表的某个字段 (field 为 0 时按照 table 自己的 key) 排序的 (排序值, key) 数组.
+// 同一个 table 的多个索引用 next 串起来.
+struct sortindex {
+	uint32_t field;	// offset of string, 0 means key
+	uint32_t n;
+	uint32_t entries;	// offset of struct sortentry [n]
+	uint32_t next;
 };
 
+struct sortentry {
+	union value v;	// sort value (number or string)
+	int key;	// key of element (integer or offset of string)
+	uint8_t valuetype;
+	uint8_t keytype;
+};
+
+// 字符串保存为 长度 + 序号 + 内容 + '\0', 序号用于索引 state.strings
+struct string {
+	uint32_t sz;
+	uint32_t index;
+	char str[1];
+};
+
+#define IMAGE(tbl) ((struct image *)((char *)(tbl) - (tbl)->base))
+#define IMAGE_PTR(img, offset, type) ((type *)((char *)(img) + (offset)))
+#define ARRAYTYPE(tbl) IMAGE_PTR(IMAGE(tbl), (tbl)->arraytype, uint8_t)
+#define ARRAY(tbl) IMAGE_PTR(IMAGE(tbl), (tbl)->array, union value)
+#define HASH(tbl) IMAGE_PTR(IMAGE(tbl), (tbl)->hash, struct node)
+
 struct context {
-	lua_State * L;
-	struct table * tbl;
-	int string_index;
+	char * buffer;
+	size_t size;
+	size_t cap;
+	uint32_t tbl;	// offset of the table converting
+	uint32_t nstring;
+	uint32_t strings;	// offset of uint32_t [nstring]
+	int reference;	// 是否允许 lightuserdata 引用其他 image 中的 table
+	int nextern;
+	int capextern;
+	struct image ** externs;
 };
 
 struct ctrl {
@@ -62,6 +139,53 @@ struct ctrl {
 	struct table * update;
 };
 
+static inline struct state *
+getstate(struct table *tbl) {
+	return &IMAGE(tbl)->state;
+}
+
+static inline struct table *
+subtable(struct table *tbl, union value *v) {
+	struct image * img = IMAGE(tbl);
+	if (v->tbl.image) {
+		img = img->state.externs[v->tbl.image - 1];
+	}
+	return IMAGE_PTR(img, v->tbl.offset, struct table);
+}
+
+static inline const char *
+getstring(struct table *tbl, uint32_t offset, size_t *sz) {
+	struct string * s = IMAGE_PTR(IMAGE(tbl), offset, struct string);
+	*sz = s->sz;
+	return s->str;
+}
+
+// 在 image 中分配 sz 字节 (8 字节对齐, 内容清零), 返回偏移量. 分配可能会移动 buffer, 之前取得的指针都会失效.
+static uint32_t
+image_alloc(lua_State *L, struct context *ctx, size_t sz) {
+	size_t offset = (ctx->size + 7) & ~(size_t)7;
+	if (offset + sz > UINT32_MAX) {
+		luaL_error(L, "sharedata image is too large");
+	}
+	if (offset + sz > ctx->cap) {
+		size_t cap = ctx->cap;
+		while (cap < offset + sz) {
+			cap *= 2;
+		}
+		char * buffer = realloc(ctx->buffer, cap);
+		if (buffer == NULL) {
+			luaL_error(L, "memory error");
+		}
+		ctx->buffer = buffer;
+		ctx->cap = cap;
+	}
+	memset(ctx->buffer + ctx->size, 0, offset + sz - ctx->size);
+	ctx->size = offset + sz;
+	return (uint32_t)offset;
+}
+
+#define CTX_TABLE(ctx) IMAGE_PTR((ctx)->buffer, (ctx)->tbl, struct table)
+
 static int
 countsize(lua_State *L, int sizearray) {
 	int n = 0;
@@ -97,98 +221,120 @@ calchash(const char * str, size_t l) {
 	return h;
 }
 
-static int
-stringindex(struct context *ctx, const char * str, size_t sz) {
-	lua_State *L = ctx->L;
+// 相同的字符串在 image 中只保存一份, stringmap(3) 记录 字符串 -> 偏移量
+static uint32_t
+stringindex(struct context *ctx, lua_State *L, const char * str, size_t sz) {
 	lua_pushlstring(L, str, sz);
 	lua_pushvalue(L, -1);
-	lua_rawget(L, 1);
-	int index;
-	// stringmap(1) str index
+	lua_rawget(L, 3);
+	uint32_t offset;
+	// str offset
 	if (lua_isnil(L, -1)) {
-		index = ++ctx->string_index;
 		lua_pop(L, 1);
-		lua_pushinteger(L, index);
-		lua_rawset(L, 1);
+		offset = image_alloc(L, ctx, offsetof(struct string, str) + sz + 1);
+		struct string * s = IMAGE_PTR(ctx->buffer, offset, struct string);
+		s->sz = (uint32_t)sz;
+		s->index = ctx->nstring++;
+		memcpy(s->str, str, sz);
+		lua_pushinteger(L, offset);
+		lua_rawset(L, 3);
 	} else {
-		index = lua_tointeger(L, -1);
+		offset = (uint32_t)lua_tointeger(L, -1);
 		lua_pop(L, 2);
 	}
-	return index;
+	return offset;
 }
 
 static int convtable(lua_State *L);
 
-static void
-setvalue(struct context * ctx, lua_State *L, int index, struct node *n) {
+static uint32_t
+extern_index(struct context *ctx, lua_State *L, struct image *img) {
+	int i;
+	for (i=0;i<ctx->nextern;i++) {
+		if (ctx->externs[i] == img)
+			return i + 1;
+	}
+	if (ctx->nextern >= ctx->capextern) {
+		int cap = ctx->capextern ? ctx->capextern * 2 : 4;
+		struct image ** externs = realloc(ctx->externs, cap * sizeof(struct image *));
+		if (externs == NULL) {
+			luaL_error(L, "memory error");
+		}
+		ctx->externs = externs;
+		ctx->capextern = cap;
+	}
+	ctx->externs[ctx->nextern++] = img;
+	return ctx->nextern;
+}
+
+// 转换 index 处的值, 返回值类型. 转换过程会在 image 中分配内存, 所以结果先写到 v 中.
+static uint8_t
+setvalue(struct context * ctx, lua_State *L, int index, union value *v) {
 	int vt = lua_type(L, index);
 	switch(vt) {
-	case LUA_TNIL:
-		n->valuetype = VALUETYPE_NIL;
-		break;
 	case LUA_TNUMBER:
 		if (lua_isinteger(L, index)) {
-			n->v.d = lua_tointeger(L, index);
-			n->valuetype = VALUETYPE_INTEGER;
+			v->d = lua_tointeger(L, index);
+			return VALUETYPE_INTEGER;
 		} else {
-			n->v.n = lua_tonumber(L, index);
-			n->valuetype = VALUETYPE_REAL;
+			v->n = lua_tonumber(L, index);
+			return VALUETYPE_REAL;
 		}
-		break;
 	case LUA_TSTRING: {
 		size_t sz = 0;
 		const char * str = lua_tolstring(L, index, &sz);
-		n->v.string = stringindex(ctx, str, sz);
-		n->valuetype = VALUETYPE_STRING;
-		break;
+		v->string = stringindex(ctx, L, str, sz);
+		return VALUETYPE_STRING;
 	}
 	case LUA_TBOOLEAN:
-		n->v.boolean = lua_toboolean(L, index);
-		n->valuetype = VALUETYPE_BOOLEAN;
-		break;
+		v->boolean = lua_toboolean(L, index);
+		return VALUETYPE_BOOLEAN;
 	case LUA_TTABLE: {
-		struct table *tbl = ctx->tbl;
-		ctx->tbl = (struct table *)malloc(sizeof(struct table));
-		if (ctx->tbl == NULL) {
-			ctx->tbl = tbl;
-			luaL_error(L, "memory error");
-			// never get here
-		}
-		memset(ctx->tbl, 0, sizeof(struct table));
+		uint32_t tbl = ctx->tbl;
+		ctx->tbl = image_alloc(L, ctx, sizeof(struct table));
 		int absidx = lua_absindex(L, index);
 
 		lua_pushcfunction(L, convtable);
 		lua_pushvalue(L, absidx);
 		lua_pushlightuserdata(L, ctx);
+		lua_pushvalue(L, 3);
 
-		lua_call(L, 2, 0);
-
-		n->v.tbl = ctx->tbl;
-		n->valuetype = VALUETYPE_TABLE;
+		lua_call(L, 3, 0);
 
+		v->tbl.offset = ctx->tbl;
+		v->tbl.image = 0;
 		ctx->tbl = tbl;
-
-		break;
+		return VALUETYPE_TABLE;
+	}
+	case LUA_TLIGHTUSERDATA: {
+		// 增量更新时, 没有变化的子表直接引用原来的 image
+		if (!ctx->reference)
+			break;
+		struct table * tbl = lua_touserdata(L, index);
+		v->tbl.offset = tbl->base;
+		v->tbl.image = extern_index(ctx, L, IMAGE(tbl));
+		return VALUETYPE_TABLE;
 	}
 	default:
-		luaL_error(L, "Unsupport value type %s", lua_typename(L, vt));
 		break;
 	}
+	luaL_error(L, "Unsupport value type %s", lua_typename(L, vt));
+	return VALUETYPE_NIL;
 }
 
 static void
 setarray(struct context *ctx, lua_State *L, int index, int key) {
-	struct node n;
-	setvalue(ctx, L, index, &n);
-	struct table *tbl = ctx->tbl;
+	union value v;
+	uint8_t vt = setvalue(ctx, L, index, &v);
+	struct table *tbl = CTX_TABLE(ctx);
 	--key;	// base 0
-	tbl->arraytype[key] = n.valuetype;
-	tbl->array[key] = n.v;
+	IMAGE_PTR(ctx->buffer, tbl->arraytype, uint8_t)[key] = vt;
+	IMAGE_PTR(ctx->buffer, tbl->array, union value)[key] = v;
 }
 
 static int
 ishashkey(struct context * ctx, lua_State *L, int index, int *key, uint32_t *keyhash, int *keytype) {
-	int sizearray = ctx->tbl->sizearray;
+	int sizearray = CTX_TABLE(ctx)->sizearray;
 	int kt = lua_type(L, index);
 	if (kt == LUA_TNUMBER) {
 		*key = lua_tointeger(L, index);
@@ -201,15 +347,20 @@ ishashkey(struct context * ctx, lua_State *L, int index, int *key, uint32_t *key
 		size_t sz = 0;
 		const char * s = lua_tolstring(L, index, &sz);
 		*keyhash = calchash(s, sz);
-		*key = stringindex(ctx, s, sz);
+		*key = (int)stringindex(ctx, L, s, sz);
 		*keytype = KEYTYPE_STRING;
 	}
 	return 1;
 }
 
+static inline struct node *
+ctx_node(struct context *ctx, int index) {
+	return &IMAGE_PTR(ctx->buffer, CTX_TABLE(ctx)->hash, struct node)[index];
+}
+
 static void
 fillnocolliding(lua_State *L, struct context *ctx) {
-	struct table * tbl = ctx->tbl;
+	int sizehash = CTX_TABLE(ctx)->sizehash;
 	lua_pushnil(L);
 	while (lua_next(L, 1) != 0) {
 		int key;
@@ -218,14 +369,19 @@ fillnocolliding(lua_State *L, struct context *ctx) {
 		if (!ishashkey(ctx, L, -2, &key, &keyhash, &keytype)) {
 			setarray(ctx, L, -1, key);
 		} else {
-			struct node * n = &tbl->hash[keyhash % tbl->sizehash];
+			int slot = keyhash % sizehash;
+			struct node * n = ctx_node(ctx, slot);
 			if (n->valuetype == VALUETYPE_NIL) {
 				n->key = key;
 				n->keytype = keytype;
 				n->keyhash = keyhash;
 				n->next = -1;
 				n->nocolliding = 1;
-				setvalue(ctx, L, -1, n);	// set n->v , n->valuetype
+				union value v;
+				uint8_t vt = setvalue(ctx, L, -1, &v);
+				n = ctx_node(ctx, slot);
+				n->v = v;
+				n->valuetype = vt;
 			}
 		}
 		lua_pop(L,1);
@@ -234,35 +390,36 @@ fillnocolliding(lua_State *L, struct context *ctx) {
 
 static void
 fillcolliding(lua_State *L, struct context *ctx) {
-	struct table * tbl = ctx->tbl;
-	int sizehash = tbl->sizehash;
+	int sizehash = CTX_TABLE(ctx)->sizehash;
 	int emptyslot = 0;
-	int i;
 	lua_pushnil(L);
 	while (lua_next(L, 1) != 0) {
 		int key;
 		int keytype;
 		uint32_t keyhash;
 		if (ishashkey(ctx, L, -2, &key, &keyhash, &keytype)) {
-			struct node * mainpos = &tbl->hash[keyhash % tbl->sizehash];
+			int mainslot = keyhash % sizehash;
+			struct node * mainpos = ctx_node(ctx, mainslot);
 			if (!(mainpos->keytype == keytype && mainpos->key == key)) {
 				// the key has not insert
-				struct node * n = NULL;
-				for (i=emptyslot;i<sizehash;i++) {
-					if (tbl->hash[i].valuetype == VALUETYPE_NIL) {
-						n = &tbl->hash[i];
-						break;
-					}
+				while (emptyslot < sizehash && ctx_node(ctx, emptyslot)->valuetype != VALUETYPE_NIL) {
+					++emptyslot;
 				}
-				assert(n);
+				assert(emptyslot < sizehash);
+				int slot = emptyslot++;
+				struct node * n = ctx_node(ctx, slot);
 				n->next = mainpos->next;
-				mainpos->next = n - tbl->hash;
+				mainpos->next = slot;
 				mainpos->nocolliding = 0;
 				n->key = key;
 				n->keytype = keytype;
 				n->keyhash = keyhash;
 				n->nocolliding = 0;
-				setvalue(ctx, L, -1, n);	// set n->v , n->valuetype
+				union value v;
+				uint8_t vt = setvalue(ctx, L, -1, &v);
+				n = ctx_node(ctx, slot);
+				n->v = v;
+				n->valuetype = vt;
 			}
 		}
 		lua_pop(L,1);
@@ -271,45 +428,36 @@ fillcolliding(lua_State *L, struct context *ctx) {
 
 // table need convert
 // struct context * ctx
+// stringmap
 static int
 convtable(lua_State *L) {
 	int i;
 	struct context *ctx = lua_touserdata(L,2);
-	struct table *tbl = ctx->tbl;
+	uint32_t base = ctx->tbl;
 
-	tbl->L = ctx->L;
+	CTX_TABLE(ctx)->base = base;
 
 	int sizearray = lua_rawlen(L, 1);
 	if (sizearray) {
-		tbl->arraytype = (uint8_t *)malloc(sizearray * sizeof(uint8_t));
-		if (tbl->arraytype == NULL) {
-			goto memerror;
-		}
-		for (i=0;i<sizearray;i++) {
-			tbl->arraytype[i] = VALUETYPE_NIL;
-		}
-		tbl->array = (union value *)malloc(sizearray * sizeof(union value));
-		if (tbl->array == NULL) {
-			goto memerror;
-		}
+		// arraytype 清零后就是 VALUETYPE_NIL
+		uint32_t arraytype = image_alloc(L, ctx, sizearray * sizeof(uint8_t));
+		uint32_t array = image_alloc(L, ctx, sizearray * sizeof(union value));
+		struct table *tbl = CTX_TABLE(ctx);
+		tbl->arraytype = arraytype;
+		tbl->array = array;
 		tbl->sizearray = sizearray;
 	}
 	int sizehash = countsize(L, sizearray);
 	if (sizehash) {
-		tbl->hash = (struct node *)malloc(sizehash * sizeof(struct node));
-		if (tbl->hash == NULL) {
-			goto memerror;
-		}
-		for (i=0;i<sizehash;i++) {
-			tbl->hash[i].valuetype = VALUETYPE_NIL;
-			tbl->hash[i].nocolliding = 0;
-		}
+		// 清零后 valuetype 为 VALUETYPE_NIL, nocolliding 为 0
+		uint32_t hash = image_alloc(L, ctx, sizehash * sizeof(struct node));
+		struct table *tbl = CTX_TABLE(ctx);
+		tbl->hash = hash;
 		tbl->sizehash = sizehash;
 
 		fillnocolliding(L, ctx);
 		fillcolliding(L, ctx);
 	} else {
-		int i;
 		for (i=1;i<=sizearray;i++) {
 			lua_rawgeti(L, 1, i);
 			setarray(ctx, L, -1, i);
@@ -318,138 +466,112 @@ convtable(lua_State *L) {
 	}
 
 	return 0;
-memerror:
-	return luaL_error(L, "memory error");
 }
 
-static void
-delete_tbl(struct table *tbl) {
-	int i;
-	for (i=0;i<tbl->sizearray;i++) {
-		if (tbl->arraytype[i] == VALUETYPE_TABLE) {
-			delete_tbl(tbl->array[i].tbl);
-		}
-	}
-	for (i=0;i<tbl->sizehash;i++) {
-		if (tbl->hash[i].valuetype == VALUETYPE_TABLE) {
-			delete_tbl(tbl->hash[i].v.tbl);
-		}
-	}
-	free(tbl->arraytype);
-	free(tbl->array);
-	free(tbl->hash);
-	free(tbl);
-}
+static void build_indexes(lua_State *L, struct context *ctx, int index);
 
+// table need convert
+// struct context * ctx
+// indexes
 static int
 pconv(lua_State *L) {
-	struct context *ctx = lua_touserdata(L,1);
-	lua_State * pL = lua_touserdata(L, 2);
-	int ret;
-
-	lua_settop(L, 0);
-
-	// init L (may throw memory error)
+	struct context *ctx = lua_touserdata(L, 2);
+	lua_settop(L, 3);
 	// create a table for string map
 	lua_newtable(L);
+	lua_insert(L, 3);
 
-	lua_pushcfunction(pL, convtable);
-	lua_pushvalue(pL,1);
-	lua_pushlightuserdata(pL, ctx);
-
-	ret = lua_pcall(pL, 2, 0, 0);
-	if (ret != LUA_OK) {
-		size_t sz = 0;
-		const char * error = lua_tolstring(pL, -1, &sz);
-		lua_pushlstring(L, error, sz);
-		lua_error(L);
-		// never get here
-	}
-
-	luaL_checkstack(L, ctx->string_index + 3, NULL);
-	lua_settop(L,1);
+	image_alloc(L, ctx, sizeof(struct image));
+	ctx->tbl = image_alloc(L, ctx, sizeof(struct table));
 
-	return 1;
-}
+	convtable(L);
 
-static void
-convert_stringmap(struct context *ctx, struct table *tbl) {
-	lua_State *L = ctx->L;
-	lua_checkstack(L, ctx->string_index + LUA_MINSTACK);
-	lua_settop(L, ctx->string_index + 1);
-	lua_pushvalue(L, 1);
-	struct state * s = lua_newuserdata(L, sizeof(*s));
-	s->dirty = 0;
-	s->ref = 0;
-	s->root = tbl;
-	lua_replace(L, 1);
-	lua_replace(L, -2);
+	if (!lua_isnil(L, 4)) {
+		build_indexes(L, ctx, 4);
+	}
 
+	// 字符串的偏移量表, 载入 image 时用它把短字符串放入全局短字符串表
+	ctx->strings = image_alloc(L, ctx, ctx->nstring * sizeof(uint32_t));
 	lua_pushnil(L);
-	// ... stringmap nil
-	while (lua_next(L, -2) != 0) {
-		int idx = lua_tointeger(L, -1);
+	while (lua_next(L, 3) != 0) {
+		uint32_t offset = (uint32_t)lua_tointeger(L, -1);
+		struct string *s = IMAGE_PTR(ctx->buffer, offset, struct string);
+		IMAGE_PTR(ctx->buffer, ctx->strings, uint32_t)[s->index] = offset;
 		lua_pop(L, 1);
-		lua_pushvalue(L, -1);
-		lua_replace(L, idx);
 	}
+	return 0;
+}
 
-	lua_pop(L, 1);
-
-	lua_gc(L, LUA_GCCOLLECT, 0);
+// 把 image 中的短字符串放入全局短字符串表, 扣除 STRING_LEFT 配额
+static void
+intern_strings(struct image *img) {
+	uint32_t i;
+	uint32_t *offset = IMAGE_PTR(img, img->strings, uint32_t);
+	img->state.strings = calloc(img->nstring, sizeof(TString *));
+	if (img->state.strings == NULL)
+		return;
+	for (i=0;i<img->nstring;i++) {
+		struct string *s = IMAGE_PTR(img, offset[i], struct string);
+		img->state.strings[i] = luaS_newshrstr(s->str, s->sz, &STRING_LEFT);
+	}
 }
 
+// table [, reference [, indexes]]
+// reference 为 true 时, table 中的 lightuserdata 是其他 image 中的子表, 新的 image 直接引用它们
+// indexes 是需要建立的排序索引 { { path, field }, ... }, 见 build_indexes
 static int
 lnewconf(lua_State *L) {
-	int ret;
 	struct context ctx;
-	struct table * tbl = NULL;
 	luaL_checktype(L,1,LUA_TTABLE);
-	ctx.L = luaL_newstate();
-	ctx.tbl = NULL;
-	ctx.string_index = 1;	// 1 reserved for dirty flag
-	if (ctx.L == NULL) {
-		lua_pushliteral(L, "memory error");
-		goto error;
-	}
-	tbl = (struct table *)malloc(sizeof(struct table));
-	if (tbl == NULL) {
-		// lua_pushliteral may fail because of memory error, close first.
-		lua_close(ctx.L);
-		ctx.L = NULL;
-		lua_pushliteral(L, "memory error");
-		goto error;
+	ctx.cap = 4096;
+	ctx.size = 0;
+	ctx.tbl = 0;
+	ctx.nstring = 0;
+	ctx.reference = lua_toboolean(L, 2);
+	ctx.nextern = 0;
+	ctx.capextern = 0;
+	ctx.externs = NULL;
+	ctx.buffer = malloc(ctx.cap);
+	if (ctx.buffer == NULL) {
+		return luaL_error(L, "memory error");
 	}
-	memset(tbl, 0, sizeof(struct table));
-	ctx.tbl = tbl;
-
-	lua_pushcfunction(ctx.L, pconv);
-	lua_pushlightuserdata(ctx.L , &ctx);
-	lua_pushlightuserdata(ctx.L , L);
 
-	ret = lua_pcall(ctx.L, 2, 1, 0);
+	lua_pushcfunction(L, pconv);
+	lua_pushvalue(L, 1);
+	lua_pushlightuserdata(L, &ctx);
+	lua_pushvalue(L, 3);
 
-	if (ret != LUA_OK) {
-		size_t sz = 0;
-		const char * error = lua_tolstring(ctx.L, -1, &sz);
-		lua_pushlstring(L, error, sz);
-		goto error;
+	if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
+		free(ctx.buffer);
+		free(ctx.externs);
+		return lua_error(L);
 	}
 
-	convert_stringmap(&ctx, tbl);
+	char * buffer = realloc(ctx.buffer, ctx.size);
+	if (buffer) {
+		ctx.buffer = buffer;
+	}
+	struct image * img = (struct image *)ctx.buffer;
+	memcpy(img->magic, IMAGE_MAGIC, sizeof(img->magic));
+	img->layout = IMAGE_LAYOUT;
+	img->size = (uint32_t)ctx.size;
+	img->root = ctx.tbl;
+	img->nstring = ctx.nstring;
+	img->strings = ctx.strings;
+	img->state.dirty = 0;
+	img->state.ref = 0;
+	img->state.mapped = 0;
+	img->state.nextern = ctx.nextern;
+	img->state.externs = ctx.externs;
+	intern_strings(img);
+	int i;
+	for (i=0;i<ctx.nextern;i++) {
+		ATOM_INC(&ctx.externs[i]->state.ref);
+	}
 
-	lua_pushlightuserdata(L, tbl);	
+	lua_pushlightuserdata(L, IMAGE_PTR(img, img->root, struct table));
 
 	return 1;
-error:
-	if (ctx.L) {
-		lua_close(ctx.L);
-	}
-	if (tbl) {
-		delete_tbl(tbl);
-	}
-	lua_error(L);
-	return -1;
 }
 
 static struct table *
@@ -464,13 +586,109 @@ get_table(lua_State *L, int index) {
 static int
 ldeleteconf(lua_State *L) {
 	struct table *tbl = get_table(L,1);
-	lua_close(tbl->L);
-	delete_tbl(tbl);
+	struct image *img = IMAGE(tbl);
+	int i;
+	for (i=0;i<img->state.nextern;i++) {
+		ATOM_DEC(&img->state.externs[i]->state.ref);
+	}
+	free(img->state.externs);
+	free(img->state.strings);
+	if (img->state.mapped) {
+		munmap(img, img->size);
+	} else {
+		free(img);
+	}
+	return 0;
+}
+
+// 把 image 写入文件. 先写临时文件再改名, 这样已经 mmap 了旧文件的进程不会受影响.
+static int
+lsaveconf(lua_State *L) {
+	struct table *tbl = get_table(L,1);
+	const char * filename = luaL_checkstring(L, 2);
+	struct image *img = IMAGE(tbl);
+	if (img->state.nextern > 0) {
+		return luaL_error(L, "Can't save a patched image, flatten it first");
+	}
+	struct image header = *img;
+	memset(&header.state, 0, sizeof(header.state));
+
+	lua_pushfstring(L, "%s.tmp", filename);
+	const char * tmpname = lua_tostring(L, -1);
+	FILE *f = fopen(tmpname, "wb");
+	if (f == NULL) {
+		return luaL_error(L, "Can't open %s : %s", tmpname, strerror(errno));
+	}
+	size_t sz = img->size - sizeof(header);
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		(sz == 0 || fwrite(img + 1, sz, 1, f) == 1);
+	if (fclose(f) != 0) {
+		ok = 0;
+	}
+	if (!ok || rename(tmpname, filename) != 0) {
+		int err = errno;
+		remove(tmpname);
+		return luaL_error(L, "Can't write %s : %s", filename, strerror(err));
+	}
 	return 0;
 }
 
+// 用 mmap 映射 lsaveconf 写出的文件, 不需要任何转换.
+static int
+lloadconf(lua_State *L) {
+	const char * filename = luaL_checkstring(L, 1);
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return luaL_error(L, "Can't open %s : %s", filename, strerror(errno));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct image) || st.st_size > UINT32_MAX) {
+		close(fd);
+		return luaL_error(L, "Invalid sharedata image %s", filename);
+	}
+	void * ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		return luaL_error(L, "Can't mmap %s : %s", filename, strerror(errno));
+	}
+	struct image *img = ptr;
+	if (memcmp(img->magic, IMAGE_MAGIC, sizeof(img->magic)) != 0 ||
+		img->layout != IMAGE_LAYOUT ||
+		img->size != st.st_size ||
+		img->root < sizeof(struct image) ||
+		img->root > img->size - sizeof(struct table) ||
+		img->strings < sizeof(struct image) ||
+		img->nstring > (img->size - img->strings) / sizeof(uint32_t)) {
+		munmap(ptr, st.st_size);
+		return luaL_error(L, "Invalid sharedata image %s", filename);
+	}
+	memset(&img->state, 0, sizeof(img->state));
+	img->state.mapped = 1;
+	intern_strings(img);
+
+	lua_pushlightuserdata(L, IMAGE_PTR(img, img->root, struct table));
+	return 1;
+}
+
+// 短字符串在建立 image 时已经放入全局短字符串表, 直接压入同一个 TString, 不需要再分配和复制.
+// 长字符串和超出配额 (STRING_LEFT) 的短字符串复制一份.
 static void
-pushvalue(lua_State *L, lua_State *sL, uint8_t vt, union value *v) {
+pushstring(lua_State *L, struct table *tbl, uint32_t offset) {
+	struct image *img = IMAGE(tbl);
+	struct string *s = IMAGE_PTR(img, offset, struct string);
+	TString *ts = NULL;
+	if (img->state.strings) {
+		ts = img->state.strings[s->index];
+	}
+	if (ts) {
+		luaS_pushshrstr(L, ts);
+	} else {
+		lua_pushlstring(L, s->str, s->sz);
+	}
+}
+
+static void
+pushvalue(lua_State *L, struct table *tbl, uint8_t vt, union value *v) {
 	switch(vt) {
 	case VALUETYPE_REAL:
 		lua_pushnumber(L, v->n);
@@ -478,17 +696,14 @@ pushvalue(lua_State *L, lua_State *sL, uint8_t vt, union value *v) {
 	case VALUETYPE_INTEGER:
 		lua_pushinteger(L, v->d);
 		break;
-	case VALUETYPE_STRING: {
-		size_t sz = 0;
-		const char *str = lua_tolstring(sL, v->string, &sz);
-		lua_pushlstring(L, str, sz);
+	case VALUETYPE_STRING:
+		pushstring(L, tbl, v->string);
 		break;
-	}
 	case VALUETYPE_BOOLEAN:
 		lua_pushboolean(L, v->boolean);
 		break;
 	case VALUETYPE_TABLE:
-		lua_pushlightuserdata(L, v->tbl);
+		lua_pushlightuserdata(L, subtable(tbl, v));
 		break;
 	default:
 		lua_pushnil(L);
@@ -500,7 +715,8 @@ static struct node *
 lookup_key(struct table *tbl, uint32_t keyhash, int key, int keytype, const char *str, size_t sz) {
 	if (tbl->sizehash == 0)
 		return NULL;
-	struct node *n = &tbl->hash[keyhash % tbl->sizehash];
+	struct node *hash = HASH(tbl);
+	struct node *n = &hash[keyhash % tbl->sizehash];
 	if (keyhash != n->keyhash && n->nocolliding)
 		return NULL;
 	for (;;) {
@@ -513,7 +729,7 @@ lookup_key(struct table *tbl, uint32_t keyhash, int key, int keytype, const char
 				// n->keytype == KEYTYPE_STRING
 				if (keytype == KEYTYPE_STRING) {
 					size_t sz2 = 0;
-					const char * str2 = lua_tolstring(tbl->L, n->key, &sz2);
+					const char * str2 = getstring(tbl, (uint32_t)n->key, &sz2);
 					if (sz == sz2 && memcmp(str,str2,sz) == 0) {
 						return n;
 					}
@@ -523,40 +739,53 @@ lookup_key(struct table *tbl, uint32_t keyhash, int key, int keytype, const char
 		if (n->next < 0) {
 			return NULL;
 		}
-		n = &tbl->hash[n->next];		
+		n = &hash[n->next];
 	}
 }
 
-static int
-lindexconf(lua_State *L) {
-	struct table *tbl = get_table(L,1);
-	int kt = lua_type(L,2);
+// 查找 index 处的 key 对应的值, 不存在返回 NULL
+static union value *
+lookup_value(lua_State *L, struct table *tbl, int index, uint8_t *vt) {
+	int kt = lua_type(L,index);
 	uint32_t keyhash;
 	int key = 0;
 	int keytype;
 	size_t sz = 0;
 	const char * str = NULL;
 	if (kt == LUA_TNUMBER) {
-		if (!lua_isinteger(L, 2)) {
-			return luaL_error(L, "Invalid key %f", lua_tonumber(L, 2));
+		if (!lua_isinteger(L, index)) {
+			luaL_error(L, "Invalid key %f", lua_tonumber(L, index));
 		}
-		key = (int)lua_tointeger(L, 2);
+		key = (int)lua_tointeger(L, index);
 		if (key > 0 && key <= tbl->sizearray) {
 			--key;
-			pushvalue(L, tbl->L, tbl->arraytype[key], &tbl->array[key]);
-			return 1;
+			*vt = ARRAYTYPE(tbl)[key];
+			return &ARRAY(tbl)[key];
 		}
 		keytype = KEYTYPE_INTEGER;
 		keyhash = (uint32_t)key;
 	} else {
-		str = luaL_checklstring(L, 2, &sz);
+		str = luaL_checklstring(L, index, &sz);
 		keyhash = calchash(str, sz);
 		keytype = KEYTYPE_STRING;
 	}
 
 	struct node *n = lookup_key(tbl, keyhash, key, keytype, str, sz);
 	if (n) {
-		pushvalue(L, tbl->L, n->valuetype, &n->v);
+		*vt = n->valuetype;
+		return &n->v;
+	} else {
+		return NULL;
+	}
+}
+
+static int
+lindexconf(lua_State *L) {
+	struct table *tbl = get_table(L,1);
+	uint8_t vt;
+	union value *v = lookup_value(L, tbl, 2, &vt);
+	if (v) {
+		pushvalue(L, tbl, vt, v);
 		return 1;
 	} else {
 		return 0;
@@ -564,20 +793,18 @@ lindexconf(lua_State *L) {
 }
 
 static void
-pushkey(lua_State *L, lua_State *sL, struct node *n) {
+pushkey(lua_State *L, struct table *tbl, struct node *n) {
 	if (n->keytype == KEYTYPE_INTEGER) {
 		lua_pushinteger(L, n->key);
 	} else {
-		size_t sz = 0;
-		const char * str = lua_tolstring(sL, n->key, &sz);
-		lua_pushlstring(L, str, sz);
+		pushstring(L, tbl, (uint32_t)n->key);
 	}
 }
 
 static int
 pushfirsthash(lua_State *L, struct table * tbl) {
 	if (tbl->sizehash) {
-		pushkey(L, tbl->L, &tbl->hash[0]);
+		pushkey(L, tbl, &HASH(tbl)[0]);
 		return 1;
 	} else {
 		return 0;
@@ -591,7 +818,7 @@ lnextkey(lua_State *L) {
 		if (tbl->sizearray > 0) {
 			int i;
 			for (i=0;i<tbl->sizearray;i++) {
-				if (tbl->arraytype[i] != VALUETYPE_NIL) {
+				if (ARRAYTYPE(tbl)[i] != VALUETYPE_NIL) {
 					lua_pushinteger(L, i+1);
 					return 1;
 				}
@@ -614,7 +841,7 @@ lnextkey(lua_State *L) {
 		if (key > 0 && key <= sizearray) {
 			lua_Integer i;
 			for (i=key;i<sizearray;i++) {
-				if (tbl->arraytype[i] != VALUETYPE_NIL) {
+				if (ARRAYTYPE(tbl)[i] != VALUETYPE_NIL) {
 					lua_pushinteger(L, i+1);
 					return 1;
 				}
@@ -632,17 +859,332 @@ lnextkey(lua_State *L) {
 	struct node *n = lookup_key(tbl, keyhash, key, keytype, str, sz);
 	if (n) {
 		++n;
-		int index = n-tbl->hash;
+		int index = n-HASH(tbl);
 		if (index == tbl->sizehash) {
 			return 0;
 		}
-		pushkey(L, tbl->L, n);
+		pushkey(L, tbl, n);
 		return 1;
 	} else {
 		return 0;
 	}
 }
 
+// 排序索引
+
+// 建立索引时的临时数据. 来自其他 image 的字符串在 ext 中, 排序前需要复制进当前的 image.
+struct sortbuild {
+	struct sortentry e;
+	struct string * ext;
+};
+
+static int
+compare_value(const char *base, uint8_t ta, const union value *a, uint8_t tb, const union value *b) {
+	if (ta == VALUETYPE_STRING) {
+		const struct string * sa = IMAGE_PTR(base, a->string, struct string);
+		const struct string * sb = IMAGE_PTR(base, b->string, struct string);
+		uint32_t sz = sa->sz < sb->sz ? sa->sz : sb->sz;
+		int r = memcmp(sa->str, sb->str, sz);
+		if (r != 0)
+			return r;
+		return sa->sz < sb->sz ? -1 : (sa->sz > sb->sz);
+	}
+	if (ta == VALUETYPE_INTEGER && tb == VALUETYPE_INTEGER) {
+		return a->d < b->d ? -1 : (a->d > b->d);
+	}
+	lua_Number na = ta == VALUETYPE_INTEGER ? (lua_Number)a->d : a->n;
+	lua_Number nb = tb == VALUETYPE_INTEGER ? (lua_Number)b->d : b->n;
+	return na < nb ? -1 : (na > nb);
+}
+
+// 自底向上的归并排序, 相同的排序值保持原来的顺序. a 和 tmp 交替使用, 返回结果所在的数组
+static struct sortbuild *
+sort_entries(const char *base, struct sortbuild *a, struct sortbuild *tmp, int n) {
+	int width, i;
+	for (width = 1; width < n; width *= 2) {
+		for (i = 0; i < n; i += 2 * width) {
+			int mid = i + width < n ? i + width : n;
+			int hi = i + 2 * width < n ? i + 2 * width : n;
+			int l = i, r = mid, k = i;
+			while (l < mid && r < hi) {
+				if (compare_value(base, a[r].e.valuetype, &a[r].e.v, a[l].e.valuetype, &a[l].e.v) < 0) {
+					tmp[k++] = a[r++];
+				} else {
+					tmp[k++] = a[l++];
+				}
+			}
+			while (l < mid)
+				tmp[k++] = a[l++];
+			while (r < hi)
+				tmp[k++] = a[r++];
+		}
+		struct sortbuild * t = a;
+		a = tmp;
+		tmp = t;
+	}
+	return a;
+}
+
+static int
+add_entry(lua_State *L, struct sortbuild *b, int n, int *kind, struct table *elem, uint8_t vt, union value *v) {
+	int k;
+	if (vt == VALUETYPE_INTEGER || vt == VALUETYPE_REAL) {
+		k = 1;
+	} else if (vt == VALUETYPE_STRING) {
+		k = 2;
+	} else {
+		return n;
+	}
+	if (*kind == 0) {
+		*kind = k;
+	} else if (*kind != k) {
+		luaL_error(L, "Can't sort numbers and strings in one index");
+	}
+	b[n].e.v = *v;
+	b[n].e.valuetype = vt;
+	b[n].ext = NULL;
+	if (vt == VALUETYPE_STRING && elem) {
+		b[n].ext = IMAGE_PTR(IMAGE(elem), v->string, struct string);
+	}
+	return n + 1;
+}
+
+// 为 target 建立按照 field 排序的索引, field 为 0 时按照 key 排序
+static void
+build_index(lua_State *L, struct context *ctx, uint32_t target, uint32_t field) {
+	struct table * tbl = IMAGE_PTR(ctx->buffer, target, struct table);
+	uint32_t index = tbl->sorted;
+	while (index) {
+		struct sortindex * si = IMAGE_PTR(ctx->buffer, index, struct sortindex);
+		if (si->field == field)
+			return;
+		index = si->next;
+	}
+	int total = tbl->sizearray + tbl->sizehash;
+	struct sortbuild * b = lua_newuserdata(L, (total + 1) * sizeof(struct sortbuild));
+	struct sortbuild * tmp = lua_newuserdata(L, (total + 1) * sizeof(struct sortbuild));
+	const char * fstr = NULL;
+	size_t fsz = 0;
+	uint32_t fhash = 0;
+	if (field) {
+		fstr = getstring(tbl, field, &fsz);
+		fhash = calchash(fstr, fsz);
+	}
+	int kind = 0;
+	int n = 0;
+	int i;
+	uint8_t * arraytype = ARRAYTYPE(tbl);
+	union value * array = ARRAY(tbl);
+	struct node * hash = HASH(tbl);
+	for (i=0;i<total;i++) {
+		uint8_t vt;
+		union value *v;
+		int key;
+		uint8_t keytype;
+		if (i < tbl->sizearray) {
+			vt = arraytype[i];
+			v = &array[i];
+			key = i + 1;
+			keytype = KEYTYPE_INTEGER;
+		} else {
+			struct node * node = &hash[i - tbl->sizearray];
+			vt = node->valuetype;
+			v = &node->v;
+			key = node->key;
+			keytype = node->keytype;
+		}
+		if (vt == VALUETYPE_NIL)
+			continue;
+		int last = n;
+		if (field == 0) {
+			union value kv;
+			if (keytype == KEYTYPE_INTEGER) {
+				kv.d = key;
+				n = add_entry(L, b, n, &kind, NULL, VALUETYPE_INTEGER, &kv);
+			} else {
+				kv.string = (uint32_t)key;
+				n = add_entry(L, b, n, &kind, NULL, VALUETYPE_STRING, &kv);
+			}
+		} else if (vt == VALUETYPE_TABLE) {
+			struct table * elem = subtable(tbl, v);
+			struct node * fn = lookup_key(elem, fhash, 0, KEYTYPE_STRING, fstr, fsz);
+			if (fn) {
+				n = add_entry(L, b, n, &kind, IMAGE(elem) == IMAGE(tbl) ? NULL : elem, fn->valuetype, &fn->v);
+			}
+		}
+		if (n > last) {
+			b[last].e.key = key;
+			b[last].e.keytype = keytype;
+		}
+	}
+	// 复制其他 image 中的字符串. 当前 image 中的字符串都已经在 stringmap 里, 不会再分配内存
+	for (i=0;i<n;i++) {
+		if (b[i].ext) {
+			b[i].e.v.string = stringindex(ctx, L, b[i].ext->str, b[i].ext->sz);
+			b[i].ext = NULL;
+		}
+	}
+
+	struct sortbuild * result = sort_entries(ctx->buffer, b, tmp, n);
+
+	uint32_t offset = image_alloc(L, ctx, sizeof(struct sortindex));
+	uint32_t entries = image_alloc(L, ctx, n * sizeof(struct sortentry));
+	struct sortentry * e = IMAGE_PTR(ctx->buffer, entries, struct sortentry);
+	for (i=0;i<n;i++) {
+		e[i] = result[i].e;
+	}
+	struct sortindex * si = IMAGE_PTR(ctx->buffer, offset, struct sortindex);
+	tbl = IMAGE_PTR(ctx->buffer, target, struct table);
+	si->field = field;
+	si->n = n;
+	si->entries = entries;
+	si->next = tbl->sorted;
+	tbl->sorted = offset;
+	lua_pop(L, 2);
+}
+
+// indexes 是 { { path, field }, ... }, path 是从根节点到目标 table 的 key 数组 (nil 表示根节点),
+// field 为 nil 时按照目标 table 自己的 key 排序, 否则按照目标 table 中每个子表的 field 字段排序.
+// 增量更新时, 没有变化的 table 来自旧的 image, 保留原来的索引.
+static void
+build_indexes(lua_State *L, struct context *ctx, int index) {
+	// subtable 需要通过 image 头部找到引用的其他 image
+	((struct image *)ctx->buffer)->state.externs = ctx->externs;
+	uint32_t root = ctx->tbl;
+	int n = lua_rawlen(L, index);
+	int i, j;
+	for (i=1;i<=n;i++) {
+		lua_rawgeti(L, index, i);
+		int spec = lua_gettop(L);
+		luaL_checktype(L, spec, LUA_TTABLE);
+		uint32_t field = 0;
+		if (lua_rawgeti(L, spec, 2) != LUA_TNIL) {
+			size_t sz = 0;
+			const char * str = luaL_checklstring(L, -1, &sz);
+			field = stringindex(ctx, L, str, sz);
+		}
+		lua_pop(L, 1);
+		struct table * tbl = IMAGE_PTR(ctx->buffer, root, struct table);
+		if (lua_rawgeti(L, spec, 1) != LUA_TNIL) {
+			luaL_checktype(L, -1, LUA_TTABLE);
+			int path = lua_gettop(L);
+			int depth = lua_rawlen(L, path);
+			for (j=1;j<=depth;j++) {
+				lua_rawgeti(L, path, j);
+				uint8_t vt = VALUETYPE_NIL;
+				union value * v = lookup_value(L, tbl, -1, &vt);
+				if (v == NULL || vt != VALUETYPE_TABLE) {
+					luaL_error(L, "Invalid sorted index path");
+				}
+				tbl = subtable(tbl, v);
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 2);
+		if (IMAGE(tbl) == (struct image *)ctx->buffer) {
+			build_index(L, ctx, (char *)tbl - ctx->buffer, field);
+		}
+	}
+}
+
+static struct sortindex *
+find_index(lua_State *L, struct table *tbl, int index) {
+	size_t sz = 0;
+	const char * field = NULL;
+	if (!lua_isnoneornil(L, index)) {
+		field = luaL_checklstring(L, index, &sz);
+	}
+	uint32_t offset = tbl->sorted;
+	while (offset) {
+		struct sortindex * si = IMAGE_PTR(IMAGE(tbl), offset, struct sortindex);
+		if (field == NULL) {
+			if (si->field == 0)
+				return si;
+		} else if (si->field) {
+			size_t sz2 = 0;
+			const char * str = getstring(tbl, si->field, &sz2);
+			if (sz == sz2 && memcmp(field, str, sz) == 0)
+				return si;
+		}
+		offset = si->next;
+	}
+	luaL_error(L, "No sorted index for %s", field ? field : "key");
+	return NULL;
+}
+
+// table field value
+// 返回第一个排序值不小于 value 的位置 (从 1 开始), 没有则不返回. value 为 nil 时返回第一个位置.
+static int
+llowerbound(lua_State *L) {
+	struct table *tbl = get_table(L,1);
+	struct sortindex * si = find_index(L, tbl, 2);
+	if (si->n == 0)
+		return 0;
+	if (lua_isnoneornil(L, 3)) {
+		lua_pushinteger(L, 1);
+		return 1;
+	}
+	struct sortentry * e = IMAGE_PTR(IMAGE(tbl), si->entries, struct sortentry);
+	int string = e[0].valuetype == VALUETYPE_STRING;
+	union value v;
+	uint8_t vt;
+	size_t sz = 0;
+	const char * str = NULL;
+	if (string) {
+		str = luaL_checklstring(L, 3, &sz);
+		vt = VALUETYPE_STRING;
+	} else if (lua_isinteger(L, 3)) {
+		v.d = lua_tointeger(L, 3);
+		vt = VALUETYPE_INTEGER;
+	} else {
+		v.n = luaL_checknumber(L, 3);
+		vt = VALUETYPE_REAL;
+	}
+	uint32_t lo = 0, hi = si->n;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int c;
+		if (string) {
+			size_t sz2 = 0;
+			const char * str2 = getstring(tbl, e[mid].v.string, &sz2);
+			size_t min = sz < sz2 ? sz : sz2;
+			c = memcmp(str2, str, min);
+			if (c == 0)
+				c = sz2 < sz ? -1 : (sz2 > sz);
+		} else {
+			c = compare_value(NULL, e[mid].valuetype, &e[mid].v, vt, &v);
+		}
+		if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo >= si->n)
+		return 0;
+	lua_pushinteger(L, lo + 1);
+	return 1;
+}
+
+// table field pos
+// 返回索引中第 pos 个元素的 排序值, key
+static int
+lsorted(lua_State *L) {
+	struct table *tbl = get_table(L,1);
+	struct sortindex * si = find_index(L, tbl, 2);
+	lua_Integer pos = luaL_checkinteger(L, 3);
+	if (pos < 1 || pos > si->n)
+		return 0;
+	struct sortentry * e = &IMAGE_PTR(IMAGE(tbl), si->entries, struct sortentry)[pos-1];
+	pushvalue(L, tbl, e->valuetype, &e->v);
+	if (e->keytype == KEYTYPE_INTEGER) {
+		lua_pushinteger(L, e->key);
+	} else {
+		pushstring(L, tbl, (uint32_t)e->key);
+	}
+	return 2;
+}
+
 static int
 llen(lua_State *L) {
 	struct table *tbl = get_table(L,1);
@@ -661,7 +1203,7 @@ static int
 releaseobj(lua_State *L) {
 	struct ctrl *c = lua_touserdata(L, 1);
 	struct table *tbl = c->root;
-	struct state *s = lua_touserdata(tbl->L, 1);
+	struct state *s = getstate(tbl);
 	ATOM_DEC(&s->ref);
 	c->root = NULL;
 	c->update = NULL;
@@ -672,7 +1214,7 @@ releaseobj(lua_State *L) {
 static int
 lboxconf(lua_State *L) {
 	struct table * tbl = get_table(L,1);	
-	struct state * s = lua_touserdata(tbl->L, 1);
+	struct state * s = getstate(tbl);
 	ATOM_INC(&s->ref);
 
 	struct ctrl * c = lua_newuserdata(L, sizeof(*c));
@@ -690,25 +1232,40 @@ lboxconf(lua_State *L) {
 static int
 lmarkdirty(lua_State *L) {
 	struct table *tbl = get_table(L,1);
-	struct state * s = lua_touserdata(tbl->L, 1);
+	struct state * s = getstate(tbl);
 	s->dirty = 1;
 	return 0;
 }
 
+// 参数可以是 table, 也可以是 box 返回的 ctrl (检查它当前持有的版本)
 static int
 lisdirty(lua_State *L) {
-	struct table *tbl = get_table(L,1);
-	struct state * s = lua_touserdata(tbl->L, 1);
+	struct table *tbl;
+	if (lua_type(L, 1) == LUA_TUSERDATA) {
+		struct ctrl * c = lua_touserdata(L, 1);
+		tbl = c->root;
+	} else {
+		tbl = get_table(L,1);
+	}
+	struct state * s = getstate(tbl);
 	int d = s->dirty;
 	lua_pushboolean(L, d);
 	
 	return 1;
 }
 
+static int
+lispatched(lua_State *L) {
+	struct table *tbl = get_table(L,1);
+	lua_pushboolean(L, IMAGE(tbl)->state.nextern > 0);
+
+	return 1;
+}
+
 static int
 lgetref(lua_State *L) {
 	struct table *tbl = get_table(L,1);
-	struct state * s = lua_touserdata(tbl->L, 1);
+	struct state * s = getstate(tbl);
 	lua_pushinteger(L , s->ref);
 
 	return 1;
@@ -717,7 +1274,7 @@ lgetref(lua_State *L) {
 static int
 lincref(lua_State *L) {
 	struct table *tbl = get_table(L,1);
-	struct state * s = lua_touserdata(tbl->L, 1);
+	struct state * s = getstate(tbl);
 	int ref = ATOM_INC(&s->ref);
 	lua_pushinteger(L , ref);
 
@@ -727,7 +1284,7 @@ lincref(lua_State *L) {
 static int
 ldecref(lua_State *L) {
 	struct table *tbl = get_table(L,1);
-	struct state * s = lua_touserdata(tbl->L, 1);
+	struct state * s = getstate(tbl);
 	int ref = ATOM_DEC(&s->ref);
 	lua_pushinteger(L , ref);
 
@@ -745,6 +1302,17 @@ lneedupdate(lua_State *L) {
 	return 0;
 }
 
+// [n] 增加放入全局短字符串表的字符串配额, 返回剩余的配额
+static int
+lstringquota(lua_State *L) {
+	int n = (int)luaL_optinteger(L, 1, 0);
+	if (n > 0) {
+		ATOM_ADD(&STRING_LEFT, n);
+	}
+	lua_pushinteger(L, STRING_LEFT);
+	return 1;
+}
+
 static int
 lupdate(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TUSERDATA);
@@ -769,10 +1337,14 @@ luaopen_sharedata_core(lua_State *L) {
 		// 用于主机
 		{ "new", lnewconf },
 		{ "delete", ldeleteconf },
+		{ "save", lsaveconf },
+		{ "load", lloadconf },
+		{ "ispatched", lispatched },
 		{ "markdirty", lmarkdirty },
 		{ "getref", lgetref },
 		{ "incref", lincref },
 		{ "decref", ldecref },
+		{ "stringquota", lstringquota },
 
 		// used by client
 		// 用于客户端
@@ -782,6 +1354,8 @@ luaopen_sharedata_core(lua_State *L) {
 		{ "len", llen },
 		{ "hashlen", lhashlen },
 		{ "isdirty", lisdirty },
+		{ "lowerbound", llowerbound },
+		{ "sorted", lsorted },
 		{ "needupdate", lneedupdate },
 		{ "update", lupdate },
 		{ NULL, NULL },
@@ -1,4 +1,5 @@
 #include "skynet.h"
+#include "skynet_server.h"
 #include "lua-seri.h"
 
 // 这个是帮助在终端打印的时候, 对于错误信息以红色打印输出
@@ -10,6 +11,69 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+
+// 每次空闲 gc 最多运行的时间 (纳秒), 超过后留到下次空闲时继续
+#define IDLE_GC_SLICE 1000000
+
+/// 空闲时 gc 的设置和统计
+struct gcstat {
+	int idle;		// 上个周期完成后新分配多少内存 (KB) 开始下一个空闲 gc 周期, 0 表示不在空闲时 gc
+	int incycle;	// 空闲 gc 开始了一个周期, 还没有完成
+	int base;		// 上一个空闲 gc 周期完成时的内存 (KB)
+	uint64_t steps;
+	uint64_t cycles;
+	uint64_t time;	// 纳秒
+	uint64_t max;
+};
+
+/// skynet_callback 的 ud
+struct callback_context {
+	lua_State *L;	// 主线程
+	struct gcstat gc;
+};
+
+static uint64_t
+gettime() {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+}
+
+/**
+ * 消息队列空了的时候, 推进增量 gc, 把 gc 的工作尽量放在没有消息要处理的时候.
+ * 上一个周期完成后, 新分配的内存达到 idle 才开始下一个周期, 避免空闲的服务反复 gc.
+ * 每次只做若干个基本步 (LUA_GCSTEP 0), 运行超过 IDLE_GC_SLICE 或者来了新消息就停下.
+ * 一次给出很大的步长, lua 会在一次调用里做完整个标记阶段, 持有大量对象的服务会停顿好几毫秒.
+ * 原子阶段不能拆分, 仍然会在一个基本步里完成.
+ */
+static void
+idle_gc(struct skynet_context * context, struct callback_context *cb) {
+	struct gcstat *gc = &cb->gc;
+	lua_State *L = cb->L;
+	if (skynet_context_mqlen(context) > 0 || !lua_gc(L, LUA_GCISRUNNING, 0))
+		return;
+	if (!gc->incycle && lua_gc(L, LUA_GCCOUNT, 0) < gc->base + gc->idle)
+		return;
+	uint64_t start = gettime();
+	uint64_t t;
+	int finish;
+	do {
+		finish = lua_gc(L, LUA_GCSTEP, 0);
+		t = gettime() - start;
+	} while (!finish && t < IDLE_GC_SLICE && skynet_context_mqlen(context) == 0);
+	++gc->steps;
+	gc->time += t;
+	if (t > gc->max)
+		gc->max = t;
+	if (finish) {
+		++gc->cycles;
+		gc->incycle = 0;
+		gc->base = lua_gc(L, LUA_GCCOUNT, 0);
+	} else {
+		gc->incycle = 1;
+	}
+}
 
 /// 错误处理函数
 static int
@@ -26,7 +90,8 @@ traceback (lua_State *L) {
 /// 普通回调, 返回 0, 函数执行完毕之后删除 msg
 static int
 _cb(struct skynet_context * context, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
-	lua_State *L = ud;
+	struct callback_context *cb = ud;
+	lua_State *L = cb->L;
 	int trace = 1;
 	int r;
 	int top = lua_gettop(L);
@@ -48,6 +113,8 @@ _cb(struct skynet_context * context, void * ud, int type, int session, uint32_t
 	r = lua_pcall(L, 5, 0 , trace);
 
 	if (r == LUA_OK) {
+		if (cb->gc.idle > 0)
+			idle_gc(context, cb);
 		return 0;
 	}
 	const char * self = skynet_command(context, "REG", NULL);
@@ -69,6 +136,9 @@ _cb(struct skynet_context * context, void * ud, int type, int session, uint32_t
 	// 无论是否发生错误, 都弹出 traceback 压入的字符串.
 	lua_pop(L,1);
 
+	if (cb->gc.idle > 0)
+		idle_gc(context, cb);
+
 	return 0;
 }
 
@@ -81,6 +151,28 @@ forward_cb(struct skynet_context * context, void * ud, int type, int session, ui
 	return 1;
 }
 
+/// 取得 (第一次时创建) 存放在注册表中的 callback_context, 空闲 gc 的阈值默认为配置中的 lua_gcidle
+static struct callback_context *
+getcb(lua_State *L, struct skynet_context * context) {
+	if (lua_rawgetp(L, LUA_REGISTRYINDEX, getcb) == LUA_TUSERDATA) {
+		struct callback_context *cb = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return cb;
+	}
+	lua_pop(L, 1);
+	struct callback_context *cb = lua_newuserdata(L, sizeof(*cb));
+	memset(cb, 0, sizeof(*cb));
+	lua_rawsetp(L, LUA_REGISTRYINDEX, getcb);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	cb->L = lua_tothread(L, -1);
+	lua_pop(L, 1);
+	const char * idle = skynet_command(context, "GETENV", "lua_gcidle");
+	if (idle) {
+		cb->gc.idle = strtol(idle, NULL, 10);
+	}
+	return cb;
+}
+
 /**
  * 设置 skynet_context 的回调函数
  * lua: 接收 2 个参数, 参数 1, 回调的执行函数; 参数 2, 是否消息转发模式, 
@@ -95,14 +187,13 @@ _callback(lua_State *L) {
 	lua_settop(L,1);	// 只保留第一个参数, 是个函数对象
 	lua_rawsetp(L, LUA_REGISTRYINDEX, _cb);	// 注册表添加 _cb 键关联栈顶的函数值
 
-	// LUA_RIDX_MAINTHREAD: 注册表中这个索引下是状态机的主线程。（主线程和状态机同时被创建出来。）
-	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
-	lua_State *gL = lua_tothread(L,-1);	// 拿到当前的主线程
+	// callback_context 中保存了主线程 (LUA_RIDX_MAINTHREAD), 回调在主线程中运行
+	struct callback_context *cb = getcb(L, context);
 
 	if (forward) {
-		skynet_callback(context, gL, forward_cb);
+		skynet_callback(context, cb, forward_cb);
 	} else {
-		skynet_callback(context, gL, _cb);
+		skynet_callback(context, cb, _cb);
 	}
 
 	return 0;
@@ -248,6 +339,17 @@ _send(lua_State *L) {
 		}
 		break;
 	}
+	case LUA_TUSERDATA: {
+		// skynet.unpackview 返回的视图, 直接发送视图对应的序列化数据
+		size_t len = 0;
+		void * msg = (void *)_luaseri_viewbuffer(L, 4, &len);
+		if (dest_string) {
+			session = skynet_sendname(context, 0, dest_string, type, session , msg, len);
+		} else {
+			session = skynet_send(context, 0, dest, type, session , msg, len);
+		}
+		break;
+	}
 	default:
 		luaL_error(L, "skynet.send invalid param %s", lua_typename(L, lua_type(L,4)));
 	}
@@ -320,6 +422,17 @@ _redirect(lua_State *L) {
 		}
 		break;
 	}
+	case LUA_TUSERDATA: {
+		// skynet.unpackview 返回的视图, 直接发送视图对应的序列化数据
+		size_t len = 0;
+		void * msg = (void *)_luaseri_viewbuffer(L, 5, &len);
+		if (dest_string) {
+			session = skynet_sendname(context, source, dest_string, type, session , msg, len);
+		} else {
+			session = skynet_send(context, source, dest, type, session , msg, len);
+		}
+		break;
+	}
 	default:
 		luaL_error(L, "skynet.redirect invalid param %s", lua_typename(L,mtype));
 	}
@@ -368,6 +481,59 @@ _harbor(lua_State *L) {
 	return 2;
 }
 
+/**
+ * 高精度的单调时钟, 用于统计耗时.
+ * lua: 没有参数; 1 个返回值, 纳秒
+ */
+static int
+_hpc(lua_State *L) {
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	lua_pushinteger(L, (lua_Integer)ti.tv_sec * 1000000000 + ti.tv_nsec);
+	return 1;
+}
+
+/**
+ * 设置空闲 gc 的阈值 (KB), 0 表示关闭.
+ * lua: 1 个可选参数, 新的阈值; 1 个返回值, 原来的阈值
+ */
+static int
+_gcidle(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	struct callback_context *cb = getcb(L, context);
+	int idle = cb->gc.idle;
+	if (!lua_isnoneornil(L, 1)) {
+		int n = luaL_checkinteger(L, 1);
+		cb->gc.idle = n > 0 ? n : 0;
+		cb->gc.incycle = 0;
+		cb->gc.base = 0;
+	}
+	lua_pushinteger(L, idle);
+	return 1;
+}
+
+/**
+ * 空闲 gc 的统计.
+ * lua: 没有参数; 1 个返回值, table { idle = 阈值 KB, steps = 次数, cycles = 完成的周期数, time = 总耗时 ms, max = 单次最长耗时 ms }
+ */
+static int
+_gcstat(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	struct gcstat *gc = &getcb(L, context)->gc;
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, gc->idle);
+	lua_setfield(L, -2, "idle");
+	lua_pushinteger(L, gc->steps);
+	lua_setfield(L, -2, "steps");
+	lua_pushinteger(L, gc->cycles);
+	lua_setfield(L, -2, "cycles");
+	lua_pushnumber(L, gc->time / 1e6);
+	lua_setfield(L, -2, "time");
+	lua_pushnumber(L, gc->max / 1e6);
+	lua_setfield(L, -2, "max");
+	return 1;
+}
+
 /**
  * 将 lua 对象序列化成 lua string 存储.
  * lua: 接收任意个参数; 1 个返回值, lua string, 注意这个 string 是序列化的二进制数据.
@@ -421,9 +587,13 @@ luaopen_skynet_core(lua_State *L) {
 		{ "harbor", _harbor },
 		{ "pack", _luaseri_pack },
 		{ "unpack", _luaseri_unpack },
+		{ "unpackview", _luaseri_unpackview },
 		{ "packstring", lpackstring },
 		{ "trash" , ltrash },
 		{ "callback", _callback },
+		{ "hpc", _hpc },
+		{ "gcidle", _gcidle },
+		{ "gcstat", _gcstat },
 		{ NULL, NULL },
 	};
 
@@ -628,14 +628,9 @@ lstr2p(lua_State *L) {
 	参数4: 如果 skynet_socket_message.buffer 有值, 则保存其指针; 否则保存 skynet_socket_message 后续内存的字符串数据
 	参数5: 只用于 udp 协议, 存储的是地址信息
 */
+/// 压入一条 socket 消息的内容, 返回压入的值的数量
 static int
-lunpack(lua_State *L) {
-	// 获得参数 1, skynet_socket_message
-	struct skynet_socket_message *message = lua_touserdata(L,1);
-
-	// 获得参数 2, size
-	int size = luaL_checkinteger(L,2);
-
+push_message(lua_State *L, struct skynet_socket_message *message, int size) {
 	lua_pushinteger(L, message->type);	// 返回值 1
 	lua_pushinteger(L, message->id);	// 返回值 2
 	lua_pushinteger(L, message->ud);	// 返回值 3
@@ -659,6 +654,55 @@ lunpack(lua_State *L) {
 	return 4;
 }
 
+/*
+	批量消息 SKYNET_SOCKET_TYPE_BATCH 返回 3 个值: type, 消息数量 n, table
+	table 中每 5 个元素对应一条消息: type, n1, n2, 指针或者字符串, udp 地址(没有时为 nil)
+*/
+static int
+lunpack(lua_State *L) {
+	// 获得参数 1, skynet_socket_message
+	struct skynet_socket_message *message = lua_touserdata(L,1);
+
+	// 获得参数 2, size
+	int size = luaL_checkinteger(L,2);
+
+	if (message->type != SKYNET_SOCKET_TYPE_BATCH) {
+		return push_message(L, message, size);
+	}
+
+	int n = message->ud;
+	lua_pushinteger(L, message->type);
+	lua_pushinteger(L, n);
+	lua_createtable(L, n * 5, 0);
+	const char * ptr = (const char *)(message + 1);
+	int i;
+	for (i=0;i<n;i++) {
+		int sz;
+		struct skynet_socket_message *m = skynet_socket_batch_next(&ptr, &sz);
+		int top = lua_gettop(L);
+		int r = push_message(L, m, sz);
+		int j;
+		for (j=r;j>0;j--) {
+			lua_rawseti(L, top, i*5+j);
+		}
+	}
+	return 3;
+}
+
+/**
+ * 开启/关闭批量模式, 开启后一轮事件中发给本服务的所有 socket 消息会合并成一条 SKYNET_SOCKET_TYPE_BATCH 消息
+ * lua: 接收 1 个参数, boolean, 不传时为 true; 0 个返回值.
+ */
+static int
+lbatch(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int enable = lua_isnoneornil(L, 1) || lua_toboolean(L, 1);
+	if (skynet_socket_batch(ctx, enable)) {
+		return luaL_error(L, "Too many services in socket batch mode");
+	}
+	return 0;
+}
+
 /**
  * 获得地址和端口
  * @param L lua_State
@@ -751,10 +795,6 @@ lclose(lua_State *L) {
 	return 0;
 }
 
-/**
- * 侦听指定的端口地址
- * lua: 接收 3 个参数, 参数 1, 主机地址; 参数 2, 端口; 参数 3, backlog, 如果不传此参数, 将使用默认值; 1 个返回值, socket id
- */
 static int
 lshutdown(lua_State *L) {
 	int id = luaL_checkinteger(L,1);
@@ -763,13 +803,24 @@ lshutdown(lua_State *L) {
 	return 0;
 }
 
+/**
+ * 侦听指定的端口地址
+ * lua: 接收 4 个参数, 参数 1, 主机地址; 参数 2, 端口; 参数 3, backlog, 如果不传此参数, 将使用默认值;
+ * 参数 4, boolean, 为 true 时开启 SO_REUSEPORT, 多个服务可以侦听同一个端口; 1 个返回值, socket id
+ */
 static int
 llisten(lua_State *L) {
 	const char * host = luaL_checkstring(L,1);
 	int port = luaL_checkinteger(L,2);
 	int backlog = luaL_optinteger(L,3,BACKLOG);
+	int reuseport = lua_toboolean(L,4);
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
-	int id = skynet_socket_listen(ctx, host,port,backlog);
+	int id;
+	if (reuseport) {
+		id = skynet_socket_listen_reuseport(ctx, host,port,backlog);
+	} else {
+		id = skynet_socket_listen(ctx, host,port,backlog);
+	}
 	if (id < 0) {
 		return luaL_error(L, "Listen error");
 	}
@@ -1036,6 +1087,7 @@ luaopen_socketdriver(lua_State *L) {
 		{ "udp_connect", ludp_connect },
 		{ "udp_send", ludp_send },
 		{ "udp_address", ludp_address },
+		{ "batch", lbatch },
 		{ NULL, NULL },
 	};
 
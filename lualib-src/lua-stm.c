@@ -9,10 +9,14 @@
 #include "skynet_malloc.h"
 #include "atomic.h"
 
+struct stm_hazard;
+
 struct stm_object {
 	struct rwlock lock;
 	int reference;
+	uint32_t version;
 	struct stm_copy * copy;
+	struct stm_hazard * hazard;
 };
 
 struct stm_copy {
@@ -21,6 +25,28 @@ struct stm_copy {
 	void * msg;
 };
 
+#define STM_CACHELINE 64
+
+// writer 等待 reader 时的忙等提示, 减少对另一个超线程和总线的干扰
+#if defined(__x86_64__) || defined(__i386__)
+#define stm_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define stm_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define stm_relax() ((void)0)
+#endif
+
+// 每个 reader 独占一个 hazard 记录, 在给 copy 加引用的那几条指令期间, 用它告诉 writer 不要释放这个 copy.
+// 记录只会挂到 stm_object 的链表上, 直到 stm_object 释放; reader 释放后, 记录留给之后的 reader 复用.
+// 填充成一个 cache line, 并且按 cache line 对齐分配 (见 stm_allochazard), 避免不同 reader 之间的伪共享.
+struct stm_hazard {
+	struct stm_copy * ptr;
+	struct stm_hazard * next;
+	void * block;	// skynet_malloc 分配的原始内存, 释放时使用
+	int active;
+	char padding[STM_CACHELINE - 3 * sizeof(void *) - sizeof(int)];
+};
+
 // msg should alloc by skynet_malloc 
 static struct stm_copy *
 stm_newcopy(void * msg, int32_t sz) {
@@ -37,7 +63,9 @@ stm_new(void * msg, int32_t sz) {
 	struct stm_object * obj = skynet_malloc(sizeof(*obj));
 	rwlock_init(&obj->lock);
 	obj->reference = 1;
+	obj->version = 0;
 	obj->copy = stm_newcopy(msg, sz);
+	obj->hazard = NULL;
 
 	return obj;
 }
@@ -52,20 +80,77 @@ stm_releasecopy(struct stm_copy *copy) {
 	}
 }
 
+static void
+stm_free(struct stm_object *obj) {
+	struct stm_hazard * h = obj->hazard;
+	while (h) {
+		struct stm_hazard * next = h->next;
+		skynet_free(h->block);
+		h = next;
+	}
+	skynet_free(obj);
+}
+
+// skynet_malloc 没有对齐分配的版本, 多分配一个 cache line 再手动对齐
+static struct stm_hazard *
+stm_allochazard() {
+	void * block = skynet_malloc(sizeof(struct stm_hazard) + STM_CACHELINE - 1);
+	struct stm_hazard * h = (struct stm_hazard *)(((uintptr_t)block + STM_CACHELINE - 1) & ~(uintptr_t)(STM_CACHELINE - 1));
+	h->block = block;
+	return h;
+}
+
+static struct stm_hazard *
+stm_newhazard(struct stm_object *obj) {
+	struct stm_hazard * h;
+	for (h = obj->hazard; h; h = h->next) {
+		if (h->active == 0 && ATOM_CAS(&h->active, 0, 1))
+			return h;
+	}
+	h = stm_allochazard();
+	h->ptr = NULL;
+	h->active = 1;
+	do {
+		h->next = obj->hazard;
+	} while (!ATOM_CAS_POINTER(&obj->hazard, h->next, h));
+	return h;
+}
+
+static void
+stm_releasehazard(struct stm_hazard *h) {
+	h->ptr = NULL;
+	__sync_synchronize();
+	h->active = 0;
+}
+
+// 换下 obj->copy 之后, 等待所有正在给旧 copy 加引用的 reader 完成, 之后才能放掉 writer 持有的那份引用.
+static struct stm_copy *
+stm_swapcopy(struct stm_object *obj, struct stm_copy *copy) {
+	struct stm_copy * oldcopy = __sync_lock_test_and_set(&obj->copy, copy);
+	ATOM_INC(&obj->version);
+	// ATOM_INC 是完整的内存屏障, 之后读到的 hazard 一定在换下 copy 之后
+	struct stm_hazard * h;
+	for (h = obj->hazard; h; h = h->next) {
+		while (((volatile struct stm_hazard *)h)->ptr == oldcopy) {
+			stm_relax();
+		}
+	}
+	return oldcopy;
+}
+
 static void
 stm_release(struct stm_object *obj) {
 	assert(obj->copy);
-	rwlock_wlock(&obj->lock);
 	// writer release the stm object, so release the last copy .
-	stm_releasecopy(obj->copy);
-	obj->copy = NULL;
+	stm_releasecopy(stm_swapcopy(obj, NULL));
+	rwlock_wlock(&obj->lock);
 	if (--obj->reference > 0) {
 		// stm object grab by readers, reset the copy to NULL.
 		rwlock_wunlock(&obj->lock);
 		return;
 	}
 	// no one grab the stm object, no need to unlock wlock.
-	skynet_free(obj);
+	stm_free(obj);
 }
 
 static void
@@ -74,7 +159,7 @@ stm_releasereader(struct stm_object *obj) {
 	if (ATOM_DEC(&obj->reference) == 0) {
 		// last reader, no writer. so no need to unlock
 		assert(obj->copy == NULL);
-		skynet_free(obj);
+		stm_free(obj);
 		return;
 	}
 	rwlock_runlock(&obj->lock);
@@ -88,15 +173,22 @@ stm_grab(struct stm_object *obj) {
 	assert(ref > 0);
 }
 
+// 先把读到的 copy 写进自己的 hazard 记录, 再确认 obj->copy 没有被换掉, 这样 writer 一定能看到这个 hazard.
 static struct stm_copy *
-stm_copy(struct stm_object *obj) {
-	rwlock_rlock(&obj->lock);
-	struct stm_copy * ret = obj->copy;
+stm_copy(struct stm_object *obj, struct stm_hazard *h) {
+	struct stm_copy * ret;
+	for (;;) {
+		ret = ((volatile struct stm_object *)obj)->copy;
+		h->ptr = ret;
+		__sync_synchronize();
+		if (((volatile struct stm_object *)obj)->copy == ret)
+			break;
+	}
 	if (ret) {
 		int ref = ATOM_FINC(&ret->reference);
 		assert(ref > 0);
 	}
-	rwlock_runlock(&obj->lock);
+	h->ptr = NULL;
 	
 	return ret;
 }
@@ -104,12 +196,7 @@ stm_copy(struct stm_object *obj) {
 static void
 stm_update(struct stm_object *obj, void *msg, int32_t sz) {
 	struct stm_copy *copy = stm_newcopy(msg, sz);
-	rwlock_wlock(&obj->lock);
-	struct stm_copy *oldcopy = obj->copy;
-	obj->copy = copy;
-	rwlock_wunlock(&obj->lock);
-
-	stm_releasecopy(oldcopy);
+	stm_releasecopy(stm_swapcopy(obj, copy));
 }
 
 // lua binding
@@ -175,14 +262,18 @@ lupdate(lua_State *L) {
 
 struct boxreader {
 	struct stm_object *obj;
+	struct stm_hazard *hazard;
 	struct stm_copy *lastcopy;
+	uint32_t version;
 };
 
 static int
 lnewreader(lua_State *L) {
 	struct boxreader * box = lua_newuserdata(L, sizeof(*box));
 	box->obj = lua_touserdata(L, 1);
+	box->hazard = stm_newhazard(box->obj);
 	box->lastcopy = NULL;
+	box->version = box->obj->version - 1;
 	lua_pushvalue(L, lua_upvalueindex(1));
 	lua_setmetatable(L, -2);
 
@@ -192,6 +283,8 @@ lnewreader(lua_State *L) {
 static int
 ldeletereader(lua_State *L) {
 	struct boxreader * box = lua_touserdata(L, 1);
+	stm_releasehazard(box->hazard);
+	box->hazard = NULL;
 	stm_releasereader(box->obj);
 	box->obj = NULL;
 	stm_releasecopy(box->lastcopy);
@@ -205,7 +298,16 @@ lread(lua_State *L) {
 	struct boxreader * box = lua_touserdata(L, 1);
 	luaL_checktype(L, 2, LUA_TFUNCTION);
 
-	struct stm_copy * copy = stm_copy(box->obj);
+	// 版本号没有变化时直接返回, 不写任何共享内存
+	uint32_t version = ((volatile struct stm_object *)box->obj)->version;
+	if (version == box->version) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	__sync_synchronize();
+	box->version = version;
+
+	struct stm_copy * copy = stm_copy(box->obj, box->hazard);
 	if (copy == box->lastcopy) {
 		// not update
 		stm_releasecopy(copy);
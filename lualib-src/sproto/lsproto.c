@@ -12,6 +12,26 @@
 #define ENCODE_MAXSIZE 0x1000000
 #define ENCODE_DEEPLEVEL 64
 
+#define SIZEOF_LENGTH 4
+#define SIZEOF_HEADER 2
+#define SIZEOF_FIELD 2
+
+#define PLAN_CACHE_SIZE 64
+
+// 注册表中字段表缓存的 key
+static int plan_cache;
+
+/*
+	字段表缓存, 每个 lua 虚拟机 1 个, 它和它的 uservalue 作为 encode/decode 的 upvalue, 同时保存在注册表中.
+	uservalue 为缓存表: { [sproto] = { [sproto_type] = plan userdata }, [slot] = 槽位中的 plan userdata }, plan 的 uservalue 为字段名数组.
+	编解码入口先按 sproto_type 的地址查槽位, 命中时不需要查询缓存表. 字段表在编解码期间留在栈上,
+	子类型的字段表被父类型的字段名数组引用. 释放 sproto 时只清除它自己的字段表.
+ */
+struct plan_cache {
+	struct sproto_type *st[PLAN_CACHE_SIZE];
+	struct type_plan *p[PLAN_CACHE_SIZE];
+};
+
 #ifndef luaL_newlib /* using LuaJIT */
 /*
 ** set functions from list 'l' into table at top - 'nup'; each
@@ -79,6 +99,23 @@ ldeleteproto(lua_State *L) {
 	if (sp == NULL) {
 		return luaL_argerror(L, 1, "Need a sproto object");
 	}
+	// sproto_type 即将失效, 只清除这个 sproto 的字段表缓存, 其他 sproto 正在使用的字段表不受影响
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &plan_cache);
+	if (lua_isuserdata(L, -1)) {
+		struct plan_cache *c = lua_touserdata(L, -1);
+		int i;
+		lua_getuservalue(L, -1);
+		for (i=0;i<PLAN_CACHE_SIZE;i++) {
+			if (c->st[i] && sproto_owner(c->st[i]) == sp) {
+				c->st[i] = NULL;
+				c->p[i] = NULL;
+				lua_pushnil(L);
+				lua_rawseti(L, -2, i + 1);
+			}
+		}
+		lua_pushnil(L);
+		lua_rawsetp(L, -2, sp);
+	}
 	sproto_release(sp);
 	return 0;
 }
@@ -458,6 +495,786 @@ ldecode(lua_State *L) {
 	return 2;
 }
 
+/*
+	直接遍历 lua table 的编解码.
+	sproto_encode/sproto_decode 对每个字段都要回调一次, 回调中再通过 lua_getfield/lua_setfield 按字段名读写 table.
+	这里为每个 sproto_type 生成一份字段表 (plan), 字段名预先生成 lua 字符串, 和字段表一起缓存在注册表中,
+	编解码时按字段表直接读写 lua table, 不再经过回调.
+ */
+
+struct field_plan {
+	const char *name;
+	int tag;
+	int type;
+	int array;
+	int key;
+	struct sproto_type *st;
+	struct type_plan *sub;	// 子类型的字段表, 编码时第一次用到才查询 (field_subplan)
+};
+
+struct type_plan {
+	struct sproto_type *st;
+	int n;
+	int maxn;
+	int base;
+	struct field_plan f[1];
+};
+
+/// 查询 (或生成) st 的字段表, 把字段表 userdata 压入栈顶. cache 为 st 所属 sproto 的缓存表在栈上的位置
+static struct type_plan *
+query_plan(lua_State *L, int cache, struct sproto_type *st) {
+	struct type_plan *p;
+	int n, maxn, i;
+	lua_rawgetp(L, cache, st);
+	if (lua_isuserdata(L, -1)) {
+		return lua_touserdata(L, -1);
+	}
+	lua_pop(L, 1);
+	n = sproto_fieldn(st, &maxn);
+	p = lua_newuserdata(L, sizeof(*p) + n * sizeof(struct field_plan));
+	p->st = st;
+	p->n = n;
+	p->maxn = maxn;
+	// 1 ~ n 为字段名, n+1 ~ 2n 为 struct 字段的子类型字段表 (第一次使用时填入)
+	lua_createtable(L, n * 2, 0);
+	for (i=0;i<n;i++) {
+		struct sproto_field field;
+		struct field_plan *f = &p->f[i];
+		sproto_field(st, i, &field);
+		f->name = field.name;
+		f->tag = field.tag;
+		f->type = field.type;
+		f->array = field.array;
+		f->key = field.key;
+		f->st = field.st;
+		f->sub = NULL;
+		lua_pushstring(L, field.name);
+		lua_rawseti(L, -2, i+1);
+	}
+	// 字段的 tag 连续时, 可以直接用 tag 计算下标
+	if (n > 0 && p->f[n-1].tag - p->f[0].tag == n-1) {
+		p->base = p->f[0].tag;
+	} else {
+		p->base = -1;
+	}
+	lua_setuservalue(L, -2);
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, cache, st);
+	return p;
+}
+
+/// 压入 st 所属 sproto 的缓存表, 不存在时创建. cache 为总缓存表在栈上的位置
+static void
+push_sprotocache(lua_State *L, int cache, struct sproto_type *st) {
+	const struct sproto *sp = sproto_owner(st);
+	lua_rawgetp(L, cache, sp);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawsetp(L, cache, sp);
+	}
+}
+
+/// 把 st 的字段表 userdata 压入栈顶并返回字段表, 在编解码结束前一直留在栈上.
+/// cache 为 struct plan_cache 的位置, slots 为它的 uservalue 的位置 (都可以是 upvalue, 命中时只需要一次 rawgeti)
+static struct type_plan *
+push_plan(lua_State *L, int cache, int slots, struct sproto_type *st) {
+	struct plan_cache *c = lua_touserdata(L, cache);
+	int slot = (int)(((size_t)st >> 4) % PLAN_CACHE_SIZE);
+	struct type_plan *p;
+	if (c->st[slot] == st) {
+		lua_rawgeti(L, slots, slot + 1);
+		return c->p[slot];
+	}
+	lua_pushvalue(L, slots);
+	push_sprotocache(L, lua_gettop(L), st);
+	p = query_plan(L, lua_gettop(L), st);
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -4, slot + 1);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	c->st[slot] = st;
+	c->p[slot] = p;
+	return p;
+}
+
+/// 从缓存中查询 p 的第 i 个字段 (struct) 的子类型字段表, 压入栈顶, 并记入 p 的字段名数组, 使它和 p 一起存活
+static struct type_plan *
+query_subplan(lua_State *L, const struct type_plan *p, int keys, int i) {
+	struct type_plan *sub;
+	int top = lua_gettop(L);
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &plan_cache);
+	lua_getuservalue(L, -1);
+	push_sprotocache(L, top + 2, p->f[i].st);
+	sub = query_plan(L, top + 3, p->f[i].st);
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, keys, p->n + i + 1);
+	lua_replace(L, top + 1);
+	lua_settop(L, top + 1);
+	return sub;
+}
+
+/// 查询 p 的第 i 个字段 (struct) 的子类型字段表, 结果记在字段中, 之后不再访问 lua.
+/// 子类型字段表被 p 的字段名数组引用, 只要 p 在栈上就不会被回收
+static struct type_plan *
+field_subplan(lua_State *L, struct type_plan *p, int i) {
+	struct field_plan *f = &p->f[i];
+	if (f->sub == NULL) {
+		int top = lua_gettop(L);
+		lua_rawgetp(L, LUA_REGISTRYINDEX, &plan_cache);
+		lua_getuservalue(L, -1);
+		push_sprotocache(L, top + 2, p->st);
+		lua_rawgetp(L, top + 3, p->st);
+		lua_getuservalue(L, -1);
+		f->sub = query_subplan(L, p, top + 5, i);
+		lua_settop(L, top);
+	}
+	return f->sub;
+}
+
+/// 压入第 i 个字段 (struct) 的子类型的字段名数组, 返回子类型的字段表. keys 为 p 的字段名数组在栈上的位置
+static struct type_plan *
+push_subplan(lua_State *L, const struct type_plan *p, int keys, int i) {
+	struct type_plan *sub;
+	lua_rawgeti(L, keys, p->n + i + 1);
+	if (lua_isuserdata(L, -1)) {
+		sub = lua_touserdata(L, -1);
+	} else {
+		// 第一次使用这个字段, 从缓存表中查询子类型
+		lua_pop(L, 1);
+		sub = query_subplan(L, p, keys, i);
+	}
+	lua_getuservalue(L, -1);
+	lua_replace(L, -2);
+	return sub;
+}
+
+static int
+plan_findtag(const struct type_plan *p, int tag) {
+	int begin, end;
+	if (p->base >= 0) {
+		tag -= p->base;
+		if (tag < 0 || tag >= p->n)
+			return -1;
+		return tag;
+	}
+	begin = 0;
+	end = p->n;
+	while (begin < end) {
+		int mid = (begin+end)/2;
+		int t = p->f[mid].tag;
+		if (t == tag) {
+			return mid;
+		}
+		if (tag > t) {
+			begin = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+	return -1;
+}
+
+static inline int
+fill_size(uint8_t * data, int sz) {
+	data[0] = sz & 0xff;
+	data[1] = (sz >> 8) & 0xff;
+	data[2] = (sz >> 16) & 0xff;
+	data[3] = (sz >> 24) & 0xff;
+	return sz + SIZEOF_LENGTH;
+}
+
+static inline void
+write_integer(uint64_t v, int intlen, uint8_t *buffer) {
+	int i;
+	for (i=0;i<intlen;i++) {
+		buffer[i] = (v >> (i*8)) & 0xff;
+	}
+}
+
+static lua_Integer
+check_integer(lua_State *L, const char *tagname, int index) {
+	int isnum;
+	lua_Integer v = lua_tointegerx(L, -1, &isnum);
+	if (!isnum) {
+		luaL_error(L, ".%s[%d] is not an integer (Is a %s)",
+			tagname, index, lua_typename(L, lua_type(L, -1)));
+	}
+	return v;
+}
+
+static int
+check_boolean(lua_State *L, const char *tagname, int index) {
+	if (!lua_isboolean(L, -1)) {
+		luaL_error(L, ".%s[%d] is not a boolean (Is a %s)",
+			tagname, index, lua_typename(L, lua_type(L, -1)));
+	}
+	return lua_toboolean(L, -1);
+}
+
+static int encode_table(lua_State *L, struct type_plan *p, int tbl, uint8_t *buffer, int size, int deep);
+
+/// 编码栈顶的 string 或 struct, 带 4 字节长度. struct 的字段表为 sub
+static int
+encode_object_direct(lua_State *L, const struct field_plan *f, struct type_plan *sub, int index, uint8_t *data, int size, int deep) {
+	int sz;
+	if (size < SIZEOF_LENGTH)
+		return -1;
+	if (f->type == SPROTO_TSTRING) {
+		size_t len = 0;
+		const char * str;
+		if (!lua_isstring(L, -1)) {
+			return luaL_error(L, ".%s[%d] is not a string (Is a %s)",
+				f->name, index, lua_typename(L, lua_type(L, -1)));
+		}
+		str = lua_tolstring(L, -1, &len);
+		if (len > size - SIZEOF_LENGTH)
+			return -1;
+		memcpy(data + SIZEOF_LENGTH, str, len);
+		sz = (int)len;
+	} else {
+		if (!lua_istable(L, -1)) {
+			return luaL_error(L, ".%s[%d] is not a table (Is a %s)",
+				f->name, index, lua_typename(L, lua_type(L, -1)));
+		}
+		// 顶层 table 用入口保证的 LUA_MINSTACK 就够了, 只在递归时检查栈空间
+		luaL_checkstack(L, 16, NULL);
+		sz = encode_table(L, sub, lua_gettop(L), data + SIZEOF_LENGTH, size - SIZEOF_LENGTH, deep + 1);
+		if (sz < 0)
+			return -1;
+	}
+	return fill_size(data, sz);
+}
+
+/// 编码栈顶的数组 (p 的第 field 个字段), 空数组返回 0 (和 nil 一样不写入)
+static int
+encode_array_direct(lua_State *L, struct type_plan *p, int field, uint8_t *data, int size, int deep) {
+	const struct field_plan *f = &p->f[field];
+	struct type_plan *sub = NULL;
+	int arr = lua_gettop(L);
+	uint8_t * buffer;
+	int i, sz;
+	if (!lua_istable(L, arr)) {
+		return luaL_error(L, ".*%s(%d) should be a table (Is a %s)",
+			f->name, 1, lua_typename(L, lua_type(L, arr)));
+	}
+	if (size < SIZEOF_LENGTH)
+		return -1;
+	size -= SIZEOF_LENGTH;
+	buffer = data + SIZEOF_LENGTH;
+	switch (f->type) {
+	case SPROTO_TINTEGER: {
+		// 第一遍检查类型并确定整数的宽度, 第二遍写入
+		int intlen = sizeof(uint32_t);
+		int n = 0;
+		for (;;) {
+			lua_Integer v, vh;
+			lua_geti(L, arr, n+1);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				break;
+			}
+			v = check_integer(L, f->name, n+1);
+			vh = v >> 31;
+			if (vh != 0 && vh != -1) {
+				intlen = sizeof(uint64_t);
+			}
+			lua_pop(L, 1);
+			++n;
+		}
+		if (n == 0)
+			return 0;
+		if (size < 1 + n * intlen)
+			return -1;
+		*buffer++ = (uint8_t)intlen;
+		for (i=1;i<=n;i++) {
+			lua_Integer v;
+			lua_geti(L, arr, i);
+			v = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			write_integer((uint64_t)v, intlen, buffer);
+			buffer += intlen;
+		}
+		break;
+	}
+	case SPROTO_TBOOLEAN:
+		for (i=1;;i++) {
+			int v;
+			lua_geti(L, arr, i);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				break;
+			}
+			v = check_boolean(L, f->name, i);
+			lua_pop(L, 1);
+			if (size < 1)
+				return -1;
+			*buffer++ = v ? 1 : 0;
+			--size;
+		}
+		break;
+	default:
+		if (f->type == SPROTO_TSTRUCT) {
+			sub = field_subplan(L, p, field);
+		}
+		if (f->key >= 0) {
+			// map, 使用 lua_next 遍历
+			i = 1;
+			lua_pushnil(L);
+			while (lua_next(L, arr)) {
+				sz = encode_object_direct(L, f, sub, i, buffer, size, deep);
+				if (sz < 0)
+					return -1;
+				lua_pop(L, 1);
+				buffer += sz;
+				size -= sz;
+				++i;
+			}
+			lua_settop(L, arr);
+		} else {
+			for (i=1;;i++) {
+				lua_geti(L, arr, i);
+				if (lua_isnil(L, -1)) {
+					lua_pop(L, 1);
+					break;
+				}
+				sz = encode_object_direct(L, f, sub, i, buffer, size, deep);
+				if (sz < 0)
+					return -1;
+				lua_pop(L, 1);
+				buffer += sz;
+				size -= sz;
+			}
+			lua_settop(L, arr);
+		}
+		break;
+	}
+	sz = buffer - (data + SIZEOF_LENGTH);
+	if (sz == 0)	// empty array
+		return 0;
+	return fill_size(data, sz);
+}
+
+/// 按字段表 p 编码 tbl 位置的 table, 格式和 sproto_encode 相同. 缓冲区不足时返回 -1
+static int
+encode_table(lua_State *L, struct type_plan *p, int tbl, uint8_t *buffer, int size, int deep) {
+	uint8_t * header = buffer;
+	uint8_t * data;
+	int header_sz;
+	int i;
+	int index;
+	int lasttag;
+	int datasz;
+	if (deep >= ENCODE_DEEPLEVEL)
+		return luaL_error(L, "The table is too deep");
+	header_sz = SIZEOF_HEADER + p->maxn * SIZEOF_FIELD;
+	if (size < header_sz)
+		return -1;
+	data = header + header_sz;
+	size -= header_sz;
+	index = 0;
+	lasttag = -1;
+	for (i=0;i<p->n;i++) {
+		const struct field_plan *f = &p->f[i];
+		int value = 0;
+		int sz;
+		// f->name 的地址固定, lua_getfield 可以命中 lua 的 api 字符串缓存
+		lua_getfield(L, tbl, f->name);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			continue;
+		}
+		if (f->array) {
+			sz = encode_array_direct(L, p, i, data, size, deep);
+		} else {
+			switch (f->type) {
+			case SPROTO_TINTEGER: {
+				lua_Integer v = check_integer(L, f->name, 0);
+				lua_Integer vh = v >> 31;
+				int intlen = (vh == 0 || vh == -1) ? sizeof(uint32_t) : sizeof(uint64_t);
+				if (intlen == sizeof(uint32_t) && (uint32_t)v < 0x7fff) {
+					value = ((uint32_t)v + 1) * 2;
+					sz = 2;
+				} else if (size < SIZEOF_LENGTH + intlen) {
+					sz = -1;
+				} else {
+					write_integer((uint64_t)v, intlen, data + SIZEOF_LENGTH);
+					sz = fill_size(data, intlen);
+				}
+				break;
+			}
+			case SPROTO_TBOOLEAN:
+				value = (check_boolean(L, f->name, 0) + 1) * 2;
+				sz = 2;
+				break;
+			case SPROTO_TSTRING:
+				sz = encode_object_direct(L, f, NULL, 0, data, size, deep);
+				break;
+			default:
+				sz = encode_object_direct(L, f, field_subplan(L, p, i), 0, data, size, deep);
+				break;
+			}
+		}
+		lua_pop(L, 1);
+		if (sz < 0)
+			return -1;
+		if (sz > 0) {
+			uint8_t * record;
+			int tag;
+			if (value == 0) {
+				data += sz;
+				size -= sz;
+			}
+			record = header+SIZEOF_HEADER+SIZEOF_FIELD*index;
+			tag = f->tag - lasttag - 1;
+			if (tag > 0) {
+				// skip tag
+				tag = (tag - 1) * 2 + 1;
+				if (tag > 0xffff)
+					return -1;
+				record[0] = tag & 0xff;
+				record[1] = (tag >> 8) & 0xff;
+				++index;
+				record += SIZEOF_FIELD;
+			}
+			++index;
+			record[0] = value & 0xff;
+			record[1] = (value >> 8) & 0xff;
+			lasttag = f->tag;
+		}
+	}
+	header[0] = index & 0xff;
+	header[1] = (index >> 8) & 0xff;
+
+	datasz = data - (header + header_sz);
+	data = header + header_sz;
+	if (index != p->maxn) {
+		memmove(header + SIZEOF_HEADER + index * SIZEOF_FIELD, data, datasz);
+	}
+	return SIZEOF_HEADER + index * SIZEOF_FIELD + datasz;
+}
+
+/*
+	lightuserdata sproto_type
+	table source
+
+	return string
+ */
+static int
+lencode_table(lua_State *L) {
+	void * buffer = lua_touserdata(L, lua_upvalueindex(1));
+	int sz = lua_tointeger(L, lua_upvalueindex(2));
+	int tbl_index = 2;
+	struct sproto_type * st = lua_touserdata(L, 1);
+	struct type_plan * p;
+	if (st == NULL) {
+		return luaL_argerror(L, 1, "Need a sproto_type object");
+	}
+	luaL_checktype(L, tbl_index, LUA_TTABLE);
+	lua_settop(L, tbl_index);
+	p = push_plan(L, lua_upvalueindex(3), lua_upvalueindex(4), st);
+	for (;;) {
+		int r;
+		lua_settop(L, tbl_index + 1);
+		r = encode_table(L, p, tbl_index, buffer, sz, 0);
+		if (r<0) {
+			buffer = expand_buffer(L, sz, sz*2);
+			sz *= 2;
+		} else {
+			lua_pushlstring(L, buffer, r);
+			return 1;
+		}
+	}
+}
+
+static inline int
+toword(const uint8_t * p) {
+	return p[0] | p[1]<<8;
+}
+
+static inline uint32_t
+todword(const uint8_t *p) {
+	return p[0] | p[1]<<8 | p[2]<<16 | p[3]<<24;
+}
+
+static inline uint64_t
+expand64(uint32_t v) {
+	uint64_t value = v;
+	if (value & 0x80000000) {
+		value |= (uint64_t)~0  << 32 ;
+	}
+	return value;
+}
+
+static int decode_table(lua_State *L, const struct type_plan *p, int keys, const uint8_t *data, int size, int result, int deep, int mainindex, int key_index);
+
+/// 按字段表 sub 解码 1 个 struct 并压入栈顶, 长度必须和 sz 一致. 作为 map 的元素时, 主键的值放在 key_index 位置
+static int
+decode_struct(lua_State *L, const struct type_plan *sub, int subkeys, const uint8_t *stream, uint32_t sz, int deep, int mainindex, int key_index) {
+	int r;
+	lua_createtable(L, 0, sub->n);
+	r = decode_table(L, sub, subkeys, stream, (int)sz, lua_gettop(L), deep + 1, mainindex, key_index);
+	if (r < 0 || r != sz)
+		return -1;
+	return 0;
+}
+
+/// 解码数组 (p 的第 field 个字段), 成功时压入数组 (空数组压入 nil)
+static int
+decode_array_direct(lua_State *L, const struct type_plan *p, int keys, int field, const uint8_t *stream, uint32_t sz, int deep) {
+	const struct field_plan *f = &p->f[field];
+	int i;
+	switch (f->type) {
+	case SPROTO_TINTEGER: {
+		int len;
+		int n;
+		if (sz < 1)
+			return -1;
+		len = *stream;
+		++stream;
+		--sz;
+		if (len != sizeof(uint32_t) && len != sizeof(uint64_t))
+			return -1;
+		if (sz % len != 0)
+			return -1;
+		n = sz / len;
+		if (n == 0) {
+			lua_pushnil(L);
+			return 0;
+		}
+		lua_createtable(L, n, 0);
+		for (i=0;i<n;i++) {
+			uint64_t value;
+			if (len == sizeof(uint32_t)) {
+				value = expand64(todword(stream + i*sizeof(uint32_t)));
+			} else {
+				uint64_t low = todword(stream + i*sizeof(uint64_t));
+				uint64_t hi = todword(stream + i*sizeof(uint64_t) + sizeof(uint32_t));
+				value = low | hi << 32;
+			}
+			lua_pushinteger(L, (lua_Integer)value);
+			lua_rawseti(L, -2, i+1);
+		}
+		return 0;
+	}
+	case SPROTO_TBOOLEAN:
+		if (sz == 0) {
+			lua_pushnil(L);
+			return 0;
+		}
+		lua_createtable(L, sz, 0);
+		for (i=0;i<sz;i++) {
+			lua_pushboolean(L, stream[i]);
+			lua_rawseti(L, -2, i+1);
+		}
+		return 0;
+	case SPROTO_TSTRING:
+	case SPROTO_TSTRUCT: {
+		const struct type_plan *sub = NULL;
+		int subkeys = 0;
+		int arr;
+		if (sz == 0) {
+			lua_pushnil(L);
+			return 0;
+		}
+		lua_newtable(L);
+		arr = lua_gettop(L);
+		if (f->type == SPROTO_TSTRUCT) {
+			sub = push_subplan(L, p, keys, field);
+			subkeys = arr + 1;
+		}
+		i = 1;
+		while (sz > 0) {
+			uint32_t hsz;
+			if (sz < SIZEOF_LENGTH)
+				return -1;
+			hsz = todword(stream);
+			stream += SIZEOF_LENGTH;
+			sz -= SIZEOF_LENGTH;
+			if (hsz > sz)
+				return -1;
+			if (f->type == SPROTO_TSTRING) {
+				lua_pushlstring(L, (const char *)stream, hsz);
+				lua_rawseti(L, arr, i);
+			} else if (f->key >= 0) {
+				lua_pushnil(L);
+				if (decode_struct(L, sub, subkeys, stream, hsz, deep, f->key, subkeys + 1))
+					return -1;
+				if (lua_isnil(L, subkeys + 1)) {
+					return luaL_error(L, "Can't find main index (tag=%d) in [%s]", f->key, f->name);
+				}
+				lua_settable(L, arr);
+			} else {
+				if (decode_struct(L, sub, subkeys, stream, hsz, deep, -1, 0))
+					return -1;
+				lua_rawseti(L, arr, i);
+			}
+			sz -= hsz;
+			stream += hsz;
+			++i;
+		}
+		lua_settop(L, arr);
+		return 0;
+	}
+	default:
+		return -1;
+	}
+}
+
+/// 按字段表 p 把数据解码到 result 位置的 table 中, 返回读取的字节数, 数据错误时返回 -1. keys 为字段名数组在栈上的位置
+static int
+decode_table(lua_State *L, const struct type_plan *p, int keys, const uint8_t *data, int size, int result, int deep, int mainindex, int key_index) {
+	int total = size;
+	const uint8_t * stream;
+	const uint8_t * datastream;
+	int fn;
+	int i;
+	int tag;
+	if (deep >= ENCODE_DEEPLEVEL)
+		return luaL_error(L, "The table is too deep");
+	if (size < SIZEOF_HEADER)
+		return -1;
+	luaL_checkstack(L, 8, NULL);
+	stream = data;
+	fn = toword(stream);
+	stream += SIZEOF_HEADER;
+	size -= SIZEOF_HEADER;
+	if (size < fn * SIZEOF_FIELD)
+		return -1;
+	datastream = stream + fn * SIZEOF_FIELD;
+	size -= fn * SIZEOF_FIELD;
+
+	tag = -1;
+	for (i=0;i<fn;i++) {
+		const uint8_t * currentdata;
+		const struct field_plan * f;
+		uint32_t sz = 0;
+		int index;
+		int value = toword(stream + i * SIZEOF_FIELD);
+		++ tag;
+		if (value & 1) {
+			tag += value/2;
+			continue;
+		}
+		value = value/2 - 1;
+		currentdata = datastream;
+		if (value < 0) {
+			if (size < SIZEOF_LENGTH)
+				return -1;
+			sz = todword(datastream);
+			if (size < sz + SIZEOF_LENGTH)
+				return -1;
+			datastream += sz+SIZEOF_LENGTH;
+			size -= sz+SIZEOF_LENGTH;
+		}
+		index = plan_findtag(p, tag);
+		if (index < 0)
+			continue;
+		f = &p->f[index];
+		lua_rawgeti(L, keys, index+1);
+		currentdata += SIZEOF_LENGTH;
+		if (value >= 0) {
+			if (f->array)
+				return -1;
+			if (f->type == SPROTO_TINTEGER) {
+				lua_pushinteger(L, value);
+			} else if (f->type == SPROTO_TBOOLEAN) {
+				lua_pushboolean(L, value);
+			} else {
+				return -1;
+			}
+		} else if (f->array) {
+			if (decode_array_direct(L, p, keys, index, currentdata, sz, deep))
+				return -1;
+			if (lua_isnil(L, -1)) {
+				// empty array
+				lua_pop(L, 2);
+				continue;
+			}
+		} else {
+			switch (f->type) {
+			case SPROTO_TINTEGER:
+				if (sz == sizeof(uint32_t)) {
+					lua_pushinteger(L, (lua_Integer)expand64(todword(currentdata)));
+				} else if (sz == sizeof(uint64_t)) {
+					uint64_t low = todword(currentdata);
+					uint64_t hi = todword(currentdata + sizeof(uint32_t));
+					lua_pushinteger(L, (lua_Integer)(low | hi << 32));
+				} else {
+					return -1;
+				}
+				break;
+			case SPROTO_TSTRING:
+				lua_pushlstring(L, (const char *)currentdata, sz);
+				break;
+			case SPROTO_TSTRUCT: {
+				int top = lua_gettop(L);
+				const struct type_plan *sub = push_subplan(L, p, keys, index);
+				if (decode_struct(L, sub, top + 1, currentdata, sz, deep, -1, 0))
+					return -1;
+				lua_replace(L, top + 1);
+				break;
+			}
+			default:
+				return -1;
+			}
+		}
+		if (f->tag == mainindex && !f->array) {
+			// This tag is marked, save the value to key_index
+			lua_pushvalue(L, -1);
+			lua_replace(L, key_index);
+		}
+		lua_settable(L, result);
+	}
+	return total - size;
+}
+
+/*
+	lightuserdata sproto_type
+	string source	/  (lightuserdata , integer)
+	return table
+ */
+static int
+ldecode_table(lua_State *L) {
+	struct sproto_type * st = lua_touserdata(L, 1);
+	const void * buffer;
+	struct type_plan * p;
+	int result;
+	size_t sz;
+	int r;
+
+	// struct sproto
+	if (st == NULL) {
+		return luaL_argerror(L, 1, "Need a sproto_type object");
+	}
+	sz = 0;
+	buffer = getbuffer(L, 2, &sz);
+	if (!lua_istable(L, -1)) {
+		lua_newtable(L);
+	}
+	result = lua_gettop(L);
+	p = push_plan(L, lua_upvalueindex(1), lua_upvalueindex(2), st);
+	lua_getuservalue(L, -1);
+	r = decode_table(L, p, result + 2, buffer, (int)sz, result, 0, -1, 0);
+	if (r < 0) {
+		return luaL_error(L, "decode error");
+	}
+	lua_settop(L, result);
+	lua_pushinteger(L, r);
+	return 2;
+}
+
+static void
+new_plancache(lua_State *L) {
+	struct plan_cache *c = lua_newuserdata(L, sizeof(*c));
+	memset(c, 0, sizeof(*c));
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
+	lua_pushvalue(L, -1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &plan_cache);
+}
+
 static int
 ldumpproto(lua_State *L) {
 	struct sproto * sp = lua_touserdata(L, 1);
@@ -474,19 +1291,22 @@ ldumpproto(lua_State *L) {
 	string source	/  (lightuserdata , integer)
 	return string
  */
+typedef int (*pack_func)(const void * src, int srcsz, void * buffer, int bufsz);
+
 static int
-lpack(lua_State *L) {
+pack_with(lua_State *L, pack_func pack) {
 	size_t sz=0;
 	const void * buffer = getbuffer(L, 1, &sz);
-	// the worst-case space overhead of packing is 2 bytes per 2 KiB of input (256 words = 2KiB).
-	size_t maxsz = (sz + 2047) / 2048 * 2 + sz;
+	// the worst-case space overhead of packing is 2 bytes per 2 KiB of input (256 words = 2KiB),
+	// and 2 bytes more for the padding of the last word (6 bytes in a 0xff run are packed into 8 bytes).
+	size_t maxsz = (sz + 2047) / 2048 * 2 + sz + 2;
 	void * output = lua_touserdata(L, lua_upvalueindex(1));
 	int bytes;
 	int osz = lua_tointeger(L, lua_upvalueindex(2));
 	if (osz < maxsz) {
 		output = expand_buffer(L, osz, maxsz);
 	}
-	bytes = sproto_pack(buffer, sz, output, maxsz);
+	bytes = pack(buffer, sz, output, maxsz);
 	if (bytes > maxsz) {
 		return luaL_error(L, "packing error, return size = %d", bytes);
 	}
@@ -496,17 +1316,27 @@ lpack(lua_State *L) {
 }
 
 static int
-lunpack(lua_State *L) {
+lpack(lua_State *L) {
+	return pack_with(L, sproto_pack);
+}
+
+static int
+lpack_scalar(lua_State *L) {
+	return pack_with(L, sproto_pack_scalar);
+}
+
+static int
+unpack_with(lua_State *L, pack_func unpack) {
 	size_t sz=0;
 	const void * buffer = getbuffer(L, 1, &sz);
 	void * output = lua_touserdata(L, lua_upvalueindex(1));
 	int osz = lua_tointeger(L, lua_upvalueindex(2));
-	int r = sproto_unpack(buffer, sz, output, osz);
+	int r = unpack(buffer, sz, output, osz);
 	if (r < 0)
 		return luaL_error(L, "Invalid unpack stream");
 	if (r > osz) {
 		output = expand_buffer(L, osz, r);
-		r = sproto_unpack(buffer, sz, output, r);
+		r = unpack(buffer, sz, output, r);
 		if (r < 0)
 			return luaL_error(L, "Invalid unpack stream");
 	}
@@ -514,6 +1344,16 @@ lunpack(lua_State *L) {
 	return 1;
 }
 
+static int
+lunpack(lua_State *L) {
+	return unpack_with(L, sproto_unpack);
+}
+
+static int
+lunpack_scalar(lua_State *L) {
+	return unpack_with(L, sproto_unpack_scalar);
+}
+
 static void
 pushfunction_withbuffer(lua_State *L, const char * name, lua_CFunction func) {
 	lua_newuserdata(L, ENCODE_BUFFERSIZE);
@@ -686,7 +1526,8 @@ luaopen_sproto_core(lua_State *L) {
 
 		// decodes a message string generated by sproto.encode with type.
 		// 将 sproto.encode 编码后的字符串解码出来.
-		{ "decode", ldecode },
+		// 原来基于回调的解码, 用于对比测试
+		{ "decode_callback", ldecode },
 		
 		{ "protocol", lprotocol },
 		{ "loadproto", lloadproto },
@@ -696,9 +1537,23 @@ luaopen_sproto_core(lua_State *L) {
 	};
 	luaL_newlib(L,l);
 
+	new_plancache(L);
+	lua_getuservalue(L, -1);
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, ldecode_table, 2);
+	lua_setfield(L, -4, "decode");
+
 	// encodes a lua table by a type object, and generates a string message.
 	// 将 1 个 table 通过类型对象编码, 然后返回 1 个字符串消息.
-	pushfunction_withbuffer(L, "encode", lencode);
+	lua_newuserdata(L, ENCODE_BUFFERSIZE);
+	lua_pushinteger(L, ENCODE_BUFFERSIZE);
+	lua_pushvalue(L, -4);
+	lua_pushvalue(L, -4);
+	lua_pushcclosure(L, lencode_table, 4);
+	lua_setfield(L, -4, "encode");
+	lua_pop(L, 2);
+	pushfunction_withbuffer(L, "encode_callback", lencode);
 
 	// packs a string encoded by sproto.encode to reduce the size.
 	// 压缩经过 sproto.encode 编码后的数据, 以减少数据容量.
@@ -707,5 +1562,9 @@ luaopen_sproto_core(lua_State *L) {
 	// unpacks the string packed by sproto.pack.
 	// 将通过 sproto.pack 压缩后的数据解压出来.
 	pushfunction_withbuffer(L, "unpack", lunpack);
+
+	// 标量版本的 pack/unpack, 输出和向量版本相同, 用于对比测试
+	pushfunction_withbuffer(L, "pack_scalar", lpack_scalar);
+	pushfunction_withbuffer(L, "unpack_scalar", lunpack_scalar);
 	return 1;
 }
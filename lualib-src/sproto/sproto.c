@@ -22,6 +22,7 @@ struct field {
 
 struct sproto_type {
 	const char * name;
+	struct sproto * owner;
 	int n;
 	int base;
 	int maxn;
@@ -272,6 +273,7 @@ import_type(struct sproto *s, struct sproto_type *t, const uint8_t * stream) {
 	int n;
 	int maxn;
 	int last;
+	t->owner = s;
 	stream += SIZEOF_LENGTH;
 	result = stream + sz;
 	fn = struct_field(stream, sz);
@@ -580,6 +582,33 @@ sproto_name(struct sproto_type * st) {
 	return st->name;
 }
 
+const struct sproto *
+sproto_owner(const struct sproto_type *st) {
+	return st->owner;
+}
+
+int
+sproto_fieldn(const struct sproto_type *st, int *maxn) {
+	if (maxn)
+		*maxn = st->maxn;
+	return st->n;
+}
+
+int
+sproto_field(const struct sproto_type *st, int index, struct sproto_field *field) {
+	struct field *f;
+	if (index < 0 || index >= st->n)
+		return -1;
+	f = &st->f[index];
+	field->name = f->name;
+	field->tag = f->tag;
+	field->type = f->type & ~SPROTO_TARRAY;
+	field->array = (f->type & SPROTO_TARRAY) != 0;
+	field->st = f->st;
+	field->key = f->key;
+	return 0;
+}
+
 static struct field *
 findtag(const struct sproto_type *st, int tag) {
 	int begin, end;
@@ -1144,6 +1173,336 @@ sproto_decode(const struct sproto_type *st, const void * data, int size, sproto_
 	return total - size;
 }
 
+/*
+	0 pack 的向量化实现.
+	每 8 字节为 1 段, 段头的每一位表示对应字节是否非 0, 后面跟随非 0 的字节.
+	向量版本用 SIMD 比较得到段头 (零字节位图), 再按段头查表, 用 1 次 shuffle 完成压缩 (或解压时的展开).
+	连续的满段 (0xff 段) 的状态处理仍然使用标量代码, 向量版本只负责:
+		pack_sparse : 连续处理不会开始 0xff 段的段 (非 0 字节少于 8 个)
+		pack_dense : 统计 0xff 段之后可以合并的段 (非 0 字节不少于 6 个)
+		unpack : 连续展开普通段, 遇到 0xff 段时返回
+	向量版本在运行时根据 CPU 选择 (x86 : AVX2 / SSSE3, aarch64 : NEON), 不支持时使用标量版本.
+	定义 SPROTO_NOSIMD 可以关闭向量版本.
+ */
+
+#if !defined(SPROTO_NOSIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPROTO_SIMD_X86
+#include <immintrin.h>
+#elif !defined(SPROTO_NOSIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#define SPROTO_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(SPROTO_SIMD_X86) || defined(SPROTO_SIMD_NEON)
+
+// 编译期生成的查找表
+#define POP8(x) (((x)&1) + (((x)>>1)&1) + (((x)>>2)&1) + (((x)>>3)&1) + (((x)>>4)&1) + (((x)>>5)&1) + (((x)>>6)&1) + (((x)>>7)&1))
+// 段头 h 的第 0 ~ i 位中 1 的个数
+#define POPTO(h,i) POP8((h) & ((2<<(i))-1))
+// 压缩: 输出的第 j 个字节来自输入的第几个字节 (第 j 个非 0 字节的位置)
+#define CIDX(h,j) ((POPTO(h,0)<=(j)) + (POPTO(h,1)<=(j)) + (POPTO(h,2)<=(j)) + (POPTO(h,3)<=(j)) + \
+	(POPTO(h,4)<=(j)) + (POPTO(h,5)<=(j)) + (POPTO(h,6)<=(j)) + (POPTO(h,7)<=(j)))
+// 展开: 输出的第 i 个字节来自输入的第几个字节, 0x80 表示填 0
+#define EIDX(h,i) ((((h)>>(i))&1) ? POP8((h) & ((1<<(i))-1)) : 0x80)
+
+#define CROW(h) { CIDX(h,0), CIDX(h,1), CIDX(h,2), CIDX(h,3), CIDX(h,4), CIDX(h,5), CIDX(h,6), CIDX(h,7) }
+#define EROW(h) { EIDX(h,0), EIDX(h,1), EIDX(h,2), EIDX(h,3), EIDX(h,4), EIDX(h,5), EIDX(h,6), EIDX(h,7) }
+#define PROW(h) POP8(h)
+
+#define REP4(M,h) M(h), M((h)+1), M((h)+2), M((h)+3)
+#define REP16(M,h) REP4(M,h), REP4(M,(h)+4), REP4(M,(h)+8), REP4(M,(h)+12)
+#define REP64(M,h) REP16(M,h), REP16(M,(h)+16), REP16(M,(h)+32), REP16(M,(h)+48)
+#define REP256(M) REP64(M,0), REP64(M,64), REP64(M,128), REP64(M,192)
+
+static const uint8_t pack_compress[256][8] = { REP256(CROW) };
+static const uint8_t pack_expand[256][8] = { REP256(EROW) };
+static const uint8_t pack_popcount[256] = { REP256(PROW) };
+
+struct pack_simd {
+	// 返回处理的段数, *bytes 为写入的字节数. 遇到满段或者 buffer 剩余空间不足时停止
+	int (*sparse)(const uint8_t *src, int nseg, uint8_t *buffer, int bufsz, int *bytes);
+	// 返回开头的非 0 字节不少于 6 个的段数, 最多 nseg 个
+	int (*dense)(const uint8_t *src, int nseg);
+	// 返回写入的字节数, *used 为读取的字节数. 遇到 0xff 段或者数据不足 1 个完整的段时停止
+	int (*unpack)(const uint8_t *src, int srcsz, uint8_t *buffer, int bufsz, int *used);
+};
+
+#endif
+
+#ifdef SPROTO_SIMD_X86
+
+__attribute__((target("ssse3")))
+static inline int
+header_ssse3(__m128i v) {
+	return ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & 0xffff;
+}
+
+// AVX2 版本用这两个函数处理剩下的段, 需要内联到 AVX2 的代码中, 避免 SSE/AVX 切换的开销
+__attribute__((target("ssse3"), always_inline))
+static inline int
+pack_sparse_ssse3(const uint8_t *src, int nseg, uint8_t *buffer, int bufsz, int *bytes) {
+	uint8_t * start = buffer;
+	int i = 0;
+	// 每次处理 2 段, 每段最多写入 9 字节
+	while (i + 2 <= nseg && bufsz >= 18) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i*8));
+		int header = header_ssse3(v);
+		int h0 = header & 0xff;
+		int h1 = header >> 8;
+		int n0, n1;
+		__m128i ctrl;
+		if (h0 == 0xff || h1 == 0xff)
+			break;
+		n0 = pack_popcount[h0];
+		n1 = pack_popcount[h1];
+		ctrl = _mm_unpacklo_epi64(
+			_mm_loadl_epi64((const __m128i *)pack_compress[h0]),
+			_mm_loadl_epi64((const __m128i *)pack_compress[h1]));
+		// 第 2 段的下标加 8
+		ctrl = _mm_add_epi8(ctrl, _mm_set_epi32(0x08080808, 0x08080808, 0, 0));
+		v = _mm_shuffle_epi8(v, ctrl);
+		buffer[0] = h0;
+		_mm_storel_epi64((__m128i *)(buffer + 1), v);
+		buffer += n0 + 1;
+		buffer[0] = h1;
+		_mm_storel_epi64((__m128i *)(buffer + 1), _mm_srli_si128(v, 8));
+		buffer += n1 + 1;
+		bufsz -= n0 + n1 + 2;
+		i += 2;
+	}
+	while (i < nseg && bufsz >= 9) {
+		__m128i v = _mm_loadl_epi64((const __m128i *)(src + i*8));
+		int header = header_ssse3(v) & 0xff;
+		int n;
+		if (header == 0xff)
+			break;
+		n = pack_popcount[header];
+		buffer[0] = header;
+		_mm_storel_epi64((__m128i *)(buffer + 1),
+			_mm_shuffle_epi8(v, _mm_loadl_epi64((const __m128i *)pack_compress[header])));
+		buffer += n + 1;
+		bufsz -= n + 1;
+		++i;
+	}
+	*bytes = buffer - start;
+	return i;
+}
+
+__attribute__((target("ssse3"), always_inline))
+static inline int
+pack_dense_ssse3(const uint8_t *src, int nseg) {
+	int i = 0;
+	while (i + 2 <= nseg) {
+		int zero = ~header_ssse3(_mm_loadu_si128((const __m128i *)(src + i*8))) & 0xffff;
+		if (pack_popcount[zero & 0xff] > 2)
+			return i;
+		if (pack_popcount[zero >> 8] > 2)
+			return i + 1;
+		i += 2;
+	}
+	if (i < nseg) {
+		int zero = ~header_ssse3(_mm_loadl_epi64((const __m128i *)(src + i*8))) & 0xff;
+		if (pack_popcount[zero] <= 2)
+			++i;
+	}
+	return i;
+}
+
+__attribute__((target("ssse3")))
+static int
+unpack_ssse3(const uint8_t *src, int srcsz, uint8_t *buffer, int bufsz, int *used) {
+	const uint8_t * start = src;
+	int size = 0;
+	// 段头加上最多 8 个字节, 保证 8 字节的读取不会越界
+	while (srcsz >= 9 && bufsz >= 8) {
+		int header = src[0];
+		int n;
+		if (header == 0xff)
+			break;
+		n = pack_popcount[header];
+		_mm_storel_epi64((__m128i *)buffer,
+			_mm_shuffle_epi8(_mm_loadl_epi64((const __m128i *)(src + 1)),
+				_mm_loadl_epi64((const __m128i *)pack_expand[header])));
+		src += n + 1;
+		srcsz -= n + 1;
+		buffer += 8;
+		bufsz -= 8;
+		size += 8;
+	}
+	*used = src - start;
+	return size;
+}
+
+__attribute__((target("avx2")))
+static int
+pack_sparse_avx2(const uint8_t *src, int nseg, uint8_t *buffer, int bufsz, int *bytes) {
+	uint8_t * start = buffer;
+	int i = 0;
+	int tail;
+	// 每次处理 4 段
+	while (i + 4 <= nseg && bufsz >= 36) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i*8));
+		uint32_t header = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+		int h0 = header & 0xff;
+		int h1 = (header >> 8) & 0xff;
+		int h2 = (header >> 16) & 0xff;
+		int h3 = header >> 24;
+		__m256i ctrl;
+		__m128i lo, hi;
+		if (h0 == 0xff || h1 == 0xff || h2 == 0xff || h3 == 0xff)
+			break;
+		ctrl = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_unpacklo_epi64(
+				_mm_loadl_epi64((const __m128i *)pack_compress[h0]),
+				_mm_loadl_epi64((const __m128i *)pack_compress[h1]))),
+			_mm_unpacklo_epi64(
+				_mm_loadl_epi64((const __m128i *)pack_compress[h2]),
+				_mm_loadl_epi64((const __m128i *)pack_compress[h3])), 1);
+		// shuffle 在每 128 位内进行, 每个 128 位中第 2 段的下标加 8
+		ctrl = _mm256_add_epi8(ctrl, _mm256_set_epi32(0x08080808, 0x08080808, 0, 0, 0x08080808, 0x08080808, 0, 0));
+		v = _mm256_shuffle_epi8(v, ctrl);
+		lo = _mm256_castsi256_si128(v);
+		hi = _mm256_extracti128_si256(v, 1);
+		buffer[0] = h0;
+		_mm_storel_epi64((__m128i *)(buffer + 1), lo);
+		buffer += pack_popcount[h0] + 1;
+		buffer[0] = h1;
+		_mm_storel_epi64((__m128i *)(buffer + 1), _mm_srli_si128(lo, 8));
+		buffer += pack_popcount[h1] + 1;
+		buffer[0] = h2;
+		_mm_storel_epi64((__m128i *)(buffer + 1), hi);
+		buffer += pack_popcount[h2] + 1;
+		buffer[0] = h3;
+		_mm_storel_epi64((__m128i *)(buffer + 1), _mm_srli_si128(hi, 8));
+		buffer += pack_popcount[h3] + 1;
+		bufsz = bufsz - (pack_popcount[h0] + pack_popcount[h1] + pack_popcount[h2] + pack_popcount[h3] + 4);
+		i += 4;
+	}
+	i += pack_sparse_ssse3(src + i*8, nseg - i, buffer, bufsz, &tail);
+	*bytes = buffer - start + tail;
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int
+pack_dense_avx2(const uint8_t *src, int nseg) {
+	int i = 0;
+	while (i + 4 <= nseg) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i*8));
+		uint32_t zero = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+		if (pack_popcount[zero & 0xff] > 2 || pack_popcount[(zero >> 8) & 0xff] > 2 ||
+			pack_popcount[(zero >> 16) & 0xff] > 2 || pack_popcount[zero >> 24] > 2)
+			break;
+		i += 4;
+	}
+	return i + pack_dense_ssse3(src + i*8, nseg - i);
+}
+
+static const struct pack_simd PACK_SSSE3 = { pack_sparse_ssse3, pack_dense_ssse3, unpack_ssse3 };
+static const struct pack_simd PACK_AVX2 = { pack_sparse_avx2, pack_dense_avx2, unpack_ssse3 };
+
+static const struct pack_simd *
+detect_simd(void) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &PACK_AVX2;
+	if (__builtin_cpu_supports("ssse3"))
+		return &PACK_SSSE3;
+	return NULL;
+}
+
+// 只在第一次调用时检测 CPU, 之后直接用缓存的结果. 多线程同时检测得到的结果相同, 重复写入无害.
+static const struct pack_simd *
+pack_simd(void) {
+	static int detected = 0;
+	static const struct pack_simd * simd = NULL;
+	if (!__atomic_load_n(&detected, __ATOMIC_ACQUIRE)) {
+		simd = detect_simd();
+		__atomic_store_n(&detected, 1, __ATOMIC_RELEASE);
+	}
+	return simd;
+}
+
+#elif defined(SPROTO_SIMD_NEON)
+
+static inline int
+header_neon(uint8x8_t v) {
+	static const uint8_t bits[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	return vaddv_u8(vand_u8(vtst_u8(v, v), vld1_u8(bits)));
+}
+
+static int
+pack_sparse_neon(const uint8_t *src, int nseg, uint8_t *buffer, int bufsz, int *bytes) {
+	uint8_t * start = buffer;
+	int i = 0;
+	while (i < nseg && bufsz >= 9) {
+		uint8x8_t v = vld1_u8(src + i*8);
+		int header = header_neon(v);
+		int n;
+		if (header == 0xff)
+			break;
+		n = pack_popcount[header];
+		buffer[0] = header;
+		vst1_u8(buffer + 1, vtbl1_u8(v, vld1_u8(pack_compress[header])));
+		buffer += n + 1;
+		bufsz -= n + 1;
+		++i;
+	}
+	*bytes = buffer - start;
+	return i;
+}
+
+static int
+pack_dense_neon(const uint8_t *src, int nseg) {
+	int i;
+	for (i=0;i<nseg;i++) {
+		int header = header_neon(vld1_u8(src + i*8));
+		if (pack_popcount[header] < 6)
+			break;
+	}
+	return i;
+}
+
+static int
+unpack_neon(const uint8_t *src, int srcsz, uint8_t *buffer, int bufsz, int *used) {
+	const uint8_t * start = src;
+	int size = 0;
+	while (srcsz >= 9 && bufsz >= 8) {
+		int header = src[0];
+		int n;
+		if (header == 0xff)
+			break;
+		n = pack_popcount[header];
+		// vtbl1_u8 的下标超出范围时得到 0
+		vst1_u8(buffer, vtbl1_u8(vld1_u8(src + 1), vld1_u8(pack_expand[header])));
+		src += n + 1;
+		srcsz -= n + 1;
+		buffer += 8;
+		bufsz -= 8;
+		size += 8;
+	}
+	*used = src - start;
+	return size;
+}
+
+static const struct pack_simd PACK_NEON = { pack_sparse_neon, pack_dense_neon, unpack_neon };
+
+static const struct pack_simd *
+pack_simd(void) {
+	return &PACK_NEON;
+}
+
+#else
+
+struct pack_simd;
+
+static const struct pack_simd *
+pack_simd(void) {
+	return NULL;
+}
+
+#endif
+
 // 0 pack
 
 static int
@@ -1197,8 +1556,8 @@ write_ff(const uint8_t * src, uint8_t * des, int n) {
 	}
 }
 
-int
-sproto_pack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
+static int
+pack(const void * srcv, int srcsz, void * bufferv, int bufsz, const struct pack_simd *simd) {
 	uint8_t tmp[8];
 	int i;
 	const uint8_t * ff_srcstart = NULL;
@@ -1210,6 +1569,28 @@ sproto_pack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
 	for (i=0;i<srcsz;i+=8) {
 		int n;
 		int padding = i+8 - srcsz;
+#if defined(SPROTO_SIMD_X86) || defined(SPROTO_SIMD_NEON)
+		if (simd && padding <= 0) {
+			int nseg = (srcsz - i) / 8;
+			int seg;
+			if (ff_n == 0) {
+				seg = simd->sparse(src, nseg, buffer, bufsz, &n);
+			} else {
+				// 合并到 0xff 段中, 第 256 段交给标量代码处理
+				seg = simd->dense(src, nseg < 255 - ff_n ? nseg : 255 - ff_n);
+				ff_n += seg;
+				n = seg * 8;
+			}
+			if (seg > 0) {
+				bufsz -= n;
+				src += seg * 8;
+				buffer += n;
+				size += n;
+				i += seg * 8 - 8;
+				continue;
+			}
+		}
+#endif
 		if (padding > 0) {
 			int j;
 			memcpy(tmp, src, 8-padding);
@@ -1255,12 +1636,36 @@ sproto_pack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
 }
 
 int
-sproto_unpack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
+sproto_pack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
+	return pack(srcv, srcsz, bufferv, bufsz, pack_simd());
+}
+
+int
+sproto_pack_scalar(const void * srcv, int srcsz, void * bufferv, int bufsz) {
+	return pack(srcv, srcsz, bufferv, bufsz, NULL);
+}
+
+static int
+unpack(const void * srcv, int srcsz, void * bufferv, int bufsz, const struct pack_simd *simd) {
 	const uint8_t * src = srcv;
 	uint8_t * buffer = bufferv;
 	int size = 0;
 	while (srcsz > 0) {
-		uint8_t header = src[0];
+		uint8_t header;
+#if defined(SPROTO_SIMD_X86) || defined(SPROTO_SIMD_NEON)
+		if (simd) {
+			int used;
+			int n = simd->unpack(src, srcsz, buffer, bufsz, &used);
+			src += used;
+			srcsz -= used;
+			buffer += n;
+			bufsz -= n;
+			size += n;
+			if (srcsz <= 0)
+				break;
+		}
+#endif
+		header = src[0];
 		--srcsz;
 		++src;
 		if (header == 0xff) {
@@ -1307,3 +1712,13 @@ sproto_unpack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
 	}
 	return size;
 }
+
+int
+sproto_unpack(const void * srcv, int srcsz, void * bufferv, int bufsz) {
+	return unpack(srcv, srcsz, bufferv, bufsz, pack_simd());
+}
+
+int
+sproto_unpack_scalar(const void * srcv, int srcsz, void * bufferv, int bufsz) {
+	return unpack(srcv, srcsz, bufferv, bufsz, NULL);
+}
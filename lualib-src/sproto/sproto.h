@@ -26,6 +26,9 @@ struct sproto_type * sproto_type(const struct sproto *, const char * type_name);
 
 int sproto_pack(const void * src, int srcsz, void * buffer, int bufsz);
 int sproto_unpack(const void * src, int srcsz, void * buffer, int bufsz);
+// scalar version of sproto_pack/sproto_unpack, the output is the same. for test use
+int sproto_pack_scalar(const void * src, int srcsz, void * buffer, int bufsz);
+int sproto_unpack_scalar(const void * src, int srcsz, void * buffer, int bufsz);
 
 struct sproto_arg {
 	void *ud;
@@ -44,6 +47,24 @@ typedef int (*sproto_callback)(const struct sproto_arg *args);
 int sproto_decode(const struct sproto_type *, const void * data, int size, sproto_callback cb, void *ud);
 int sproto_encode(const struct sproto_type *, void * buffer, int size, sproto_callback cb, void *ud);
 
+// field layout of a type, for the codec which walks lua table directly (see lsproto.c)
+// 类型的字段布局, 字段按 tag 从小到大排列.
+struct sproto_field {
+	const char *name;
+	int tag;
+	int type;	// SPROTO_TINTEGER ... SPROTO_TSTRUCT
+	int array;
+	struct sproto_type *st;	// for SPROTO_TSTRUCT
+	int key;	// main index tag for map, -1 for none
+};
+
+// returns the sproto which the type belongs to
+const struct sproto * sproto_owner(const struct sproto_type *);
+
+// returns the number of fields, *maxn is the max number of records in the encoded header
+int sproto_fieldn(const struct sproto_type *, int *maxn);
+int sproto_field(const struct sproto_type *, int index, struct sproto_field *field);
+
 // for debug use
 void sproto_dump(struct sproto *);
 const char * sproto_name(struct sproto_type *);
@@ -1,11 +1,13 @@
 local skynet = require "skynet"
+local core = require "cluster.core"
 
 local clusterd
+local transport	-- service_cluster.c, 直接把请求交给它打包发送
 local cluster = {}
 
 function cluster.call(node, address, ...)
-	-- skynet.pack(...) will free by cluster.core.packrequest
-	return skynet.call(clusterd, "lua", "req", node, address, skynet.pack(...))
+	-- skynet.pack(...) will be reused by cluster.core.packforward
+	return skynet.unpack(skynet.rawcall(transport, "lua", core.packforward(node, address, skynet.pack(...))))
 end
 
 function cluster.open(port)
@@ -40,11 +42,12 @@ function cluster.register(name, addr)
 end
 
 function cluster.query(node, name)
-	return skynet.call(clusterd, "lua", "req", node, 0, skynet.pack(name))
+	return skynet.unpack(skynet.rawcall(transport, "lua", core.packforward(node, 0, skynet.pack(name))))
 end
 
 skynet.init(function()
 	clusterd = skynet.uniqueservice("clusterd")
+	transport = skynet.call(clusterd, "lua", "transport")
 end)
 
 return cluster
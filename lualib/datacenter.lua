@@ -6,8 +6,9 @@ local datacenter = {}
 
 -- datacenter.get(key1, key2, ...) 从 key1.key2 读一个值。
 -- 这个 api 至少需要一个参数，如果传入多个参数，则用来读出树的一个分支。
+-- 读取的是本节点的缓存服务 (datacentercache), 只有第一次读取需要访问 master 节点, 之后的更新由 datacenterd 通知缓存失效.
 function datacenter.get(...)
-	return skynet.call("DATACENTER", "lua", "QUERY", ...)
+	return skynet.call(".datacenter", "lua", "QUERY", ...)
 end
 
 -- datacenter.set(key1, key2, ... , value) 可以向 key1.key2 设置一个值 value 。
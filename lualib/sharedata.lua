@@ -28,14 +28,37 @@ function sharedata.query(name)
 	return r
 end
 
-function sharedata.new(name, v)
-	skynet.call(service, "lua", "new", name, v)
+-- indexes 是可选的排序索引 { { path, field }, ... }, 在转换时一次性建好, 之后可以用 lower_bound / range 做范围查询.
+-- path 是从根节点到目标 table 的 key 数组 (nil 表示根节点), field 为 nil 时按照目标 table 的 key 排序,
+-- 否则按照目标 table 中每个元素的 field 字段排序. 例如 { { {"items"}, "price" }, { {"levels"} } }
+function sharedata.new(name, v, indexes)
+	skynet.call(service, "lua", "new", name, v, indexes)
 end
 
-function sharedata.update(name, v)
-	skynet.call(service, "lua", "update", name, v)
+-- 把 name 对应的数据保存为 image 文件. 之后 sharedata.new/update 传入 "@filename" 时直接 mmap 这个文件,
+-- 同一台机器上的多个进程共享这些内存页. filename 需要以 .image 结尾.
+function sharedata.save(name, filename)
+	skynet.call(service, "lua", "save", name, filename)
 end
 
+-- indexes 为 nil 时沿用之前的索引
+function sharedata.update(name, v, indexes)
+	skynet.call(service, "lua", "update", name, v, indexes)
+end
+
+-- 增量更新, changes 是 { { path, value }, ... }, 例如 { { {"list", 5, "price"}, 100 }, { {"removed"} } }
+-- path 是 key 的数组, value 为 nil 表示删除. 没有变化的子表在新旧版本之间共享.
+function sharedata.patch(name, changes)
+	skynet.call(service, "lua", "patch", name, changes)
+end
+
+-- obj 是 sharedata.query 返回的对象或者它的子表. 返回第一个 field 字段不小于 value 的元素 key, obj[key], 排序值
+sharedata.lower_bound = sd.lower_bound
+
+-- for key, value, sortkey in sharedata.range(obj, field, lo, hi) do ... end
+-- 按 field 字段从小到大遍历 lo <= field <= hi 的元素, lo, hi 为 nil 表示不限
+sharedata.range = sd.range
+
 function sharedata.delete(name)
 	skynet.call(service, "lua", "delete", name)
 end
@@ -8,10 +8,16 @@ local conf = {}
 conf.host = {
 	new = core.new,
 	delete = core.delete,
+	save = core.save,
+	load = core.load,
+	ispatched = core.ispatched,
+	index = core.index,
+	nextkey = core.nextkey,
 	getref = core.getref,
 	markdirty = core.markdirty,
 	incref = core.incref,
 	decref = core.decref,
+	stringquota = core.stringquota,
 }
 
 local meta = {}
@@ -20,25 +26,34 @@ local isdirty = core.isdirty
 local index = core.index
 local needupdate = core.needupdate
 local len = core.len
+local lowerbound = core.lowerbound
+local sorted = core.sorted
 
-local function findroot(self)
-	while self.__parent do
-		self = self.__parent
+-- 新版本中已经不存在的子表, 连同它缓存的子表一起失效
+local function detach(node)
+	node.__root = false
+	local children = rawget(node, "__cache")
+	if children then
+		for k,v in pairs(children) do
+			detach(v)
+		end
 	end
-	return self
 end
 
-local function update(root, cobj, gcobj)
-	root.__obj = cobj
-	root.__gcobj = gcobj
-	local children = root.__cache
+-- 只有根节点保存 gcobj. 增量更新时没有变化的子表在新旧版本之间共享, 指针相同, 不需要继续向下刷新.
+local function update(node, cobj)
+	node.__obj = cobj
+	local children = rawget(node, "__cache")
 	if children then
 		for k,v in pairs(children) do
 			local pointer = index(cobj, k)
-			if type(pointer) == "userdata" then
-				update(v, pointer, gcobj)
-			else
-				children[k] = nil
+			if pointer ~= v.__obj then
+				if type(pointer) == "userdata" then
+					update(v, pointer)
+				else
+					children[k] = nil
+					detach(v)
+				end
 			end
 		end
 	end
@@ -54,27 +69,29 @@ local function genkey(self)
 end
 
 local function getcobj(self)
-	local obj = self.__obj
-	if isdirty(obj) then
-		local newobj, newtbl = needupdate(self.__gcobj)
+	local root = self.__root
+	if not root then
+		error ("The key [" .. genkey(self) .. "] doesn't exist after update")
+	end
+	local gcobj = root.__gcobj
+	if isdirty(gcobj) then
+		local newobj, newtbl = needupdate(gcobj)
 		if newobj then
-			local newgcobj = newtbl.__gcobj
-			local root = findroot(self)
-			update(root, newobj, newgcobj)
-			if obj == self.__obj then
+			root.__gcobj = newtbl.__gcobj
+			update(root, newobj)
+			if not self.__root then
 				error ("The key [" .. genkey(self) .. "] doesn't exist after update")
 			end
-			obj = self.__obj
 		end
 	end
-	return obj
+	return self.__obj
 end
 
 function meta:__index(key)
 	local obj = getcobj(self)
 	local v = index(obj, key)
 	if type(v) == "userdata" then
-		local children = self.__cache
+		local children = rawget(self, "__cache")
 		if children == nil then
 			children = {}
 			self.__cache = children
@@ -85,7 +102,7 @@ function meta:__index(key)
 		end
 		r = setmetatable({
 			__obj = v,
-			__gcobj = self.__gcobj,
+			__root = self.__root,
 			__parent = self,
 			__key = key,
 		}, meta)
@@ -112,19 +129,52 @@ function conf.next(obj, key)
 	end
 end
 
+-- 排序索引, 见 sharedata.new 的 indexes 参数. field 为 nil 时使用按 key 排序的索引.
+-- 返回第一个排序值不小于 value 的元素 key, obj[key], 排序值
+function conf.lower_bound(obj, field, value)
+	local cobj = getcobj(obj)
+	local pos = lowerbound(cobj, field, value)
+	if pos then
+		local sortkey, key = sorted(cobj, field, pos)
+		return key, obj[key], sortkey
+	end
+end
+
+-- 按排序值从小到大遍历 lo <= 排序值 <= hi 的元素 (lo, hi 为 nil 表示不限), 每次返回 key, obj[key], 排序值.
+-- 遍历的顺序固定在开始时的版本.
+function conf.range(obj, field, lo, hi)
+	local cobj = getcobj(obj)
+	local gcobj = obj.__root.__gcobj	-- 持有开始时的版本, 遍历期间不会被释放
+	local pos = lowerbound(cobj, field, lo)
+	return function()
+		if pos == nil then
+			return
+		end
+		local sortkey, key = sorted(cobj, field, pos)
+		if sortkey == nil or (hi ~= nil and sortkey > hi) then
+			pos = nil
+			gcobj = nil
+			return
+		end
+		pos = pos + 1
+		return key, obj[key], sortkey
+	end
+end
+
 function conf.box(obj)
 	local gcobj = core.box(obj)
-	return setmetatable({
+	local root = setmetatable({
 		__parent = false,
 		__obj = obj,
 		__gcobj = gcobj,
 		__key = "",
 	} , meta)
+	root.__root = root
+	return root
 end
 
 function conf.update(self, pointer)
-	local cobj = self.__obj
-	assert(isdirty(cobj), "Only dirty object can be update")
+	assert(isdirty(self.__gcobj), "Only dirty object can be update")
 	core.update(self.__gcobj, pointer, { __gcobj = core.box(pointer) })
 end
 
@@ -498,6 +498,9 @@ function skynet.time()
 	return skynet.now() / 100 + skynet.starttime()	-- get now first would be better
 end
 
+-- 返回单调时钟的纳秒数, 只用于计算时间间隔。
+skynet.hpc = c.hpc
+
 -- 用于退出当前的服务。skynet.exit 之后的代码都不会被运行。而且，当前服务被阻塞住的 coroutine 也会立刻中断退出。
 -- 这些通常是一些 RPC 尚未收到回应。所以调用 skynet.exit() 请务必小心。
 -- 关闭了当前的服务, 所以对于之前请求的消息, 将以 PTYPE_ERROR 的类型返回给消息源.
@@ -563,6 +566,12 @@ function skynet.send(addr, typename, ...)
 	return c.send(addr, p.id, 0, p.pack(...))
 end
 
+-- 与 skynet.send 功能类似, 但发送时不经过 pack 打包流程, msg 可以是字符串, lightuserdata 加 sz, 或者 skynet.unpackview 返回的视图。
+function skynet.rawsend(addr, typename, msg, sz)
+	local p = proto[typename]
+	return c.send(addr, p.id, 0, msg, sz)
+end
+
 -- 生成一个唯一 session 号。
 skynet.genid = assert(c.genid)
 
@@ -575,6 +584,8 @@ end
 skynet.pack = assert(c.pack)
 skynet.packstring = assert(c.packstring)
 skynet.unpack = assert(c.unpack)
+-- 惰性解包, 返回一个视图, 访问字段时才解析; 视图可以直接作为 skynet.rawsend/skynet.rawcall/skynet.ret 的消息转发
+skynet.unpackview = assert(c.unpackview)
 skynet.tostring = assert(c.tostring)
 skynet.trash = assert(c.trash)
 
@@ -649,6 +660,13 @@ function skynet.dispatch(typename, func)
 	end
 end
 
+-- 将特定类消息改为惰性解包, 之后 dispatch 函数收到的参数是 skynet.unpackview 返回的一个视图, 而不是解包后的一组值。
+-- 适合只读取少量字段就转发整条消息的服务, 视图可以直接作为消息转发。
+function skynet.lazyunpack(typename)
+	local p = assert(proto[typename])
+	p.unpack = skynet.unpackview
+end
+
 -- 打印未知的请求错误, 并抛出错误
 local function unknown_request(session, address, msg, sz, prototype)
 	skynet.error(string.format("Unknown request (%s): %s", prototype, c.tostring(msg,sz)))
@@ -938,6 +956,25 @@ function skynet.mqlen()
 	return c.intcommand "MQLEN"
 end
 
+-- 调整当前服务的 gc 参数, conf 中可以有 pause, stepmul (同 collectgarbage) 和 idle (上个周期完成后新分配多少 KB 开始消息队列空闲时的 gc, 0 表示关闭)
+-- 返回原来的参数
+function skynet.gcconfig(conf)
+	local old = {}
+	if conf.pause then
+		old.pause = collectgarbage("setpause", conf.pause)
+	end
+	if conf.stepmul then
+		old.stepmul = collectgarbage("setstepmul", conf.stepmul)
+	end
+	if conf.idle then
+		old.idle = c.gcidle(conf.idle)
+	end
+	return old
+end
+
+-- 空闲 gc 的统计 { idle = 阈值 KB, steps = 次数, cycles = 完成的周期数, time = 总耗时 ms, max = 单次最长耗时 ms }
+skynet.gcstat = c.gcstat
+
 -- 一个服务中所有被挂起的请求的调用栈, ret 是个 table 类型, 存储栈信息, 返回挂起的请求的调用栈数量
 function skynet.task(ret)
 	local t = 0
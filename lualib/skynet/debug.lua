@@ -17,7 +17,7 @@ return function (skynet, export)
 
 	function dbgcmd.MEM()
 		local kb, bytes = collectgarbage "count"
-		skynet.ret(skynet.pack(kb,bytes))
+		skynet.ret(skynet.pack(kb,bytes,skynet.gcstat()))
 	end
 
 	function dbgcmd.GC()
@@ -25,6 +25,10 @@ return function (skynet, export)
 		collectgarbage "collect"
 	end
 
+	function dbgcmd.GCCONFIG(conf)
+		skynet.ret(skynet.pack(skynet.gcconfig(conf)))
+	end
+
 	function dbgcmd.STAT()
 		local stat = {}
 		stat.mqlen = skynet.mqlen()
@@ -85,8 +85,13 @@ function gateserver.start(handler)
 		maxclient = conf.maxclient or 1024
 		nodelay = conf.nodelay
 		skynet.error(string.format("Listen on %s:%d", address, port))
-		socket = socketdriver.listen(address, port)
+		-- conf.reuseport 为 true 时, 多个 gateserver 可以侦听同一个端口, 组成侦听组
+		socket = socketdriver.listen(address, port, conf.backlog, conf.reuseport)
 		socketdriver.start(socket)
+		-- conf.batch 为 true 时开启批量模式, 一轮 socket 事件合并成一条消息, 由 MSG.batch 处理
+		if conf.batch then
+			socketdriver.batch(true)
+		end
 		if handler.open then
 			return handler.open(source, conf)
 		end
@@ -190,6 +195,16 @@ function gateserver.start(handler)
 		end
 	end
 
+	-- 对应 TYPE_BATCH, 批量模式下一轮 socket 事件合并成的消息
+	-- 完整的数据包已经全部压入 queue, 先派发数据, 再按顺序处理 open/close/error/warning
+	function MSG.batch(events, n)
+		dispatch_queue()
+		for i = 0, n - 1 do
+			local b = i * 3
+			MSG[events[b+1]](events[b+2], events[b+3])
+		end
+	end
+
 	-- 注册 socket 类型的协议, 所以不能和 socket.lua 模块同时使用
 	skynet.register_protocol {
 		name = "socket",
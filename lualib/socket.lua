@@ -198,6 +198,17 @@ socket_message[7] = function(id, size)
 	end
 end
 
+-- SKYNET_SOCKET_TYPE_BATCH = 8
+-- 批量消息, 开启批量模式之后, 一轮事件中发给本服务的所有 socket 消息合并在一起
+-- t 中每 5 个元素对应一条消息, 依次交给对应的处理函数.
+-- 注意: 如果某个处理函数(例如 accept 的回调)阻塞了, 同一批中后面的消息也会等到它恢复之后才处理.
+socket_message[8] = function(n, t)
+	for i = 0, n - 1 do
+		local b = i * 5
+		socket_message[t[b+1]](t[b+2], t[b+3], t[b+4], t[b+5])
+	end
+end
+
 -- 注册 socket 消息类型
 skynet.register_protocol {
 	name = "socket",
@@ -497,18 +508,25 @@ socket.write = assert(driver.send)
 socket.lwrite = assert(driver.lsend)
 socket.header = assert(driver.header)
 
+-- 开启/关闭批量模式, 不传参数时开启.
+-- 开启后通信线程会把一轮事件中发给本服务的所有 socket 消息合并成一条消息, 减少消息数量和回调的次数.
+function socket.batch(enable)
+	driver.batch(enable)
+end
+
 -- 判断 id 对应的 socket 是否无效, 无效返回 true, 否则返回 false
 function socket.invalid(id)
 	return socket_pool[id] == nil
 end
 
 -- 监听一个端口，返回一个 id ，供 start 使用。
-function socket.listen(host, port, backlog)
+-- reuseport 为 true 时开启 SO_REUSEPORT, 多个服务可以监听同一个端口组成监听组, 由内核分摊新的连接。
+function socket.listen(host, port, backlog, reuseport)
 	if port == nil then
 		host, port = string.match(host, "([^:]+):(.+)$")
 		port = tonumber(port)
 	end
-	return driver.listen(host, port, backlog)
+	return driver.listen(host, port, backlog, reuseport)
 end
 
 -- 挂起 id 对应的 socket 所在的 coroutine.
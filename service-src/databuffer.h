@@ -6,6 +6,7 @@
 #include <assert.h>
 
 #define MESSAGEPOOL 1023	// message 缓存的大小
+#define DATABUFFER_DETACH_MIN 256	// 小于这个大小的数据包总是复制, 不交出 socket 读缓冲
 
 // 存储数据的基本单元
 struct message {
@@ -100,6 +101,33 @@ databuffer_read(struct databuffer *db, struct messagepool *mp, void * buffer, in
 	}
 }
 
+/**
+ * 当接下来 sz 大小的数据恰好是 databuffer 当前 message 中剩余的全部数据时, 不再分配内存复制数据,
+ * 而是把数据移动到 message.buffer 的起始位置, 直接交出 message.buffer 的所有权, 由调用者负责释放.
+ * 数据不在同一个 message 中, 或者 message 之后还有其他数据时返回 NULL, 需要使用 databuffer_read 读取.
+ * 数据小于 DATABUFFER_DETACH_MIN 或者不到 message 的一半时也返回 NULL: 复制小数据很便宜,
+ * 交出整块 buffer 会让接收者为一个小包长时间占着整块 socket 读缓冲.
+ */
+static inline void *
+databuffer_detach(struct databuffer *db, struct messagepool *mp, int sz) {
+	assert(db->size >= sz);
+	struct message *current = db->head;
+	if (current->size - db->offset != sz || sz < DATABUFFER_DETACH_MIN || sz < current->size / 2) {
+		return NULL;
+	}
+
+	// message.buffer 是 skynet_malloc 分配的起始地址, 交出之后要能直接 skynet_free, 所以数据需要前移
+	char * buffer = current->buffer;
+	if (db->offset > 0) {
+		memmove(buffer, buffer + db->offset, sz);
+	}
+	current->buffer = NULL;
+	db->offset = 0;
+	db->size -= sz;
+	_return_message(db, mp);
+	return buffer;
+}
+
 /// 将 data 数据存入到 dababuffer 中
 static void
 databuffer_push(struct databuffer *db, struct messagepool *mp, void *data, int sz) {
@@ -0,0 +1,1213 @@
+// cluster 节点之间的传输服务, 作用类似 service_harbor.c, 但是服务于 cluster 节点.
+// 这个服务持有节点之间的所有 socket 连接, 请求和回应的打包, 分帧以及 session 的映射都在 C 中完成,
+// Lua 层只会看到投递过来的请求和返回的回应. 线路协议与 lua-cluster.c 相同.
+//
+// 发起请求: 调用方给当前服务发送 PTYPE_LUA 消息, 消息末尾附带目标地址和节点名 (见 lua-cluster.c 的 packforward).
+//   当前服务分配远端 session, 打包之后写入节点的连接, 记录 远端 session -> (调用方, 调用方的 session),
+//   收到回应之后按 session 以 PTYPE_RESPONSE 或者 PTYPE_ERROR 返回给调用方.
+// 接收请求: 接入的连接收到请求之后, 以 PTYPE_LUA 投递给目标服务 (分配新的 session),
+//   记录 本地 session -> (socket id, 远端 session), 目标服务回应之后打包写回连接.
+//   地址为 0 的请求是名字查询, 以 PTYPE_SYSTEM 交给启动参数指定的服务 (clusterd) 处理.
+//
+// 控制命令 (PTYPE_TEXT):
+//   node name host:port	设置节点的地址, 地址改变时断开已有的连接
+//   listen host port		侦听端口, 接受其他节点的连接
+//   F						自己发送的 flush 命令, 发送所有连接的批量数据
+//
+// 小于 32K 的请求和回应先追加到连接的批量数据中, 在这一轮消息处理完 (收到自己发送的 flush 命令) 或者批量数据超过
+// BATCH_LIMIT 时一次交给 socket, 并发的小请求只需要很少的 write. 有批量数据的连接记录在 dirty 列表中, flush 时只处理这些连接.
+//
+// 连接其他节点时, 连接建立之前的请求都留在批量数据中. 连接失败 (例如对方节点正在重启) 时这些请求还没有发出,
+// 所以不返回错误, 而是等待一段时间 (RETRY_MAX 以内逐次增加) 重新连接, 连接成功后再发送, 和原来 socketchannel 的行为一致.
+// 已经建立的连接断开时, 等待回应的请求可能已经被对方处理, 仍然返回错误.
+
+#include "skynet.h"
+#include "skynet_socket.h"
+#include "skynet_server.h"
+#include "databuffer.h"
+#include "hashid.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+
+#define BACKLOG 32
+#define DEFAULT_CONNECTION 1024
+#define MULTI_PART 0x8000
+#define SESSION_MAP_INIT 64
+
+// 每个连接待发送的批量数据初始分配的大小, 超过 BATCH_LIMIT 时立即发送
+#define BATCH_SIZE 4096
+#define BATCH_LIMIT 0x10000
+
+// 连接其他节点失败后重试的间隔, 每次增加 RETRY_STEP, 最多 RETRY_MAX (单位为 1/100 秒)
+#define RETRY_STEP 100
+#define RETRY_MAX 1000
+
+/// 正在分段接收的大消息 (请求或者回应)
+struct large_message {
+	struct large_message *next;
+	uint32_t session;		// 远端 session
+	uint32_t addr;			// 请求的目标地址, 回应不使用
+	char *name;				// 请求的目标名字, 为 NULL 时使用 addr
+	char *buffer;			// 拼接的数据
+	uint32_t size;			// 数据的总大小
+	uint32_t offset;		// 已经接收的大小
+};
+
+/// 其他的 cluster 节点
+struct node {
+	struct node *next;
+	char *name;				// 节点名
+	char *host;				// 主机地址
+	int port;				// 端口
+	int id;					// 连接的 socket id, -1 表示还没有连接. 等待重连时仍然是失败的 socket id, 请求继续追加到它的批量数据中
+	int retry;				// 下一次重连之前等待的时间, 0 表示还没有失败过
+	int timer;				// 等待重连的定时器的 session, 0 表示没有等待重连
+};
+
+/// 节点之间的 socket 连接
+struct connection {
+	int id;							// socket id
+	struct node *node;				// 主动连接其他节点时指向该节点, 读取的是回应; NULL 表示接入的连接, 读取的是请求
+	struct databuffer buffer;		// 接收数据
+	struct large_message *large;	// 正在分段接收的大消息
+	uint8_t *batch;					// 待发送的批量数据, 多个数据包拼接在一起, 一次交给 socket
+	int batch_size;					// 批量数据的长度
+	int batch_cap;					// 批量数据的容量
+	int connected;					// 连接已经建立, 可以发送数据
+	int dirty;						// 槽位的索引在 dirty 列表中. 属于槽位, 不随连接重置
+};
+
+/// session 映射表的一项, key 为 0 表示空位
+struct session_slot {
+	uint32_t key;			// 映射表的键
+	int id;					// socket id
+	uint32_t address;		// 发起请求的服务, 接收请求的映射表不使用
+	uint32_t session;		// 发起请求时为调用方的 session, 接收请求时为远端 session
+};
+
+/// 开放寻址 (线性探测) 的 session 映射表, 容量为 2 的幂
+struct session_map {
+	int cap;
+	int count;
+	struct session_slot *slot;
+};
+
+struct cluster {
+	struct skynet_context *ctx;
+	uint32_t self;					// 当前服务的 handle
+	int flushing;					// 已经给自己发送了 flush 命令, 还没有处理
+	uint32_t query;					// 处理名字查询的服务 (clusterd)
+	int listen_id;					// 侦听连接的 socket id
+	uint32_t session;				// 下一个发往远端的 session
+	struct node *node;				// 节点链表
+	int max_connection;				// 最大的连接数量
+	struct hashid hash;				// socket id -> connection 数组的索引
+	struct connection *conn;		// 所有的连接
+	int *dirty;						// 有批量数据等待 flush 的连接在 conn 中的索引
+	int ndirty;						// dirty 列表的长度
+	struct messagepool mp;			// 为 connection 的 databuffer 分配内存资源的 messagepool
+	struct session_map request;		// 发出的请求: 远端 session -> 调用方
+	struct session_map response;	// 接收的请求: 本地 session -> 连接和远端 session
+};
+
+static void
+fill_uint32(uint8_t *buf, uint32_t n) {
+	buf[0] = n & 0xff;
+	buf[1] = (n >> 8) & 0xff;
+	buf[2] = (n >> 16) & 0xff;
+	buf[3] = (n >> 24) & 0xff;
+}
+
+/// 2 个字节的数据包长度, big-endian
+static void
+fill_header(uint8_t *buf, int sz) {
+	assert(sz < 0x10000);
+	buf[0] = (sz >> 8) & 0xff;
+	buf[1] = sz & 0xff;
+}
+
+static inline uint32_t
+unpack_uint32(const uint8_t *buf) {
+	return buf[0] | buf[1]<<8 | buf[2]<<16 | buf[3]<<24;
+}
+
+static void
+session_init(struct session_map *m, int cap) {
+	m->cap = cap;
+	m->count = 0;
+	m->slot = skynet_malloc(cap * sizeof(struct session_slot));
+	memset(m->slot, 0, cap * sizeof(struct session_slot));
+}
+
+static struct session_slot *
+session_find(struct session_map *m, uint32_t key) {
+	int mask = m->cap - 1;
+	int i = key & mask;
+	for (;;) {
+		struct session_slot *s = &m->slot[i];
+		if (s->key == key) {
+			return s;
+		}
+		if (s->key == 0) {
+			return NULL;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+/// 插入 key, 返回对应的空位, 由调用者填写其余的字段. 装载率超过 1/2 时容量翻倍
+static struct session_slot *
+session_insert(struct session_map *m, uint32_t key) {
+	assert(key != 0);
+	if ((m->count + 1) * 2 > m->cap) {
+		struct session_map tmp;
+		session_init(&tmp, m->cap * 2);
+		int i;
+		for (i=0;i<m->cap;i++) {
+			struct session_slot *s = &m->slot[i];
+			if (s->key) {
+				*session_insert(&tmp, s->key) = *s;
+			}
+		}
+		skynet_free(m->slot);
+		*m = tmp;
+	}
+	int mask = m->cap - 1;
+	int i = key & mask;
+	while (m->slot[i].key != 0) {
+		assert(m->slot[i].key != key);
+		i = (i + 1) & mask;
+	}
+	struct session_slot *s = &m->slot[i];
+	s->key = key;
+	++m->count;
+	return s;
+}
+
+/// 删除 s, 同一探测链上之后的项向前移动填补空位, 不留墓碑
+static void
+session_remove(struct session_map *m, struct session_slot *s) {
+	int mask = m->cap - 1;
+	int i = s - m->slot;
+	int j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		struct session_slot *n = &m->slot[j];
+		if (n->key == 0) {
+			break;
+		}
+		// n 的理想位置 k 在循环区间 (i, j] 之内时不能前移
+		int k = n->key & mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
+		}
+		m->slot[i] = *n;
+		i = j;
+	}
+	m->slot[i].key = 0;
+	--m->count;
+}
+
+/// 创建 struct cluster 对象
+struct cluster *
+cluster_create(void) {
+	struct cluster * c = skynet_malloc(sizeof(*c));
+	memset(c, 0, sizeof(*c));
+	c->listen_id = -1;
+	return c;
+}
+
+static void
+large_free(struct large_message *m) {
+	while (m) {
+		struct large_message *next = m->next;
+		skynet_free(m->name);
+		skynet_free(m->buffer);
+		skynet_free(m);
+		m = next;
+	}
+}
+
+/// 删除 struct cluster 对象
+void
+cluster_release(struct cluster *c) {
+	struct skynet_context *ctx = c->ctx;
+	int i;
+	for (i=0;i<c->max_connection;i++) {
+		struct connection *conn = &c->conn[i];
+		if (conn->id >= 0) {
+			skynet_socket_close(ctx, conn->id);
+			databuffer_clear(&conn->buffer, &c->mp);
+			large_free(conn->large);
+			skynet_free(conn->batch);
+		}
+	}
+	if (c->listen_id >= 0) {
+		skynet_socket_close(ctx, c->listen_id);
+	}
+	struct node *n = c->node;
+	while (n) {
+		struct node *next = n->next;
+		skynet_free(n->name);
+		skynet_free(n->host);
+		skynet_free(n);
+		n = next;
+	}
+	messagepool_free(&c->mp);
+	hashid_clear(&c->hash);
+	skynet_free(c->conn);
+	skynet_free(c->dirty);
+	skynet_free(c->request.slot);
+	skynet_free(c->response.slot);
+	skynet_free(c);
+}
+
+/// 清空连接的槽位, 保留 dirty 标记 (槽位的索引可能还在 dirty 列表中)
+static void
+reset_connection(struct connection *conn) {
+	int dirty = conn->dirty;
+	memset(conn, 0, sizeof(*conn));
+	conn->dirty = dirty;
+	conn->id = -1;
+}
+
+/// 记录新的连接, 连接数量已满时返回 NULL. 接入的连接 (n 为 NULL) 已经建立, 连接其他节点的要等待 SKYNET_SOCKET_TYPE_CONNECT
+static struct connection *
+new_connection(struct cluster *c, int id, struct node *n) {
+	if (hashid_full(&c->hash)) {
+		return NULL;
+	}
+	struct connection *conn = &c->conn[hashid_insert(&c->hash, id)];
+	reset_connection(conn);
+	conn->id = id;
+	conn->node = n;
+	conn->connected = (n == NULL);
+	return conn;
+}
+
+static struct connection *
+find_connection(struct cluster *c, int id) {
+	int index = hashid_lookup(&c->hash, id);
+	if (index < 0) {
+		return NULL;
+	}
+	return &c->conn[index];
+}
+
+/// 回应调用方: ok 为 0 时返回 PTYPE_ERROR. tag 为 PTYPE_TAG_DONTCOPY 时交出 msg 的所有权
+static void
+reply(struct cluster *c, uint32_t address, uint32_t session, int ok, void *msg, size_t sz, int tag) {
+	if (ok) {
+		skynet_send(c->ctx, 0, address, PTYPE_RESPONSE | tag, session, msg, sz);
+	} else {
+		if (tag & PTYPE_TAG_DONTCOPY) {
+			skynet_free(msg);
+		}
+		skynet_send(c->ctx, 0, address, PTYPE_ERROR, session, NULL, 0);
+	}
+}
+
+/// 连接断开, 等待这个连接回应的调用方都返回 PTYPE_ERROR, 投递给本地服务的请求不再回应
+static void
+close_connection(struct cluster *c, int id) {
+	int index = hashid_remove(&c->hash, id);
+	if (index < 0) {
+		return;
+	}
+	struct connection *conn = &c->conn[index];
+	if (conn->node && conn->node->id == id) {
+		conn->node->id = -1;
+		conn->node->retry = 0;
+		conn->node->timer = 0;	// 取消等待中的重连
+	}
+	databuffer_clear(&conn->buffer, &c->mp);
+	large_free(conn->large);
+	skynet_free(conn->batch);	// 连接已经断开, 丢弃还没有发送的数据
+	reset_connection(conn);
+
+	// 删除之后会有其它项移到当前位置, 所以删除时不前进
+	int i = 0;
+	while (i < c->request.cap) {
+		struct session_slot *s = &c->request.slot[i];
+		if (s->key && s->id == id) {
+			uint32_t address = s->address;
+			uint32_t session = s->session;
+			session_remove(&c->request, s);
+			reply(c, address, session, 0, NULL, 0, 0);
+		} else {
+			++i;
+		}
+	}
+	i = 0;
+	while (i < c->response.cap) {
+		struct session_slot *s = &c->response.slot[i];
+		if (s->key && s->id == id) {
+			session_remove(&c->response, s);
+		} else {
+			++i;
+		}
+	}
+}
+
+static struct node *
+find_node(struct cluster *c, const char *name, size_t sz) {
+	struct node *n;
+	for (n = c->node; n; n = n->next) {
+		if (strlen(n->name) == sz && memcmp(n->name, name, sz) == 0) {
+			return n;
+		}
+	}
+	return NULL;
+}
+
+/// 返回节点连接的 socket id, 还没有连接时发起连接. 连接中就可以写入, 数据由 socket_server 缓存到连接成功
+static int
+connect_node(struct cluster *c, struct node *n) {
+	if (n->id >= 0) {
+		return n->id;
+	}
+	if (n->host == NULL) {
+		return -1;
+	}
+	int id = skynet_socket_connect(c->ctx, n->host, n->port);
+	if (id < 0) {
+		return -1;
+	}
+	if (new_connection(c, id, n) == NULL) {
+		skynet_error(c->ctx, "[cluster] Too many connections, connect to %s failed", n->name);
+		skynet_socket_close(c->ctx, id);
+		return -1;
+	}
+	skynet_socket_nodelay(c->ctx, id);
+	n->id = id;
+	return id;
+}
+
+/// 连接其他节点失败, 连接中的请求还没有发出, 保留连接和它的批量数据, 等待一段时间之后重连
+static void
+schedule_reconnect(struct cluster *c, struct connection *conn) {
+	struct node *n = conn->node;
+	int delay = n->retry;
+	n->retry = delay >= RETRY_MAX ? RETRY_MAX : delay + RETRY_STEP;
+	skynet_error(c->ctx, "[cluster] Connect to %s (%s:%d) failed, retry in %d.%02ds", n->name, n->host, n->port, delay / 100, delay % 100);
+	char tmp[16];
+	sprintf(tmp, "%d", delay);
+	n->timer = strtol(skynet_command(c->ctx, "TIMEOUT", tmp), NULL, 10);
+}
+
+/// 重连的定时器到期, 用新的 socket id 替换原来的连接, 等待这个连接回应的请求也改为新的 socket id
+static void
+reconnect_node(struct cluster *c, struct node *n) {
+	int old = n->id;
+	int index = hashid_lookup(&c->hash, old);
+	assert(index >= 0);
+	int id = skynet_socket_connect(c->ctx, n->host, n->port);
+	if (id < 0) {
+		schedule_reconnect(c, &c->conn[index]);
+		return;
+	}
+	n->timer = 0;
+	struct connection tmp = c->conn[index];
+	hashid_remove(&c->hash, old);
+	reset_connection(&c->conn[index]);
+	struct connection *conn = &c->conn[hashid_insert(&c->hash, id)];
+	int dirty = conn->dirty;
+	*conn = tmp;
+	conn->dirty = dirty;
+	conn->id = id;
+	int i;
+	for (i=0;i<c->request.cap;i++) {
+		struct session_slot *s = &c->request.slot[i];
+		if (s->key && s->id == old) {
+			s->id = id;
+		}
+	}
+	skynet_socket_nodelay(c->ctx, id);
+	n->id = id;
+}
+
+/// 定时器的回应: session 是某个节点等待重连的定时器时重连并返回 1, 否则返回 0
+static int
+reconnect_timer(struct cluster *c, int session) {
+	struct node *n;
+	for (n = c->node; n; n = n->next) {
+		if (n->timer == session) {
+			reconnect_node(c, n);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/// 写入请求的目标地址: 数值地址为 BYTE type DWORD addr, 名字地址为 BYTE type|0x80 BYTE namelen STRING name
+static uint8_t *
+fill_address(uint8_t *buf, int type, const uint8_t *addr, size_t namelen) {
+	if (namelen == 0) {
+		buf[0] = type;
+		memcpy(buf+1, addr, 4);
+		return buf + 5;
+	} else {
+		buf[0] = type | 0x80;
+		buf[1] = (uint8_t)namelen;
+		memcpy(buf+2, addr, namelen);
+		return buf + 2 + namelen;
+	}
+}
+
+/// 把连接的批量数据交给 socket 发送, 批量数据的内存由 socket 释放. 连接还没有建立时保留, 建立之后发送
+static void
+flush_connection(struct cluster *c, struct connection *conn) {
+	if (conn->batch_size == 0 || !conn->connected) {
+		return;
+	}
+	skynet_socket_send(c->ctx, conn->id, conn->batch, conn->batch_size);
+	conn->batch = NULL;
+	conn->batch_size = 0;
+	conn->batch_cap = 0;
+}
+
+/**
+ * 给自己发送 flush 命令. 命令排在已经进入队列的消息之后, 处理它的时候这一轮要发送的数据包都已经拼接到批量数据中,
+ * 相当于在一批消息处理完之后统一发送.
+ */
+static void
+schedule_flush(struct cluster *c) {
+	if (!c->flushing) {
+		c->flushing = 1;
+		skynet_send(c->ctx, 0, c->self, PTYPE_TEXT, 0, "F", 1);
+	}
+}
+
+/// 发送 dirty 列表中所有连接的批量数据
+static void
+flush_all(struct cluster *c) {
+	int i;
+	c->flushing = 0;
+	for (i=0;i<c->ndirty;i++) {
+		struct connection *conn = &c->conn[c->dirty[i]];
+		conn->dirty = 0;
+		if (conn->id >= 0) {
+			flush_connection(c, conn);
+		}
+	}
+	c->ndirty = 0;
+}
+
+/// 在连接 id 的批量数据末尾预留 sz 字节, 返回预留空间的起始指针. 连接不存在时返回 NULL
+static uint8_t *
+batch_reserve(struct cluster *c, int id, size_t sz) {
+	struct connection *conn = find_connection(c, id);
+	if (conn == NULL) {
+		return NULL;
+	}
+	if (conn->batch_size + sz > conn->batch_cap) {
+		size_t cap = conn->batch_cap ? conn->batch_cap : BATCH_SIZE;
+		while (cap < conn->batch_size + sz) {
+			cap *= 2;
+		}
+		conn->batch = skynet_realloc(conn->batch, cap);
+		conn->batch_cap = (int)cap;
+	}
+	uint8_t *ptr = conn->batch + conn->batch_size;
+	conn->batch_size += (int)sz;
+	return ptr;
+}
+
+/// batch_reserve 预留的数据填写完之后调用, 批量数据太大时立即发送, 否则等待 flush 命令
+static void
+batch_commit(struct cluster *c, int id) {
+	struct connection *conn = find_connection(c, id);
+	if (conn->batch_size >= BATCH_LIMIT) {
+		flush_connection(c, conn);
+	} else {
+		if (!conn->dirty) {
+			conn->dirty = 1;
+			c->dirty[c->ndirty++] = conn - c->conn;
+		}
+		schedule_flush(c);
+	}
+}
+
+/// 以低优先级发送大消息的一个数据包, 交出 buf 的所有权. 连接还没有建立时追加到批量数据中, 保持顺序
+static void
+send_lowpriority(struct cluster *c, int id, uint8_t *buf, size_t sz) {
+	struct connection *conn = find_connection(c, id);
+	if (conn && !conn->connected) {
+		memcpy(batch_reserve(c, id, sz), buf, sz);
+		skynet_free(buf);
+		return;
+	}
+	skynet_socket_send_lowpriority(c->ctx, id, buf, (int)sz);
+}
+
+/// 大消息分段之前先发送连接中已经拼接的数据, 保持数据包的顺序
+static void
+batch_flush(struct cluster *c, int id) {
+	struct connection *conn = find_connection(c, id);
+	if (conn) {
+		flush_connection(c, conn);
+	}
+}
+
+/*
+	大于 32K 的消息分成多个数据包, 每个数据包单独以低优先级写入连接.
+	socket_server 总是先发送高优先级的数据, 所以其它 session 的小消息可以插在分段之间, 不会被大消息阻塞.
+	同一个 session 的分段在低优先级队列中保持顺序, 接收方按 session 分别拼接.
+	请求的分段为 WORD sz+5 BYTE type DWORD session, 回应的分段为 WORD sz+5 DWORD session BYTE type
+ */
+static void
+send_parts(struct cluster *c, int id, uint32_t session, int response, const uint8_t *msg, size_t sz) {
+	while (sz > 0) {
+		size_t s = sz > MULTI_PART ? MULTI_PART : sz;
+		int last = (s == sz);
+		uint8_t *buf = skynet_malloc(7 + s);
+		fill_header(buf, s + 5);
+		if (response) {
+			fill_uint32(buf+2, session);
+			buf[6] = last ? 4 : 3;	// 4 是最后一个数据包
+		} else {
+			buf[2] = last ? 3 : 2;	// 3 是最后一个数据包
+			fill_uint32(buf+3, session);
+		}
+		memcpy(buf+7, msg, s);
+		send_lowpriority(c, id, buf, 7 + s);
+		msg += s;
+		sz -= s;
+	}
+}
+
+/*
+	按照 lua-cluster.c 中 packrequest 的格式打包请求并写入连接.
+	addr 为名字时 namelen 为名字的长度, 否则 namelen 为 0, addr 为 4 个字节的地址 (little-endian)
+ */
+static void
+send_request(struct cluster *c, int id, const uint8_t *addr, size_t namelen, uint32_t session, const uint8_t *msg, size_t sz) {
+	size_t addrsz = namelen ? namelen + 2 : 5;
+	size_t framesz;
+	uint8_t *buf;
+	if (sz < MULTI_PART) {
+		framesz = 2 + addrsz + 4 + sz;
+		buf = batch_reserve(c, id, framesz);
+		if (buf == NULL) {
+			return;
+		}
+		fill_header(buf, framesz - 2);
+		uint8_t *p = fill_address(buf+2, 0, addr, namelen);
+		fill_uint32(p, session);
+		memcpy(p+4, msg, sz);
+		batch_commit(c, id);
+		return;
+	}
+	batch_flush(c, id);
+	framesz = 2 + addrsz + 8;
+	buf = skynet_malloc(framesz);
+	fill_header(buf, framesz - 2);
+	uint8_t *p = fill_address(buf+2, 1, addr, namelen);
+	fill_uint32(p, session);
+	fill_uint32(p+4, (uint32_t)sz);
+	send_lowpriority(c, id, buf, framesz);
+	send_parts(c, id, session, 0, msg, sz);
+}
+
+/*
+	按照 lua-cluster.c 中 packresponse 的格式打包回应并写入连接. 出错时 msg 为错误信息, 超过 32K 的部分截断
+ */
+static void
+send_response(struct cluster *c, int id, uint32_t session, int ok, const void *msg, size_t sz) {
+	uint8_t *buf;
+	if (!ok && sz > MULTI_PART) {
+		sz = MULTI_PART;
+	}
+	if (sz <= MULTI_PART) {
+		buf = batch_reserve(c, id, 7 + sz);
+		if (buf == NULL) {
+			return;
+		}
+		fill_header(buf, sz + 5);
+		fill_uint32(buf+2, session);
+		buf[6] = ok;
+		memcpy(buf+7, msg, sz);
+		batch_commit(c, id);
+		return;
+	}
+	batch_flush(c, id);
+	buf = skynet_malloc(11);
+	fill_header(buf, 9);
+	fill_uint32(buf+2, session);
+	buf[6] = 2;
+	fill_uint32(buf+7, (uint32_t)sz);
+	send_lowpriority(c, id, buf, 11);
+	send_parts(c, id, session, 1, msg, sz);
+}
+
+/*
+	调用方发来的请求 (PTYPE_LUA), 布局见 lua-cluster.c 的 packforward:
+		PADDING msg(sz)
+		DWORD addr 或者 STRING name
+		BYTE namelen	; 0 表示 addr 是数值地址
+		STRING node
+		BYTE nodelen
+ */
+static void
+forward_request(struct cluster *c, uint32_t source, int session, const uint8_t *msg, size_t sz) {
+	struct skynet_context *ctx = c->ctx;
+	size_t nodelen = sz > 0 ? msg[sz-1] : 0;
+	if (nodelen == 0 || sz < nodelen + 2) {
+		skynet_error(ctx, "[cluster] Invalid request from %x", source);
+		reply(c, source, session, 0, NULL, 0, 0);
+		return;
+	}
+	const char *nodename = (const char *)msg + sz - 1 - nodelen;
+	size_t namelen = msg[sz - 2 - nodelen];
+	size_t addrsz = namelen ? namelen : 4;
+	if (sz < nodelen + 2 + addrsz) {
+		skynet_error(ctx, "[cluster] Invalid request from %x", source);
+		reply(c, source, session, 0, NULL, 0, 0);
+		return;
+	}
+	const uint8_t *addr = msg + sz - 2 - nodelen - addrsz;
+
+	struct node *n = find_node(c, nodename, nodelen);
+	if (n == NULL) {
+		skynet_error(ctx, "[cluster] Unknown node %.*s", (int)nodelen, nodename);
+		reply(c, source, session, 0, NULL, 0, 0);
+		return;
+	}
+	int id = connect_node(c, n);
+	if (id < 0) {
+		skynet_error(ctx, "[cluster] Connect to node %s failed", n->name);
+		reply(c, source, session, 0, NULL, 0, 0);
+		return;
+	}
+
+	uint32_t remote = c->session;
+	if (++c->session > 0x7fffffff) {
+		c->session = 1;
+	}
+	if (session != 0) {
+		struct session_slot *s = session_insert(&c->request, remote);
+		s->id = id;
+		s->address = source;
+		s->session = session;
+	}
+	send_request(c, id, addr, namelen, remote, msg, addr - msg);
+}
+
+/// 把请求投递给本地服务, tag 为 PTYPE_TAG_DONTCOPY 时交出 msg 的所有权
+static void
+deliver_request(struct cluster *c, int id, uint32_t addr, const char *name, size_t namelen, uint32_t session, void *msg, size_t sz, int tag) {
+	struct skynet_context *ctx = c->ctx;
+	int local;
+	if (name) {
+		char tmp[256];
+		memcpy(tmp, name, namelen);
+		tmp[namelen] = '\0';
+		local = skynet_sendname(ctx, 0, tmp, PTYPE_RESERVED_LUA | PTYPE_TAG_ALLOCSESSION | tag, 0, msg, sz);
+	} else if (addr == 0) {
+		local = skynet_send(ctx, 0, c->query, PTYPE_SYSTEM | PTYPE_TAG_ALLOCSESSION | tag, 0, msg, sz);
+	} else {
+		local = skynet_send(ctx, 0, addr, PTYPE_RESERVED_LUA | PTYPE_TAG_ALLOCSESSION | tag, 0, msg, sz);
+	}
+	if (local <= 0) {
+		static const char err[] = "Invalid address";
+		send_response(c, id, session, 0, err, sizeof(err) - 1);
+		return;
+	}
+	struct session_slot *s = session_insert(&c->response, (uint32_t)local);
+	s->id = id;
+	s->session = session;
+}
+
+static void
+large_begin(struct connection *conn, uint32_t session, uint32_t addr, const char *name, size_t namelen, uint32_t size) {
+	struct large_message *m = skynet_malloc(sizeof(*m));
+	m->session = session;
+	m->addr = addr;
+	m->name = NULL;
+	if (name) {
+		m->name = skynet_malloc(namelen + 1);
+		memcpy(m->name, name, namelen);
+		m->name[namelen] = '\0';
+	}
+	m->buffer = skynet_malloc(size);
+	m->size = size;
+	m->offset = 0;
+	m->next = conn->large;
+	conn->large = m;
+}
+
+/*
+	把分段数据追加到 session 对应的大消息中. last 为 1 时表示最后一段, 这时把大消息从连接中取出返回, 由调用者释放.
+	数据超出声明的大小或者最后一段不完整时, *err 为 1, 返回已经取出的大消息 (可能为 NULL)
+ */
+static struct large_message *
+large_append(struct connection *conn, uint32_t session, const uint8_t *data, size_t sz, int last, int *err) {
+	struct large_message **prev = &conn->large;
+	struct large_message *m;
+	*err = 0;
+	for (m = conn->large; m; prev = &m->next, m = m->next) {
+		if (m->session == session) {
+			break;
+		}
+	}
+	if (m == NULL) {
+		*err = 1;
+		return NULL;
+	}
+	if (m->offset + sz > m->size) {
+		*err = 1;
+	} else {
+		memcpy(m->buffer + m->offset, data, sz);
+		m->offset += sz;
+		if (!last) {
+			return NULL;
+		}
+		if (m->offset != m->size) {
+			*err = 1;
+		}
+	}
+	*prev = m->next;
+	m->next = NULL;
+	return m;
+}
+
+/// 远端节点的回应, 按 session 返回给调用方. tag 为 PTYPE_TAG_DONTCOPY 时交出 msg 的所有权
+static void
+complete_request(struct cluster *c, uint32_t session, int ok, void *msg, size_t sz, int tag) {
+	struct session_slot *s = session_find(&c->request, session);
+	if (s == NULL) {
+		if (tag & PTYPE_TAG_DONTCOPY) {
+			skynet_free(msg);
+		}
+		return;
+	}
+	uint32_t address = s->address;
+	uint32_t local = s->session;
+	session_remove(&c->request, s);
+	if (!ok) {
+		skynet_error(c->ctx, "[cluster] Remote error (session = %u) : %.*s", session, (int)sz, (const char *)msg);
+	}
+	reply(c, address, local, ok, msg, sz, tag);
+}
+
+/// 大消息接收完成: 请求投递给本地服务, 回应返回给调用方. err 为 1 时表示数据不完整, 回应错误. 释放 m
+static void
+finish_large(struct cluster *c, struct connection *conn, uint32_t session, struct large_message *m, int err) {
+	if (conn->node) {
+		if (err) {
+			static const char invalid[] = "Invalid large response";
+			complete_request(c, session, 0, (void *)invalid, sizeof(invalid) - 1, 0);
+		} else {
+			complete_request(c, session, 1, m->buffer, m->size, PTYPE_TAG_DONTCOPY);
+			m->buffer = NULL;
+		}
+	} else {
+		if (err) {
+			static const char invalid[] = "Invalid large req";
+			send_response(c, conn->id, session, 0, invalid, sizeof(invalid) - 1);
+		} else {
+			deliver_request(c, conn->id, m->addr, m->name, m->name ? strlen(m->name) : 0, session, m->buffer, m->size, PTYPE_TAG_DONTCOPY);
+			m->buffer = NULL;
+		}
+	}
+	large_free(m);
+}
+
+/// 接入的连接收到一个请求数据包. 数据包无效时返回 -1, 调用者关闭连接
+static int
+dispatch_request(struct cluster *c, struct connection *conn, const uint8_t *buf, size_t sz) {
+	uint32_t session;
+	size_t namesz;
+	switch (buf[0]) {
+	case 0:
+		if (sz < 9) {
+			return -1;
+		}
+		session = unpack_uint32(buf+5);
+		deliver_request(c, conn->id, unpack_uint32(buf+1), NULL, 0, session, (void *)(buf+9), sz-9, 0);
+		return 0;
+	case 1:
+		if (sz != 13) {
+			return -1;
+		}
+		large_begin(conn, unpack_uint32(buf+5), unpack_uint32(buf+1), NULL, 0, unpack_uint32(buf+9));
+		return 0;
+	case 2:
+	case 3: {
+		if (sz < 5) {
+			return -1;
+		}
+		int err;
+		session = unpack_uint32(buf+1);
+		struct large_message *m = large_append(conn, session, buf+5, sz-5, buf[0] == 3, &err);
+		if (err || m) {
+			finish_large(c, conn, session, m, err);
+		}
+		return 0;
+	}
+	case 0x80:
+		if (sz < 2) {
+			return -1;
+		}
+		namesz = buf[1];
+		if (sz < namesz + 6) {
+			return -1;
+		}
+		session = unpack_uint32(buf+2+namesz);
+		deliver_request(c, conn->id, 0, (const char *)buf+2, namesz, session, (void *)(buf+6+namesz), sz-6-namesz, 0);
+		return 0;
+	case 0x81:
+		if (sz < 2) {
+			return -1;
+		}
+		namesz = buf[1];
+		if (sz != namesz + 10) {
+			return -1;
+		}
+		large_begin(conn, unpack_uint32(buf+2+namesz), 0, (const char *)buf+2, namesz, unpack_uint32(buf+6+namesz));
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/// 节点的连接收到一个回应数据包. 数据包无效时返回 -1, 调用者关闭连接
+static int
+dispatch_response(struct cluster *c, struct connection *conn, const uint8_t *buf, size_t sz) {
+	if (sz < 5) {
+		return -1;
+	}
+	uint32_t session = unpack_uint32(buf);
+	switch (buf[4]) {
+	case 0:	// error
+	case 1:	// ok
+		complete_request(c, session, buf[4], (void *)(buf+5), sz-5, 0);
+		return 0;
+	case 2:	// multi begin
+		if (sz != 9) {
+			return -1;
+		}
+		large_begin(conn, session, 0, NULL, 0, unpack_uint32(buf+5));
+		return 0;
+	case 3:	// multi part
+	case 4: {	// multi end
+		int err;
+		struct large_message *m = large_append(conn, session, buf+5, sz-5, buf[4] == 4, &err);
+		if (err || m) {
+			finish_large(c, conn, session, m, err);
+		}
+		return 0;
+	}
+	default:
+		return -1;
+	}
+}
+
+/*
+	分段数据直接从 databuffer 复制到大消息预先分配的内存中, 不需要先读出完整的数据包. head 为数据包的前 5 个字节,
+	sz 为之后的数据长度. 最后一段接收完成之后投递. 不是分段数据, 或者没有对应的大消息时返回 0, 按普通的数据包处理
+ */
+static int
+stream_part(struct cluster *c, struct connection *conn, const uint8_t *head, size_t sz) {
+	uint32_t session;
+	int last;
+	if (conn->node) {
+		if (head[4] != 3 && head[4] != 4) {
+			return 0;
+		}
+		session = unpack_uint32(head);
+		last = (head[4] == 4);
+	} else {
+		if (head[0] != 2 && head[0] != 3) {
+			return 0;
+		}
+		session = unpack_uint32(head+1);
+		last = (head[0] == 3);
+	}
+	struct large_message **prev = &conn->large;
+	struct large_message *m;
+	for (m = conn->large; m; prev = &m->next, m = m->next) {
+		if (m->session == session) {
+			break;
+		}
+	}
+	if (m == NULL || m->offset + sz > m->size) {
+		return 0;
+	}
+	databuffer_read(&conn->buffer, &c->mp, m->buffer + m->offset, (int)sz);
+	m->offset += sz;
+	if (last) {
+		*prev = m->next;
+		m->next = NULL;
+		finish_large(c, conn, session, m, m->offset != m->size);
+	}
+	return 1;
+}
+
+/// 处理连接接收到的数据, 每个完整的数据包按连接的类型解析为请求或者回应
+static void
+dispatch_data(struct cluster *c, struct connection *conn, void *data, int sz) {
+	databuffer_push(&conn->buffer, &c->mp, data, sz);
+	for (;;) {
+		int size = databuffer_readheader(&conn->buffer, &c->mp, 2);
+		if (size < 0) {
+			return;
+		}
+		if (size == 0) {
+			continue;
+		}
+		uint8_t tmp[256];
+		uint8_t *buf = tmp;
+		int offset = 0;
+		if (size > 5) {
+			// 先读出前 5 个字节判断是否为分段数据
+			uint8_t head[5];
+			databuffer_read(&conn->buffer, &c->mp, head, 5);
+			if (stream_part(c, conn, head, size - 5)) {
+				databuffer_reset(&conn->buffer);
+				continue;
+			}
+			if (size > sizeof(tmp)) {
+				buf = skynet_malloc(size);
+			}
+			memcpy(buf, head, 5);
+			offset = 5;
+		}
+		databuffer_read(&conn->buffer, &c->mp, buf + offset, size - offset);
+		databuffer_reset(&conn->buffer);
+		int r;
+		if (conn->node) {
+			r = dispatch_response(c, conn, buf, size);
+		} else {
+			r = dispatch_request(c, conn, buf, size);
+		}
+		if (buf != tmp) {
+			skynet_free(buf);
+		}
+		if (r < 0) {
+			int id = conn->id;
+			skynet_error(c->ctx, "[cluster] Invalid cluster message from socket %d", id);
+			close_connection(c, id);
+			skynet_socket_close(c->ctx, id);
+			return;
+		}
+	}
+}
+
+static void
+dispatch_socket_message(struct cluster *c, const struct skynet_socket_message * message, int sz) {
+	struct skynet_context *ctx = c->ctx;
+	switch (message->type) {
+	case SKYNET_SOCKET_TYPE_DATA: {
+		struct connection *conn = find_connection(c, message->id);
+		if (conn) {
+			dispatch_data(c, conn, message->buffer, message->ud);
+		} else {
+			skynet_error(ctx, "[cluster] Drop unknown connection %d message", message->id);
+			skynet_socket_close(ctx, message->id);
+			skynet_free(message->buffer);
+		}
+		break;
+	}
+	case SKYNET_SOCKET_TYPE_CONNECT: {
+		struct connection *conn = find_connection(c, message->id);
+		if (conn && !conn->connected) {
+			conn->connected = 1;
+			if (conn->node->retry) {
+				skynet_error(ctx, "[cluster] Connect to %s (%s:%d)", conn->node->name, conn->node->host, conn->node->port);
+				conn->node->retry = 0;
+			}
+			flush_connection(c, conn);
+		}
+		break;
+	}
+	case SKYNET_SOCKET_TYPE_CLOSE:
+	case SKYNET_SOCKET_TYPE_ERROR:
+		if (message->id == c->listen_id) {
+			skynet_error(ctx, "[cluster] Listen socket closed");
+			c->listen_id = -1;
+			break;
+		}
+		struct connection *conn = find_connection(c, message->id);
+		if (conn) {
+			if (conn->node && !conn->connected) {
+				schedule_reconnect(c, conn);
+				break;
+			}
+			skynet_error(ctx, "[cluster] socket %s %d", message->type == SKYNET_SOCKET_TYPE_CLOSE ? "close" : "error", message->id);
+			close_connection(c, message->id);
+		}
+		break;
+	case SKYNET_SOCKET_TYPE_ACCEPT: {
+		char remote[64];
+		if (sz >= sizeof(remote)) {
+			sz = sizeof(remote) - 1;
+		}
+		memcpy(remote, message+1, sz);
+		remote[sz] = '\0';
+		if (new_connection(c, message->ud, NULL) == NULL) {
+			skynet_error(ctx, "[cluster] Too many connections, refuse %s", remote);
+			skynet_socket_close(ctx, message->ud);
+			break;
+		}
+		skynet_error(ctx, "[cluster] socket accept from %s", remote);
+		skynet_socket_start(ctx, message->ud);
+		skynet_socket_nodelay(ctx, message->ud);
+		break;
+	}
+	case SKYNET_SOCKET_TYPE_WARNING:
+		skynet_error(ctx, "[cluster] fd (%d) send buffer (%d)K", message->id, message->ud);
+		break;
+	}
+}
+
+/// 设置节点的地址, 地址改变时断开已有的连接, 等待回应的请求返回错误
+static void
+set_node(struct cluster *c, const char *name, const char *address) {
+	const char *portstr = strrchr(address, ':');
+	if (portstr == NULL) {
+		skynet_error(c->ctx, "[cluster] Invalid node address %s %s", name, address);
+		return;
+	}
+	size_t hostlen = portstr - address;
+	int port = strtol(portstr + 1, NULL, 10);
+	struct node *n = find_node(c, name, strlen(name));
+	if (n == NULL) {
+		n = skynet_malloc(sizeof(*n));
+		n->name = skynet_strdup(name);
+		n->host = NULL;
+		n->port = 0;
+		n->id = -1;
+		n->next = c->node;
+		c->node = n;
+	} else if (n->port == port && strlen(n->host) == hostlen && memcmp(n->host, address, hostlen) == 0) {
+		return;
+	}
+	skynet_free(n->host);
+	n->host = skynet_malloc(hostlen + 1);
+	memcpy(n->host, address, hostlen);
+	n->host[hostlen] = '\0';
+	n->port = port;
+	if (n->id >= 0) {
+		int id = n->id;
+		close_connection(c, id);
+		skynet_socket_close(c->ctx, id);
+	}
+}
+
+static void
+start_listen(struct cluster *c, const char *host, int port) {
+	if (c->listen_id >= 0) {
+		skynet_error(c->ctx, "[cluster] Already listen");
+		return;
+	}
+	c->listen_id = skynet_socket_listen(c->ctx, host, port, BACKLOG);
+	if (c->listen_id < 0) {
+		skynet_error(c->ctx, "[cluster] Listen %s:%d failed", host, port);
+		return;
+	}
+	skynet_socket_start(c->ctx, c->listen_id);
+}
+
+/// 控制命令处理
+static void
+_ctrl(struct cluster *c, uint32_t source, const void * msg, int sz) {
+	if (sz == 1 && *(const char *)msg == 'F') {
+		// 自己发送的 flush 命令, 见 schedule_flush
+		if (source == c->self) {
+			flush_all(c);
+		}
+		return;
+	}
+	char tmp[sz + 1];
+	memcpy(tmp, msg, sz);
+	tmp[sz] = '\0';
+	char cmd[sz + 1], arg1[sz + 1], arg2[sz + 1];
+	int n = sscanf(tmp, "%s %s %s", cmd, arg1, arg2);
+	if (n == 3 && strcmp(cmd, "node") == 0) {
+		set_node(c, arg1, arg2);
+		return;
+	}
+	if (n == 3 && strcmp(cmd, "listen") == 0) {
+		start_listen(c, arg1, strtol(arg2, NULL, 10));
+		return;
+	}
+	skynet_error(c->ctx, "[cluster] Unknown command : %s", tmp);
+}
+
+static int
+_cb(struct skynet_context * ctx, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
+	struct cluster *c = ud;
+	switch (type) {
+	case PTYPE_TEXT:
+		_ctrl(c, source, msg, (int)sz);
+		break;
+	case PTYPE_RESERVED_LUA:
+		forward_request(c, source, session, msg, sz);
+		break;
+	case PTYPE_RESPONSE:
+	case PTYPE_ERROR: {
+		if (type == PTYPE_RESPONSE && reconnect_timer(c, session)) {
+			break;
+		}
+		// 投递给本地服务的请求的回应
+		struct session_slot *s = session_find(&c->response, (uint32_t)session);
+		if (s == NULL) {
+			break;
+		}
+		int id = s->id;
+		uint32_t remote = s->session;
+		session_remove(&c->response, s);
+		if (type == PTYPE_RESPONSE) {
+			send_response(c, id, remote, 1, msg, sz);
+		} else {
+			static const char err[] = "call failed";
+			send_response(c, id, remote, 0, err, sizeof(err) - 1);
+		}
+		break;
+	}
+	case PTYPE_SOCKET:
+		dispatch_socket_message(c, msg, (int)(sz - sizeof(struct skynet_socket_message)));
+		break;
+	}
+	return 0;
+}
+
+/// 初始化 struct cluster, 参数为处理名字查询的服务地址和最大的连接数量 (可选)
+int
+cluster_init(struct cluster *c, struct skynet_context *ctx, const char * parm) {
+	char query[64] = "";
+	int max = 0;
+	if (parm == NULL || sscanf(parm, "%63s %d", query, &max) < 1) {
+		skynet_error(ctx, "[cluster] Need query service");
+		return 1;
+	}
+	c->query = skynet_queryname(ctx, query);
+	if (c->query == 0) {
+		skynet_error(ctx, "[cluster] Invalid query service %s", query);
+		return 1;
+	}
+	if (max <= 0) {
+		max = DEFAULT_CONNECTION;
+	}
+	c->ctx = ctx;
+	c->self = skynet_context_handle(ctx);
+	c->session = 1;
+	hashid_init(&c->hash, max);
+	c->conn = skynet_malloc(max * sizeof(struct connection));
+	memset(c->conn, 0, max * sizeof(struct connection));
+	c->max_connection = max;
+	c->dirty = skynet_malloc(max * sizeof(int));
+	int i;
+	for (i=0;i<max;i++) {
+		c->conn[i].id = -1;
+	}
+	session_init(&c->request, SESSION_MAP_INIT);
+	session_init(&c->response, SESSION_MAP_INIT);
+	skynet_callback(ctx, c, _cb);
+	return 0;
+}
@@ -1,6 +1,11 @@
 // 网关服务器的实现, 客户端与连接这个服务连接, 这个服务接收到数据之后, 伪造 client 给 agent 发送接收到的数据, 由 agent 处理实际的逻辑.
 // 这个服务实际上只是做数据的转发与 socket 的连接管理.
 // 这个服务貌似目前已经不使用了, 而是直接使用 gateserver.lua + gate.lua + watchdog.lua 来代替.
+//
+// 分片模式: 启动参数的第 6 项为分片数量 N (N > 1) 时, 当前服务作为前端, 只负责侦听和转发控制命令,
+// 另外启动 N 个分片 gate 服务 (binding 为 "!", 不侦听). 新接入的 socket 按 id % N 交给对应的分片,
+// 之后该连接的数据解析和转发都在分片中完成, 这样多个工作线程可以同时处理不同分片的连接.
+// watchdog 仍然只和前端交互, kick/forward/start 等命令由前端按 socket id 路由到分片, 协议保持不变.
 
 #include "skynet.h"
 #include "skynet_socket.h"
@@ -36,6 +41,8 @@ struct gate {
 	struct connection *conn;		// 连接到当前主机的客户端
 	// todo: save message pool ptr for release
 	struct messagepool mp;			// 为 connection 的 databuffer 分配内存资源的 messagepool
+	int shard_n;					// 分片数量, 大于 0 表示当前服务是分片模式的前端
+	uint32_t *shard;				// 分片 gate 服务的 handle 数组
 };
 
 /// 创建 struct gate 对象
@@ -66,6 +73,16 @@ gate_release(struct gate *g) {
 		skynet_socket_close(ctx, g->listen_id);
 	}
 
+	// 退出分片 gate 服务
+	for (i = 0; i < g->shard_n; i++) {
+		if (g->shard[i]) {
+			char addr[16];
+			snprintf(addr, sizeof(addr), ":%08x", g->shard[i]);
+			skynet_command(ctx, "KILL", addr);
+		}
+	}
+	skynet_free(g->shard);
+
 	// 释放 messagepool 资源
 	messagepool_free(&g->mp);
 
@@ -113,6 +130,32 @@ _forward_agent(struct gate * g, int fd, uint32_t agentaddr, uint32_t clientaddr)
 	}
 }
 
+/// 返回 socket id 所属的分片 gate 服务
+static inline uint32_t
+_shard(struct gate * g, int id) {
+	return g->shard[(unsigned)id % g->shard_n];
+}
+
+/// 分片模式的前端处理命令: broker 广播给所有分片, 其他带 socket id 的命令原样转发给 id 所属的分片
+static void
+_route(struct gate * g, const void * msg, int sz, char * command, int i) {
+	struct skynet_context * ctx = g->ctx;
+	int n;
+	if (memcmp(command, "broker", i) == 0) {
+		for (n = 0; n < g->shard_n; n++) {
+			skynet_send(ctx, 0, g->shard[n], PTYPE_TEXT, 0, (void *)msg, sz);
+		}
+		return;
+	}
+	_parm(command, sz, i);
+	int uid = strtol(command, NULL, 10);
+	if (uid < 0) {
+		skynet_error(ctx, "[gate] Invalid socket id : %s", command);
+		return;
+	}
+	skynet_send(ctx, 0, _shard(g, uid), PTYPE_TEXT, 0, (void *)msg, sz);
+}
+
 /// 命令处理, 解析字符串, 然后做对应的处理
 static void
 _ctrl(struct gate * g, const void * msg, int sz) {
@@ -135,6 +178,12 @@ _ctrl(struct gate * g, const void * msg, int sz) {
 		}
 	}
 
+	// 分片模式下, 除了关闭侦听的 close 命令外, 都交给分片处理
+	if (g->shard_n > 0 && memcmp(command, "close", i) != 0) {
+		_route(g, msg, sz, command, i);
+		return;
+	}
+
 	if (memcmp(command, "kick", i) == 0) {		// 关闭掉某个建立的连接 socket
 		_parm(tmp, sz, i);
 		int uid = strtol(command, NULL, 10);
@@ -212,6 +261,17 @@ _report(struct gate * g, const char * data, ...) {
 	skynet_send(ctx, 0, g->watchdog, PTYPE_TEXT,  0, tmp, n);
 }
 
+/// 从 connection 中取出 size 大小的数据包. 数据包在同一个 socket 数据块的末尾时直接交出该数据块, 否则分配内存复制
+static void *
+_read_package(struct gate *g, struct connection * c, int size) {
+	void * temp = databuffer_detach(&c->buffer, &g->mp, size);
+	if (temp == NULL) {
+		temp = skynet_malloc(size);
+		databuffer_read(&c->buffer, &g->mp, temp, size);
+	}
+	return temp;
+}
+
 /// 将 connection 接收的数据转发到其他服务中去
 static void
 _forward(struct gate *g, struct connection * c, int size) {
@@ -219,16 +279,14 @@ _forward(struct gate *g, struct connection * c, int size) {
 
 	// 存在 broker 服务, 将消息发给 broker 服务
 	if (g->broker) {
-		void * temp = skynet_malloc(size);
-		databuffer_read(&c->buffer, &g->mp, temp, size);
+		void * temp = _read_package(g, c, size);
 		skynet_send(ctx, 0, g->broker, g->client_tag | PTYPE_TAG_DONTCOPY, 0, temp, size);
 		return;
 	}
 
 	// 存在 agent 服务, 将消息发给 agent 服务
 	if (c->agent) {
-		void * temp = skynet_malloc(size);
-		databuffer_read(&c->buffer, &g->mp, temp, size);
+		void * temp = _read_package(g, c, size);
 
 		// 伪装数据成 client 发送给 agent
 		skynet_send(ctx, c->client, c->agent, g->client_tag | PTYPE_TAG_DONTCOPY, 0 , temp, size);
@@ -314,7 +372,8 @@ dispatch_socket_message(struct gate *g, const struct skynet_socket_message * mes
 	case SKYNET_SOCKET_TYPE_ACCEPT:	// 新的客户端接入
 		// report accept, then it will be get a SKYNET_SOCKET_TYPE_CONNECT message
 		// 脑高 accept, 然后当前函数将获得 1 个 SKYNET_SOCKET_TYPE_CONNECT 消息
-		assert(g->listen_id == message->id);
+		// 分片 gate 服务不侦听 (listen_id 为 -1), 它的 accept 消息由前端转发过来
+		assert(g->listen_id == message->id || g->listen_id < 0);
 		if (hashid_full(&g->hash)) {
 			skynet_socket_close(ctx, message->ud);
 		} else {
@@ -339,10 +398,49 @@ dispatch_socket_message(struct gate *g, const struct skynet_socket_message * mes
 	}
 }
 
+/**
+ * 分片模式的前端处理 PTYPE_CLIENT 和 PTYPE_SOCKET 消息, 按 socket id 转发给分片, 消息内存的所有权一并交出.
+ * 返回 1 表示消息已经转发, 不要释放 msg.
+ */
+static int
+_dispatch_shard(struct gate *g, int type, uint32_t source, const void * msg, size_t sz) {
+	struct skynet_context * ctx = g->ctx;
+	int id;
+	if (type == PTYPE_CLIENT) {
+		if (sz <= 4) {
+			skynet_error(ctx, "Invalid client message from %x", source);
+			return 0;
+		}
+		const uint8_t * idbuf = msg + sz - 4;
+		id = (int)(idbuf[0] | idbuf[1] << 8 | idbuf[2] << 16 | idbuf[3] << 24);
+		if (id < 0) {
+			skynet_error(ctx, "Invalid client id %d from %x", id, source);
+			return 0;
+		}
+	} else {
+		const struct skynet_socket_message * message = msg;
+		if (message->type == SKYNET_SOCKET_TYPE_ACCEPT) {
+			// 新接入的 socket 交给 ud (新 socket id) 所属的分片
+			id = message->ud;
+		} else if (message->id == g->listen_id) {
+			// 侦听 socket 自身的消息不需要处理
+			return 0;
+		} else {
+			// 分片 start 之前的 socket 消息仍然会发给前端, 例如在 start 之前被 kick 产生的 close 消息
+			id = message->id;
+		}
+	}
+	skynet_send(ctx, source, _shard(g, id), type | PTYPE_TAG_DONTCOPY, 0, (void *)msg, sz);
+	return 1;
+}
+
 /// 每次接收到 skynet_message 的逻辑处理
 static int
 _cb(struct skynet_context * ctx, void * ud, int type, int session, uint32_t source, const void * msg, size_t sz) {
 	struct gate *g = ud;
+	if (g->shard_n > 0 && (type == PTYPE_CLIENT || type == PTYPE_SOCKET)) {
+		return _dispatch_shard(g, type, source, msg, sz);
+	}
 	switch(type) {
 	case PTYPE_TEXT:
 		_ctrl(g, msg, (int)sz);
@@ -413,6 +511,33 @@ start_listen(struct gate * g, char * listen_addr) {
 	return 0;
 }
 
+/// 启动 n 个分片 gate 服务, 每个分片的最大连接数量为 max / n (向上取整). 成功返回 0, 否则返回 1
+static int
+start_shard(struct gate * g, char header, int client_tag, int max, int n) {
+	struct skynet_context * ctx = g->ctx;
+	char watchdog[16] = "!";
+	if (g->watchdog) {
+		snprintf(watchdog, sizeof(watchdog), ":%08x", g->watchdog);
+	}
+
+	g->shard = skynet_malloc(n * sizeof(uint32_t));
+	memset(g->shard, 0, n * sizeof(uint32_t));
+	g->shard_n = n;
+
+	char parm[64];
+	snprintf(parm, sizeof(parm), "gate %c %s ! %d %d", header, watchdog, client_tag, (max + n - 1) / n);
+	int i;
+	for (i=0;i<n;i++) {
+		const char * addr = skynet_command(ctx, "LAUNCH", parm);
+		if (addr == NULL) {
+			skynet_error(ctx, "Launch gate shard %d failed", i);
+			return 1;
+		}
+		g->shard[i] = strtoul(addr+1, NULL, 16);
+	}
+	return 0;
+}
+
 /// 初始化 struct gate 资源
 int
 gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
@@ -426,8 +551,9 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 	char binding[sz];
 	int client_tag = 0;
 	char header;
+	int shard = 0;
 
-	int n = sscanf(parm, "%c %s %s %d %d", &header, watchdog, binding, &client_tag, &max);
+	int n = sscanf(parm, "%c %s %s %d %d %d", &header, watchdog, binding, &client_tag, &max, &shard);
 	if (n<4) {
 		skynet_error(ctx, "Invalid gate parm %s", parm);
 		return 1;
@@ -443,10 +569,6 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 		return 1;
 	}
 
-	if (client_tag == 0) {
-		client_tag = PTYPE_CLIENT;
-	}
-
 	// 判断是否开启 watchdog
 	if (watchdog[0] == '!') {
 		g->watchdog = 0;
@@ -460,6 +582,19 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 
 	g->ctx = ctx;
 
+	if (client_tag == 0) {
+		client_tag = PTYPE_CLIENT;
+	}
+
+	// 分片模式的前端不保存连接, 只负责侦听和路由
+	if (shard > 1) {
+		if (start_shard(g, header, client_tag, max, shard)) {
+			return 1;
+		}
+		skynet_callback(ctx, g, _cb);
+		return start_listen(g, binding);
+	}
+
 	// 初始化 hash 表
 	hashid_init(&g->hash, max);
 
@@ -477,5 +612,9 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 
 	skynet_callback(ctx, g, _cb);
 
+	// binding 为 "!" 表示不侦听, 作为分片由前端交给它 socket
+	if (binding[0] == '!') {
+		return 0;
+	}
 	return start_listen(g, binding);
 }
@@ -8,6 +8,7 @@
 #include "skynet_harbor.h"
 #include "skynet_socket.h"
 #include "skynet_handle.h"
+#include "skynet_server.h"
 
 /*
 	harbor listen the PTYPE_HARBOR (in text)
@@ -39,6 +40,13 @@
 #define HASH_SIZE 4096
 #define DEFAULT_QUEUE_SIZE 1024
 
+// 每个 slave 待发送的批量数据初始分配的大小, 超过 BATCH_LIMIT 时立即发送
+#define BATCH_SIZE 4096
+#define BATCH_LIMIT 0x10000
+
+// 不小于这个大小的消息不复制到批量数据中, 在消息内存之后追加 cookie 直接交给 socket
+#define LARGE_MESSAGE 0x4000
+
 // 12 is sizeof(struct remote_message_header)
 // 12 是 sizeof(struct remote_message_header)
 #define HEADER_COOKIE_LENGTH 12
@@ -103,6 +111,9 @@ struct slave {
 	int read;							// 记录已经读取的数据长度
 	uint8_t size[4];					// 存储数据头数据
 	char * recv_buffer;					// 记录当次从 socket 读取的数据内容, 当完整的数据内容读取完, 会将数据发送给本地的 slave 服务
+	uint8_t * batch;					// 待发送的批量数据, 多条消息拼接在一起, 一次交给 socket
+	int batch_size;						// 批量数据的长度
+	int batch_cap;						// 批量数据的容量
 };
 
 /// 当前 skynet 的节点数据结构
@@ -112,6 +123,8 @@ struct harbor {
 	uint32_t slave;					// skynet_context handle
 	struct hashmap * map;			// 存储服务的全局名字和 handle
 	struct slave s[REMOTE_MAX];		// 与当前节点连接的 slave, 如果 slave.status 不为 STATUS_DOWN 时, 才认为该 slave 为可用的
+	uint32_t self;					// 当前服务的 handle
+	int flushing;					// 已经给自己发送了 flush 命令, 还没有处理
 };
 
 // hash table
@@ -300,6 +313,12 @@ close_harbor(struct harbor *h, int id) {
 		release_queue(s->queue);
 		s->queue = NULL;
 	}
+
+	// 丢弃还没有发送的批量数据
+	skynet_free(s->batch);
+	s->batch = NULL;
+	s->batch_size = 0;
+	s->batch_cap = 0;
 }
 
 /// 报告给 slave skynet_context 有 slave id 断开连接
@@ -413,39 +432,105 @@ forward_local_messsage(struct harbor *h, void *msg, int sz) {
 	}
 }
 
+/// 把 slave 的批量数据交给 socket 发送, 批量数据的内存由 socket 释放
+static void
+flush_slave(struct harbor *h, struct slave *s) {
+	if (s->batch_size == 0) {
+		return;
+	}
+
+	// ignore send error, because if the connection is broken, the mainloop will recv a message.
+	// 忽略发送错误, 因为如果连接断开, mainloop 将接收 1 消息.
+	skynet_socket_send(h->ctx, s->fd, s->batch, s->batch_size);
+	s->batch = NULL;
+	s->batch_size = 0;
+	s->batch_cap = 0;
+}
+
+/**
+ * 给自己发送 flush 命令. 命令排在已经进入队列的消息之后, 处理它的时候这一轮待发送的消息都已经拼接到批量数据中,
+ * 相当于在一批消息处理完之后统一发送.
+ */
+static void
+schedule_flush(struct harbor *h) {
+	if (!h->flushing) {
+		h->flushing = 1;
+		skynet_send(h->ctx, 0, h->self, PTYPE_HARBOR, 0, "F", 1);
+	}
+}
+
+/// 发送所有 slave 的批量数据
+static void
+flush_all(struct harbor *h) {
+	int i;
+	h->flushing = 0;
+	for (i=1;i<REMOTE_MAX;i++) {
+		struct slave *s = &h->s[i];
+		if (s->batch_size > 0) {
+			flush_slave(h, s);
+		}
+	}
+}
+
+/// 在 slave 的批量数据末尾预留 sz 字节, 返回预留空间的起始指针
+static uint8_t *
+batch_reserve(struct slave *s, size_t sz) {
+	if (s->batch_size + sz > s->batch_cap) {
+		size_t cap = s->batch_cap ? s->batch_cap : BATCH_SIZE;
+		while (cap < s->batch_size + sz) {
+			cap *= 2;
+		}
+		s->batch = skynet_realloc(s->batch, cap);
+		s->batch_cap = (int)cap;
+	}
+	uint8_t * ptr = s->batch + s->batch_size;
+	s->batch_size += (int)sz;
+	return ptr;
+}
+
 /**
- * 通过 socket 发送数据, 注意: 这个函数对 buffer 的数据进行了复制.
+ * 通过 socket 发送数据. 小消息复制到 slave 的批量数据中, 在 flush 命令或者批量数据超过 BATCH_LIMIT 时统一发送;
+ * 大消息不复制, 在 buffer 之后追加 cookie 直接交给 socket, 这时返回 1, 表示 buffer 的所有权已经交出.
  * 节点间的数据格式为: 数据头(表示内容数据长度, 4 个字节) + 实际数据内容 + remote_message_header
- * @param ctx skynet_context
- * @param fd socket id
+ * @param h harbor
+ * @param s slave, 必须已经完成握手
  * @param buffer 数据指针
  * @param sz 数据长度
  * @param cookie 消息头
+ * @return 1 表示 buffer 已经交给 socket, 调用者不能再释放; 0 表示调用者负责释放 buffer
  */
-static void
-send_remote(struct skynet_context * ctx, int fd, const char * buffer, size_t sz, struct remote_message_header * cookie) {
+static int
+send_remote(struct harbor *h, struct slave *s, const char * buffer, size_t sz, struct remote_message_header * cookie) {
 	// 加上 remote_message_header 的数据长度
 	size_t sz_header = sz + sizeof(*cookie);
 	if (sz_header > UINT32_MAX) {
-		skynet_error(ctx, "remote message from :%08x to :%08x is too large.", cookie->source, cookie->destination);
-		return;
+		skynet_error(h->ctx, "remote message from :%08x to :%08x is too large.", cookie->source, cookie->destination);
+		return 0;
 	}
 
-	// 分配数据空间
-	uint8_t * sendbuf = skynet_malloc(sz_header + 4);
-
 	// 前 4 个字节存储数据长度
-	to_bigendian(sendbuf, (uint32_t)sz_header);
-
-	// 拷贝数据内容
-	memcpy(sendbuf + 4, buffer, sz);
+	to_bigendian(batch_reserve(s, 4), (uint32_t)sz_header);
+
+	if (sz >= LARGE_MESSAGE) {
+		// 先发送之前的批量数据 (包含这条消息的数据头), 保证顺序
+		flush_slave(h, s);
+		uint8_t * msg = skynet_realloc((void *)buffer, sz_header);
+		header_to_message(cookie, msg + sz);
+		skynet_socket_send(h->ctx, s->fd, msg, (int)sz_header);
+		return 1;
+	}
 
-	// 存储 remote_message_header 内容
-	header_to_message(cookie, sendbuf + 4 + sz);
+	// 拷贝数据内容, 存储 remote_message_header 内容
+	uint8_t * ptr = batch_reserve(s, sz_header);
+	memcpy(ptr, buffer, sz);
+	header_to_message(cookie, ptr + sz);
 
-	// ignore send error, because if the connection is broken, the mainloop will recv a message.
-	// 忽略发送错误, 因为如果连接断开, mainloop 将接收 1 消息.
-	skynet_socket_send(ctx, fd, sendbuf, sz_header + 4);
+	if (s->batch_size >= BATCH_LIMIT) {
+		flush_slave(h, s);
+	} else {
+		schedule_flush(h);
+	}
+	return 0;
 }
 
 /// 如果 slave 还未连接成功, 那么先将 keyvalue.queue 的 harbor_msg 全部传给 slave.queue; 否则将 keyvalue.queue 里面的 msg 全部发送 slave 主机.
@@ -468,10 +553,7 @@ dispatch_name_queue(struct harbor *h, struct keyvalue * node) {
 	// slave
 	struct slave *s = &h->s[harbor_id];
 
-	// socket id
-	int fd = s->fd;
-
-	if (fd == 0) {	// 如果还未连接成功
+	if (s->fd == 0) {	// 如果还未连接成功
 		if (s->status == STATUS_DOWN) {	// 未启用的状态, 报告错误
 			char tmp [GLOBALNAME_LENGTH + 1];
 			memcpy(tmp, node->key, GLOBALNAME_LENGTH);
@@ -497,11 +579,10 @@ dispatch_name_queue(struct harbor *h, struct keyvalue * node) {
 		// 记录 skynet_context handle
 		m->header.destination |= (handle & HANDLE_MASK);
 
-		// 发送数据给远程主机
-		send_remote(context, fd, m->buffer, m->size, &m->header);
-
-		// 可以释放 buffer 内存资源, 因为 send_remote 函数对 buffer 的数据进行了复制
-		skynet_free(m->buffer);
+		// 发送数据给远程主机, send_remote 没有交出 buffer 时, buffer 的数据已经被复制, 可以释放
+		if (!send_remote(h, s, m->buffer, m->size, &m->header)) {
+			skynet_free(m->buffer);
+		}
 	}
 }
 
@@ -511,9 +592,7 @@ dispatch_queue(struct harbor *h, int id) {
 	// slave
 	struct slave *s = &h->s[id];
 
-	// socket id
-	int fd = s->fd;
-	assert(fd != 0);
+	assert(s->fd != 0);
 
 	// harbor_msg_queue
 	struct harbor_msg_queue *queue = s->queue;
@@ -523,8 +602,9 @@ dispatch_queue(struct harbor *h, int id) {
 	// 将 harbor_msg_queue 里面的数据全部发送出去
 	struct harbor_msg * m;
 	while ((m = pop_queue(queue)) != NULL) {
-		send_remote(h->ctx, fd, m->buffer, m->size, &m->header);
-		skynet_free(m->buffer);
+		if (!send_remote(h, s, m->buffer, m->size, &m->header)) {
+			skynet_free(m->buffer);
+		}
 	}
 
 	// 释放 harbor_msg_queue 资源
@@ -532,8 +612,8 @@ dispatch_queue(struct harbor *h, int id) {
 	s->queue = NULL;
 }
 
-/// 接收 socket 数据, 并且将接收的完整数据转发给目的服务
-static void
+/// 接收 socket 数据, 并且将接收的完整数据转发给目的服务. 返回 1 表示 message->buffer 的所有权已经交出, 调用者不能释放
+static int
 push_socket_data(struct harbor *h, const struct skynet_socket_message * message) {
 	// 只处理 SKYNET_SOCKET_TYPE_DATA 消息
 	assert(message->type == SKYNET_SOCKET_TYPE_DATA);
@@ -553,9 +633,9 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 	}
 
 	if (s == NULL) {
-		skynet_free(message->buffer);
+		// buffer 由调用者释放
 		skynet_error(h->ctx, "Invalid socket fd (%d) data", fd);
-		return;
+		return 0;
 	}
 
 	// buffer & sz
@@ -571,7 +651,7 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 			if (remote_id != id) {
 				skynet_error(h->ctx, "Invalid shakehand id (%d) from fd = %d , harbor = %d", id, fd, remote_id);
 				close_harbor(h,id);
-				return;
+				return 0;
 			}
 
 			++buffer;	// 读取数据起始指针
@@ -588,13 +668,41 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 		}
 
 		case STATUS_HEADER: {
+			// 批量解析: 数据头和内容都完整地在 buffer 中时直接读取, 不经过下面逐段拼接的流程
+			while (s->read == 0 && size >= 4) {
+				if (buffer[0] != 0) {
+					skynet_error(h->ctx, "Message is too long from harbor %d", id);
+					close_harbor(h, id);
+					return 0;
+				}
+				int length = buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+				if (size - 4 < length) {
+					break;
+				}
+				if (size - 4 == length && length >= message->ud / 2) {
+					// 最后一条消息, 并且占了读到的数据的一半以上: 前移到 message->buffer 的起始位置, 直接交出 buffer, 不再分配内存复制.
+					// 消息比 buffer 小很多时还是复制, 否则接收者会长时间占着整块 buffer (至少是读到的数据大小)
+					memmove(message->buffer, buffer + 4, length);
+					forward_local_messsage(h, message->buffer, length);
+					return 1;
+				}
+				char * msg = skynet_malloc(length);
+				memcpy(msg, buffer + 4, length);
+				forward_local_messsage(h, msg, length);
+				buffer += 4 + length;
+				size -= 4 + length;
+			}
+			if (size == 0) {
+				return 0;
+			}
+
 			// big endian 4 bytes length, the first one must be 0.
 			// big endian 4 字节长度, 第一个字节必须为 0.
 			int need = 4 - s->read;
 			if (size < need) {	// 读取所能读取的数据
 				memcpy(s->size + s->read, buffer, size);
 				s->read += size;
-				return;
+				return 0;
 			} else {	// 将数据头数据完全读取完
 				memcpy(s->size + s->read, buffer, need);
 				buffer += need;		// 剩余数据起始指针
@@ -604,7 +712,7 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 				if (s->size[0] != 0) {
 					skynet_error(h->ctx, "Message is too long from harbor %d", id);
 					close_harbor(h, id);
-					return;
+					return 0;
 				}
 
 				// 内容数据长度
@@ -621,7 +729,7 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 
 				// 缓存中的数据读取完
 				if (size == 0) {
-					return;
+					return 0;
 				}
 			}
 		}
@@ -631,7 +739,7 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 			if (size < need) {	// 读取所能读取的数据
 				memcpy(s->recv_buffer + s->read, buffer, size);
 				s->read += size;
-				return;
+				return 0;
 			}
 
 			memcpy(s->recv_buffer + s->read, buffer, need);
@@ -650,11 +758,11 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 
 			// 缓存中的数据读取完
 			if (size == 0)
-				return;
+				return 0;
 			break;
 		}
 		default:
-			return;
+			return 0;
 		}
 	}
 }
@@ -732,7 +840,7 @@ remote_send_handle(struct harbor *h, uint32_t source, uint32_t destination, int
 		cookie.source = source;
 		cookie.destination = (destination & HANDLE_MASK) | ((uint32_t)type << HANDLE_REMOTE_SHIFT);
 		cookie.session = (uint32_t)session;
-		send_remote(context, s->fd, msg, sz, &cookie);
+		return send_remote(h, s, msg, sz, &cookie);
 	}
 
 	return 0;
@@ -801,6 +909,11 @@ harbor_command(struct harbor * h, const char * msg, size_t sz, int session, uint
 	s -= 2;
 
 	switch(msg[0]) {
+	case 'F' :		// 自己发送的 flush 命令, 见 schedule_flush
+		if (source == h->self) {
+			flush_all(h);
+		}
+		break;
 	case 'N' : {	// 更新全局名字
 		// 长度校验
 		if (s <= 0 || s >= GLOBALNAME_LENGTH) {
@@ -895,10 +1008,10 @@ mainloop(struct skynet_context * context, void * ud, int type, int session, uint
 		switch(message->type) {
 		case SKYNET_SOCKET_TYPE_DATA:
 			// 接收的数据发送给 skynet_context slave
-			push_socket_data(h, message);
-
-			// message 由 skynet_context 删除, buffer 当前删除
-			skynet_free(message->buffer);
+			// message 由 skynet_context 删除, buffer 没有交出时由当前删除
+			if (!push_socket_data(h, message)) {
+				skynet_free(message->buffer);
+			}
 			break;
 		case SKYNET_SOCKET_TYPE_ERROR:
 		case SKYNET_SOCKET_TYPE_CLOSE: {
@@ -966,6 +1079,7 @@ harbor_init(struct harbor *h, struct skynet_context *ctx, const char * args) {
 	}
 	h->id = harbor_id;	// harbor id
 	h->slave = slave;	// .slave skynet_context handle
+	h->self = skynet_context_handle(ctx);
 	skynet_callback(ctx, h, mainloop);
 	skynet_harbor_start(ctx);
 
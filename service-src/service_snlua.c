@@ -1,3 +1,8 @@
+// SCHED_IDLE 需要 _GNU_SOURCE
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "skynet.h"
 
 #include <lua.h>
@@ -8,12 +13,34 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
 
 struct snlua {
 	lua_State * L;
 	struct skynet_context * ctx;
 };
 
+// 预热的 lua_State 池. 后台线程预先完成打开标准库, 设置全局变量, require 常用模块 (snlua_require) 这些和服务无关的工作,
+// 启动服务时直接取出一个, 绑定 skynet_context 之后运行 loader. 池的大小由 snlua_pool 配置, 为 0 时不使用.
+#define POOL_MAX 1024
+
+struct snlua_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int quit;
+	int size;
+	int n;
+	lua_State * L[POOL_MAX];
+};
+
+static struct snlua_pool * POOL = NULL;
+static int POOL_INIT = 0;
+
+// 预热时 skynet_context 还不存在, 注册表中的 skynet_context 先用这个地址占位, 启动服务时替换
+static char CONTEXT_PLACEHOLDER;
+
 // LUA_CACHELIB may defined in patched lua for shared proto
 // LUA_CACHELIB 可能已经在 lua 的共享原型补丁中定义
 #ifdef LUA_CACHELIB
@@ -61,7 +88,7 @@ _report_launcher_error(struct skynet_context *ctx) {
 	skynet_sendname(ctx, 0, ".launcher", PTYPE_TEXT, 0, "ERROR", 5);
 }
 
-/// 获取配置数据
+/// 获取配置数据, ctx 可以为 NULL
 static const char *
 optstring(struct skynet_context *ctx, const char *key, const char * str) {
 	const char * ret = skynet_command(ctx, "GETENV", key);
@@ -71,11 +98,9 @@ optstring(struct skynet_context *ctx, const char *key, const char * str) {
 	return ret;
 }
 
-static int
-_init(struct snlua *l, struct skynet_context *ctx, const char * args, size_t sz) {
-	lua_State *L = l->L;
-	l->ctx = ctx;
-
+/// 和具体服务无关的初始化, ctx 为 NULL 时是在预热池中的 lua_State
+static void
+_prepare(lua_State *L, struct skynet_context *ctx) {
 	// int lua_gc (lua_State *L, int what, int data);
 	// 控制垃圾收集器。根据参数 what 发起不同的任务.
 	lua_gc(L, LUA_GCSTOP, 0);	// 停止垃圾收集器
@@ -88,7 +113,7 @@ _init(struct snlua *l, struct skynet_context *ctx, const char * args, size_t sz)
 	luaL_openlibs(L);
 
 	// 注册表添加 skynet_context = ctx(lightuserdata)
-	lua_pushlightuserdata(L, ctx);
+	lua_pushlightuserdata(L, ctx ? (void *)ctx : (void *)&CONTEXT_PLACEHOLDER);
 	lua_setfield(L, LUA_REGISTRYINDEX, "skynet_context");
 
 	// 添加 "skynet.codecache" 模块
@@ -114,6 +139,210 @@ _init(struct snlua *l, struct skynet_context *ctx, const char * args, size_t sz)
 	const char *preload = skynet_command(ctx, "GETENV", "preload");
 	lua_pushstring(L, preload);
 	lua_setglobal(L, "LUA_PRELOAD");
+}
+
+/// 关闭 lua_State, 如果它使用独立的 arena, 释放的内存由 arena 一次重置回收
+static void
+_close(lua_State *L) {
+	void *arena = NULL;
+	lua_getallocf(L, &arena);
+	skynet_arena_discard(arena);
+	lua_close(L);
+	skynet_arena_delete(arena);
+}
+
+/// 预热: 在 _prepare 的基础上 require snlua_require 中的模块 (以空格分隔, 默认为 skynet).
+/// 这些模块在 require 时不能调用需要 skynet_context 的函数.
+static lua_State *
+_warm(void) {
+	lua_State *L = lua_newstate(skynet_lalloc, skynet_arena_new());
+	_prepare(L, NULL);
+
+	// require 使用和 loader.lua 相同的路径, loader.lua 之后会重新设置
+	lua_getglobal(L, "package");
+	lua_getglobal(L, "LUA_PATH");
+	lua_setfield(L, -2, "path");
+	lua_getglobal(L, "LUA_CPATH");
+	lua_setfield(L, -2, "cpath");
+	lua_pop(L, 1);
+
+	const char * modules = optstring(NULL, "snlua_require", "skynet");
+	while (*modules) {
+		size_t sz = strcspn(modules, " \t");
+		if (sz > 0) {
+			lua_getglobal(L, "require");
+			lua_pushlstring(L, modules, sz);
+			if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+				skynet_error(NULL, "snlua pool require error : %s", lua_tostring(L, -1));
+				_close(L);
+				return NULL;
+			}
+		}
+		modules += sz;
+		modules += strspn(modules, " \t");
+	}
+	// 回收 require 过程中产生的垃圾, 之后由 _init 重新开启垃圾收集器
+	lua_gc(L, LUA_GCRESTART, 0);
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	lua_gc(L, LUA_GCSTOP, 0);
+	return L;
+}
+
+/// 后台线程, 一直把池填满, 直到 snlua_module_exit 设置 quit
+static void *
+_refill(void *ud) {
+	struct snlua_pool *p = ud;
+#ifdef SCHED_IDLE
+	// 只在 cpu 空闲时预热, 不和工作线程争抢
+	struct sched_param param;
+	param.sched_priority = 0;
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->n >= p->size && !p->quit) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+		if (p->quit) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		lua_State *L = _warm();
+		if (L == NULL) {
+			// 预热失败, 不再使用预热池
+			pthread_mutex_lock(&p->lock);
+			p->size = 0;
+			pthread_mutex_unlock(&p->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		if (p->quit) {
+			pthread_mutex_unlock(&p->lock);
+			_close(L);
+			break;
+		}
+		p->L[p->n++] = L;
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+/// 启动时把 codecache_preload 目录下的 lua 文件 (可以是 luac 预编译的) 载入共享原型缓存
+static void
+_preload(struct skynet_context *ctx) {
+	const char * dir = optstring(ctx, "codecache_preload", NULL);
+	if (dir == NULL)
+		return;
+	lua_State *L = luaL_newstate();
+	luaL_requiref(L, "skynet.codecache", codecache , 0);
+	if (lua_getfield(L, -1, "preload") != LUA_TFUNCTION) {
+		skynet_error(ctx, "codecache_preload : shared proto is not supported");
+	} else {
+		lua_pushstring(L, dir);
+		if (lua_pcall(L, 1, 2, 0) != LUA_OK) {
+			skynet_error(ctx, "codecache_preload : %s", lua_tostring(L, -1));
+		} else {
+			if (!lua_isnil(L, -1)) {
+				skynet_error(ctx, "codecache_preload : %s", lua_tostring(L, -1));
+			}
+			skynet_error(ctx, "codecache_preload : %d files from %s", (int)lua_tointeger(L, -2), dir);
+		}
+	}
+	lua_close(L);
+}
+
+static void
+_pool_init(struct skynet_context *ctx) {
+	int size = atoi(optstring(ctx, "snlua_pool", "0"));
+	if (size <= 0)
+		return;
+	if (size > POOL_MAX)
+		size = POOL_MAX;
+	struct snlua_pool *p = skynet_malloc(sizeof(*p));
+	memset(p, 0, sizeof(*p));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->size = size;
+	if (pthread_create(&p->thread, NULL, _refill, p) != 0) {
+		skynet_error(ctx, "snlua pool : create thread failed");
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->cond);
+		skynet_free(p);
+		return;
+	}
+	POOL = p;
+}
+
+/// 从预热池中取出一个 lua_State, 池为空时返回 NULL
+static lua_State *
+_pool_pop(void) {
+	struct snlua_pool *p = POOL;
+	if (p == NULL)
+		return NULL;
+	lua_State *L = NULL;
+	pthread_mutex_lock(&p->lock);
+	if (p->n > 0) {
+		L = p->L[--p->n];
+	}
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	return L;
+}
+
+/// 把预热时 require 的 C 模块中绑定的占位 skynet_context 换成 ctx
+static void
+_bind_context(lua_State *L, struct skynet_context *ctx) {
+	lua_pushlightuserdata(L, ctx);
+	lua_setfield(L, LUA_REGISTRYINDEX, "skynet_context");
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaded");
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		if (lua_type(L, -1) == LUA_TTABLE) {
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0) {
+				if (lua_iscfunction(L, -1) && lua_getupvalue(L, -1, 1)) {
+					int placeholder = lua_touserdata(L, -1) == &CONTEXT_PLACEHOLDER;
+					lua_pop(L, 1);
+					if (placeholder) {
+						lua_pushlightuserdata(L, ctx);
+						lua_setupvalue(L, -2, 1);
+					}
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+}
+
+static int
+_init(struct snlua *l, struct skynet_context *ctx, const char * args, size_t sz) {
+	lua_State *L = _pool_pop();
+	if (L) {
+		_bind_context(L, ctx);
+	} else {
+		L = lua_newstate(skynet_lalloc, skynet_arena_new());
+		_prepare(L, ctx);
+	}
+	void *arena = NULL;
+	lua_getallocf(L, &arena);
+	skynet_arena_bind(arena, skynet_current_handle());
+	l->L = L;
+	l->ctx = ctx;
+
+	// 配置中的 gc 参数作为默认值, 服务可以在启动后再用 skynet.gcconfig 调整
+	int pause = atoi(optstring(ctx, "lua_gcpause", "0"));
+	if (pause > 0)
+		lua_gc(L, LUA_GCSETPAUSE, pause);
+	int stepmul = atoi(optstring(ctx, "lua_gcstepmul", "0"));
+	if (stepmul > 0)
+		lua_gc(L, LUA_GCSETSTEPMUL, stepmul);
 
 	// 压入错误跟踪函数
 	lua_pushcfunction(L, traceback);
@@ -164,6 +393,12 @@ _launch(struct skynet_context * context, void *ud, int type, int session, uint32
 /// 初始化 struct snlua
 int
 snlua_init(struct snlua *l, struct skynet_context *ctx, const char * args) {
+	if (POOL_INIT == 0 && __sync_bool_compare_and_swap(&POOL_INIT, 0, 1)) {
+		skynet_arena_init(atoi(optstring(ctx, "lua_arena", "0")));
+		_preload(ctx);
+		_pool_init(ctx);
+	}
+
 	// 复制参数数据
 	int sz = strlen(args);
 	char * tmp = skynet_malloc(sz);
@@ -186,17 +421,42 @@ struct snlua *
 snlua_create(void) {
 	struct snlua * l = skynet_malloc(sizeof(*l));
 	memset(l,0,sizeof(*l));
-	l->L = lua_newstate(skynet_lalloc, NULL);
+	// lua_State 在 _init 中创建或者从预热池中取出
 	return l;
 }
 
 /// 释放 struct snlua
 void
 snlua_release(struct snlua *l) {
-	lua_close(l->L);
+	if (l->L) {
+		_close(l->L);
+	}
 	skynet_free(l);
 }
 
+/// 节点退出时由 skynet_module_exit 调用: 停止预热线程, 关闭池中的 lua_State.
+/// 必须在 luaS_exitshr 之前运行, 池中的 lua_State 可能引用共享短字符串表中的字符串
+void
+snlua_module_exit(void) {
+	struct snlua_pool *p = POOL;
+	int i;
+	if (p == NULL)
+		return;
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+
+	for (i=0;i<p->n;i++) {
+		_close(p->L[i]);
+	}
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+	skynet_free(p);
+	POOL = NULL;
+}
+
 /// struct snlua 对于信号量处理
 void
 snlua_signal(struct snlua *l, int signal) {
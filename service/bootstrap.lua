@@ -51,6 +51,9 @@ skynet.start(function()
 		skynet.name("DATACENTER", datacenter)
 	end
 
+	-- 每个节点都启动一个 datacenter 的本地缓存, datacenter.get 先从这里读取, 避免每次都访问 master 节点
+	skynet.name(".datacenter", skynet.newservice "datacentercache")
+
 	-- 启动用于 UniqueService 管理的 service_mgr, 启动这个服务的时候已经加载了 snax 模块
 	skynet.newservice "service_mgr"
 
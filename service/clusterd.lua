@@ -1,33 +1,28 @@
 local skynet = require "skynet"
-local sc = require "socketchannel"
-local socket = require "socket"
 local cluster = require "cluster.core"
+require "skynet.manager"	-- inject skynet.launch
 
 local config_name = skynet.getenv "cluster"
 local node_address = {}
-local node_session = {}
 local command = {}
 
-local function read_response(sock)
-	local sz = socket.header(sock:read(2))
-	local msg = sock:read(sz)
-	return cluster.unpackresponse(msg)	-- session, ok, data, padding
-end
+-- C 实现的传输服务 (service_cluster.c), 持有节点之间的连接, 负责请求和回应的打包与 session 映射.
+-- clusterd 只负责配置, 名字注册和名字查询.
+local transport
 
-local function open_channel(t, key)
-	local host, port = string.match(node_address[key], "([^:]+):(.*)$")
-	local c = sc.channel {
-		host = host,
-		port = tonumber(port),
-		response = read_response,
-		nodelay = true,
-	}
-	assert(c:connect(true))
-	t[key] = c
-	return c
-end
+skynet.register_protocol {
+	name = "text",
+	id = skynet.PTYPE_TEXT,
+	pack = function(...) return table.concat({...}, " ") end,
+	unpack = skynet.tostring,
+}
 
-local node_channel = setmetatable({}, { __index = open_channel })
+-- 传输服务把名字查询 (地址为 0 的请求) 以 PTYPE_SYSTEM 转交给 clusterd
+skynet.register_protocol {
+	name = "system",
+	id = skynet.PTYPE_SYSTEM,
+	unpack = skynet.unpack,
+}
 
 local function loadconfig()
 	local f = assert(io.open(config_name))
@@ -38,11 +33,9 @@ local function loadconfig()
 	for name,address in pairs(tmp) do
 		assert(type(address) == "string")
 		if node_address[name] ~= address then
-			-- address changed
-			if rawget(node_channel, name) then
-				node_channel[name] = nil	-- reset connection
-			end
+			-- address changed, transport will reset the connection
 			node_address[name] = address
+			skynet.send(transport, "text", "node", name, address)
 		end
 	end
 end
@@ -53,36 +46,24 @@ function command.reload()
 end
 
 function command.listen(source, addr, port)
-	local gate = skynet.newservice("gate")
 	if port == nil then
 		addr, port = string.match(node_address[addr], "([^:]+):(.*)$")
 	end
-	skynet.call(gate, "lua", "open", { address = addr, port = port })
+	skynet.send(transport, "text", "listen", addr, port)
 	skynet.ret(skynet.pack(nil))
 end
 
-local function send_request(source, node, addr, msg, sz)
-	local session = node_session[node] or 1
-	-- msg is a local pointer, cluster.packrequest will free it
-	local request, new_session, padding = cluster.packrequest(addr, session, msg, sz)
-	node_session[node] = new_session
-
-	-- node_channel[node] may yield or throw error
-	local c = node_channel[node]
-
-	return c:request(request, session, padding)
+function command.transport()
+	skynet.ret(skynet.pack(transport))
 end
 
-function command.req(...)
-	local ok, msg, sz = pcall(send_request, ...)
+-- 兼容旧的调用方式, 请求直接交给传输服务
+function command.req(source, node, addr, msg, sz)
+	local ok, msg, sz = pcall(skynet.rawcall, transport, "lua", cluster.packforward(node, addr, msg, sz))
 	if ok then
-		if type(msg) == "table" then
-			skynet.ret(cluster.concat(msg))
-		else
-			skynet.ret(msg)
-		end
+		-- 回应的 msg 在消息处理完之后会被释放, 需要复制一份
+		skynet.ret(skynet.tostring(msg, sz))
 	else
-		skynet.error(msg)
 		skynet.response()(false)
 	end
 end
@@ -112,73 +93,19 @@ function command.register(source, name, addr)
 	skynet.error(string.format("Register [%s] :%08x", name, addr))
 end
 
-local large_request = {}
-
-function command.socket(source, subcmd, fd, msg)
-	if subcmd == "data" then
-		local sz
-		local addr, session, msg, padding = cluster.unpackrequest(msg)
-		if padding then
-			local req = large_request[session] or { addr = addr }
-			large_request[session] = req
-			table.insert(req, msg)
-			return
-		else
-			local req = large_request[session]
-			if req then
-				large_request[session] = nil
-				table.insert(req, msg)
-				msg,sz = cluster.concat(req)
-				addr = req.addr
-			end
-			if not msg then
-				local response = cluster.packresponse(session, false, "Invalid large req")
-				socket.write(fd, response)
-				return
-			end
-		end
-
-		local ok, response
-		if addr == 0 then
-			local name = skynet.unpack(msg, sz)
-			local addr = register_name[name]
-			if addr then
-				ok = true
-				msg, sz = skynet.pack(addr)
-			else
-				ok = false
-				msg = "name not found"
-			end
-		else
-			ok , msg, sz = pcall(skynet.rawcall, addr, "lua", msg, sz)
-		end
-
-		if ok then
-			response = cluster.packresponse(session, true, msg, sz)
-			if type(response) == "table" then
-				for _, v in ipairs(response) do
-					socket.lwrite(fd, v)
-				end
-			else
-				socket.write(fd, response)
-			end
-		else
-			response = cluster.packresponse(session, false, msg)
-			socket.write(fd, response)
-		end
-	elseif subcmd == "open" then
-		skynet.error(string.format("socket accept from %s", msg))
-		skynet.call(source, "lua", "accept", fd)
-	else
-		large_request = {}
-		skynet.error(string.format("socket %s %d : %s", subcmd, fd, msg))
-	end
-end
-
 skynet.start(function()
+	transport = assert(skynet.launch("cluster", skynet.address(skynet.self())))
 	loadconfig()
 	skynet.dispatch("lua", function(session , source, cmd, ...)
 		local f = assert(command[cmd])
 		f(source, ...)
 	end)
+	skynet.dispatch("system", function(session, source, name)
+		local addr = register_name[name]
+		if addr then
+			skynet.ret(skynet.pack(addr))
+		else
+			skynet.response()(false)
+		end
+	end)
 end)
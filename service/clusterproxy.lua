@@ -1,5 +1,6 @@
 local skynet = require "skynet"
 local cluster = require "cluster"
+local core = require "cluster.core"
 require "skynet.manager"	-- inject skynet.forward_type
 
 local node, address = ...
@@ -18,11 +19,13 @@ local forward_map = {
 
 skynet.forward_type( forward_map ,function()
 	local clusterd = skynet.uniqueservice("clusterd")
+	local transport = skynet.call(clusterd, "lua", "transport")
 	local n = tonumber(address)
 	if n then
 		address = n
 	end
 	skynet.dispatch("system", function (session, source, msg, sz)
-		skynet.ret(skynet.rawcall(clusterd, "lua", skynet.pack("req", node, address, msg, sz)))
+		-- msg 由 forward_type 保留, 追加地址之后交给传输服务
+		skynet.ret(skynet.rawcall(transport, "lua", core.packforward(node, address, msg, sz)))
 	end)
 end)
@@ -0,0 +1,117 @@
+-- 每个节点启动一个, 缓存从 datacenterd 读取的数据. 第一次读取时向 datacenterd 发送 CQUERY, 同时订阅更新通知,
+-- datacenterd 中的数据发生变化时会发送 INVALIDATE 过来, 丢弃相关的缓存.
+-- datacenterd 发来的响应和通知是按顺序到达的, 所以缓存中的数据不会比已经收到的通知更旧.
+-- 缓存的值的数量超过 datacenter_cache (默认 4096) 时清空整个缓存, 之后的读取重新从 datacenterd 获取.
+
+local skynet = require "skynet"
+
+-- 缓存树, 每个节点是 { cached = 是否缓存了 value, value = 值, children = 子节点 }
+local root = { children = {} }
+
+-- 缓存的值的数量和上限
+local count = 0
+local limit = tonumber(skynet.getenv "datacenter_cache") or 4096
+
+local command = {}
+
+local function query(v, key, ...)
+	if key == nil then
+		return v
+	elseif type(v) == "table" then
+		return query(v[key], ...)
+	end
+end
+
+-- 查找 key1.key2... 的缓存, 路径上任何一个节点有缓存, 都可以从它的值中读出来
+-- @return 是否命中, 值
+local function lookup(node, key, ...)
+	if node.cached then
+		return true, query(node.value, key, ...)
+	end
+	if key == nil then
+		return false
+	end
+	local child = node.children[key]
+	if child == nil then
+		return false
+	end
+	return lookup(child, ...)
+end
+
+-- 节点和它的子节点中缓存的值的数量
+local function cached(node)
+	local n = node.cached and 1 or 0
+	for _, child in pairs(node.children) do
+		n = n + cached(child)
+	end
+	return n
+end
+
+local function store(node, value, key, ...)
+	if key == nil then
+		count = count - cached(node) + 1
+		node.cached = true
+		node.value = value
+		node.children = {}	-- 子节点的数据都包含在 value 里了
+		return
+	end
+	local child = node.children[key]
+	if child == nil then
+		child = { children = {} }
+		node.children[key] = child
+	end
+	store(child, value, ...)
+end
+
+function command.QUERY(...)
+	local ok, value = lookup(root, ...)
+	if ok then
+		return value
+	end
+	value = skynet.call("DATACENTER", "lua", "CQUERY", ...)
+	if count >= limit then
+		root = { children = {} }
+		count = 0
+	end
+	store(root, value, ...)
+	return value
+end
+
+function command.STAT()
+	return { count = count, limit = limit }
+end
+
+-- key1.key2... 发生了变化. 路径上的节点的值包含了这个分支, 全部丢弃; 这个分支下的节点也全部丢弃.
+function command.INVALIDATE(...)
+	local node = root
+	local n = select("#", ...)
+	for i = 1, n do
+		local key = select(i, ...)
+		if node.cached then
+			count = count - 1
+			node.cached = nil
+			node.value = nil
+		end
+		local child = node.children[key]
+		if child == nil then
+			return
+		end
+		if i == n then
+			count = count - cached(child)
+			node.children[key] = nil
+		else
+			node = child
+		end
+	end
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function (_, _, cmd, ...)
+		if cmd == "INVALIDATE" then
+			command.INVALIDATE(...)
+		else
+			local f = assert(command[cmd])
+			skynet.ret(skynet.pack(f(...)))
+		end
+	end)
+end)
@@ -6,6 +6,7 @@
 -- 所以你可以把一些需要跨节点访问的服务，自己把其地址记在 datacenter 中，需要的人可以读出。是 1 个树形结构.
 
 local skynet = require "skynet"
+local harbor = require "skynet.harbor"
 
 -- 处理函数集合表
 local command = {}
@@ -19,11 +20,51 @@ local wait_queue = {}
 -- 作为 1 个键使用
 local mode = {}
 
+-- 各个节点的 datacentercache 服务, key1 -> { [cache 地址] = true }
+-- 更新 key1 下的数据时, 通知这些服务丢弃缓存
+local subscriber = {}
+
+-- 正在监视断开的节点, harbor id -> true
+local watching = {}
+
+-- 删除满足 filter(cache) 的订阅者, 没有订阅者的 key 也一起删除
+local function unsubscribe(filter)
+	for key, s in pairs(subscriber) do
+		for cache in pairs(s) do
+			if filter(cache) then
+				s[cache] = nil
+			end
+		end
+		if next(s) == nil then
+			subscriber[key] = nil
+		end
+	end
+end
+
+-- 其他节点上的缓存服务随节点一起退出, 节点断开时删除这个节点上所有的订阅者.
+-- (发给其他节点上不存在的服务的消息会被对方丢弃, 这边无法知道, 所以只能按节点删除)
+-- 先等连接建立 (connect), 避免 cslave 还没有记录这个节点时 link 立即返回.
+local function watch(id)
+	if watching[id] or id == skynet.harbor(skynet.self()) then
+		return
+	end
+	watching[id] = true
+	skynet.fork(function()
+		harbor.connect(id)
+		harbor.link(id)
+		watching[id] = nil
+		unsubscribe(function(cache)
+			return skynet.harbor(cache) == id
+		end)
+	end)
+end
+
 -- 从 db 里面查询数据, 如果 key 为 nil, 直接返回 db 值. 否则根据参数递归查询.
+-- 路径中间不是分支时返回 nil, 和 datacentercache 从缓存的分支中读取的结果一致.
 local function query(db, key, ...)
 	if key == nil then
 		return db
-	else
+	elseif type(db) == "table" then
 		return query(db[key], ...)
 	end
 end
@@ -85,10 +126,50 @@ local function wakeup(db, key1, ...)
 	end
 end
 
+-- 缓存服务查询数据, 同时订阅 key 下的更新通知
+function command.CQUERY(source, key, ...)
+	local s = subscriber[key]
+	if s == nil then
+		s = {}
+		subscriber[key] = s
+	end
+	if not s[source] then
+		s[source] = true
+		watch(skynet.harbor(source))
+	end
+	return command.QUERY(key, ...)
+end
+
+-- 订阅了 key 的缓存服务的数量
+function command.SUBSCRIBER(key)
+	local n = 0
+	for _ in pairs(subscriber[key] or {}) do
+		n = n + 1
+	end
+	return n
+end
+
+-- 通知缓存服务 key1.key2... 发生了变化. 通知在响应 UPDATE 之前发出, 所以更新者之后的读取一定能看到新值.
+-- 本节点上已经退出的缓存服务发送会失败 (skynet.send 返回 nil), 顺便删除它的订阅.
+local function invalidate(key, ...)
+	local s = subscriber[key]
+	if s then
+		local path = table.pack(key, ...)
+		for cache in pairs(s) do
+			if not skynet.send(cache, "lua", "INVALIDATE", table.unpack(path, 1, path.n - 1)) then
+				unsubscribe(function(c)
+					return c == cache
+				end)
+			end
+		end
+	end
+end
+
 -- 更新数据, 并且响应对待的服务
 -- @return 如果更新前存在值, 则返回更新前的值; 否则返回 nil.
 function command.UPDATE(...)
 	local ret, value = update(database, ...)
+	invalidate(...)
 	if ret or value == nil then
 		return ret
 	end
@@ -132,8 +213,10 @@ end
 
 skynet.start(function()
 	-- 注册 lua 类型的处理函数
-	skynet.dispatch("lua", function (_, _, cmd, ...)
-		if cmd == "WAIT" then
+	skynet.dispatch("lua", function (_, source, cmd, ...)
+		if cmd == "CQUERY" then
+			skynet.ret(skynet.pack(command.CQUERY(source, ...)))
+		elseif cmd == "WAIT" then
 			local ret = command.QUERY(...)
 			if ret then	-- 有值则直接响应
 				skynet.ret(skynet.pack(ret))
@@ -120,6 +120,7 @@ function COMMAND.help()
 		kill = "kill address : kill service",
 		mem = "mem : show memory status",
 		gc = "gc : force every lua service do garbage collect",
+		gcconfig = "gcconfig address pause stepmul idle : set gc parameters of a lua service",
 		start = "lanuch a new lua service",
 		snax = "lanuch a new snax service",
 		clearcache = "clear lua code cache",
@@ -133,6 +134,7 @@ function COMMAND.help()
 		signal = "signal address sig",
 		cmem = "Show C memory info",
 		shrtbl = "Show shared short string table info",
+		arena = "Show lua arena pages of each service (lua_arena)",
 	}
 end
 
@@ -199,6 +201,15 @@ function COMMAND.gc()
 	return skynet.call(".launcher", "lua", "GC")
 end
 
+function COMMAND.gcconfig(address, pause, stepmul, idle)
+	address = adjust_address(address)
+	return skynet.call(address, "debug", "GCCONFIG", {
+		pause = tonumber(pause),
+		stepmul = tonumber(stepmul),
+		idle = tonumber(idle),
+	})
+end
+
 function COMMAND.exit(address)
 	skynet.send(adjust_address(address), "debug", "EXIT")
 end
@@ -271,6 +282,15 @@ function COMMAND.cmem()
 	return tmp
 end
 
+function COMMAND.arena()
+	local info = memory.arena()
+	local tmp = {}
+	for k,v in pairs(info) do
+		tmp[skynet.address(k)] = v
+	end
+	return tmp
+end
+
 function COMMAND.shrtbl()
 	local n, total, longest, space = memory.ssinfo()
 	return { n = n, total = total, longest = longest, space = space }
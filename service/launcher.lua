@@ -54,8 +54,13 @@ end
 function command.MEM()
 	local list = {}
 	for k,v in pairs(services) do
-		local kb, bytes = skynet.call(k,"debug","MEM")
-		list[skynet.address(k)] = string.format("%.2f Kb (%s)",kb,v)
+		local kb, bytes, gc = skynet.call(k,"debug","MEM")
+		if gc and gc.steps > 0 then
+			list[skynet.address(k)] = string.format("%.2f Kb (%s) idle gc %d steps %d cycles %.2fms max %.3fms",
+				kb, v, gc.steps, gc.cycles, gc.time, gc.max)
+		else
+			list[skynet.address(k)] = string.format("%.2f Kb (%s)",kb,v)
+		end
 	end
 	return list
 end
@@ -5,8 +5,7 @@ local datacenter = require "datacenter"
 local harbor_id = skynet.harbor(skynet.self())
 
 local command = {}
-local channel = {}
-local channel_n = {}
+local channel = {}	-- channel -> 本节点的订阅者集合 (mc.newgroup)
 local channel_remote = {}
 local channel_id = harbor_id
 local NORET = {}
@@ -24,8 +23,7 @@ function command.NEW()
 	while channel[channel_id] do
 		channel_id = mc.nextid(channel_id)
 	end
-	channel[channel_id] = {}
-	channel_n[channel_id] = 0
+	channel[channel_id] = mc.newgroup()
 	local ret = channel_id
 	channel_id = mc.nextid(channel_id)
 	return ret
@@ -34,7 +32,6 @@ end
 -- MUST call by the owner node of channel, delete a remote channel
 function command.DELR(source, c)
 	channel[c] = nil
-	channel_n[c] = nil
 	return NORET
 end
 
@@ -48,7 +45,6 @@ function command.DEL(source, c)
 	end
 	local remote = channel_remote[c]
 	channel[c] = nil
-	channel_n[c] = nil
 	channel_remote[c] = nil
 	if remote then
 		for node in pairs(remote) do
@@ -63,31 +59,34 @@ local function remote_publish(node, channel, source, ...)
 	skynet.redirect(node_address[node], source, "multicast", channel, ...)
 end
 
--- publish a message, for local node, use the message pointer (call mc.bind to add the reference)
--- for remote node, call remote_publish. (call mc.unpack and skynet.tostring to convert message pointer to string)
-local function publish(c , source, pack, size)
-	local group = channel[c]
-	if group == nil or next(group) == nil then
-		-- dead channel, delete the pack. mc.bind returns the pointer in pack
-		local pack = mc.bind(pack, 1)
-		mc.close(pack)
-		return
-	end
-	mc.bind(pack, channel_n[c])
-	local msg = skynet.tostring(pack, size)
-	for k in pairs(group) do
-		-- the msg is a pointer to the real message, publish pointer in local is ok.
-		skynet.redirect(k, source, "multicast", c , msg)
+-- the last local subscriber of a remote channel is gone, unsubscribe it from the owner node
+local function release_remote(c)
+	local node = c % 256
+	if node ~= harbor_id then
+		channel[c] = nil
+		skynet.send(node_address[node], "lua", "USUBR", c)
 	end
+end
+
+-- publish a message, for remote node, call remote_publish. (call mc.unpack and skynet.tostring to convert message pointer to string)
+-- for local node, mc.publish pushes the message pointer to every subscriber in C, and binds the reference.
+local function publish(c , source, pack, size)
 	local remote = channel_remote[c]
 	if remote then
 		-- remote publish should unpack the pack, because we should not publish the pointer out.
+		-- do it before local publish, local subscribers may release the pack at any time after that.
 		local _, msg, sz = mc.unpack(pack, size)
 		local msg = skynet.tostring(msg,sz)
 		for node in pairs(remote) do
 			remote_publish(node, c, source, msg)
 		end
 	end
+	local group = channel[c]
+	-- dead channel (group is nil or empty) will delete the pack
+	if mc.publish(group, pack, source, c) == 0 and group then
+		-- subscribers may exit without unsubscribe
+		release_remote(c)
+	end
 end
 
 skynet.register_protocol {
@@ -143,15 +142,13 @@ function command.SUB(source, c)
 			end
 			if channel[c] == nil then
 				-- double check, because skynet.call whould yield, other SUB may occur.
-				channel[c] = {}
-				channel_n[c] = 0
+				channel[c] = mc.newgroup()
 			end
 		end
 	end
 	local group = channel[c]
-	if group and not group[source] then
-		channel_n[c] = channel_n[c] + 1
-		group[source] = true
+	if group then
+		mc.subscribe(group, source)
 	end
 end
 
@@ -167,18 +164,8 @@ end
 -- Unsubscribe a channel, if the subscriber is empty and the channel is remote, send USUBR to the channel owner
 function command.USUB(source, c)
 	local group = assert(channel[c])
-	if group[source] then
-		group[source] = nil
-		channel_n[c] = channel_n[c] - 1
-		if channel_n[c] == 0 then
-			local node = c % 256
-			if node ~= harbor_id then
-				-- remote group
-				channel[c] = nil
-				channel_n[c] = nil
-				skynet.send(node_address[node], "lua", "USUBR", c)
-			end
-		end
+	if mc.unsubscribe(group, source) and mc.size(group) == 0 then
+		release_remote(c)
 	end
 	return NORET
 end
@@ -9,11 +9,10 @@ local pool = {}
 local pool_count = {}
 local objmap = {}
 
-local function newobj(name, tbl)
+local function newobj(name, cobj, indexes)
 	assert(pool[name] == nil)
-	local cobj = sharedata.host.new(tbl)
 	sharedata.host.incref(cobj)
-	local v = { value = tbl , obj = cobj, watch = {} }
+	local v = { obj = cobj, watch = {}, indexes = indexes }
 	objmap[cobj] = v
 	pool[name] = v
 	pool_count[name] = { n = 0, threshold = 16 }
@@ -38,11 +37,21 @@ local CMD = {}
 
 local env_mt = { __index = _ENV }
 
-function CMD.new(name, t)
+-- "@xxx.image" 是 CMD.save 预先编译好的 image 文件, 直接 mmap, 不需要加载和转换
+local function isimage(t)
+	return t:sub(1,1) == "@" and t:sub(-6) == ".image"
+end
+
+-- indexes 是需要建立的排序索引 { { path, field }, ... }, 见 sharedata.new
+function CMD.new(name, t, indexes)
 	local dt = type(t)
 	local value
 	if dt == "table" then
 		value = t
+	elseif dt == "string" and isimage(t) then
+		-- image 中已经包含了保存时建立的索引
+		newobj(name, sharedata.host.load(t:sub(2)), indexes)
+		return
 	elseif dt == "string" then
 		value = setmetatable({}, env_mt)
 		local f
@@ -61,7 +70,7 @@ function CMD.new(name, t)
 	else
 		error ("Unknown data type " .. dt)
 	end
-	newobj(name, value)
+	newobj(name, sharedata.host.new(value, nil, indexes), indexes)
 end
 
 function CMD.delete(name)
@@ -76,6 +85,35 @@ function CMD.delete(name)
 	end
 end
 
+-- 把 cobj 展开成普通的 lua table
+local function flatten(cobj)
+	local t = {}
+	local k = sharedata.host.nextkey(cobj)
+	while k ~= nil do
+		local v = sharedata.host.index(cobj, k)
+		if type(v) == "userdata" then
+			v = flatten(v)
+		end
+		t[k] = v
+		k = sharedata.host.nextkey(cobj, k)
+	end
+	return t
+end
+
+-- 把 name 对应的数据编译成 image 文件, 之后可以用 "@filename" 加载
+function CMD.save(name, filename)
+	local v = assert(pool[name])
+	if sharedata.host.ispatched(v.obj) then
+		-- 增量更新的结果引用了旧的 image, 先展开成一个完整的 image
+		local cobj = sharedata.host.new(flatten(v.obj), nil, v.indexes)
+		local ok, err = pcall(sharedata.host.save, cobj, filename)
+		sharedata.host.delete(cobj)
+		assert(ok, err)
+	else
+		sharedata.host.save(v.obj, filename)
+	end
+end
+
 function CMD.query(name)
 	local v = assert(pool[name])
 	local obj = v.obj
@@ -90,7 +128,7 @@ function CMD.confirm(cobj)
 	return NORET
 end
 
-function CMD.update(name, t)
+local function replace(name, create, ...)
 	local v = pool[name]
 	local watch, oldcobj
 	if v then
@@ -101,7 +139,7 @@ function CMD.update(name, t)
 		pool[name] = nil
 		pool_count[name] = nil
 	end
-	CMD.new(name, t)
+	create(name, ...)
 	local newobj = pool[name].obj
 	if watch then
 		sharedata.host.markdirty(oldcobj)
@@ -111,6 +149,95 @@ function CMD.update(name, t)
 	end
 end
 
+-- 没有指定 indexes 时沿用之前的索引
+function CMD.update(name, t, indexes)
+	local v = pool[name]
+	replace(name, CMD.new, t, indexes or (v and v.indexes))
+end
+
+local DELETE = {}
+
+-- 把 changes 整理成一棵树: sub[k] 是需要继续深入的子表, set[k] 是新的值 (DELETE 表示删除)
+local function patchtree(changes)
+	local root = { sub = {}, set = {} }
+	for _, c in ipairs(changes) do
+		local path, value = c[1], c[2]
+		local n = #path
+		assert(n > 0, "Empty patch path")
+		local node, target = root
+		for i = 1, n - 1 do
+			local k = path[i]
+			local set = node.set[k]
+			if set ~= nil then
+				-- 路径穿过一个新设置的值, 剩下的路径直接修改这个 lua table
+				for j = i + 1, n - 1 do
+					assert(type(set) == "table" and set ~= DELETE, "Patch path is not a table")
+					set = set[path[j]]
+				end
+				assert(type(set) == "table" and set ~= DELETE, "Patch path is not a table")
+				node, target = nil, set
+				break
+			end
+			local sub = node.sub[k]
+			if sub == nil then
+				sub = { sub = {}, set = {} }
+				node.sub[k] = sub
+			end
+			node = sub
+		end
+		local k = path[n]
+		if node then
+			node.sub[k] = nil
+			if value == nil then
+				value = DELETE
+			end
+			node.set[k] = value
+		else
+			target[k] = value
+		end
+	end
+	return root
+end
+
+-- 只重建 changes 经过的 table, 其他的子表以 lightuserdata 的形式直接引用旧版本
+local function patchtable(cobj, node)
+	local t = {}
+	if cobj then
+		local k = sharedata.host.nextkey(cobj)
+		while k ~= nil do
+			t[k] = sharedata.host.index(cobj, k)
+			k = sharedata.host.nextkey(cobj, k)
+		end
+	end
+	for k, v in pairs(node.set) do
+		if v == DELETE then
+			t[k] = nil
+		else
+			t[k] = v
+		end
+	end
+	for k, sub in pairs(node.sub) do
+		local old = t[k]
+		if type(old) ~= "userdata" then
+			old = nil
+		end
+		t[k] = patchtable(old, sub)
+	end
+	return t
+end
+
+-- 变化路径上重建的 table 重新建立索引, 没有变化的子表沿用旧版本中的索引
+local function newpatch(name, oldcobj, changes, indexes)
+	newobj(name, sharedata.host.new(patchtable(oldcobj, patchtree(changes)), true, indexes), indexes)
+end
+
+-- 增量更新: changes 是 { { path, value }, ... }, path 是 key 的数组, value 为 nil 表示删除.
+-- 新版本和旧版本共享没有变化的子表, 读取方只需要刷新变化的路径.
+function CMD.patch(name, changes)
+	local v = assert(pool[name])
+	replace(name, newpatch, v.obj, changes, v.indexes)
+end
+
 local function check_watch(queue)
 	local n = 0
 	for k,response in pairs(queue) do
@@ -141,6 +268,7 @@ function CMD.monitor(name, obj)
 end
 
 skynet.start(function()
+	sharedata.host.stringquota(tonumber(skynet.getenv "sharedata_string") or 65536)
 	skynet.fork(collectobj)
 	skynet.dispatch("lua", function (session, source ,cmd, ...)
 		local f = assert(CMD[cmd])
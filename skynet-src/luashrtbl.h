@@ -10,6 +10,8 @@ static inline int luaS_shrinfo(lua_State *L) { return 0; }
 static inline void luaS_initshr() {}
 static inline void luaS_exitshr() {}
 static inline void luaS_expandshr(int n);
+static inline TString * luaS_newshrstr(const char *str, size_t l, int *quota) { return NULL; }
+static inline void luaS_pushshrstr(lua_State *L, TString *ts) {}
 
 #endif
 
@@ -7,6 +7,7 @@
 #include "malloc_hook.h"
 #include "skynet.h"
 #include "atomic.h"
+#include "spinlock.h"
 
 // 当前内存使用的容量
 static size_t _used_memory = 0;
@@ -149,6 +150,216 @@ static void malloc_oom(size_t size) {
 	abort();
 }
 
+/**
+ * 每个 lua 虚拟机独占的 jemalloc arena 和 tcache, 作为 skynet_lalloc 的 ud.
+ * 虚拟机的内存只在它所属的服务中分配和释放, 所以 tcache 不需要加锁, 也不用在每块内存前记录 handle,
+ * 统计直接记在 arena 上. 服务退出时整个 arena 一次重置, 不会在和其他服务共用的 arena 中留下碎片.
+ */
+struct skynet_arena {
+	unsigned index;		// jemalloc arena 的编号
+	unsigned tcache;	// 显式创建的 tcache
+	int flags;			// mallocx / rallocx 使用的 flags
+	int discard;		// 为 1 时 lua_close 释放内存不再调用 dallocx, 由 arena 重置统一回收
+	uint32_t handle;	// 所属服务
+	ssize_t allocated;
+	struct skynet_arena *next;
+};
+
+#define ARENA_MAX 4096
+
+static struct {
+	struct spinlock lock;
+	int max;		// 最多创建的 arena 数量, 0 表示不使用
+	int n;			// 已经创建的 arena 数量
+	size_t reset_mib[3];
+	size_t reset_miblen;	// 为 0 表示 jemalloc 不支持 arena.<i>.reset
+	struct skynet_arena *freelist;	// 回收的 arena, 可以重复使用
+	struct skynet_arena *arena[ARENA_MAX];
+} A;
+
+void
+skynet_arena_init(int max) {
+	if (max <= 0)
+		return;
+	if (max > ARENA_MAX)
+		max = ARENA_MAX;
+	SPIN_INIT(&A)
+	size_t miblen = sizeof(A.reset_mib) / sizeof(A.reset_mib[0]);
+	if (je_mallctlnametomib("arena.0.reset", A.reset_mib, &miblen) == 0) {
+		A.reset_miblen = miblen;
+	}
+	A.max = max;
+}
+
+/// 已经创建的 arena 数量. skynet_arena_new 在锁内写入 A.arena[n] 再增加 A.n, 所以要在锁内读取
+static int
+arena_count(void) {
+	int n;
+	SPIN_LOCK(&A)
+	n = A.n;
+	SPIN_UNLOCK(&A)
+	return n;
+}
+
+static int
+arena_mallctl(const char *name, unsigned index) {
+	char tmp[64];
+	snprintf(tmp, sizeof(tmp), name, index);
+	return je_mallctl(tmp, NULL, NULL, NULL, 0);
+}
+
+static struct skynet_arena *
+arena_create(void) {
+	unsigned index;
+	size_t sz = sizeof(index);
+	// jemalloc 4 is arenas.extend, jemalloc 5 is arenas.create
+	if (je_mallctl("arenas.extend", &index, &sz, NULL, 0) != 0 &&
+		je_mallctl("arenas.create", &index, &sz, NULL, 0) != 0) {
+		return NULL;
+	}
+	struct skynet_arena *a = skynet_malloc(sizeof(*a));
+	memset(a, 0, sizeof(*a));
+	a->index = index;
+	return a;
+}
+
+void *
+skynet_arena_new(void) {
+	if (A.max == 0)
+		return NULL;
+	struct skynet_arena *a = NULL;
+	SPIN_LOCK(&A)
+	a = A.freelist;
+	if (a) {
+		A.freelist = a->next;
+	} else if (A.n < A.max) {
+		a = arena_create();
+		if (a) {
+			A.arena[A.n++] = a;
+		}
+	}
+	SPIN_UNLOCK(&A)
+	if (a == NULL)
+		return NULL;
+	unsigned tcache;
+	size_t sz = sizeof(tcache);
+	if (je_mallctl("tcache.create", &tcache, &sz, NULL, 0) != 0) {
+		SPIN_LOCK(&A)
+		a->next = A.freelist;
+		A.freelist = a;
+		SPIN_UNLOCK(&A)
+		return NULL;
+	}
+	a->tcache = tcache;
+	a->flags = MALLOCX_ARENA(a->index) | MALLOCX_TCACHE(tcache);
+	a->discard = 0;
+	a->handle = 0;
+	a->allocated = 0;
+	a->next = NULL;
+	return a;
+}
+
+void
+skynet_arena_bind(void *ud, uint32_t handle) {
+	struct skynet_arena *a = ud;
+	if (a)
+		a->handle = handle;
+}
+
+void
+skynet_arena_discard(void *ud) {
+	struct skynet_arena *a = ud;
+	if (a && A.reset_miblen > 0)
+		a->discard = 1;
+}
+
+void
+skynet_arena_delete(void *ud) {
+	struct skynet_arena *a = ud;
+	if (a == NULL)
+		return;
+	// 重置之前必须先清空用过这个 arena 的 tcache
+	je_mallctl("tcache.destroy", NULL, NULL, &a->tcache, sizeof(a->tcache));
+	if (a->discard) {
+		size_t mib[3];
+		memcpy(mib, A.reset_mib, sizeof(mib));
+		mib[1] = a->index;
+		int err = je_mallctlbymib(mib, A.reset_miblen, NULL, NULL, NULL, 0);
+		if (err != 0) {
+			// lua_close 时没有逐个释放, 这个 arena 中的内存泄漏了. 之后的服务不再使用 discard, 改为逐个释放
+			skynet_error(NULL, "arena.%u.reset failed (%d), lua arena discard disabled", a->index, err);
+			A.reset_miblen = 0;
+		}
+	}
+	// 把空闲的页归还给操作系统
+	arena_mallctl("arena.%u.purge", a->index);
+	a->handle = 0;
+	SPIN_LOCK(&A)
+	a->next = A.freelist;
+	A.freelist = a;
+	SPIN_UNLOCK(&A)
+}
+
+/// 使用 arena 的 lalloc, 每块内存的大小由 je_sallocx 得到
+static void *
+arena_lalloc(struct skynet_arena *a, void *ptr, size_t nsize) {
+	ssize_t osize = 0;
+	if (ptr) {
+		osize = je_sallocx(ptr, 0);
+	}
+	if (nsize == 0) {
+		if (ptr) {
+			ATOM_SUB(&_used_memory, osize);
+			ATOM_DEC(&_memory_block);
+			a->allocated -= osize;
+			if (!a->discard)
+				je_dallocx(ptr, MALLOCX_TCACHE(a->tcache));
+		}
+		return NULL;
+	}
+	void *newptr;
+	if (ptr) {
+		newptr = je_rallocx(ptr, nsize, a->flags);
+	} else {
+		newptr = je_mallocx(nsize, a->flags);
+		ATOM_INC(&_memory_block);
+	}
+	if (newptr == NULL)
+		malloc_oom(nsize);
+	ssize_t size = je_sallocx(newptr, 0);
+	ATOM_ADD(&_used_memory, size - osize);
+	a->allocated += size - osize;
+	return newptr;
+}
+
+/// 每个服务 arena 中实际占用的内存页 (字节), 键是服务的 handle
+int
+dump_arena_lua(lua_State *L) {
+	lua_newtable(L);
+	if (A.max == 0)
+		return 1;
+	uint64_t epoch = 1;
+	size_t sz = sizeof(epoch);
+	je_mallctl("epoch", &epoch, &sz, &epoch, sz);
+	size_t page = mallctl_int64("arenas.page", NULL);
+	int i;
+	int n = arena_count();
+	for (i=0; i<n; i++) {
+		struct skynet_arena *a = A.arena[i];
+		if (a == NULL || a->handle == 0)
+			continue;
+		char name[64];
+		size_t pactive = 0;
+		sz = sizeof(pactive);
+		snprintf(name, sizeof(name), "stats.arenas.%u.pactive", a->index);
+		if (je_mallctl(name, &pactive, &sz, NULL, 0) == 0) {
+			lua_pushinteger(L, (lua_Integer)(pactive * page));
+			lua_rawseti(L, -2, (lua_Integer)a->handle);
+		}
+	}
+	return 1;
+}
+
 /**
  * 打印当前的内存信息
  */
@@ -229,6 +440,35 @@ skynet_calloc(size_t nmemb,size_t size) {
 
 #else
 
+void
+skynet_arena_init(int max) {
+	if (max > 0)
+		skynet_error(NULL, "No jemalloc : lua_arena %d.", max);
+}
+
+void *
+skynet_arena_new(void) {
+	return NULL;
+}
+
+void
+skynet_arena_bind(void *ud, uint32_t handle) {
+}
+
+void
+skynet_arena_discard(void *ud) {
+}
+
+void
+skynet_arena_delete(void *ud) {
+}
+
+int
+dump_arena_lua(lua_State *L) {
+	lua_newtable(L);
+	return 1;
+}
+
 void 
 memory_info_dump(void) {
 	skynet_error(NULL, "No jemalloc");
@@ -270,6 +510,16 @@ dump_c_mem() {
 			skynet_error(NULL, "0x%x -> %zdkb", data->handle, data->allocated >> 10);
 		}
 	}
+#ifndef NOUSE_JEMALLOC
+	int n = A.max > 0 ? arena_count() : 0;
+	for(i=0; i<n; i++) {
+		struct skynet_arena *a = A.arena[i];
+		if (a && a->handle != 0 && a->allocated != 0) {
+			total += a->allocated;
+			skynet_error(NULL, "0x%x -> %zdkb (lua arena %u)", a->handle, a->allocated >> 10, a->index);
+		}
+	}
+#endif
 	skynet_error(NULL, "+total: %zdkb",total >> 10);
 }
 
@@ -285,6 +535,11 @@ skynet_strdup(const char *str) {
 /// lalloc 的 skynet 版本
 void * 
 skynet_lalloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+#ifndef NOUSE_JEMALLOC
+	if (ud) {
+		return arena_lalloc(ud, ptr, nsize);
+	}
+#endif
 	if (nsize == 0) {
 		skynet_free(ptr);
 		return NULL;
@@ -304,5 +559,21 @@ dump_mem_lua(lua_State *L) {
 			lua_rawseti(L, -2, (lua_Integer)data->handle);
 		}
 	}
+#ifndef NOUSE_JEMALLOC
+	// lua 虚拟机在独立 arena 中的内存, 加到所属服务上
+	int n = A.max > 0 ? arena_count() : 0;
+	for(i=0; i<n; i++) {
+		struct skynet_arena *a = A.arena[i];
+		if (a && a->handle != 0 && a->allocated != 0) {
+			lua_Integer sz = a->allocated;
+			if (lua_rawgeti(L, -1, (lua_Integer)a->handle) == LUA_TNUMBER) {
+				sz += lua_tointeger(L, -1);
+			}
+			lua_pop(L, 1);
+			lua_pushinteger(L, sz);
+			lua_rawseti(L, -2, (lua_Integer)a->handle);
+		}
+	}
+#endif
 	return 1;
 }
@@ -29,5 +29,8 @@ extern int    mallctl_opt(const char* name, int* newval);
 extern void   dump_c_mem(void);
 extern int    dump_mem_lua(lua_State *L);
 
+// 每个服务 lua 虚拟机 arena 实际占用的内存页, 键是服务的 handle
+extern int    dump_arena_lua(lua_State *L);
+
 #endif /* SKYNET_MALLOC_HOOK_H */
 
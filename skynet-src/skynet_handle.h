@@ -43,6 +43,14 @@ int skynet_handle_retire(uint32_t handle);
  */
 struct skynet_context * skynet_handle_grab(uint32_t handle);
 
+/**
+ * 批量获得 handles 对应的 skynet_context 对象, 只加一次读锁. 不存在的 handle 对应的 result 为 NULL
+ * @param handles 待查询的 handle 数组
+ * @param n 数组的长度
+ * @param result 输出的 skynet_context 数组, 每个不为 NULL 的 context 引用计数 +1
+ */
+void skynet_handle_grabmulti(const uint32_t *handles, int n, struct skynet_context **result);
+
 /**
  * 回收所有的数据, 即删除所有的 context
  */
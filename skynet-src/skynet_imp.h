@@ -10,6 +10,7 @@ struct skynet_config {
 	const char * bootstrap;    // skynet 启动的第一个服务以及其启动参数
 	const char * logger;       // skynet_error 日志输出的文件
 	const char * logservice;   // 定制的 log 服务
+	int accept_budget;         // 侦听 socket 一次可读事件上最多连续 accept 的连接数量
 };
 
 // 以下是各个线程私有变量初始化时使用的值
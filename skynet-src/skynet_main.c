@@ -174,6 +174,7 @@ main(int argc, char *argv[]) {
 	config.daemon = optstring("daemon", NULL);
 	config.logger = optstring("logger", NULL);
 	config.logservice = optstring("logservice", "logger");
+	config.accept_budget = optint("accept_budget", 16);
 
 	lua_close(L);
 
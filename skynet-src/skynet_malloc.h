@@ -6,6 +6,7 @@
 #define skynet_malloc_h
 
 #include <stddef.h>
+#include <stdint.h>
 
 // 如果使用了 jemalloc 的话, 那么会在 malloc_hook.c 文件中找到函数的定义.
 // 如果没有使用 jemalloc 的话, 那么使用的就是标准库的 malloc, 这里只是又做了一次声明而已.
@@ -22,4 +23,12 @@ void skynet_free(void *ptr);
 char * skynet_strdup(const char *str);
 void * skynet_lalloc(void *ud, void *ptr, size_t osize, size_t nsize);	// use for lua
 
+// 每个 lua 虚拟机独占的 jemalloc arena, skynet_arena_new 的返回值作为 skynet_lalloc 的 ud (没有 jemalloc 或者数量达到上限时返回 NULL).
+// 关闭虚拟机时先 discard 再 lua_close, 之后 delete 一次重置整个 arena, 参数为 NULL 时什么也不做.
+void skynet_arena_init(int max);
+void * skynet_arena_new(void);
+void skynet_arena_bind(void *arena, uint32_t handle);
+void skynet_arena_discard(void *arena);
+void skynet_arena_delete(void *arena);
+
 #endif
@@ -120,14 +120,14 @@ _query(const char * name) {
 	return NULL;
 }
 
-/// 将已经打开的动态链接库的 xxx_create, xxx_init, xxx_release, xxx_signal 方法导入.
+/// 将已经打开的动态链接库的 xxx_create, xxx_init, xxx_release, xxx_signal, xxx_module_exit 方法导入.
 /// 返回 1 表示初始化失败, 返回 0 表示初始化成功.
 static int
 _open_sym(struct skynet_module *mod) {
 
 	// 分配内存空间
 	size_t name_size = strlen(mod->name);
-	char tmp[name_size + 9]; // create/init/release/signal , longest name is release (7)
+	char tmp[name_size + 13]; // create/init/release/signal/module_exit , longest name is module_exit (12)
 	memcpy(tmp, mod->name, name_size);
 
 	// dlsym 介绍
@@ -153,6 +153,11 @@ _open_sym(struct skynet_module *mod) {
 	strcpy(tmp+name_size, "_signal");
 	mod->signal = dlsym(mod->module, tmp);
 
+	// 获得 xxxx_module_exit 函数. 不用 xxxx_exit 这个名字, 因为 dlsym 也会在模块依赖的库中查找,
+	// 像 quick_exit 这样的 libc 函数会被 quick 模块误当成清理函数
+	strcpy(tmp+name_size, "_module_exit");
+	mod->exit = dlsym(mod->module, tmp);
+
 	// mod->init 方法是必须要实现的
 	return mod->init == NULL;
 }
@@ -238,6 +243,16 @@ skynet_module_instance_signal(struct skynet_module *m, void *inst, int signal) {
 	}
 }
 
+void
+skynet_module_exit(void) {
+	int i;
+	for (i=0;i<M->count;i++) {
+		if (M->m[i].exit) {
+			M->m[i].exit();
+		}
+	}
+}
+
 void 
 skynet_module_init(const char *path) {
 	struct modules *m = skynet_malloc(sizeof(*m));
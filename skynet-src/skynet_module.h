@@ -19,6 +19,9 @@ typedef void (*skynet_dl_release)(void * inst);
 /// C 服务模块对于 signal(信号) 的特殊处理接口声明
 typedef void (*skynet_dl_signal)(void * inst, int signal);
 
+/// C 服务模块在节点退出时的清理函数接口声明 (可选), 用于释放模块级别的资源
+typedef void (*skynet_dl_exit)(void);
+
 struct skynet_module {
 	const char * name;             // 模块的名字
 	void * module;                 // 加载的动态链接库
@@ -26,6 +29,7 @@ struct skynet_module {
 	skynet_dl_init init;           // 加载的动态链接库中的初始化服务实例函数
 	skynet_dl_release release;     // 加载的动态链接库中的释放服务实例资源函数
 	skynet_dl_signal signal;       // 加载的动态链接库中的服务实例对信号量的处理函数
+	skynet_dl_exit exit;           // 加载的动态链接库中的模块清理函数, 节点退出时调用
 };
 
 /// 插入新的 skynet_module 
@@ -52,4 +56,7 @@ void skynet_module_instance_signal(struct skynet_module *, void *inst, int signa
 /// 当前节点的 skynet_module 相关的初始化
 void skynet_module_init(const char *path);
 
+/// 节点退出时调用所有已加载模块的 xxx_module_exit, 此时工作线程已经全部结束
+void skynet_module_exit(void);
+
 #endif
@@ -302,6 +302,29 @@ skynet_context_push(uint32_t handle, struct skynet_message *message) {
 	return 0;
 }
 
+int
+skynet_context_pushmulti(const uint32_t *handles, int n, struct skynet_message *message) {
+	struct skynet_context * ctx[SKYNET_PUSHMULTI_MAX];
+	int i;
+	int fail = 0;
+	assert(n <= SKYNET_PUSHMULTI_MAX);
+
+	skynet_handle_grabmulti(handles, n, ctx);
+
+	for (i=0;i<n;i++) {
+		if (ctx[i] == NULL) {
+			skynet_free(message[i].data);
+			message[i].data = NULL;
+			++fail;
+		} else {
+			skynet_mq_push(ctx[i]->queue, &message[i]);
+			skynet_context_release(ctx[i]);
+		}
+	}
+
+	return fail;
+}
+
 void 
 skynet_context_endless(uint32_t handle) {
 	// 保留一个引用
@@ -766,10 +789,15 @@ cmd_monitor(struct skynet_context * context, const char * param) {
 	return NULL;
 }
 
+int
+skynet_context_mqlen(struct skynet_context *ctx) {
+	return skynet_mq_length(ctx->queue);
+}
+
 /// 得到当前 skynet_context 的 queue 长度, skynet.mqlen() 中有使用到
 static const char *
 cmd_mqlen(struct skynet_context * context, const char * param) {
-	int len = skynet_mq_length(context->queue);
+	int len = skynet_context_mqlen(context);
 	sprintf(context->result, "%d", len);
 	return context->result;
 }
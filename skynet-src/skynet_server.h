@@ -52,6 +52,19 @@ uint32_t skynet_context_handle(struct skynet_context *);
  */
 int skynet_context_push(uint32_t handle, struct skynet_message *message);
 
+// skynet_context_pushmulti 一次最多发送的消息数量
+#define SKYNET_PUSHMULTI_MAX 64
+
+/**
+ * 把 n 条消息分别压入到 handles 对应的 context 的消息队列中, 查询 handle 时只加一次读锁.
+ * 发送失败 (服务已经退出) 的消息, 数据会被释放, 同时 data 被置为 NULL.
+ * @param handles context 的 handle 数组
+ * @param n 数组的长度, 不能超过 SKYNET_PUSHMULTI_MAX
+ * @param message 数据信息数组, 和 handles 一一对应
+ * @return 发送失败的数量
+ */
+int skynet_context_pushmulti(const uint32_t *handles, int n, struct skynet_message *message);
+
 /**
  * 将数据封装为 skynet_message 压入到 context 队列中
  * @param context skynet_context
@@ -63,6 +76,9 @@ int skynet_context_push(uint32_t handle, struct skynet_message *message);
  */
 void skynet_context_send(struct skynet_context * context, void * msg, size_t sz, uint32_t source, int type, int session);
 
+// skynet_context 消息队列的长度
+int skynet_context_mqlen(struct skynet_context *);
+
 /**
  * 生成当前 skynet_context 的新 session
  * @param skynet_context 计算 session 使用的 context
@@ -5,14 +5,36 @@
 #include "skynet_server.h"
 #include "skynet_mq.h"
 #include "skynet_harbor.h"
+#include "atomic.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
+#define MAX_BATCH_SERVICE 64	// 最多可以同时开启批量模式的服务数量
+
 static struct socket_server * SOCKET_SERVER = NULL;
 
+// 开启批量模式的服务在本轮事件中累积的 socket 消息, 只在通信线程中操作
+struct socket_batch {
+	uint32_t active;	// 通信线程中这个位置当前开启批量模式的服务, 0 表示没有
+	uint32_t handle;	// 接收这批消息的服务
+	int n;				// 累积的消息数量
+	size_t sz;			// 已经使用的内存大小
+	size_t cap;			// buffer 的容量
+	char * buffer;		// 批量消息的内容, 布局参考 skynet_socket.h 的 skynet_socket_batch
+};
+
+// 工作线程为开启批量模式的服务占用的位置, 0 表示该位置没有使用, 通过 CAS 修改.
+// 开关本身通过 socket_server_userevent 交给通信线程, 和 socket 事件按顺序处理, 见 switch_batch
+static uint32_t BATCH_HANDLE[MAX_BATCH_SERVICE];
+static int BATCH_COUNT = 0;		// 通信线程中开启批量模式的服务数量
+static struct socket_batch BATCH[MAX_BATCH_SERVICE];
+static bool BATCH_PENDING = false;	// 本轮是否有累积的批量消息
+
+static void free_batch(char * buffer, int n);
+
 void 
 skynet_socket_init() {
 	SOCKET_SERVER = socket_server_create();
@@ -25,6 +47,14 @@ skynet_socket_exit() {
 
 void
 skynet_socket_free() {
+	int i;
+	for (i=0;i<MAX_BATCH_SERVICE;i++) {
+		struct socket_batch *b = &BATCH[i];
+		if (b->buffer) {
+			free_batch(b->buffer, b->n);
+			b->buffer = NULL;
+		}
+	}
 	socket_server_release(SOCKET_SERVER);
 	SOCKET_SERVER = NULL;
 }
@@ -32,6 +62,136 @@ skynet_socket_free() {
 // mainloop thread
 // 主循环线程
 
+/// 查找 handle 对应的 socket_batch, 该服务没有开启批量模式时返回 NULL
+static struct socket_batch *
+find_batch(uint32_t handle) {
+	if (BATCH_COUNT == 0) {
+		return NULL;
+	}
+	int i;
+	for (i=0;i<MAX_BATCH_SERVICE;i++) {
+		if (BATCH[i].active == handle) {
+			return &BATCH[i];
+		}
+	}
+	return NULL;
+}
+
+/// 在通信线程中关闭位置 b 的批量模式
+static void
+deactivate_batch(struct socket_batch *b) {
+	if (b->active) {
+		b->active = 0;
+		--BATCH_COUNT;
+	}
+}
+
+/// 释放批量消息中还没有转交出去的数据
+static void
+free_batch(char * buffer, int n) {
+	const char * ptr = buffer + sizeof(struct skynet_socket_message);
+	int i;
+	for (i=0;i<n;i++) {
+		int sz;
+		struct skynet_socket_message *sm = skynet_socket_batch_next(&ptr, &sz);
+		skynet_free(sm->buffer);
+	}
+	skynet_free(buffer);
+}
+
+/// 将累积的消息作为一条 SKYNET_SOCKET_TYPE_BATCH 消息发给服务
+static void
+flush_batch(struct socket_batch *b) {
+	if (b->n == 0) {
+		return;
+	}
+	struct skynet_socket_message *sm = (struct skynet_socket_message *)b->buffer;
+	sm->type = SKYNET_SOCKET_TYPE_BATCH;
+	sm->id = 0;
+	sm->ud = b->n;
+	sm->buffer = NULL;
+
+	struct skynet_message message;
+	message.source = 0;
+	message.session = 0;
+	message.data = sm;
+	message.sz = b->sz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
+
+	if (skynet_context_push(b->handle, &message)) {
+		// 服务已经退出, 释放消息并且关闭它的批量模式, 同时释放工作线程占用的位置
+		free_batch(b->buffer, b->n);
+		if (b->active == b->handle) {
+			deactivate_batch(b);
+		}
+		ATOM_CAS(&BATCH_HANDLE[b - BATCH], b->handle, 0);
+	}
+
+	// buffer 的所有权已经转交给了消息
+	b->n = 0;
+	b->sz = 0;
+	b->cap = 0;
+	b->buffer = NULL;
+}
+
+/// 一轮事件处理完, 发出所有累积的批量消息
+static void
+flush_all_batch() {
+	if (!BATCH_PENDING) {
+		return;
+	}
+	int i;
+	for (i=0;i<MAX_BATCH_SERVICE;i++) {
+		flush_batch(&BATCH[i]);
+	}
+	BATCH_PENDING = false;
+}
+
+/**
+ * 通信线程中切换服务的批量模式, 由 skynet_socket_batch 通过 SOCKET_USER 事件发来, 和 socket 事件按顺序处理.
+ * 关闭时先把已经累积的消息发出去, 之后的消息直接发送, 不会跑到它们前面.
+ */
+static void
+switch_batch(uint32_t handle, int slot, int enable) {
+	struct socket_batch *b = &BATCH[slot];
+	if (enable) {
+		if (b->active == 0) {
+			++BATCH_COUNT;
+		}
+		b->active = handle;
+	} else if (b->active == handle) {
+		flush_batch(b);
+		deactivate_batch(b);
+	}
+}
+
+/// 在批量消息中为一条 sz 大小的消息分配空间
+static struct skynet_socket_message *
+batch_alloc(struct socket_batch *b, uint32_t handle, size_t sz) {
+	if (b->n > 0 && b->handle != handle) {
+		// 这个位置已经换成了其他服务, 先把之前服务的消息发出去
+		flush_batch(b);
+	}
+	if (b->n == 0) {
+		BATCH_PENDING = true;
+		b->handle = handle;
+		b->sz = sizeof(struct skynet_socket_message);
+	}
+	size_t need = b->sz + sizeof(struct skynet_socket_batch) + SKYNET_SOCKET_BATCH_ALIGN(sz);
+	if (need > b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 1024;
+		while (cap < need) {
+			cap *= 2;
+		}
+		b->buffer = skynet_realloc(b->buffer, cap);
+		b->cap = cap;
+	}
+	struct skynet_socket_batch *h = (struct skynet_socket_batch *)(b->buffer + b->sz);
+	h->sz = sz;
+	b->sz = need;
+	++b->n;
+	return (struct skynet_socket_message *)(h + 1);
+}
+
 /**
  * 将 socket_message 内容转化为 skynet_socket_message, 再使用 skynet_message 保存 skynet_socket_message 的引用, 
  * 最后把 skynet_message 存入到 skynet_context 的队列中.
@@ -57,8 +217,14 @@ forward_message(int type, bool padding, struct socket_message * result) {
 		}
 	}
 
-	// 将 socket_message 使用 skynet_socket_message 存储
-	sm = (struct skynet_socket_message *)skynet_malloc(sz);
+	// 将 socket_message 使用 skynet_socket_message 存储, 开启了批量模式的服务直接写入到批量消息中
+	uint32_t handle = (uint32_t)result->opaque;
+	struct socket_batch *b = find_batch(handle);
+	if (b) {
+		sm = batch_alloc(b, handle, sz);
+	} else {
+		sm = (struct skynet_socket_message *)skynet_malloc(sz);
+	}
 	sm->type = type;
 	sm->id = result->id;
 	sm->ud = result->ud;
@@ -70,6 +236,11 @@ forward_message(int type, bool padding, struct socket_message * result) {
 		sm->buffer = result->data;
 	}
 
+	if (b) {
+		// 等到本轮事件处理完 (SOCKET_IDLE) 再一起发送
+		return;
+	}
+
 	// 将 skynet_socket_message 使用 skynet_message 保存数据
 	struct skynet_message message;
 	message.source = 0;
@@ -77,7 +248,7 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	message.data = sm;
 	message.sz = sz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
 	
-	if (skynet_context_push((uint32_t)result->opaque, &message)) {
+	if (skynet_context_push(handle, &message)) {
 		// todo: report somewhere to close socket
 		// 待办事项: 报告在某处关闭 socket
 		// don't call skynet_socket_close here (It will block mainloop)
@@ -120,6 +291,13 @@ skynet_socket_poll() {
 	case SOCKET_UDP:
 		forward_message(SKYNET_SOCKET_TYPE_UDP, false, &result);
 		break;
+	case SOCKET_IDLE:
+		flush_all_batch();
+		break;
+	case SOCKET_USER:
+		// 目前只有批量模式的开关, ud 为 位置 * 2 + 是否开启
+		switch_batch((uint32_t)result.opaque, result.ud >> 1, result.ud & 1);
+		break;
 	default:
 		skynet_error(NULL, "Unknown socket message type %d.",type);
 		return -1;
@@ -166,6 +344,43 @@ skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int
 	return socket_server_listen(SOCKET_SERVER, source, host, port, backlog);
 }
 
+int 
+skynet_socket_listen_reuseport(struct skynet_context *ctx, const char *host, int port, int backlog) {
+	uint32_t source = skynet_context_handle(ctx);
+	return socket_server_listen_reuseport(SOCKET_SERVER, source, host, port, backlog);
+}
+
+int
+skynet_socket_batch(struct skynet_context *ctx, int enable) {
+	uint32_t handle = skynet_context_handle(ctx);
+	int i;
+	for (i=0;i<MAX_BATCH_SERVICE;i++) {
+		if (BATCH_HANDLE[i] == handle) {
+			if (!enable) {
+				// 先发出关闭的请求再释放位置, 之后占用这个位置的服务开启的请求一定排在后面
+				socket_server_userevent(SOCKET_SERVER, handle, i * 2);
+				ATOM_CAS(&BATCH_HANDLE[i], handle, 0);
+			}
+			return 0;
+		}
+	}
+	if (!enable) {
+		return 0;
+	}
+	for (i=0;i<MAX_BATCH_SERVICE;i++) {
+		if (BATCH_HANDLE[i] == 0 && ATOM_CAS(&BATCH_HANDLE[i], 0, handle)) {
+			socket_server_userevent(SOCKET_SERVER, handle, i * 2 + 1);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void
+skynet_socket_accept_budget(int budget) {
+	socket_server_accept_budget(SOCKET_SERVER, budget);
+}
+
 int 
 skynet_socket_connect(struct skynet_context *ctx, const char *host, int port) {
 	uint32_t source = skynet_context_handle(ctx);
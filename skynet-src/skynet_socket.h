@@ -5,6 +5,8 @@
 #ifndef skynet_socket_h
 #define skynet_socket_h
 
+#include <stddef.h>
+
 struct skynet_context;
 
 #define SKYNET_SOCKET_TYPE_DATA 1       // tcp 接收到数据
@@ -14,6 +16,7 @@ struct skynet_context;
 #define SKYNET_SOCKET_TYPE_ERROR 5      // socket 出错, 已经无法使用
 #define SKYNET_SOCKET_TYPE_UDP 6        // udp 接收到数据
 #define SKYNET_SOCKET_TYPE_WARNING 7    // socket 相关的警告通知
+#define SKYNET_SOCKET_TYPE_BATCH 8      // 批量消息, 开启批量模式的服务在一轮事件中收到的所有 socket 消息, ud 为消息数量
 
 /// skynet 与 socket_server 的数据转化, 一般是将 socket_message 的内容传给 skynet_socket_message
 struct skynet_socket_message {
@@ -23,6 +26,27 @@ struct skynet_socket_message {
 	char * buffer; // 数据指针
 };
 
+/*
+	批量消息 (SKYNET_SOCKET_TYPE_BATCH) 的内存布局:
+	skynet_socket_message, type 为 SKYNET_SOCKET_TYPE_BATCH, ud 为消息数量, buffer 为 NULL;
+	之后依次存放每一条消息: skynet_socket_batch 头部, 紧接着是 skynet_socket_message 以及可能填充的字符串(同普通的 socket 消息),
+	每条消息占用的内存按 8 字节对齐, 可以使用 skynet_socket_batch_next 遍历.
+*/
+struct skynet_socket_batch {
+	size_t sz;     // 之后的 skynet_socket_message 连同填充内容的大小
+};
+
+#define SKYNET_SOCKET_BATCH_ALIGN(sz) (((sz) + 7) & ~(size_t)7)
+
+/// 从批量消息的 *ptr 位置取出一条消息, *sz 返回消息连同填充内容的大小, *ptr 移动到下一条消息
+static inline struct skynet_socket_message *
+skynet_socket_batch_next(const char **ptr, int *sz) {
+	const struct skynet_socket_batch *h = (const struct skynet_socket_batch *)*ptr;
+	*sz = (int)h->sz;
+	*ptr += sizeof(*h) + SKYNET_SOCKET_BATCH_ALIGN(h->sz);
+	return (struct skynet_socket_message *)(h + 1);
+}
+
 /// 当前节点的 socket 环境初始化
 void skynet_socket_init();
 
@@ -44,6 +68,17 @@ void skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *bu
 /// 侦听指定的地址端口. 返回值, 成功返回 socket id, 否则返回 -1
 int skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog);
 
+/// 开启 SO_REUSEPORT 侦听指定的地址端口, 多个服务侦听同一个端口组成侦听组. 返回值, 成功返回 socket id, 否则返回 -1
+int skynet_socket_listen_reuseport(struct skynet_context *ctx, const char *host, int port, int backlog);
+
+/// 开启/关闭批量模式, 开启后通信线程把一轮事件中发给该服务的所有 socket 消息合并成一条 SKYNET_SOCKET_TYPE_BATCH 消息.
+/// 开关在通信线程中和 socket 事件按顺序生效, 关闭时先发出已经累积的消息, 保证消息顺序不变.
+/// 返回值, 成功返回 0, 开启批量模式的服务数量达到上限时返回 -1
+int skynet_socket_batch(struct skynet_context *ctx, int enable);
+
+/// 设置侦听 socket 在一次可读事件上最多连续 accept 的连接数量
+void skynet_socket_accept_budget(int budget);
+
 /// 连接到指定的主机. 返回值, 成功返回 socket id, 否则返回 -1
 int skynet_socket_connect(struct skynet_context *ctx, const char *host, int port);
 
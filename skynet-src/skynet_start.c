@@ -338,6 +338,7 @@ skynet_start(struct skynet_config * config) {
 	skynet_module_init(config->module_path);
 	skynet_timer_init();
 	skynet_socket_init();
+	skynet_socket_accept_budget(config->accept_budget);
 
 	// 开启打印日志服务
 	struct skynet_context *ctx = skynet_context_new(config->logservice, config->logger);
@@ -350,6 +351,9 @@ skynet_start(struct skynet_config * config) {
 
 	start(config->thread);
 
+	// 模块的清理函数可能还要用到 lua 的共享短字符串表, 所以在 skynet_main 调用 luaS_exitshr 之前运行
+	skynet_module_exit();
+
 	// harbor_exit may call socket send, so it should exit before socket_free
 	// harbor_exit 可能会调用 socket 方法, 所以它应该在 socket_free 之前运行
 	skynet_harbor_exit();
@@ -1,3 +1,8 @@
+// accept4 和 recvmmsg 需要 _GNU_SOURCE
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "skynet.h"
 
 #include "socket_server.h"
@@ -6,6 +11,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
@@ -21,6 +27,7 @@
 #define MAX_SOCKET_P 16			// 决定能够管理的 socket 数量, 直接控制当前 skynet 节点能够操作的 socket 数量
 #define MAX_EVENT 64			// 每次从 event pool 中读取 event 的最大数量
 #define MIN_READ_BUFFER 64		// 初始化 socket 读取数据的最小字节数
+#define DEFAULT_ACCEPT_BUDGET 16	// 每个侦听 socket 的可读事件上默认最多连续 accept 的连接数量
 
 // socket 的状态
 /*
@@ -70,6 +77,12 @@
 
 #define MAX_UDP_PACKAGE 65535	// udp 数据包的大小
 
+#ifdef __linux__
+#define MAX_UDP_BATCH 16		// linux 下使用 recvmmsg 一次系统调用最多读取的 udp 数据包数量
+#endif
+
+#define MAX_SEND_IOV 64			// tcp 发送时 writev 一次系统调用最多合并的 write_buffer 数量
+
 // 写数据的缓存, 这是一个链表
 struct write_buffer {
 	struct write_buffer * next;	// 关联的下一个 write_buffer
@@ -114,6 +127,34 @@ struct socket {
 	} p;
 };
 
+/// 是一个方便 sockaddr 操作的整合功能, 因为内部的成员是共享内存空间的, 这个方式有点屌!!!
+union sockaddr_all {
+	// 用于存储参与（IP）套接字通信的计算机上的一个internet协议（IP）地址。
+	// 为了统一地址结构的表示方法 ，统一接口函数，使得不同的地址结构可以被bind()、connect()、recvfrom()、sendto()等函数调用。
+	// 但一般的编程中并不直接对此数据结构进行操作，而使用另一个与之等价的数据结构sockaddr_in, 两者大小都是16字节，所以二者之间可以进行切换。
+	struct sockaddr s;
+
+	// 此数据结构用做bind、connect、recvfrom、sendto等函数的参数，指明地址信息。
+	// 但一般编程中并不直接针对此数据结构操作，而是使用另一个与sockaddr等价的数据结构.
+	struct sockaddr_in v4;
+
+	// 同上, 但是是 ipv6 的协议.
+	struct sockaddr_in6 v6;
+};
+
+#ifdef MAX_UDP_BATCH
+// recvmmsg 批量读取 udp 数据包使用的缓存, 一次读出的数据包在后面的 socket_server_poll 调用中逐个派发, 不再重复调用 recvmmsg
+struct udp_batch {
+	int id;		// 缓存中的数据包所属的 socket id
+	int n;		// 缓存中数据包的数量
+	int index;	// 下一个待派发的数据包索引
+	struct mmsghdr msg[MAX_UDP_BATCH];
+	struct iovec iov[MAX_UDP_BATCH];
+	union sockaddr_all addr[MAX_UDP_BATCH];	// 每个数据包的来源地址
+	uint8_t buffer[MAX_UDP_BATCH][MAX_UDP_PACKAGE];	// 每个数据包的内容
+};
+#endif
+
 // socket_server 服务对象
 struct socket_server {
 	// 用管道来保证多线程操作, 所有的操作命令通过管道存储起来,
@@ -126,11 +167,17 @@ struct socket_server {
 	int alloc_id;			// 分配的 id 计数
 	int event_n;			// 实际从 event pool 中读取数据的数量
 	int event_index;		// 当前处理到的 event 索引
+	int accept_budget;		// 同一个可读事件上最多连续 accept 的连接数量
+	int accept_count;		// 当前侦听事件上已经 accept 的连接数量
 	struct socket_object_interface soi;	// 用户数据类型的内存操作接口
 	struct event ev[MAX_EVENT];			// 从 event poll 得到事件的集合
 	struct socket slot[MAX_SOCKET];		// 连接的 socket 集合
 	char buffer[MAX_INFO];				// 存储一些信息内容, 一般存储 IP 地址信息
+#ifdef MAX_UDP_BATCH
+	struct udp_batch udpbatch;			// 批量接收到的 udp 数据内容
+#else
 	uint8_t udpbuffer[MAX_UDP_PACKAGE];	// 接收到的 udp 数据内容
+#endif
 	fd_set rfds;						// select 函数中判断是否有可读字符集
 };
 
@@ -202,6 +249,12 @@ struct request_udp {
 	uintptr_t opaque;
 };
 
+/// 原样返回给 socket_server_poll 调用者的事件
+struct request_user {
+	uintptr_t opaque;
+	int ud;
+};
+
 /*
 	The first byte is TYPE
 	第一个字节是类型
@@ -218,6 +271,7 @@ struct request_udp {
 	T Set opt
 	U Create UDP socket
 	C set udp address
+	E User event
  */
 
 /// 这里也是一个很屌的处理, 每个 request_package 变量, 所占的内存空间是连续的 8 + 256 + 256 = 520 字节大小
@@ -235,25 +289,11 @@ struct request_package {
 		struct request_setopt setopt;
 		struct request_udp udp;
 		struct request_setudp set_udp;
+		struct request_user user;
 	} u;
 	uint8_t dummy[256];	// 这是一个虚拟的内存空间, 预留使用, 例如: 可以给 request_open.host 用来存储字符串
 };
 
-/// 是一个方便 sockaddr 操作的整合功能, 因为内部的成员是共享内存空间的, 这个方式有点屌!!!
-union sockaddr_all {
-	// 用于存储参与（IP）套接字通信的计算机上的一个internet协议（IP）地址。
-	// 为了统一地址结构的表示方法 ，统一接口函数，使得不同的地址结构可以被bind()、connect()、recvfrom()、sendto()等函数调用。
-	// 但一般的编程中并不直接对此数据结构进行操作，而使用另一个与之等价的数据结构sockaddr_in, 两者大小都是16字节，所以二者之间可以进行切换。
-	struct sockaddr s;
-
-	// 此数据结构用做bind、connect、recvfrom、sendto等函数的参数，指明地址信息。
-	// 但一般编程中并不直接针对此数据结构操作，而是使用另一个与sockaddr等价的数据结构.
-	struct sockaddr_in v4;
-
-	// 同上, 但是是 ipv6 的协议.
-	struct sockaddr_in6 v6;
-};
-
 // 发送数据对象
 struct send_object {
 	void * buffer;	// 数据的指针
@@ -416,6 +456,20 @@ socket_server_create() {
 
 	ss->event_n = 0;
 	ss->event_index = 0;
+	ss->accept_budget = DEFAULT_ACCEPT_BUDGET;
+	ss->accept_count = 0;
+
+#ifdef MAX_UDP_BATCH
+	// recvmmsg 的每个数据包都固定使用 udpbatch 中对应的地址和缓存
+	struct udp_batch *b = &ss->udpbatch;
+	b->id = -1;
+	b->n = 0;
+	b->index = 0;
+	for (i=0;i<MAX_UDP_BATCH;i++) {
+		b->iov[i].iov_base = b->buffer[i];
+		b->iov[i].iov_len = MAX_UDP_PACKAGE;
+	}
+#endif
 
 	memset(&ss->soi, 0, sizeof(ss->soi));
 
@@ -664,16 +718,25 @@ _failed:
 }
 
 /// 基于 tcp 协议, 使用 socket 将 wb_list 内的数据发送出去, 但是并不保证会将 wb_list 内的所有数据全部发送出去.
+/// 链表中连续的多个 write_buffer 使用 writev 一次系统调用发送, 每次最多 MAX_SEND_IOV 个.
 /// 返回值, 返回 -1, 表示发送操作完成; SOCKET_CLOSE, 表示关闭掉了该 socket.
 static int
 send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
-	
+	struct iovec iov[MAX_SEND_IOV];
+
 	// 理想状态下是希望将 wb_list 内的数据全部发送出去
 	while (list->head) {
-		struct write_buffer * tmp = list->head;
-		for (;;) {
-			int sz = write(s->fd, tmp->ptr, tmp->sz);
+		int n = 0;
+		struct write_buffer * tmp;
+		for (tmp = list->head; tmp && n < MAX_SEND_IOV; tmp = tmp->next) {
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			++n;
+		}
 
+		ssize_t sz;
+		for (;;) {
+			sz = writev(s->fd, iov, n);
 			if (sz < 0) {
 				switch(errno) {
 
@@ -690,20 +753,27 @@ send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 				force_close(ss, s, result);
 				return SOCKET_CLOSE;
 			}
+			break;
+		}
 
-			// 减掉已发送数据的大小
-			s->wb_size -= sz;
+		// 减掉已发送数据的大小
+		s->wb_size -= sz;
 
-			// 数据并没有完全发送出去, 将已经发送的数据忽略掉, 并且停止继续发送
-			if (sz != tmp->sz) {
-				tmp->ptr += sz;
-				tmp->sz -= sz;
-				return -1;
-			}
-			break;
+		// 释放已经完全发送的 write_buffer
+		int i;
+		for (i = 0; i < n && sz >= list->head->sz; i++) {
+			tmp = list->head;
+			sz -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss, tmp);
+		}
+
+		// 数据并没有完全发送出去, 将已经发送的数据忽略掉, 并且停止继续发送
+		if (i < n) {
+			list->head->ptr += sz;
+			list->head->sz -= sz;
+			return -1;
 		}
-		list->head = tmp->next;
-		write_buffer_free(ss, tmp);
 	}
 	list->tail = NULL;
 
@@ -1341,6 +1411,14 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
+	case 'E': {
+		struct request_user * user = (struct request_user *)buffer;
+		result->opaque = user->opaque;
+		result->id = 0;
+		result->ud = user->ud;
+		result->data = NULL;
+		return SOCKET_USER;
+	}
 	default:
 		fprintf(stderr, "socket-server: Unknown ctrl %c.\n",type);
 		return -1;
@@ -1434,13 +1512,75 @@ gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	return addrsz;
 }
 
+#ifdef MAX_UDP_BATCH
+
+/// 使用 recvmmsg 一次读出多个 udp 数据包存放到 ss->udpbatch 中, 返回读取到的数据包数量, 出错时返回 -1 (errno 保存错误代码)
+static int
+read_udp_batch(struct socket_server *ss, struct socket *s) {
+	struct udp_batch *b = &ss->udpbatch;
+	int i;
+
+	// recvmmsg 会修改 msg_namelen 和 msg_len, 所以每次读取之前都需要重新设置
+	for (i=0;i<MAX_UDP_BATCH;i++) {
+		struct msghdr *h = &b->msg[i].msg_hdr;
+		memset(h, 0, sizeof(*h));
+		h->msg_name = &b->addr[i];
+		h->msg_namelen = sizeof(b->addr[i]);
+		h->msg_iov = &b->iov[i];
+		h->msg_iovlen = 1;
+	}
+
+	// int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+	// 是 recvmsg 的批量版本, 一次系统调用最多读取 vlen 个数据包. 返回值, 成功返回读取到的数据包数量, 否则返回 -1
+	int n = recvmmsg(s->fd, b->msg, MAX_UDP_BATCH, 0, NULL);
+	b->id = s->id;
+	b->index = 0;
+	b->n = n < 0 ? 0 : n;
+	return n;
+}
+
+#endif
+
 /// 基于 udp 协议, 读取数据, 读取成功返回 SOCKET_UDP
+/// linux 下一次 recvmmsg 读出多个数据包, 之后每次调用从缓存中取出一个, 缓存取空后才会再次读取 socket
 static int
 forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_message * result) {
+#ifdef MAX_UDP_BATCH
+	struct udp_batch *b = &ss->udpbatch;
+_next:
+	if (b->id != s->id || b->index >= b->n) {
+		int n = read_udp_batch(ss, s);
+		if (n < 0) {
+			switch(errno) {
+			case EINTR:
+			case EAGAIN:
+				break;
+			default:
+				// close when error
+				// 其他错误将关闭掉这个 socket
+				force_close(ss, s, result);
+				result->data = strerror(errno);
+				return SOCKET_ERROR;
+			}
+			return -1;
+		}
+		if (n == 0) {
+			return -1;
+		}
+	}
+
+	int i = b->index++;
+	int n = b->msg[i].msg_len;
+	socklen_t slen = b->msg[i].msg_hdr.msg_namelen;
+	union sockaddr_all *psa = &b->addr[i];
+	const uint8_t *udpbuffer = b->buffer[i];
+#else
 
 	// 读取数据
 	union sockaddr_all sa;
+	union sockaddr_all *psa = &sa;
 	socklen_t slen = sizeof(sa);
+	const uint8_t *udpbuffer = ss->udpbuffer;
 
 	// ssize_t recvfrom(int sockfd,void *buf,int len,unsigned int flags, struct sockaddr *from,socket_t *fromlen); 
 	// 接收一个数据报并保存源地址。
@@ -1468,23 +1608,24 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_me
 		}
 		return -1;
 	}
+#endif
 
 	// 将地址信息存储在 data + n 的内存空间位置
 	uint8_t * data;
-	if (slen == sizeof(sa.v4)) {
+	if (slen == sizeof(psa->v4)) {
 		if (s->protocol != PROTOCOL_UDP)
-			return -1;
+			goto _mismatch;
 		data = MALLOC(n + 1 + 2 + 4);
-		gen_udp_address(PROTOCOL_UDP, &sa, data + n);
+		gen_udp_address(PROTOCOL_UDP, psa, data + n);
 	} else {
 		if (s->protocol != PROTOCOL_UDPv6)
-			return -1;
+			goto _mismatch;
 		data = MALLOC(n + 1 + 2 + 16);
-		gen_udp_address(PROTOCOL_UDPv6, &sa, data + n);
+		gen_udp_address(PROTOCOL_UDPv6, psa, data + n);
 	}
 
 	// 复制读取的数据内容
-	memcpy(data, ss->udpbuffer, n);
+	memcpy(data, udpbuffer, n);
 
 	// 记录操作结果
 	result->opaque = s->opaque;
@@ -1493,6 +1634,14 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_me
 	result->data = (char *)data;
 
 	return SOCKET_UDP;
+
+_mismatch:
+#ifdef MAX_UDP_BATCH
+	// 丢弃协议不匹配的数据包, 继续处理缓存中剩下的数据包, 避免它们滞留在缓存中
+	goto _next;
+#else
+	return -1;
+#endif
 }
 
 /// 报告 socket 连接, 成功返回 SOCKET_OPEN, 否则返回 SOCKET_ERROR
@@ -1589,7 +1738,12 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 	// addrlen：（可选）指针，输入参数，配合addr一起使用，指向存有addr地址长度的整型数。
 	// 如果 addr 与 addrlen 中有一个为 0/NULL，将不返回所接受的套接口远程地址的任何信息。
 	// 返回值, 如果成功返回连接成功的 socket 的文件描述符, 否则返回错误代码
+	// linux 下使用 accept4 在 accept 的同时设置 SOCK_NONBLOCK | SOCK_CLOEXEC, 省掉后面的 fcntl 调用.
+#ifdef SOCK_NONBLOCK
+	int client_fd = accept4(s->fd, &u.s, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
 	int client_fd = accept(s->fd, &u.s, &len);
+#endif
 
 	// 如果没有连接的 socket 函数直接返回
 	if (client_fd < 0) {
@@ -1616,8 +1770,10 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 	// 开启保持活动检测
 	socket_keepalive(client_fd);
 
+#ifndef SOCK_NONBLOCK
 	// 连接的 socket 是非阻塞的方式工作
 	sp_nonblocking(client_fd);
+#endif
 
 	// 使用之前保留的 id, 生成一个 socket, 注意, 这时不会注册到 event pool 中.
 	struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
@@ -1693,6 +1849,13 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 
 		// 当事件处理完的时候, 从新获取新的时间集合
 		if (ss->event_index == ss->event_n) {
+			// 先报告本轮事件处理完毕, 让上层有机会在阻塞之前处理本轮累积的数据
+			if (ss->event_n > 0) {
+				ss->event_n = 0;
+				ss->event_index = 0;
+				return SOCKET_IDLE;
+			}
+
 			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
 			ss->checkctrl = 1;	// 标记为需要从管道读取数据
 
@@ -1727,8 +1890,16 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		case SOCKET_TYPE_LISTEN: {		// 此时这个 socket 正在 listen
 			int ok = report_accept(ss, s, result);
 			if (ok > 0) {
+				// 在预算之内, 下次循环继续在同一个事件上 accept, 不用等到下一次 sp_wait
+				if (++ss->accept_count < ss->accept_budget) {
+					--ss->event_index;
+				} else {
+					ss->accept_count = 0;
+				}
 				return SOCKET_ACCEPT;
-			} if (ok < 0 ) {
+			}
+			ss->accept_count = 0;
+			if (ok < 0 ) {
 				return SOCKET_ERROR;
 			}
 			// when ok == 0, retry
@@ -1909,6 +2080,14 @@ socket_server_exit(struct socket_server *ss) {
 	send_request(ss, &request, 'X', 0);
 }
 
+void
+socket_server_userevent(struct socket_server *ss, uintptr_t opaque, int ud) {
+	struct request_package request;
+	request.u.user.opaque = opaque;
+	request.u.user.ud = ud;
+	send_request(ss, &request, 'E', sizeof(request.u.user));
+}
+
 void
 socket_server_close(struct socket_server *ss, uintptr_t opaque, int id) {
 	// 生成 request_close
@@ -1937,7 +2116,7 @@ socket_server_shutdown(struct socket_server *ss, uintptr_t opaque, int id) {
 
 /// bind 到指定的 [地址, 端口], 失败返回 -1, 成功得到 bind 成功的 socket 的文件描述符
 static int
-do_bind(const char *host, int port, int protocol, int *family) {
+do_bind(const char *host, int port, int protocol, int *family, bool reuseport) {
 	int fd;
 	int status;
 	int reuse = 1;
@@ -1981,6 +2160,18 @@ do_bind(const char *host, int port, int protocol, int *family) {
 		goto _failed;
 	}
 
+	// SO_REUSEPORT 允许多个 socket 绑定在同一个 [地址, 端口] 上, 由内核把新的连接分摊给它们.
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int))==-1) {
+			goto _failed;
+		}
+#else
+		fprintf(stderr, "socket-server : SO_REUSEPORT is not supported.\n");
+		goto _failed;
+#endif
+	}
+
 	// int bind( int sockfd, const struct sockaddr * my_addr, socklen_t addrlen);
 	// 将一本地地址与一套接口捆绑。
 	// sockfd 表示已经建立的socket编号（描述符）；
@@ -2006,9 +2197,9 @@ _failed_fd:
 
 /// 侦听指定的 [地址, 端口], 失败返回 -1, 成功返回正在侦听的 socket 文件描述符
 static int
-do_listen(const char * host, int port, int backlog) {
+do_listen(const char * host, int port, int backlog, bool reuseport) {
 	int family = 0;
-	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family);
+	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family, reuseport);
 	if (listen_fd < 0) {
 		return -1;
 	}
@@ -2027,13 +2218,17 @@ do_listen(const char * host, int port, int backlog) {
 		return -1;
 	}
 
+	// 侦听的 socket 必须是非阻塞的, 在同一个可读事件上连续 accept 时, 没有新的连接会返回 EAGAIN 而不是阻塞通信线程
+	sp_nonblocking(listen_fd);
+
 	return listen_fd;
 }
 
-int 
-socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
+/// 开始侦听并生成 request_listen 写入管道, 返回值, 成功返回 socket id, 否则返回 -1
+static int
+listen_request(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog, bool reuseport) {
 	// 开始侦听
-	int fd = do_listen(addr, port, backlog);
+	int fd = do_listen(addr, port, backlog, reuseport);
 	if (fd < 0) {
 		return -1;
 	}
@@ -2056,6 +2251,24 @@ socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * ad
 	return id;
 }
 
+int 
+socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
+	return listen_request(ss, opaque, addr, port, backlog, false);
+}
+
+int 
+socket_server_listen_reuseport(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
+	return listen_request(ss, opaque, addr, port, backlog, true);
+}
+
+void
+socket_server_accept_budget(struct socket_server *ss, int budget) {
+	if (budget < 1) {
+		budget = 1;
+	}
+	ss->accept_budget = budget;
+}
+
 int
 socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	
@@ -2108,7 +2321,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	int family;
 	if (port != 0 || addr != NULL) {
 		// bind
-		fd = do_bind(addr, port, IPPROTO_UDP, &family);
+		fd = do_bind(addr, port, IPPROTO_UDP, &family, false);
 		if (fd < 0) {
 			return -1;
 		}
@@ -15,6 +15,8 @@
 #define SOCKET_ERROR 4      // socket 操作产生错误, 这时的 socket 是无法操作的
 #define SOCKET_EXIT 5       // 当前 skynet 节点退出通信的轮询
 #define SOCKET_UDP 6        // udp 协议, 接收数据成功时的返回值
+#define SOCKET_IDLE 7       // 本轮从 event pool 取出的事件已经全部处理完, 下次调用将阻塞在 sp_wait 上
+#define SOCKET_USER 8       // socket_server_userevent 发来的事件, 按请求的顺序在通信线程中返回, opaque 和 ud 原样带回
 
 struct socket_server;
 
@@ -48,6 +50,9 @@ int socket_server_poll(struct socket_server *, struct socket_message *result, in
 /// 请求退出
 void socket_server_exit(struct socket_server *);
 
+/// 请求通信线程返回一个 SOCKET_USER 事件, 和其他请求一样按顺序处理, 用于需要在通信线程中完成的操作
+void socket_server_userevent(struct socket_server *, uintptr_t opaque, int ud);
+
 /// 请求关闭指定的 socket
 void socket_server_close(struct socket_server *, uintptr_t opaque, int id);
 
@@ -72,6 +77,12 @@ void socket_server_send_lowpriority(struct socket_server *, int id, const void *
 /// 这个函数首先会 bind, 然后再 listen
 int socket_server_listen(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog);
 
+/// 同 socket_server_listen, 但是侦听的 socket 会开启 SO_REUSEPORT, 多个服务可以侦听同一个 [地址, 端口] 组成侦听组, 由内核分摊新的连接.
+int socket_server_listen_reuseport(struct socket_server *, uintptr_t opaque, const char * addr, int port, int backlog);
+
+/// 设置侦听 socket 在一次可读事件上最多连续 accept 的连接数量, 小于 1 时按 1 处理
+void socket_server_accept_budget(struct socket_server *, int budget);
+
 /// 请求连接到指定的主机. 返回值, 如果请求成功返回 socket id, 否则返回 -1
 int socket_server_connect(struct socket_server *, uintptr_t opaque, const char * addr, int port);
 
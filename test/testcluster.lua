@@ -0,0 +1,133 @@
+-- cluster 测试: 节点通过 cluster 调用自己, 检查大消息, 名字地址, 名字查询和代理服务,
+-- 检查慢请求不会阻塞其它请求, 统计串行请求的延迟和并发小请求的吞吐量,
+-- 以及传输大消息 (分段发送) 的同时小请求的延迟.
+-- 需要在 config 中配置 cluster = "./examples/clustername.lua"
+-- 用法: testcluster [并发数量] [每个协程的请求数量]
+
+local skynet = require "skynet"
+local cluster = require "cluster"
+require "skynet.manager"	-- inject skynet.register
+
+local mode = ...
+
+if mode == "backend" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, cmd, ...)
+		if cmd == "sleep" then
+			skynet.sleep(...)
+		elseif cmd == "error" then
+			error "backend error"
+		end
+		skynet.ret(skynet.pack(cmd, ...))
+	end)
+	skynet.register ".clusterbackend"
+end)
+
+elseif mode == "bulk" then
+
+-- 反复收发 8M 的消息, 模拟传输状态快照
+local backend = tonumber((select(2, ...)))
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local snapshot = string.rep("S", 8 * 1024 * 1024)
+		for i = 1, 5 do
+			local _, v = cluster.call("db", backend, "echo", snapshot)
+			assert(#v == #snapshot)
+		end
+		skynet.ret()
+	end)
+end)
+
+else
+
+local concurrent = tonumber(mode) or 100
+local count = tonumber((select(2, ...))) or 100
+
+skynet.start(function()
+	local backend = skynet.newservice(SERVICE_NAME, "backend")
+	cluster.open "db"
+
+	-- 1 个 2 秒的慢请求, 同时发起的快请求应该先返回
+	local slow_done
+	skynet.fork(function()
+		assert(cluster.call("db", backend, "sleep", 200) == "sleep")
+		slow_done = true
+	end)
+	skynet.sleep(10)
+
+	-- 大于 32K 的请求和回应会分成多个数据包
+	local large = string.rep("X", 100 * 1024)
+	local cmd, v = cluster.call("db", backend, "echo", large)
+	assert(cmd == "echo" and v == large)
+	assert(select(2, cluster.call("db", ".clusterbackend", "echo", "name")) == "name")
+	cluster.register("backend", backend)
+	assert(cluster.query("db", "backend") == backend)
+	assert(not pcall(cluster.query, "db", "nobody"))
+	assert(not pcall(cluster.call, "db", backend, "error"))
+	assert(not pcall(cluster.call, "nonode", backend, "echo"))
+	local proxy = cluster.proxy("db", backend)
+	assert(select(2, skynet.call(proxy, "lua", "echo", large)) == large)
+	print "cluster check ok"
+
+	local n = 1000
+	local start = skynet.time()
+	for i = 1, n do
+		cluster.call("db", backend, "echo", i)
+	end
+	print(string.format("%d serial requests : %.2fs (%.0fus per request)", n, skynet.time() - start, (skynet.time() - start) * 1000000 / n))
+
+	start = skynet.now()
+	for i = 1, 100 do
+		local cmd, v = cluster.call("db", backend, "echo", i)
+		assert(cmd == "echo" and v == i)
+	end
+	assert(not slow_done, "fast requests are blocked by the slow one")
+	print(string.format("100 requests during a slow request : %.2fs", (skynet.now() - start) / 100))
+
+	-- 并发的小请求
+	local finish = 0
+	start = skynet.now()
+	for i = 1, concurrent do
+		skynet.fork(function()
+			for j = 1, count do
+				local _, v = cluster.call("db", backend, "echo", j)
+				assert(v == j)
+			end
+			finish = finish + 1
+		end)
+	end
+	while finish < concurrent do
+		skynet.sleep(1)
+	end
+	local t = (skynet.now() - start) / 100
+	print(string.format("%d coroutines x %d requests : %.2fs (%.0f/s)", concurrent, count, t, concurrent * count / t))
+
+	-- 4 个服务反复收发 8M 的消息, 同时测量发给另一个服务的小请求的延迟
+	local small = skynet.newservice(SERVICE_NAME, "backend")
+	local transfers = 0
+	for i = 1, 4 do
+		local bulk = skynet.newservice(SERVICE_NAME, "bulk", skynet.newservice(SERVICE_NAME, "backend"))
+		skynet.fork(function()
+			skynet.call(bulk, "lua")
+			transfers = transfers + 1
+		end)
+	end
+	skynet.sleep(1)
+	local max, total, n = 0, 0, 0
+	while transfers < 4 do
+		local t = skynet.time()
+		cluster.call("db", small, "echo", n)
+		t = skynet.time() - t
+		total = total + t
+		n = n + 1
+		if t > max then
+			max = t
+		end
+	end
+	print(string.format("%d requests during 8M transfers : avg %.2fms, max %.2fms", n, total * 1000 / n, max * 1000))
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,69 @@
+-- codecache 测试: 启动 N 个 require 了常用模块的服务, 统计每个服务的 lua 内存, 启动耗时, 以及 codecache 的命中情况,
+-- 最后检查 clear 之后旧的缓存表会被回收.
+-- 在 config 中配置 codecache_preload = "目录" 可以在启动时预先加载这个目录下的代码.
+-- 用法: testcodecache [服务数量]
+
+local skynet = require "skynet"
+local cache = require "skynet.codecache"
+
+local mode = ...
+
+if mode == "agent" then
+
+require "skynet.manager"
+require "socket"
+require "skynet.queue"
+require "sharedata"
+require "datacenter"
+require "multicast"
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd == "mem" then
+			collectgarbage "collect"
+			skynet.ret(skynet.pack(collectgarbage "count"))
+		else
+			skynet.ret()
+			skynet.exit()
+		end
+	end)
+end)
+
+else
+
+local N = tonumber(mode) or 200
+
+local function stat()
+	local s = cache.stat()
+	return string.format("entry %d preload %d hit %d miss %d", s.entry, s.preload, s.hit, s.miss)
+end
+
+skynet.start(function()
+	print("codecache before :", stat())
+	local agents = {}
+	local start = skynet.hpc()
+	for i = 1, N do
+		agents[i] = skynet.newservice(SERVICE_NAME, "agent")
+	end
+	local t = (skynet.hpc() - start) / 1e6
+	local mem = 0
+	for _, agent in ipairs(agents) do
+		mem = mem + skynet.call(agent, "lua", "mem")
+	end
+	print(string.format("%d services : launch %.3fms each, lua memory %.1fKB each", N, t / N, mem / N))
+	print("codecache after  :", stat())
+	for _, agent in ipairs(agents) do
+		skynet.call(agent, "lua", "exit")
+	end
+	-- clear 换下来的缓存表在没有读取者之后由下一次写入回收
+	for i = 1, 10 do
+		cache.clear()
+		skynet.call(skynet.newservice(SERVICE_NAME, "agent"), "lua", "exit")
+	end
+	local retired = cache.stat().retired
+	print("codecache clear  :", stat(), "retired", retired)
+	assert(retired <= 1)
+	skynet.exit()
+end)
+
+end
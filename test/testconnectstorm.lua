@@ -0,0 +1,74 @@
+-- 连接风暴测试: 同时发起大量的连接, 统计侦听服务全部 accept 完成的耗时.
+-- 用法: testconnectstorm [连接数量] [侦听服务数量]
+-- 侦听服务数量大于 1 时, 使用 SO_REUSEPORT 组成侦听组, 由内核分摊新的连接.
+-- 可以配合 config 中的 accept_budget 对比不同的 accept 预算.
+
+local skynet = require "skynet"
+local socket = require "socket"
+local driver = require "socketdriver"
+
+local PORT = 8002
+
+local mode, reuseport = ...
+
+if mode == "listener" then
+	skynet.start(function()
+		local accepted = 0
+		local id = socket.listen("127.0.0.1", PORT, 4096, reuseport == "true")
+		socket.start(id, function(fd, addr)
+			accepted = accepted + 1
+			driver.close(fd)
+		end)
+		skynet.dispatch("lua", function(_, _, cmd)
+			if cmd == "count" then
+				skynet.ret(skynet.pack(accepted))
+			elseif cmd == "exit" then
+				socket.close(id)
+				skynet.ret(skynet.pack(accepted))
+				skynet.exit()
+			end
+		end)
+	end)
+else
+	local total = tonumber(mode) or 5000
+	local n = tonumber(reuseport) or 1
+
+	skynet.start(function()
+		local listeners = {}
+		for i = 1, n do
+			listeners[i] = skynet.newservice(SERVICE_NAME, "listener", tostring(n > 1))
+		end
+
+		local connected = 0
+		local failed = 0
+		local start = skynet.time()
+		for i = 1, total do
+			skynet.fork(function()
+				local ok, fd = pcall(socket.open, "127.0.0.1", PORT)
+				if ok and fd then
+					connected = connected + 1
+					socket.close(fd)
+				else
+					failed = failed + 1
+				end
+			end)
+		end
+
+		local accepted
+		repeat
+			skynet.sleep(1)
+			accepted = 0
+			for _, addr in ipairs(listeners) do
+				accepted = accepted + skynet.call(addr, "lua", "count")
+			end
+		until accepted + failed >= total or skynet.time() - start > 60
+		local elapsed = skynet.time() - start
+
+		print(string.format("connect storm: %d connections, %d listeners, accepted %d, failed %d, %.2fs (%.0f/s)",
+			total, n, accepted, failed, elapsed, accepted / elapsed))
+		for i, addr in ipairs(listeners) do
+			print(string.format("  listener %d accepted %d", i, skynet.call(addr, "lua", "exit")))
+		end
+		skynet.exit()
+	end)
+end
@@ -0,0 +1,102 @@
+-- datacenter 本地缓存测试: 检查更新之后读取到的都是新值, 然后对比 datacenter.get 和直接访问 datacenterd 的速度.
+-- 在非 master 节点上运行时, 直接访问 datacenterd 需要跨节点.
+-- 用法: testdatacentercache [读取次数]
+
+local skynet = require "skynet"
+local datacenter = require "datacenter"
+require "skynet.manager"	-- import skynet.kill
+
+local N = tonumber((...)) or 20000
+local harbor_id = skynet.harbor(skynet.self())
+
+local function check()
+	local key = "cache" .. harbor_id
+	assert(datacenter.get(key) == nil)
+	datacenter.set(key, "a", 1)
+	assert(datacenter.get(key, "a") == 1)
+	assert(datacenter.get(key).a == 1)
+	datacenter.set(key, "a", 2)
+	assert(datacenter.get(key, "a") == 2)
+	assert(datacenter.get(key).a == 2)
+
+	-- 更新子节点, 缓存的父节点失效
+	datacenter.set(key, "b", "c", 3)
+	assert(datacenter.get(key).b.c == 3)
+	assert(datacenter.get(key, "b", "c") == 3)
+
+	-- 替换整个分支, 缓存的子节点失效
+	datacenter.set(key, "b", { c = 4, d = 5 })
+	assert(datacenter.get(key, "b", "c") == 4 and datacenter.get(key, "b", "d") == 5)
+	datacenter.set(key, "b", nil)
+	assert(datacenter.get(key, "b", "c") == nil and datacenter.get(key, "b") == nil)
+	assert(datacenter.get(key).a == 2)
+
+	-- 其他服务的更新也能看到
+	local other = skynet.newservice(SERVICE_NAME, "set", key)
+	skynet.call(other, "lua")
+	assert(datacenter.get(key, "a") == "other")
+
+	-- 缓存的值的数量不超过上限, 清空之后读到的仍然是正确的值
+	local stat = skynet.call(".datacenter", "lua", "STAT")
+	for i = 1, stat.limit + 10 do
+		assert(datacenter.get(key, "many", i) == nil)
+	end
+	stat = skynet.call(".datacenter", "lua", "STAT")
+	assert(stat.count <= stat.limit)
+	assert(datacenter.get(key, "a") == "other")
+
+	-- 和 datacenterd 在同一个节点上退出的订阅者, 在下一次更新时被删除 (其他节点上的订阅者在节点断开时删除)
+	if skynet.getenv "standalone" then
+		local n = skynet.call("DATACENTER", "lua", "SUBSCRIBER", key)
+		local sub = skynet.newservice(SERVICE_NAME, "subscribe", key)
+		skynet.call(sub, "lua")
+		assert(skynet.call("DATACENTER", "lua", "SUBSCRIBER", key) == n + 1)
+		skynet.kill(sub)
+		datacenter.set(key, "a", 3)
+		assert(skynet.call("DATACENTER", "lua", "SUBSCRIBER", key) == n)
+	end
+	print "datacenter cache check ok"
+end
+
+local function bench()
+	local key = "bench" .. harbor_id
+	datacenter.set(key, "addr", skynet.self())
+	local start = skynet.time()
+	for i = 1, N do
+		skynet.call("DATACENTER", "lua", "QUERY", key, "addr")
+	end
+	local t1 = skynet.time() - start
+	start = skynet.time()
+	for i = 1, N do
+		datacenter.get(key, "addr")
+	end
+	local t2 = skynet.time() - start
+	print(string.format("datacenterd : %d queries %.2fs (%.0f/s)", N, t1, N / t1))
+	print(string.format("local cache : %d queries %.2fs (%.0f/s)", N, t2, N / t2))
+end
+
+if ... == "subscribe" then
+	-- 模拟一个缓存服务, 向 datacenterd 订阅 key 之后由测试杀掉
+	local key = select(2, ...)
+	skynet.start(function()
+		skynet.dispatch("lua", function(_, _, cmd)
+			if cmd == nil then
+				skynet.call("DATACENTER", "lua", "CQUERY", key)
+				skynet.ret()
+			end
+		end)
+	end)
+elseif ... == "set" then
+	local key = select(2, ...)
+	skynet.start(function()
+		skynet.dispatch("lua", function()
+			datacenter.set(key, "a", "other")
+			skynet.ret()
+		end)
+	end)
+else
+	skynet.start(function()
+		check()
+		bench()
+	end)
+end
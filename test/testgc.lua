@@ -0,0 +1,71 @@
+-- 空闲 gc 测试: 一个持有大量存活对象的服务, 每个请求都会分配一些临时对象, 统计请求处理时间的分布和空闲 gc 的统计.
+-- 用法: testgc [空闲 gc 阈值 KB, 默认使用配置中的 lua_gcidle]
+
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "worker" then
+
+local live = {}
+
+local function request(n)
+	local t = {}
+	for i = 1, n do
+		t[i] = { live[i], tostring(i) }
+	end
+	return #t
+end
+
+skynet.start(function()
+	for i = 1, 200000 do
+		live[i] = { i }
+	end
+	local cost = {}
+	skynet.dispatch("lua", function(_,_, cmd, n)
+		if cmd == "req" then
+			local start = skynet.hpc()
+			request(n)
+			table.insert(cost, skynet.hpc() - start)
+			skynet.ret()
+		elseif cmd == "idle" then
+			skynet.ret(skynet.pack(skynet.gcconfig { idle = n }))
+		else
+			table.sort(cost)
+			local r = {
+				p50 = cost[#cost // 2] / 1e6,
+				p99 = cost[#cost * 99 // 100] / 1e6,
+				max = cost[#cost] / 1e6,
+			}
+			cost = {}
+			skynet.ret(skynet.pack(r, skynet.gcstat()))
+		end
+	end)
+end)
+
+else
+
+local idle = tonumber(mode)
+
+skynet.start(function()
+	local worker = skynet.newservice(SERVICE_NAME, "worker")
+	if idle then
+		skynet.call(worker, "lua", "idle", idle)
+	end
+	for i = 1, 5000 do
+		skynet.call(worker, "lua", "req", 200)
+		if i % 10 == 0 then
+			skynet.sleep(0)
+		end
+	end
+	local r, gc = skynet.call(worker, "lua", "stat")
+	print(string.format("request : p50 %.3fms p99 %.3fms max %.3fms", r.p50, r.p99, r.max))
+	print(string.format("idle gc %dKB : %d steps %d cycles, total %.2fms max %.3fms", gc.idle, gc.steps, gc.cycles, gc.time, gc.max))
+	if gc.idle > 0 then
+		-- 每个请求都在分配, 空闲 gc 必须真的运行并完成周期
+		assert(gc.steps > 0 and gc.cycles > 0, "idle gc never ran")
+	end
+	skynet.exit()
+end)
+
+end
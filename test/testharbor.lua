@@ -0,0 +1,72 @@
+-- harbor 测试: 两个节点之间的大消息往返, 大量单向小消息的吞吐量, 以及并发请求的吞吐量.
+-- 先以 harbor 1 (standalone) 启动 testharbor, 再以 harbor 2 启动 testharbor client [消息数量]
+
+local skynet = require "skynet"
+local harbor = require "skynet.harbor"
+require "skynet.manager"	-- inject skynet.register
+
+local mode, count = ...
+
+if mode == "client" then
+
+local N = tonumber(count) or 100000
+
+skynet.start(function()
+	-- 第一次按名字发送, 由 harbor 向 master 查询全局名字, 之后 cslave 中已经有了记录
+	assert(skynet.call("HARBORECHO", "lua", "echo", "hello") == "hello")
+	local echo = harbor.queryname "HARBORECHO"
+
+	for _, sz in ipairs { 10, 0x3fff, 0x4000, 100 * 1024, 1024 * 1024 } do
+		local s = string.rep("H", sz)
+		assert(skynet.call(echo, "lua", "echo", s) == s)
+	end
+	print "harbor check ok"
+
+	skynet.call(echo, "lua", "reset")
+	local start = skynet.time()
+	for i = 1, N do
+		skynet.send(echo, "lua", "push", i)
+	end
+	local received = skynet.call(echo, "lua", "count")
+	local t = skynet.time() - start
+	assert(received == N)
+	print(string.format("%d sends : %.2fs (%.0f/s)", N, t, N / t))
+
+	local concurrent, finish = 100, 0
+	start = skynet.time()
+	for i = 1, concurrent do
+		skynet.fork(function()
+			for j = 1, N // concurrent do
+				assert(skynet.call(echo, "lua", "echo", j) == j)
+			end
+			finish = finish + 1
+		end)
+	end
+	while finish < concurrent do
+		skynet.sleep(1)
+	end
+	t = skynet.time() - start
+	print(string.format("%d coroutines x %d calls : %.2fs (%.0f/s)", concurrent, N // concurrent, t, N / t))
+	skynet.abort()
+end)
+
+else
+
+skynet.start(function()
+	local count = 0
+	skynet.dispatch("lua", function(session, source, cmd, v)
+		if cmd == "push" then
+			count = count + 1
+		elseif cmd == "echo" then
+			skynet.ret(skynet.pack(v))
+		elseif cmd == "reset" then
+			count = 0
+			skynet.ret()
+		elseif cmd == "count" then
+			skynet.ret(skynet.pack(count))
+		end
+	end)
+	skynet.register "HARBORECHO"
+end)
+
+end
@@ -0,0 +1,55 @@
+-- 服务启动测试: 连续启动 N 个服务, 统计每次 skynet.newservice 的耗时分布.
+-- 在 config 中配置 snlua_pool = 64 可以对比使用预热池的效果.
+-- 用法: testlaunch [服务数量], 结束后退出节点.
+
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "agent" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		skynet.ret()
+		skynet.exit()
+	end)
+end)
+
+else
+
+local N = tonumber(mode) or 1000
+
+local function percentile(t, p)
+	return t[math.max(1, math.ceil(#t * p))]
+end
+
+skynet.start(function()
+	-- 等待预热池填满
+	skynet.sleep(100)
+	local cost = {}
+	local agents = {}
+	for i = 1, N do
+		local start = skynet.hpc()
+		agents[i] = skynet.newservice(SERVICE_NAME, "agent")
+		cost[i] = (skynet.hpc() - start) / 1000000
+		if i % 64 == 0 then
+			-- 模拟登录的间隔, 让预热池有时间补充
+			skynet.sleep(1)
+		end
+	end
+	local total = 0
+	for _, v in ipairs(cost) do
+		total = total + v
+	end
+	table.sort(cost)
+	print(string.format("snlua_pool=%s launch %d services : avg %.3fms p50 %.3fms p90 %.3fms p99 %.3fms max %.3fms",
+		skynet.getenv "snlua_pool" or "0", N, total / N,
+		percentile(cost, 0.5), percentile(cost, 0.9), percentile(cost, 0.99), cost[N]))
+	for _, agent in ipairs(agents) do
+		skynet.call(agent, "lua")
+	end
+	-- 直接结束节点, 检查退出时能停止预热线程并关闭池中的 lua_State
+	require "skynet.core".command "ABORT"
+end)
+
+end
@@ -0,0 +1,90 @@
+-- multicast 发布测试: 订阅者数量逐步增加, 统计 multicastd 的发布耗时, 以及所有订阅者收完消息的耗时.
+-- 用法: testmulticastbench [最大订阅者数量] [每轮发布的消息数量]
+
+local skynet = require "skynet"
+local mc = require "multicast"
+
+local mode = ...
+
+if mode == "sub" then
+
+local channel
+local count = 0
+local expect, waiting
+
+skynet.start(function()
+	skynet.dispatch("lua", function (_,_, cmd, arg)
+		if cmd == "init" then
+			channel = mc.new {
+				channel = arg,
+				dispatch = function (channel, source, msg)
+					count = count + 1
+					if count == expect then
+						skynet.wakeup(waiting)
+					end
+				end
+			}
+			channel:subscribe()
+			skynet.ret(skynet.pack())
+		elseif cmd == "wait" then
+			-- 等待收到 arg 条消息
+			expect = arg
+			if count < expect then
+				waiting = coroutine.running()
+				skynet.wait()
+			end
+			skynet.ret(skynet.pack(count))
+		else
+			assert(cmd == "exit")
+			channel:unsubscribe()
+			skynet.ret(skynet.pack())
+			skynet.exit()
+		end
+	end)
+end)
+
+else
+
+local MAX = tonumber(mode) or 2000
+local M = tonumber((select(2, ...))) or 200
+
+local function bench(channel, subs)
+	local start = skynet.time()
+	for i = 1, M do
+		channel:publish(i, "hello")
+	end
+	local t_pub = skynet.time() - start
+	for _, s in ipairs(subs) do
+		assert(skynet.call(s, "lua", "wait", M) == M)
+	end
+	local t_all = skynet.time() - start
+	print(string.format("%5d subscribers : %d publish %.2fs (%.0f/s), delivered %d in %.2fs (%.0f/s)",
+		#subs, M, t_pub, M / t_pub, M * #subs, t_all, M * #subs / t_all))
+end
+
+skynet.start(function()
+	local sizes = {}
+	local n = 10
+	while n < MAX do
+		table.insert(sizes, n)
+		n = n * 10
+	end
+	table.insert(sizes, MAX)
+	for _, n in ipairs(sizes) do
+		local channel = mc.new()
+		local subs = {}
+		for i = 1, n do
+			local s = skynet.newservice(SERVICE_NAME, "sub")
+			skynet.call(s, "lua", "init", channel.channel)
+			subs[i] = s
+		end
+		bench(channel, subs)
+		for _, s in ipairs(subs) do
+			skynet.call(s, "lua", "exit")
+		end
+		channel:delete()
+	end
+	skynet.exit()
+end)
+
+end
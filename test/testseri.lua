@@ -0,0 +1,178 @@
+-- skynet.pack / skynet.unpack 的测试: 先检查各种形状 (包括共享的子表, 环, 同类型数组) 打包后能还原, 再测试吞吐量.
+-- 用法: testseri [每种形状的循环次数]
+
+local skynet = require "skynet"
+
+local N = tonumber((...)) or 100000
+
+local function shape_call()
+	return "query", 10086, true, "player_info"
+end
+
+local function shape_records()
+	local list = {}
+	for i = 1, 100 do
+		list[i] = { id = i, name = "item_" .. i, count = i * 3, price = i * 1.5, bind = i % 2 == 0 }
+	end
+	return list
+end
+
+-- 类似配置表的数据: 大量重复的字符串和共享的子表
+local function shape_config()
+	local quality = { { name = "white", color = 0xffffff }, { name = "green", color = 0x00ff00 }, { name = "blue", color = 0x0000ff } }
+	local config = {}
+	for i = 1, 200 do
+		config[i] = {
+			id = 10000 + i,
+			type = i % 2 == 0 and "equipment" or "consumable",
+			quality = quality[i % 3 + 1],
+			desc = "common description text",
+			attr = { attack = i, defense = i * 2 },
+		}
+	end
+	return config
+end
+
+local function shape_deep()
+	local t = { value = "leaf" }
+	for i = 1, 20 do
+		t = { level = i, child = t, tag = "node" }
+	end
+	return t
+end
+
+-- 大量数值的同类型数组: 位置同步和排行榜分数
+local function shape_positions()
+	local pos = {}
+	for i = 1, 300 do
+		pos[i] = i * 0.75 - 100.5
+	end
+	return pos
+end
+
+local function shape_scores()
+	local ids, scores = {}, {}
+	for i = 1, 300 do
+		ids[i] = 100000 + i
+		scores[i] = (i * 7919) % 50000
+	end
+	return { ids = ids, scores = scores }
+end
+
+-- 形状名称, 构造函数, 循环次数的缩放比例
+local shapes = {
+	{ "call", shape_call, 1 },
+	{ "records", shape_records, 100 },
+	{ "config", shape_config, 100 },
+	{ "deep", shape_deep, 10 },
+	{ "position", shape_positions, 100 },
+	{ "scores", shape_scores, 100 },
+}
+
+-- 深度比较, 同时要求 a 中共享的子表在 b 中也是共享的 (map 记录 a 的子表对应的 b 的子表)
+local function equal(a, b, map)
+	if type(a) ~= "table" or type(b) ~= "table" then
+		return a == b and math.type(a) == math.type(b)
+	end
+	if map[a] then
+		return map[a] == b
+	end
+	map[a] = b
+	for k, v in pairs(a) do
+		if not equal(v, b[k], map) then
+			return false
+		end
+	end
+	for k in pairs(b) do
+		if a[k] == nil then
+			return false
+		end
+	end
+	return true
+end
+
+local function roundtrip(...)
+	local args = table.pack(...)
+	local msg, sz = skynet.pack(...)
+	local r1 = table.pack(skynet.unpack(msg, sz))
+	skynet.trash(msg, sz)
+	local r2 = table.pack(skynet.unpack(skynet.packstring(...)))
+	assert(equal(args, r1, {}) and equal(args, r2, {}))
+	return table.unpack(r1, 1, r1.n)
+end
+
+local function check()
+	for _, s in ipairs(shapes) do
+		roundtrip(s[2]())
+	end
+
+	-- 标量: 整数的各种宽度, 浮点数, 空字符串, 长字符串, 带 \0 的字符串
+	roundtrip(nil, true, false, 0, 1, -1, 127, 128, 255, 256, 0x7fff, 0x8000, 0x7fffffff, 0x80000000, -0x80000000,
+		math.maxinteger, math.mininteger, 0.0, -0.5, 1e300, math.huge, -math.huge,
+		"", "abc", "abcd", "a\0b", string.rep("x", 40), string.rep("y", 300), string.rep("z", 0x10000))
+
+	-- 数组和 hash 混合, 以及有空洞的数组
+	roundtrip({ 1, 2, 3, x = 1, [1.5] = "f", [true] = false }, { [1] = 1, [3] = 3 }, {}, { {}, { {} } })
+
+	-- 同类型数组: 整数的宽度变化, 混入浮点数或其他类型时退回普通数组
+	roundtrip({ 1, 2, 3 }, { 1, 300, 70000, 0x100000000 }, { -1, -300, -70000 }, { 0.5, 1.5, -2.25 },
+		{ 1, 2, 3.5 }, { 1.5, 2 }, { 1, 2, "3" }, { 1, 2, nil, 4 })
+
+	-- 重复的字符串和共享的子表, 还原后仍然共享
+	local sub = { name = "shared" }
+	local str = "repeated string value"
+	local r = roundtrip({ a = sub, b = sub, list = { sub, sub }, s1 = str, s2 = str }, sub, str)
+	assert(r.a == r.b and r.list[1] == r.a and r.list[2] == r.a)
+	local config = roundtrip(shape_config())
+	assert(config[1].quality == config[4].quality)
+
+	-- 环
+	local t = { name = "root" }
+	t.self = t
+	t.child = { parent = t, list = { t } }
+	r = roundtrip(t)
+	assert(r.self == r and r.child.parent == r and r.child.list[1] == r)
+	local a, b = {}, {}
+	a.b, b.a = b, a
+	local ra, rb = roundtrip(a, b)
+	assert(ra.b == rb and rb.a == ra)
+
+	-- __pairs 产生的值
+	local proxy = setmetatable({}, { __pairs = function()
+		return next, { x = 1, y = { 2, 3 } }, nil
+	end })
+	local p, tail = skynet.unpack(skynet.packstring(proxy, "tail"))
+	assert(p.x == 1 and p.y[1] == 2 and p.y[2] == 3 and tail == "tail")
+	print "seri check ok"
+end
+
+local function bench(name, f, scale)
+	local args = table.pack(f())
+	local n = N // scale
+	local msg, sz = skynet.pack(table.unpack(args, 1, args.n))
+	skynet.trash(msg, sz)
+
+	local start = os.clock()
+	for i = 1, n do
+		msg, sz = skynet.pack(table.unpack(args, 1, args.n))
+		skynet.trash(msg, sz)
+	end
+	local pack_time = os.clock() - start
+
+	local str = skynet.packstring(table.unpack(args, 1, args.n))
+	start = os.clock()
+	for i = 1, n do
+		skynet.unpack(str)
+	end
+	local unpack_time = os.clock() - start
+
+	print(string.format("%-8s size %6d  pack %8.0f/s  unpack %8.0f/s", name, #str, n / pack_time, n / unpack_time))
+end
+
+skynet.start(function()
+	check()
+	for _, s in ipairs(shapes) do
+		bench(table.unpack(s))
+	end
+	skynet.exit()
+end)
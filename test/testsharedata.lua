@@ -0,0 +1,278 @@
+-- sharedata 测试: 检查 new/query/update/patch, image 文件的保存和加载, 排序索引,
+-- 以及大配置表的加载耗时, 全量更新和增量更新的耗时, 字符串读取的速度, 范围查询的速度.
+-- 用法: testsharedata [记录数量]
+
+local skynet = require "skynet"
+local sharedata = require "sharedata"
+
+local N = tonumber((...)) or 200000
+local IMAGE = "/tmp/testsharedata.image"
+
+local function config(n, tag)
+	local quality = { "white", "green", "blue", "purple" }
+	local t = { tag = tag, list = {}, [-1] = "negative", [1.5 // 1] = "one" }
+	for i = 1, n do
+		t.list[i] = {
+			id = 10000 + i,
+			name = "item_" .. i,
+			quality = quality[i % 4 + 1],
+			price = i * 1.5,
+			bind = i % 2 == 0,
+			attr = { attack = i, defense = i * 2, [i] = true },
+		}
+	end
+	return t
+end
+
+local function compare(obj, t, path)
+	for k, v in pairs(t) do
+		local ov = obj[k]
+		if type(v) == "table" then
+			compare(ov, v, path .. "." .. tostring(k))
+		else
+			assert(ov == v, path .. "." .. tostring(k))
+		end
+	end
+	local n = 0
+	for k in pairs(obj) do
+		assert(t[k] ~= nil, path .. "." .. tostring(k))
+		n = n + 1
+	end
+	for k in pairs(t) do
+		n = n - 1
+	end
+	assert(n == 0, path)
+	assert(#obj == #t, path)
+end
+
+local function check()
+	local t = config(100, "first")
+	sharedata.new("check", t)
+	local obj = sharedata.query "check"
+	compare(obj, t, "check")
+
+	sharedata.save("check", IMAGE)
+	sharedata.new("image", "@" .. IMAGE)
+	compare(sharedata.query "image", t, "image")
+
+	-- 用 image 热更新
+	local t2 = config(10, "second")
+	sharedata.new("tmp", t2)
+	sharedata.save("tmp", IMAGE)
+	sharedata.delete "tmp"
+	sharedata.update("check", "@" .. IMAGE)
+	skynet.sleep(10)
+	compare(obj, t2, "update")
+
+	-- 从全局短字符串表读出的字符串, 和本地生成的相同字符串必须是同一个 key
+	local name = obj.list[3].name
+	local map = { [name] = true, [obj.list[1].quality] = true }
+	assert(map["item_" .. 3] and map.green)
+	print "sharedata check ok"
+end
+
+local function check_patch()
+	local t = config(100, "patch")
+	sharedata.new("patch", t)
+	local obj = sharedata.query "patch"
+	local item1 = obj.list[1]
+	local attr7 = obj.list[7].attr
+	assert(item1.name == "item_1" and attr7.attack == 7)
+
+	local changes = {
+		{ { "list", 5, "price" }, 100 },
+		{ { "tag" }, "patched" },
+		{ { -1 } },
+		{ { "list", 7, "attr" } },
+		{ { "extra" }, { a = { b = 1 } } },
+		{ { "extra", "a", "c" }, 2 },
+		{ { "list", 8, "attr", "new" }, "value" },
+	}
+	sharedata.patch("patch", changes)
+	t.list[5].price = 100
+	t.tag = "patched"
+	t[-1] = nil
+	t.list[7].attr = nil
+	t.extra = { a = { b = 1, c = 2 } }
+	t.list[8].attr.new = "value"
+	skynet.sleep(10)
+	compare(obj, t, "patch")
+
+	-- 没有变化的子表继续有效, 被删除的子表失效
+	assert(obj.list[1] == item1 and item1.name == "item_1")
+	assert(not pcall(function() return attr7.attack end))
+
+	-- 连续的增量更新, 然后展开保存
+	sharedata.patch("patch", { { { "list", 1, "name" }, "first" } })
+	sharedata.patch("patch", { { { "list", 2 } , { id = 2 } } })
+	t.list[1].name = "first"
+	t.list[2] = { id = 2 }
+	skynet.sleep(10)
+	compare(obj, t, "patch2")
+	assert(item1.name == "first")
+	sharedata.save("patch", IMAGE)
+	sharedata.new("patch_image", "@" .. IMAGE)
+	compare(sharedata.query "patch_image", t, "patch_image")
+	print "sharedata patch ok"
+end
+
+local INDEXES = { { { "list" }, "price" }, { { "list" }, "name" }, { { "list" } } }
+
+local function keys(iter)
+	local r = {}
+	for k in iter do
+		table.insert(r, k)
+	end
+	return table.concat(r, ",")
+end
+
+local function check_index()
+	local t = config(100, "index")
+	t.list[3].price = nil
+	t.list[4] = "noprice"
+	sharedata.new("index", t, INDEXES)
+	local obj = sharedata.query "index"
+	local list = obj.list
+
+	local k, v, price = sharedata.lower_bound(list, "price", 10)
+	assert(k == 7 and v.id == 10007 and price == 10.5)
+	assert(sharedata.lower_bound(list, "price", 1000) == nil)
+	assert(sharedata.lower_bound(list, "price") == 1)
+	assert(keys(sharedata.range(list, "price", 1.5, 9)) == "1,2,5,6")
+	assert(keys(sharedata.range(list, "price", 148)) == "99,100")
+	assert(keys(sharedata.range(list, "name", "item_10", "item_11")) == "10,100,11")
+	assert(keys(sharedata.range(list, nil, 98)) == "98,99,100")
+	assert(not pcall(sharedata.lower_bound, list, "id", 1))
+	assert(not pcall(sharedata.lower_bound, obj, nil, 1))
+
+	-- 增量更新重建变化的 table 的索引, 全量更新沿用之前的索引
+	sharedata.patch("index", { { { "list", 5, "price" }, 1000 }, { { "list", 101 }, { price = 0 } } })
+	skynet.sleep(10)
+	assert(keys(sharedata.range(list, "price", nil, 3)) == "101,1,2")
+	assert(keys(sharedata.range(list, "price", 149)) == "100,5")
+	sharedata.save("index", IMAGE)
+	sharedata.new("index_image", "@" .. IMAGE)
+	assert(keys(sharedata.range(sharedata.query("index_image").list, "price", 149)) == "100,5")
+	sharedata.update("index", config(10))
+	skynet.sleep(10)
+	assert(keys(sharedata.range(list, "price", 12)) == "8,9,10")
+	print "sharedata index ok"
+end
+
+-- 读取方缓存了所有的子表, 统计更新之后第一次访问的耗时
+local function refresh(obj)
+	skynet.sleep(10)
+	local start = os.clock()
+	assert(obj.list[1].id == 10001)
+	return os.clock() - start
+end
+
+local function bench()
+	local t = config(N)
+	local start = skynet.time()
+	sharedata.new("bench", t)
+	local t_new = skynet.time() - start
+	sharedata.save("bench", IMAGE)
+	start = skynet.time()
+	sharedata.new("bench_image", "@" .. IMAGE)
+	local t_load = skynet.time() - start
+	local obj = sharedata.query "bench_image"
+	assert(obj.list[N].name == "item_" .. N)
+	print(string.format("%d records : new %.2fs, load image %.2fs", N, t_new, t_load))
+
+	obj = sharedata.query "bench"
+	local list = obj.list
+	for i = 1, N do
+		assert(list[i].attr.attack == i)
+	end
+	t.list[1].price = 0
+	start = skynet.time()
+	sharedata.update("bench", t)
+	local t_update = skynet.time() - start
+	local t_refresh = refresh(obj)
+	print(string.format("full update : %.2fs, reader refresh %.3fs", t_update, t_refresh))
+
+	start = skynet.time()
+	sharedata.patch("bench", { { { "list", 1, "price" }, 1 } })
+	t_update = skynet.time() - start
+	t_refresh = refresh(obj)
+	assert(obj.list[1].price == 1)
+	print(string.format("patch       : %.2fs, reader refresh %.3fs", t_update, t_refresh))
+	os.remove(IMAGE)
+end
+
+local function bench_lookup()
+	local list = sharedata.query("bench_image").list
+	local m = math.min(N, 10000)
+	local round = 50
+	local n = round * m * 2
+	local start = os.clock()
+	for r = 1, round do
+		for i = 1, m do
+			local item = list[i]
+			local name, quality = item.name, item.quality
+		end
+	end
+	local t = os.clock() - start
+	print(string.format("lookup : %d string reads %.2fs (%.0f/s)", n, t, n / t))
+
+	-- 绕过读取方的代理表, 只统计 C 层读取字符串的开销
+	local index = require "sharedata.core".index
+	local items = {}
+	for i = 1, m do
+		items[i] = rawget(list[i], "__obj")
+	end
+	start = os.clock()
+	for r = 1, round do
+		for i = 1, m do
+			local item = items[i]
+			local name, quality = index(item, "name"), index(item, "quality")
+		end
+	end
+	t = os.clock() - start
+	print(string.format("core.index : %d string reads %.2fs (%.0f/s)", n, t, n / t))
+	-- 建立 image 时短字符串放入全局短字符串表, 扣除 sharedata_string 配额, 超出配额的字符串读取时复制一份.
+	-- 每条记录有一个不同的 name, 所有记录都使用共享字符串大约需要 N + 20 的配额
+	local left = require "sharedata.core".stringquota()
+	assert(left >= 0)
+	print(string.format("sharedata_string = %s : %d left, %d records need about %d",
+		skynet.getenv "sharedata_string" or "65536", left, N, N + 20))
+end
+
+-- 查询 price 在某个区间内的 10 个元素: 排序索引, 对比每个服务自己建立排序的副本
+local function bench_range()
+	local t = config(N)
+	sharedata.new("range", t, INDEXES)
+	local list = sharedata.query("range").list
+	local round = 10000
+	local start = os.clock()
+	for r = 1, round do
+		local lo = (r % N) * 1.5
+		for k, v, price in sharedata.range(list, "price", lo, lo + 14) do
+		end
+	end
+	local t_index = os.clock() - start
+
+	collectgarbage()
+	local mem = collectgarbage "count"
+	start = os.clock()
+	local copy = {}
+	for i = 1, N do
+		copy[i] = { price = list[i].price, key = i }
+	end
+	table.sort(copy, function(a, b) return a.price < b.price end)
+	local t_copy = os.clock() - start
+	collectgarbage()
+	mem = collectgarbage "count" - mem
+	print(string.format("range : %d queries %.2fs, sorted copy of %d records %.2fs %.0fKB per service", round, t_index, N, t_copy, mem))
+end
+
+skynet.start(function()
+	check()
+	check_patch()
+	check_index()
+	bench()
+	bench_lookup()
+	bench_range()
+	skynet.exit()
+end)
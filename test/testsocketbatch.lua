@@ -0,0 +1,84 @@
+-- socket 批量模式测试: 通信线程在一轮事件中会反复读取同一个 udp socket, 接收的服务一边收包一边不停地开关批量模式,
+-- 检查每个发送方的包序号只增不减, 关闭批量模式时已经累积的消息不会被同一轮之后的消息超过.
+-- 本机回环上的 udp 不会乱序, 但缓冲区满时可能丢包, 所以只检查顺序, 丢包数量仅作参考.
+-- 用法: testsocketbatch [每个发送方的包数量] [发送方数量]
+
+local skynet = require "skynet"
+local socket = require "socket"
+
+local PORT = 8003
+
+local mode = ...
+
+if mode == "client" then
+
+local count = tonumber((select(2, ...)))
+
+skynet.start(function()
+	skynet.fork(function()
+		local c = socket.udp(function() end)
+		socket.udp_connect(c, "127.0.0.1", PORT)
+		for i = 1, count do
+			socket.write(c, tostring(i))
+			if i % 64 == 0 then
+				skynet.sleep(1)
+			end
+		end
+		socket.close(c)
+		skynet.exit()
+	end)
+end)
+
+else
+
+local count = tonumber(mode) or 20000
+local clients = tonumber((select(2, ...))) or 4
+
+local function spin()
+	local t = os.clock() + 0.00002
+	while os.clock() < t do end
+end
+
+skynet.start(function()
+	local last = {}
+	local recv = 0
+	local toggles = 0
+	local disorder = 0
+	local host = socket.udp(function(str, from)
+		local n = tonumber(str)
+		local l = last[from] or 0
+		if n <= l then
+			disorder = disorder + 1
+			skynet.error(string.format("packet out of order from %s : %d after %d", socket.udp_address(from), n, l))
+		end
+		last[from] = n
+		recv = recv + 1
+	end, "127.0.0.1", PORT)
+	for i = 1, clients do
+		skynet.newservice(SERVICE_NAME, "client", count)
+	end
+	local running = true
+	skynet.fork(function()
+		while running do
+			socket.batch(true)
+			spin()
+			socket.batch(false)
+			spin()
+			toggles = toggles + 1
+			skynet.yield()
+		end
+	end)
+	-- 等到不再收到新的包
+	local n
+	repeat
+		n = recv
+		skynet.sleep(100)
+	until n == recv
+	running = false
+	socket.close(host)
+	assert(disorder == 0, string.format("%d packets out of order", disorder))
+	print(string.format("socket batch toggle ok : %d/%d packets, %d toggles", recv, count * clients, toggles))
+	skynet.exit()
+end)
+
+end
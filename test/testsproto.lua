@@ -0,0 +1,161 @@
+-- sproto 编解码测试: 对比直接遍历 table 的编解码 (core.encode/core.decode) 和原来基于回调的编解码
+-- (core.encode_callback/core.decode_callback), 先检查两者结果一致, 再比较吞吐量.
+-- 用法: testsproto [循环次数]
+
+local skynet = require "skynet"
+local sproto = require "sproto"
+local core = require "sproto.core"
+
+local N = tonumber((...)) or 100000
+
+local sp = sproto.parse [[
+.package {
+	type 0 : integer
+	session 1 : integer
+}
+
+.Item {
+	id 0 : integer
+	name 1 : string
+	count 2 : integer
+	bind 3 : boolean
+	attr 5 : *integer
+}
+
+.Player {
+	id 0 : integer
+	name 1 : string
+	level 2 : integer
+	exp 3 : integer
+	gold 4 : integer
+	online 5 : boolean
+	pos 6 : *integer
+	flags 7 : *boolean
+	titles 8 : *string
+	items 9 : *Item
+	bag 10 : *Item(id)
+	friend 12 : Player
+}
+
+foobar 1 {
+	request {
+		what 0 : string
+	}
+	response {
+		ok 0 : boolean
+	}
+}
+]]
+
+local function equal(a, b)
+	if type(a) ~= "table" or type(b) ~= "table" then
+		return a == b
+	end
+	for k, v in pairs(a) do
+		if not equal(v, b[k]) then
+			return false
+		end
+	end
+	for k in pairs(b) do
+		if a[k] == nil then
+			return false
+		end
+	end
+	return true
+end
+
+local function player(id)
+	local items, bag = {}, {}
+	for i = 1, 10 do
+		items[i] = { id = i, name = "item_" .. i, count = i * 100, bind = i % 2 == 0, attr = { i, -i, i * 1000000 } }
+		bag[1000 + i] = { id = 1000 + i, name = "bag_" .. i, count = 0x7fff + i }
+	end
+	return {
+		id = id,
+		name = "player_" .. id,
+		level = 60,
+		exp = 0x7fffffff + id,
+		gold = -1,
+		online = true,
+		pos = { 100, -200, 0x7ffffffff },
+		flags = { true, false, true },
+		titles = { "", "king", "hero" },
+		items = items,
+		bag = bag,
+		friend = { id = id + 1, name = "friend", pos = {}, items = {} },
+	}
+end
+
+local function check()
+	local Player = core.querytype(sp.__cobj, "Player")
+	local Item = core.querytype(sp.__cobj, "Item")
+	local package = core.querytype(sp.__cobj, "package")
+	local t = player(10086)
+	local code = core.encode(Player, t)
+	assert(code == core.encode_callback(Player, t))
+	local r1, n1 = core.decode(Player, code)
+	local r2, n2 = core.decode_callback(Player, code)
+	assert(n1 == #code and n2 == #code)
+	assert(equal(r1, r2))
+	-- 空数组和 nil 一样不编码
+	t.friend.pos = nil
+	t.friend.items = nil
+	assert(equal(r1, t))
+
+	local header = { type = 1, session = 0x7fff }
+	code = core.encode(package, header)
+	assert(code == core.encode_callback(package, header))
+	local tmp = {}
+	local r, n = core.decode(package, code .. "tail", tmp)
+	assert(r == tmp and r.type == 1 and r.session == 0x7fff and n == #code)
+
+	assert(not pcall(core.encode, Item, { id = "x" }))
+	assert(not pcall(core.decode, Item, "\1"))
+	local deep = {}
+	for i = 1, 100 do
+		deep = { friend = deep }
+	end
+	assert(not pcall(core.encode, Player, deep))
+
+	-- 释放另一个 sproto 只清除它自己的字段表, 编码中途被回收也不影响正在使用的字段表
+	t = player(10086)
+	code = core.encode(Player, t)
+	local tmp = sproto.parse ".foo { a 0 : integer }"
+	assert(tmp:decode("foo", tmp:encode("foo", { a = 1 })).a == 1)
+	tmp = nil
+	setmetatable(t.friend, { __index = function() collectgarbage() end })
+	assert(core.encode(Player, t) == code)
+	print("sproto check ok")
+end
+
+local function bench(name, st, t, scale)
+	local n = N // scale
+	local code = core.encode(st, t)
+	local function run(f, arg)
+		collectgarbage()
+		local start = os.clock()
+		for i = 1, n do
+			f(st, arg)
+		end
+		return n / (os.clock() - start)
+	end
+	-- 两种实现交替跑 3 轮取最好成绩, 减少运行顺序和 gc 带来的偏差
+	local e1, e2, d1, d2 = 0, 0, 0, 0
+	for _ = 1, 3 do
+		e1 = math.max(e1, run(core.encode_callback, t))
+		e2 = math.max(e2, run(core.encode, t))
+		d1 = math.max(d1, run(core.decode_callback, code))
+		d2 = math.max(d2, run(core.decode, code))
+	end
+	print(string.format("%-8s size %5d  encode %8.0f/s -> %8.0f/s  decode %8.0f/s -> %8.0f/s",
+		name, #code, e1, e2, d1, d2))
+end
+
+skynet.start(function()
+	check()
+	local _, foobar = core.protocol(sp.__cobj, "foobar")
+	bench("package", core.querytype(sp.__cobj, "package"), { type = 1, session = 10086 }, 1)
+	bench("foobar", foobar, { what = "hello" }, 1)
+	bench("player", core.querytype(sp.__cobj, "Player"), player(10086), 20)
+	skynet.exit()
+end)
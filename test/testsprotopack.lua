@@ -0,0 +1,90 @@
+-- sproto 0 pack 测试: 用随机数据对比向量版本 (core.pack/core.unpack) 和标量版本 (core.pack_scalar/core.unpack_scalar)
+-- 的输出, 再比较大数据包的吞吐量.
+-- 用法: testsprotopack [随机测试次数]
+
+local skynet = require "skynet"
+local core = require "sproto.core"
+
+local N = tonumber((...)) or 2000
+
+-- 生成长度为 sz 的随机数据, 每个字节非 0 的概率为 density
+local function random_data(sz, density)
+	local bytes = {}
+	for i = 1, sz do
+		if math.random() < density then
+			bytes[i] = math.random(1, 255)
+		else
+			bytes[i] = 0
+		end
+	end
+	local chunks = {}
+	for i = 1, sz, 4096 do
+		chunks[#chunks + 1] = string.char(table.unpack(bytes, i, math.min(i + 4095, sz)))
+	end
+	return table.concat(chunks)
+end
+
+-- 由不同密度的片段拼接而成, 覆盖 0xff 段的开始, 合并, 256 段的上限和结束
+local function random_mix()
+	local parts = {}
+	for i = 1, math.random(1, 8) do
+		local density = ({ 0, 0.1, 0.5, 0.8, 0.95, 1 })[math.random(1, 6)]
+		parts[i] = random_data(math.random(0, 1200), density)
+	end
+	if math.random() < 0.1 then
+		parts[#parts + 1] = random_data(256 * 8 + math.random(-16, 16), 1)
+	end
+	return table.concat(parts)
+end
+
+local function check_pack(data)
+	local p = core.pack(data)
+	local ps = core.pack_scalar(data)
+	assert(p == ps, "pack mismatch")
+	local u = core.unpack(p)
+	assert(u == core.unpack_scalar(p), "unpack mismatch")
+	assert(u:sub(1, #data) == data and u:sub(#data + 1) == string.rep("\0", #u - #data))
+end
+
+local function check_unpack(data)
+	local ok, u = pcall(core.unpack, data)
+	local oks, us = pcall(core.unpack_scalar, data)
+	assert(ok == oks and (not ok or u == us), "unpack garbage mismatch")
+end
+
+local function fuzz()
+	for i = 0, 64 do
+		check_pack(random_data(i, 0.5))
+		check_pack(random_data(i, 1))
+	end
+	for i = 1, N do
+		check_pack(random_mix())
+		check_unpack(random_data(math.random(0, 300), math.random()))
+	end
+	print(string.format("sproto pack fuzz ok (%d)", N))
+end
+
+local function bench(name, data, n)
+	local packed = core.pack(data)
+	local function run(f, arg)
+		local start = os.clock()
+		for i = 1, n do
+			f(arg)
+		end
+		return #data * n / (os.clock() - start) / 1048576
+	end
+	print(string.format("%-8s %7d -> %7d  pack %7.1f MB/s -> %7.1f MB/s  unpack %7.1f MB/s -> %7.1f MB/s",
+		name, #data, #packed,
+		run(core.pack_scalar, data), run(core.pack, data),
+		run(core.unpack_scalar, packed), run(core.unpack, packed)))
+end
+
+skynet.start(function()
+	math.randomseed(os.time())
+	fuzz()
+	-- 类似地图快照的数据: 大量的小整数字段
+	bench("sparse", random_data(256 * 1024, 0.3), 200)
+	bench("half", random_data(256 * 1024, 0.6), 200)
+	bench("dense", random_data(256 * 1024, 0.97), 200)
+	skynet.exit()
+end)
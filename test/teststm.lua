@@ -19,6 +19,62 @@ skynet.start(function()
 	end)
 end)
 
+elseif mode == "reader" then
+
+-- 不停地轮询 stm 对象, 每 1000 次让出一次, 让 writer 有机会更新
+skynet.start(function()
+	skynet.dispatch("lua", function (_,_, obj, n)
+		local obj = stm.newcopy(obj)
+		local updates = 0
+		for i=1,n do
+			if obj(skynet.unpack) then
+				updates = updates + 1
+			end
+			if i % 1000 == 0 then
+				skynet.yield()
+			end
+		end
+		skynet.ret(skynet.pack(updates))
+		skynet.exit()
+	end)
+end)
+
+elseif mode == "bench" then
+
+-- 用法: teststm bench [reader 数量] [每个 reader 的读取次数]
+local readers = tonumber((select(2, ...))) or 64
+local n = tonumber((select(3, ...))) or 200000
+
+skynet.start(function()
+	local obj = stm.new(skynet.pack(0, "world state"))
+	local running = true
+	local version = 0
+	skynet.fork(function()
+		while running do
+			version = version + 1
+			obj(skynet.pack(version, "world state"))
+			skynet.yield()
+		end
+	end)
+	local finish, updates = 0, 0
+	local start = skynet.time()
+	for i=1,readers do
+		local reader = skynet.newservice(SERVICE_NAME, "reader")
+		skynet.fork(function()
+			updates = updates + skynet.call(reader, "lua", stm.copy(obj), n)
+			finish = finish + 1
+		end)
+	end
+	while finish < readers do
+		skynet.sleep(1)
+	end
+	running = false
+	local t = skynet.time() - start
+	print(string.format("%d readers x %d reads, %d writes : %.2fs (%.0f reads/s, %d updates seen)",
+		readers, n, version, t, readers * n / t, updates))
+	skynet.exit()
+end)
+
 else
 
 skynet.start(function()
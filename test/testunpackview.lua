@@ -0,0 +1,105 @@
+-- 惰性解包测试: 路由服务只读取消息的前两个字段, 然后把整条消息转发给后端服务.
+-- 对比 skynet.unpack + skynet.pack 与 skynet.unpackview + skynet.rawcall 两种路由方式的吞吐量.
+-- 用法: testunpackview [请求数量]
+
+local skynet = require "skynet"
+
+local mode = ...
+
+local function payload()
+	local items = {}
+	for i = 1, 100 do
+		items[i] = { id = i, name = "item_" .. i, attr = { attack = i, defense = i * 2 } }
+	end
+	return { target = "backend", items = items }
+end
+
+if mode == "backend" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, cmd, msg)
+		skynet.ret(skynet.pack(cmd, #msg.items))
+	end)
+end)
+
+elseif mode == "router" then
+
+local backend = tonumber(select(2, ...))
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, cmd, msg)
+		assert(msg.target == "backend")
+		skynet.ret(skynet.pack(skynet.call(backend, "lua", cmd, msg)))
+	end)
+end)
+
+elseif mode == "lazyrouter" then
+
+local backend = tonumber(select(2, ...))
+
+skynet.lazyunpack "lua"
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, _, view)
+		assert(view[2].target == "backend")
+		skynet.ret(skynet.tostring(skynet.rawcall(backend, "lua", view)))
+	end)
+end)
+
+else
+
+local function check()
+	local shared = { x = "shared" }
+	local t = { 1, 2, "three", shared, shared, name = "view", [10] = 3.5, flag = false, packed = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 1000 } }
+	t.self = t
+	local view = skynet.unpackview(skynet.packstring("cmd", t, nil, 42))
+	assert(#view == 4)
+	assert(view[1] == "cmd" and view[3] == nil and view[4] == 42 and view[5] == nil)
+	local v = view[2]
+	assert(#v == 5 and v[1] == 1 and v[3] == "three" and v[4].x == "shared")
+	assert(v.name == "view" and v[10] == 3.5 and v.flag == false and v.missing == nil)
+	assert(v.self.self.name == "view")
+	assert(#v.packed == 10 and v.packed[10] == 1000 and v.packed[11] == nil)
+	local keys = 0
+	for k, value in pairs(v) do
+		keys = keys + 1
+	end
+	assert(keys == 10)
+	local sum = 0
+	for i, value in pairs(v.packed) do
+		sum = sum + value
+	end
+	assert(sum == 1045)
+	local cmd, copy, _, n = skynet.unpack(view)
+	assert(cmd == "cmd" and copy.self == copy and copy[4] == copy[5] and n == 42)
+	local sub = skynet.unpack(v.packed)
+	assert(sub[10] == 1000)
+	local self = skynet.unpack(v.self)
+	assert(self.self == self and self.name == "view")
+	print("unpackview check ok")
+end
+
+local function bench(router, n)
+	local msg = payload()
+	local start = skynet.now()
+	for i = 1, n do
+		skynet.call(router, "lua", "query", msg)
+	end
+	return (skynet.now() - start) / 100
+end
+
+local N = tonumber(mode) or 10000
+
+skynet.start(function()
+	check()
+	local backend = skynet.newservice(SERVICE_NAME, "backend")
+	local router = skynet.newservice(SERVICE_NAME, "router", backend)
+	local lazy = skynet.newservice(SERVICE_NAME, "lazyrouter", backend)
+	local t1 = bench(router, N)
+	local t2 = bench(lazy, N)
+	print(string.format("unpack + pack : %d requests %.2fs (%.0f/s)", N, t1, N / t1))
+	print(string.format("unpackview    : %d requests %.2fs (%.0f/s)", N, t2, N / t2))
+	skynet.exit()
+end)
+
+end